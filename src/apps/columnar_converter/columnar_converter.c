@@ -0,0 +1,115 @@
+/** \file columnar_converter.c
+ *  \brief An application to convert RPFITS files into the columnar format
+ *
+ * ATCA Training Application
+ * (C) Jamie Stevens CSIRO 2020
+ *
+ * This app pre-compiles one or more RPFITS files into the columnar format,
+ * writing each one next to its RPFITS file with the COLUMNAR_SUFFIX added.
+ * When rpfitsfile_server finds an up-to-date columnar file, it reads the
+ * data from there instead of decoding the RPFITS file again.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <argp.h>
+#include "atrpfits.h"
+#include "columnar.h"
+#include "memory.h"
+
+const char *argp_program_version = "columnar_converter 1.0";
+const char *arpg_program_bug_address = "<Jamie.Stevens@csiro.au>";
+
+static char converter_doc[] = "RPFITS to columnar format converter";
+static char converter_args_doc[] = "[options] RPFITS_FILES...";
+
+static struct argp_option converter_options[] = {
+  { "quiet", 'q', 0, 0, "Don't print the name of each file as it is converted" },
+  { 0 }
+};
+
+/*! \struct converter_arguments
+ *  \brief The structure holding values representing the command line arguments
+ *         we were called with; filled by the argp library
+ */
+struct converter_arguments {
+  /*! \var quiet
+   *  \brief Whether to keep quiet while converting
+   */
+  bool quiet;
+  /*! \var n_rpfits_files
+   *  \brief The number of RPFITS files that were specified by the user
+   */
+  int n_rpfits_files;
+  /*! \var rpfits_files
+   *  \brief The name of each RPFITS file that was specified by the user
+   *
+   * This array of strings has length `n_rpfits_files` and is indexed starting
+   * at 0. Each string has its own length (argp handles this) but is properly
+   * NULL terminated.
+   */
+  char **rpfits_files;
+};
+
+static error_t converter_parse_opt(int key, char *arg, struct argp_state *state) {
+  struct converter_arguments *arguments = state->input;
+
+  switch (key) {
+  case 'q':
+    arguments->quiet = true;
+    break;
+  case ARGP_KEY_ARG:
+    arguments->n_rpfits_files += 1;
+    REALLOC(arguments->rpfits_files, arguments->n_rpfits_files);
+    arguments->rpfits_files[arguments->n_rpfits_files - 1] = arg;
+    break;
+
+  default:
+    return ARGP_ERR_UNKNOWN;
+  }
+
+  return 0;
+}
+
+static struct argp argp = { converter_options, converter_parse_opt,
+			    converter_args_doc, converter_doc };
+
+int main(int argc, char *argv[]) {
+  int i, n_failed = 0;
+  size_t length;
+  char *columnar_filename = NULL;
+  struct converter_arguments arguments;
+
+  // Set the defaults for the arguments.
+  arguments.quiet = false;
+  arguments.n_rpfits_files = 0;
+  arguments.rpfits_files = NULL;
+
+  // Parse the arguments.
+  argp_parse(&argp, argc, argv, 0, 0, &arguments);
+
+  // Stop here if we don't have any RPFITS files.
+  if (arguments.n_rpfits_files == 0) {
+    fprintf(stderr, "NO RPFITS FILES SPECIFIED, EXITING\n");
+    return (-1);
+  }
+
+  for (i = 0; i < arguments.n_rpfits_files; i++) {
+    length = strlen(arguments.rpfits_files[i]) + strlen(COLUMNAR_SUFFIX) + 1;
+    MALLOC(columnar_filename, length);
+    snprintf(columnar_filename, length, "%s%s", arguments.rpfits_files[i],
+	     COLUMNAR_SUFFIX);
+    if (!arguments.quiet) {
+      printf("Converting %s to %s\n", arguments.rpfits_files[i], columnar_filename);
+    }
+    if (columnar_convert(arguments.rpfits_files[i], columnar_filename) !=
+	JSTAT_SUCCESSFUL) {
+      fprintf(stderr, "CONVERSION FAILED FOR FILE %s\n", arguments.rpfits_files[i]);
+      n_failed++;
+    }
+    FREE(columnar_filename);
+  }
+  FREE(arguments.rpfits_files);
+
+  return ((n_failed > 0) ? -1 : 0);
+}
@@ -200,11 +200,12 @@ static void sighandler(int sig) {
 #define ACTION_TVMEDIAN_CHANGED          1<<12
 
 // Make a shortcut to stop action for those actions which can only be
-// done by a simulator.
+// done by a simulator, or a correlator that recomputes data like one.
 #define CHECKSIMULATOR				\
   do						\
     {						\
-      if (server_type != SERVERTYPE_SIMULATOR)	\
+      if ((server_type != SERVERTYPE_SIMULATOR) &&	\
+	  (server_type != SERVERTYPE_CORRELATOR))	\
 	{					\
 	  FREE(line_els);			\
 	  FREE(line);				\
@@ -740,6 +741,8 @@ int main(int argc, char *argv[]) {
   double earliest_mjd, latest_mjd, mjd_cycletime, cmjd, min_dmjd, dmjd;
   double *all_cycle_mjd = NULL;
   struct syscal_data *tsys_data;
+  struct spectrum_data avg_spectrum_data;
+  struct ampphase ***avg_spectrum = NULL;
   struct panelspec dump_panelspec;
   
   // Allocate some memory.
@@ -872,6 +875,12 @@ int main(int argc, char *argv[]) {
       reconcile_spd_plotcontrols(&spectrum_data, &spd_plotcontrols, &spd_alteredcontrols);
       // Get the Tsys.
       spectrum_data_compile_system_temperatures(&spectrum_data, &tsys_data);
+      // Average all the spectra together if they will be shown.
+      avg_spectrum = NULL;
+      if (spd_alteredcontrols.plot_options & PLOT_AVERAGED_DATA) {
+	chanaverage_spectrum_data(&spectrum_data, &avg_spectrum_data);
+	avg_spectrum = avg_spectrum_data.spectrum;
+      }
 
       if (action_required & ACTION_HARDCOPY_PLOT) {
 	nmesg = 0;
@@ -887,8 +896,9 @@ int main(int argc, char *argv[]) {
 	    // The the plotter to use the device.
 	    spd_alteredcontrols.pgplot_device = dump_device_number;
 	    // Make the plot.
-	    make_spd_plot(spectrum_data.spectrum, &dump_panelspec, &spd_alteredcontrols,
-			  spectrum_data.header_data, tsys_data, 2, true);
+	    make_spd_plot(spectrum_data.spectrum, avg_spectrum, &dump_panelspec,
+			  &spd_alteredcontrols, spectrum_data.header_data, tsys_data,
+			  2, true);
 	    // Close the device.
 	    release_spd_device(&dump_device_number, &dump_device_opened, &dump_panelspec);
 	    // Reset the plot controls.
@@ -909,13 +919,17 @@ int main(int argc, char *argv[]) {
       }
       
       if (action_required & ACTION_REFRESH_PLOT) {
-	make_spd_plot(spectrum_data.spectrum, &spd_panelspec, &spd_alteredcontrols,
-		      spectrum_data.header_data, tsys_data, 2, true);
+	make_spd_plot(spectrum_data.spectrum, avg_spectrum, &spd_panelspec,
+		      &spd_alteredcontrols, spectrum_data.header_data, tsys_data,
+		      2, true);
 	action_required -= ACTION_REFRESH_PLOT;
       }
 
       free_syscal_data(tsys_data);
       FREE(tsys_data);
+      if (avg_spectrum != NULL) {
+	free_spectrum_data(&avg_spectrum_data);
+      }
     }
 
     if (action_required & ACTION_TVCHANNELS_CHANGED) {
@@ -1196,7 +1210,8 @@ int main(int argc, char *argv[]) {
         snprintf(mesgout[0], SPDBUFSIZE, "Connected to %s server.\n",
                  get_servertype_string(server_type));
         readline_print_messages(nmesg, mesgout);
-        if (server_type == SERVERTYPE_SIMULATOR) {
+        if ((server_type == SERVERTYPE_SIMULATOR) ||
+	    (server_type == SERVERTYPE_CORRELATOR)) {
           // Send a request for the time information.
           server_request.request_type = REQUEST_TIMERANGE;
           init_cmp_memory_buffer(&cmp, &mem, send_buffer, (size_t)SENDBUFSIZE);
@@ -215,11 +215,12 @@ static void sighandler(int sig) {
 #define ACTIONMOD_CORRECT_BEFORE         3
 
 // Make a shortcut to stop action for those actions which can only be
-// done by a simulator.
+// done by a simulator, or a correlator that recomputes data like one.
 #define CHECKSIMULATOR                          \
   do                                            \
     {                                           \
-      if (server_type != SERVERTYPE_SIMULATOR)	\
+      if ((server_type != SERVERTYPE_SIMULATOR) &&	\
+	  (server_type != SERVERTYPE_CORRELATOR))	\
         {                                       \
           FREE(line_els);                       \
           FREE(line);                           \
@@ -1114,6 +1115,7 @@ int main(int argc, char *argv[]) {
   cmp_mem_access_t mem;
   struct requests server_request;
   struct responses server_response;
+  struct vis_data appended_vis_data;
   SOCKET socket_peer, max_socket = -1;
   char *recv_buffer = NULL, send_buffer[SENDBUFSIZE], htime[20];
   char **mesgout = NULL, client_id[CLIENTIDLENGTH];
@@ -1294,15 +1296,7 @@ int main(int argc, char *argv[]) {
       action_required |= ACTION_REFRESH_PLOT;
       vis_plotcontrols.reference_antenna =
 	vis_data.header_data[data_selected_index]->ant_label[reference_antenna_index];
-      for (i = 0; i < vis_data.nviscycles; i++) {
-	for (j = 0; j < vis_data.num_ifs[i]; j++) {
-	  for (k = 0; k < vis_data.num_pols[i][j]; k++) {
-	    compute_closure_phase(vis_data.header_data[i],
-				  vis_data.vis_quantities[i][j][k],
-				  reference_antenna_index);
-	  }
-	}
-      }
+      compute_closure_phases(&vis_data, reference_antenna_index);
     }
 
     if ((action_required & ACTION_COMPUTE_DELAYS) ||
@@ -1981,7 +1975,8 @@ int main(int argc, char *argv[]) {
       }
       // Check we're getting what we expect.
       if ((server_response.response_type == RESPONSE_CURRENT_VISDATA) ||
-          (server_response.response_type == RESPONSE_COMPUTED_VISDATA)) {
+          (server_response.response_type == RESPONSE_COMPUTED_VISDATA) ||
+	  (server_response.response_type == RESPONSE_APPENDED_VISDATA)) {
 	// Receive the ampphase options first, and free old ones if we need to.
 	if (n_ampphase_options > 0) {
 	  for (i = 0; i < n_ampphase_options; i++) {
@@ -1996,13 +1991,19 @@ int main(int argc, char *argv[]) {
 	  CALLOC(ampphase_options[i], 1);
 	  unpack_ampphase_options(&cmp, ampphase_options[i]);
 	}
-	// Before we get the new vis data, free the old.
-	for (i = 0; i < vis_data.nviscycles; i++) {
-	  free_scan_header_data(vis_data.header_data[i]);
-	  FREE(vis_data.header_data[i]);
+	if (server_response.response_type == RESPONSE_APPENDED_VISDATA) {
+	  // The server has found some new cycles, which go after the ones we have.
+	  unpack_vis_data(&cmp, &appended_vis_data);
+	  append_vis_data(&vis_data, &appended_vis_data);
+	} else {
+	  // Before we get the new vis data, free the old.
+	  for (i = 0; i < vis_data.nviscycles; i++) {
+	    free_scan_header_data(vis_data.header_data[i]);
+	    FREE(vis_data.header_data[i]);
+	  }
+	  free_vis_data(&vis_data);
+	  unpack_vis_data(&cmp, &vis_data);
 	}
-	free_vis_data(&vis_data);
-        unpack_vis_data(&cmp, &vis_data);
         action_required = ACTION_NEW_DATA_RECEIVED;
 	/* nmesg = 0; */
 	/* snprintf(mesgout[nmesg++], VISBUFLONG, " Data received\n"); */
@@ -21,7 +21,10 @@
 #include <stdbool.h>
 #include <time.h>
 #include <signal.h>
+#include <pthread.h>
+#include <sys/stat.h>
 #include "atrpfits.h"
+#include "columnar.h"
 #include "memory.h"
 #include "packing.h"
 #include "atnetworking.h"
@@ -73,6 +76,12 @@ static struct argp_option rpfitsfile_server_options[] = {
   { "testing", 't', "TESTFILE", 0,
     "Operate as a testing server with instructions given "
     "in this file (multiple accepted)" },
+  { "follow", 'f', 0, 0,
+    "Follow the most recently modified RPFITS file as it is written, "
+    "and send new data to clients (only when networked)" },
+  { "cache_memory", 'm', "MB", 0,
+    "The memory to use for keeping the decoded data, so it doesn't need "
+    "to be read again when the options change (default 1024, 0 to disable)" },
   { 0 }
 };
 
@@ -126,6 +135,17 @@ struct rpfitsfile_server_arguments {
    *  \brief MJD after which no data will be read from file
    */
   double maximum_read_mjd;
+  /*! \var follow_operation
+   *  \brief A flag to indicate that we should keep reading new data from
+   *         the most recently modified RPFITS file, like a correlator would
+   *         supply it
+   */
+  bool follow_operation;
+  /*! \var cache_memory
+   *  \brief The number of MB of memory that can be used to keep the decoded
+   *         cycles from the RPFITS files
+   */
+  int cache_memory;
 };
 
 /*!
@@ -153,6 +173,12 @@ static error_t rpfitsfile_server_parse_opt(int key, char *arg, struct argp_state
       arguments->maximum_read_mjd = INFINITY;
     }
     break;
+  case 'f':
+    arguments->follow_operation = true;
+    break;
+  case 'm':
+    arguments->cache_memory = atoi(arg);
+    break;
   case 'n':
     arguments->network_operation = true;
     break;
@@ -440,6 +466,92 @@ struct cache_spd_data {
 
 struct cache_spd_data cache_spd_data;
 
+/*! \struct cache_cycle_data
+ *  \brief Cache for the decoded cycles of each RPFITS file
+ *
+ * The vis and SPD caches only help if the same options are asked for again,
+ * and the computed products depend on almost every option (even the Tsys
+ * values, which come from the tvchannel range and averaging method, and are
+ * applied to the visibilities). So when the options change, we still need
+ * every cycle, but we don't need to read and decode the RPFITS files again.
+ * Each file is converted to the columnar format in memory by a background
+ * thread, and data_reader reads from that image in preference to the disk.
+ */
+struct cache_cycle_data {
+  /*! \var n_files
+   *  \brief The number of files that may be cached
+   */
+  int n_files;
+  /*! \var files
+   *  \brief The information structure of each file that may be cached
+   *
+   * This array of pointers has length `n_files`, and is indexed starting at 0.
+   */
+  struct rpfits_file_information **files;
+  /*! \var fd
+   *  \brief The descriptor of the in-memory columnar image of each file, or
+   *         -1 if the file isn't cached (yet)
+   *
+   * This array has length `n_files`, and is indexed starting at 0. Each entry
+   * is only set once its image is complete, and is read and written
+   * atomically, since the cache is filled while data is being read.
+   */
+  int *fd;
+  /*! \var max_bytes
+   *  \brief The most memory that all the images together may use
+   */
+  size_t max_bytes;
+  /*! \var used_bytes
+   *  \brief The memory used by the images so far
+   */
+  size_t used_bytes;
+  /*! \var skip_file
+   *  \brief The file that must not be cached because it is still being
+   *         written, or NULL
+   */
+  struct rpfits_file_information *skip_file;
+};
+
+struct cache_cycle_data cache_cycle_data;
+
+/*! \struct cache_acal_sums
+ *  \brief Cache for the tvchannel averages used to compute noise diode
+ *         amplitudes
+ *
+ * The averages of a cycle in a window only depend on the data and the options
+ * used to compute it, not on the flux density of the calibrator, so when acal
+ * is tried again on the same cycles, only the final solve has to be done.
+ */
+struct cache_acal_sums {
+  /*! \var num_cache_acal_sums
+   *  \brief The number of cache entries present in this structure
+   */
+  int num_cache_acal_sums;
+  /*! \var num_options
+   *  \brief The number of options supplied for each cache entry
+   *
+   * This array has length `num_cache_acal_sums`, and is indexed starting at 0.
+   */
+  int *num_options;
+  /*! \var ampphase_options
+   *  \brief The set of options supplied for each cache entry
+   *
+   * This 2-D array of pointers has length `num_cache_acal_sums` on the first
+   * index, and `num_options[i]` for the second index, where `i` is the
+   * position along the first index. Both indices start at 0.
+   */
+  struct ampphase_options ***ampphase_options;
+  /*! \var sums
+   *  \brief The cached averages, each of which knows its cycle MJD and window
+   *
+   * This array of pointers has length `num_cache_acal_sums`, and is indexed
+   * starting at 0.
+   */
+  struct noise_diode_sums **sums;
+};
+
+struct cache_acal_sums cache_acal_sums;
+
 /*! \struct client_spd_data
  *  \param Client cache of SPD data
  */
@@ -507,6 +619,37 @@ struct rpfits_file_information {
    * the first index; both indices start at 0.
    */
   double **cycle_mjd;
+  /*! \var scan_offset
+   *  \brief The byte offset in the file of the header of each scan
+   *
+   * This array has length `n_scans`, and is indexed starting at 0.
+   */
+  long *scan_offset;
+  /*! \var cycle_offset
+   *  \brief The byte offset in the file of the start of each cycle in each scan
+   *
+   * This 2-D array has the same shape as `cycle_mjd`.
+   */
+  long **cycle_offset;
+  /*! \var followed_size
+   *  \brief The size of the file in bytes when it was last checked for new
+   *         data, if we are following it
+   */
+  off_t followed_size;
+  /*! \var followed
+   *  \brief Whether we are following this file, in which case it can change
+   *         while we read it, and so it is never read through a memory mapping
+   */
+  bool followed;
+  /*! \var scanned_stat
+   *  \brief The stat information for the file taken just before its metadata
+   *         was last read, which is what an index of that metadata describes
+   */
+  struct stat scanned_stat;
+  /*! \var scanned_stat_valid
+   *  \brief Whether `scanned_stat` has been set
+   */
+  bool scanned_stat_valid;
 };
 
 /*!
@@ -524,346 +667,2004 @@ struct rpfits_file_information *new_rpfits_file(void) {
   rv->scan_end_mjd = NULL;
   rv->n_cycles = NULL;
   rv->cycle_mjd = NULL;
+  rv->scan_offset = NULL;
+  rv->cycle_offset = NULL;
+  rv->followed_size = 0;
+  rv->followed = false;
+  rv->scanned_stat_valid = false;
 
   return (rv);
 }
 
-/*! \struct client_ampphase_options
- *  \brief Structure to hold the last-used ampphase_options set for each
- *         different user or client
+/*! \def RPFITS_INDEX_SUFFIX
+ *  \brief The suffix added to the name of an RPFITS file to make the name of
+ *         its metadata index file
  */
-struct client_ampphase_options {
-  /*! \var num_clients
-   *  \brief The number of clients we hold data for
-   */
-  int num_clients;
-  /*! \var client_id
-   *  \brief The ID of each of the clients
-   *
-   * This array of strings has size `num_clients`, and is indexed starting
-   * at 0. Each string has length CLIENTIDLENGTH.
-   */
-  char **client_id;
-  /*! \var client_username
-   *  \brief The username of each of the clients
-   *
-   * This array of strings has size `num_clients`, and is indexed starting
-   * at 0. Each string has length CLIENTIDLENGTH.
-   */
-  char **client_username;
-  /*! \var n_ampphase_options
-   *  \brief The number of ampphase_options provided by each client
-   *
-   * This array has size `num_clients`, and is indexed starting at 0.
-   */
-  int *n_ampphase_options;
-  /*! \var ampphase_options
-   *  \brief The set of ampphase_options provided by each client
-   *
-   * This 2-D array has size `num_clients` for the first index, and
-   * `n_ampphase_options[i]` for the second index, where `i` is the position
-   * along the first index. Both indices start at 0.
-   */
-  struct ampphase_options ***ampphase_options;
-};
+#define RPFITS_INDEX_SUFFIX ".idx"
+/*! \def RPFITS_INDEX_MAGIC
+ *  \brief The string at the start of every metadata index file
+ */
+#define RPFITS_INDEX_MAGIC "ATRPFITSIDX"
+/*! \def RPFITS_INDEX_VERSION
+ *  \brief The version of the metadata index file format, which must be
+ *         incremented whenever the layout of the index changes
+ */
+#define RPFITS_INDEX_VERSION 2
 
 /*!
- *  \brief Add a SPD cache entry, labelled with a provided set of options
- *  \param num_options the number of options in the set
- *  \param options the set of options with which to label the SPD cache entry
- *  \param data the data to store in the cache
- *  \return an indication of whether the data was added to the cache; false
- *          if an existing entry was found with the same options set, or true
- *          if the set was added
+ *  \brief Write out the key that identifies which version of an RPFITS file,
+ *         read with which MJD limits, an index describes
+ *  \param cmp the CMP stream to write to
+ *  \param st the stat information for the RPFITS file
+ *  \param mjd_low the MJD before which no data was read
+ *  \param mjd_high the MJD after which no data was read
  */
-bool add_cache_spd_data(int num_options, struct ampphase_options **options,
-                        struct spectrum_data *data) {
-  int i, j, n;
-  bool match_found = false;
-  char details[RPSBUFSIZE], time[RPSBUFSIZE];
+void write_rpfits_index_key(cmp_ctx_t *cmp, struct stat *st,
+			    double mjd_low, double mjd_high) {
+  pack_write_string(cmp, RPFITS_INDEX_MAGIC, strlen(RPFITS_INDEX_MAGIC));
+  pack_write_sint(cmp, RPFITS_INDEX_VERSION);
+  pack_write_slong(cmp, (long)st->st_size);
+  pack_write_slong(cmp, (long)st->st_mtim.tv_sec);
+  pack_write_slong(cmp, (long)st->st_mtim.tv_nsec);
+  pack_write_double(cmp, mjd_low);
+  pack_write_double(cmp, mjd_high);
+}
 
-  if (num_options == 0) {
-    // What??
+/*!
+ *  \brief Check that the key at the start of an index matches the current state
+ *         of the RPFITS file and the MJD limits we want to read with
+ *  \param cmp the CMP stream to read from
+ *  \param st the stat information for the RPFITS file
+ *  \param mjd_low the MJD before which no data will be read
+ *  \param mjd_high the MJD after which no data will be read
+ *  \return true if the index is usable, or false if it is stale or is not an
+ *          index file at all
+ *
+ * Unlike the pack_read_* routines, this routine does not exit if the stream
+ * cannot be decoded, since the index file may be damaged or of an older format.
+ */
+bool check_rpfits_index_key(cmp_ctx_t *cmp, struct stat *st,
+			    double mjd_low, double mjd_high) {
+  char magic[RPSBUFSIZE];
+  uint32_t magic_length = RPSBUFSIZE;
+  int32_t version;
+  int64_t file_size, mtime_sec, mtime_nsec;
+  double index_low, index_high;
+
+  if (!cmp_read_str(cmp, magic, &magic_length) ||
+      (strcmp(magic, RPFITS_INDEX_MAGIC) != 0)) {
     return false;
   }
-  
-  /* fprintf(stderr, "[add_cache_spd_data] trying to cache data at %s %.1f %d\n", */
-  /*         data->header_data->obsdate, data->spectrum[0][0]->ut_seconds, */
-  /*         options->phase_in_degrees); */
-  // Check that we don't already know about the data.
-  for (i = 0; i < cache_spd_data.num_cache_spd_data; i++) {
-    /* fprintf(stderr, "[add_cache_spd_data] checking cache entry %d %s %.1f %d\n", */
-    /*         i, cache_spd_data.spectrum_data[i]->header_data->obsdate, */
-    /*         cache_spd_data.spectrum_data[i]->spectrum[0][0]->ut_seconds, */
-    /*         cache_spd_data.ampphase_options[i]->phase_in_degrees); */
-    if (cache_spd_data.num_options[i] != num_options) {
-      // Can't be this one.
-      continue;
-    }
-    if ((strncmp(cache_spd_data.spectrum_data[i]->header_data->obsdate,
-		 data->header_data->obsdate, OBSDATE_LENGTH) != 0) ||
-	(cache_spd_data.spectrum_data[i]->spectrum[0][0]->ut_seconds !=
-	 data->spectrum[0][0]->ut_seconds)) {
-      // Not a match.
-      continue;
-    }
-    match_found = true;
-    for (j = 0; j < cache_spd_data.num_options[i]; j++) {
-      /* if (options[j]->phase_in_degrees != */
-      /* 	  cache_spd_data.ampphase_options[i][j]->phase_in_degrees) { */
-      if (ampphase_options_match(options[j],
-				 cache_spd_data.ampphase_options[i][j]) == false) {
-	match_found = false;
-	break;
-      }
-    }
-    if (match_found) {
-      /* fprintf(stderr, "[add_cache_spd_data] match found!\n"); */
-      print_options_set(num_options, options, details, RPSBUFSIZE);
-      angle_to_string((24.0 * data->spectrum[0][0]->ut_seconds / 86400.0),
-		      time, ATS_ANGLE_IN_HOURS | ATS_STRING_IN_HOURS |
-		      ATS_STRING_SEP_COLON | ATS_STRING_ZERO_PAD_FIRST, 0);
-      fprintf(stderr, "[add_cache_spd_data] found SPD match for data at "
-	      "time %s %s with options:\n%s", data->header_data->obsdate,
-	      time, details);
-      return false;
-    }
+  if (!cmp_read_int(cmp, &version) || (version != RPFITS_INDEX_VERSION)) {
+    return false;
+  }
+  if (!cmp_read_long(cmp, &file_size) || !cmp_read_long(cmp, &mtime_sec) ||
+      !cmp_read_long(cmp, &mtime_nsec) || !cmp_read_double(cmp, &index_low) ||
+      !cmp_read_double(cmp, &index_high)) {
+    return false;
+  }
+  if ((file_size != (int64_t)st->st_size) ||
+      (mtime_sec != (int64_t)st->st_mtim.tv_sec) ||
+      (mtime_nsec != (int64_t)st->st_mtim.tv_nsec) ||
+      (index_low != mjd_low) || (index_high != mjd_high)) {
+    return false;
   }
 
-  // If we get here, this is new data.
-  print_options_set(num_options, options, details, RPSBUFSIZE);
-  angle_to_string((24.0 * data->spectrum[0][0]->ut_seconds / 86400.0),
-		  time, ATS_ANGLE_IN_HOURS | ATS_STRING_IN_HOURS |
-		  ATS_STRING_SEP_COLON | ATS_STRING_ZERO_PAD_FIRST, 0);
-  fprintf(stderr, "[add_cache_spd_data] adding SPD cache entry for data at "
-	  "time %s %s with options:\n%s", data->header_data->obsdate,
-	  time, details);
-  n = cache_spd_data.num_cache_spd_data + 1;
-  REALLOC(cache_spd_data.num_options, n);
-  REALLOC(cache_spd_data.ampphase_options, n);
-  cache_spd_data.num_options[n - 1] = num_options;
-  MALLOC(cache_spd_data.ampphase_options[n - 1], num_options);
-  for (i = 0; i < num_options; i++) {
-    MALLOC(cache_spd_data.ampphase_options[n - 1][i], 1);
-    set_default_ampphase_options(cache_spd_data.ampphase_options[n - 1][i]);
-    copy_ampphase_options(cache_spd_data.ampphase_options[n - 1][i], options[i]);
+  return true;
+}
+
+/*!
+ *  \brief Read a signed integer from an index, without exiting if it can't
+ *         be decoded
+ *  \param cmp the CMP stream to read from
+ *  \param value a pointer to the variable in which to store the value
+ *  \return true if the value was read
+ */
+bool index_read_sint(cmp_ctx_t *cmp, int *value) {
+  int64_t v;
+
+  if (!cmp_read_sinteger(cmp, &v)) {
+    return false;
   }
-  REALLOC(cache_spd_data.spectrum_data, n);
-  MALLOC(cache_spd_data.spectrum_data[n - 1], 1);
-  copy_spectrum_data(cache_spd_data.spectrum_data[n - 1], data);
-  cache_spd_data.num_cache_spd_data = n;
-  
+  *value = (int)v;
   return true;
 }
 
 /*!
- *  \brief Add a vis cache entry, labelled with a provided set of options
- *  \param num_options the number of options in the set
- *  \param options the set of options with which to label the vis cache entry
- *  \param data the data to store in the cache
- *  \return an indication of whether the data was added to the cache; false
- *          if an existing entry was found with the same options set, or true
- *          if the set was added
+ *  \brief Read a non-negative count from an index, without exiting if it
+ *         can't be decoded
+ *  \param cmp the CMP stream to read from
+ *  \param value a pointer to the variable in which to store the count
+ *  \return true if the count was read and is not negative
  */
-bool add_cache_vis_data(int num_options, struct ampphase_options **options,
-                        struct vis_data *data) {
-  int i, j, n;
-  bool match_found = false;
+bool index_read_count(cmp_ctx_t *cmp, int *value) {
+  return (index_read_sint(cmp, value) && (*value >= 0));
+}
 
-  if (num_options == 0) {
-    // What??
+/*!
+ *  \brief Read a long signed integer from an index, without exiting if it
+ *         can't be decoded
+ *  \param cmp the CMP stream to read from
+ *  \param value a pointer to the variable in which to store the value
+ *  \return true if the value was read
+ */
+bool index_read_slong(cmp_ctx_t *cmp, long *value) {
+  int64_t v;
+
+  if (!cmp_read_sinteger(cmp, &v)) {
     return false;
   }
+  *value = (long)v;
+  return true;
+}
 
-  // Check that we don't already know about the data.
-  for (i = 0; i < cache_vis_data.num_cache_vis_data; i++) {
-    if (cache_vis_data.num_options[i] != num_options) {
-      // Can't be this one.
-      continue;
-    }
-    match_found = true;
-    for (j = 0; j < cache_vis_data.num_options[i]; j++) {
-      if (ampphase_options_match(options[j],
-				 cache_vis_data.ampphase_options[i][j]) == false) {
-	// Not a perfect match.
-	match_found = false;
-	break;
-      }
-    }
-    if (match_found) {
-      // Don't need to add this data, we already have it.
+/*!
+ *  \brief Check that the next array in an index has the expected length,
+ *         without exiting if it can't be decoded
+ *  \param cmp the CMP stream to read from
+ *  \param expected_length the number of elements the array should have
+ *  \return true if the array has \a expected_length elements
+ */
+bool index_read_arraysize(cmp_ctx_t *cmp, int expected_length) {
+  uint32_t size_read;
+
+  return (cmp_read_array(cmp, &size_read) && (size_read == (uint32_t)expected_length));
+}
+
+/*!
+ *  \brief Read an array of floating-point values from an index, without
+ *         exiting if it can't be decoded
+ *  \param cmp the CMP stream to read from
+ *  \param length the number of elements to read
+ *  \param array the already allocated array to fill
+ *  \return true if all the values were read
+ */
+bool index_readarray_float(cmp_ctx_t *cmp, int length, float *array) {
+  int i;
+
+  if (!index_read_arraysize(cmp, length)) {
+    return false;
+  }
+  for (i = 0; i < length; i++) {
+    if (!cmp_read_float(cmp, &(array[i]))) {
       return false;
     }
   }
+  return true;
+}
 
-  // If we get here, this is new data.
-  n = cache_vis_data.num_cache_vis_data + 1;
-  REALLOC(cache_vis_data.num_options, n);
-  REALLOC(cache_vis_data.ampphase_options, n);
-  REALLOC(cache_vis_data.vis_data, n);
-  cache_vis_data.num_options[n - 1] = num_options;
-  MALLOC(cache_vis_data.ampphase_options[n - 1], num_options);
-  for (i = 0; i < num_options; i++) {
-    MALLOC(cache_vis_data.ampphase_options[n - 1][i], 1);
-    set_default_ampphase_options(cache_vis_data.ampphase_options[n - 1][i]);
-    copy_ampphase_options(cache_vis_data.ampphase_options[n - 1][i], options[i]);
-  }
-  MALLOC(cache_vis_data.vis_data[n - 1], 1);
-  copy_vis_data(cache_vis_data.vis_data[n - 1], data);
-  cache_vis_data.num_cache_vis_data = n;
+/*!
+ *  \brief Read an array of double-precision values from an index, without
+ *         exiting if it can't be decoded
+ *  \param cmp the CMP stream to read from
+ *  \param length the number of elements to read
+ *  \param array the already allocated array to fill
+ *  \return true if all the values were read
+ */
+bool index_readarray_double(cmp_ctx_t *cmp, int length, double *array) {
+  int i;
 
+  if (!index_read_arraysize(cmp, length)) {
+    return false;
+  }
+  for (i = 0; i < length; i++) {
+    if (!cmp_read_double(cmp, &(array[i]))) {
+      return false;
+    }
+  }
   return true;
 }
 
 /*!
- *  \brief Get a SPD cache entry, labelled with a provided set of options
- *  \param num_options the number of options in the set
- *  \param options the set of options to consider while searching
- *  \param mjd the MJD of the cycle to search for
- *  \param tol the tolerance on the MJD (in days) in assessing a match
- *  \param data a pointer to a data variable which, if a match is found will
- *              be filled with the matching cache entry; if the pointer is to
- *              NULL, the pointer will be redirected to the actual cache
- *              entry, otherwise a copy of the data will be made
- *  \return an indication of whether the search found a match; true if a
- *          match was found, or false if not
+ *  \brief Read an array of signed integers from an index, without exiting if
+ *         it can't be decoded
+ *  \param cmp the CMP stream to read from
+ *  \param length the number of elements to read
+ *  \param array the already allocated array to fill
+ *  \return true if all the values were read
  */
-bool get_cache_spd_data(int num_options, struct ampphase_options **options,
-                        double mjd, double tol,
-                        struct spectrum_data **data) {
+bool index_readarray_sint(cmp_ctx_t *cmp, int length, int *array) {
+  int i;
+
+  if (!index_read_arraysize(cmp, length)) {
+    return false;
+  }
+  for (i = 0; i < length; i++) {
+    if (!index_read_sint(cmp, &(array[i]))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/*!
+ *  \brief Read an array of strings from an index, without exiting if it
+ *         can't be decoded
+ *  \param cmp the CMP stream to read from
+ *  \param length the number of strings to read
+ *  \param array the already allocated array of strings to fill
+ *  \param maxlength the size of each string in \a array
+ *  \return true if all the strings were read
+ */
+bool index_readarray_string(cmp_ctx_t *cmp, int length, char **array,
+			    int maxlength) {
+  int i;
+  uint32_t string_size;
+
+  if (!index_read_arraysize(cmp, length)) {
+    return false;
+  }
+  for (i = 0; i < length; i++) {
+    string_size = (uint32_t)maxlength;
+    if (!cmp_read_str(cmp, array[i], &string_size)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/*!
+ *  \brief Free the memory in a scan header that may only have been partly
+ *         read from an index
+ *  \param a the scan header, which must have started out zeroed
+ *
+ * Unlike free_scan_header_data, this routine copes with any of the arrays not
+ * having been allocated yet.
+ */
+void free_index_scan_header(struct scan_header_data *a) {
   int i, j;
-  double tmjd;
+
+  for (i = 0; (a->source_name != NULL) && (i < a->num_sources); i++) {
+    FREE(a->source_name[i]);
+  }
+  FREE(a->source_name);
+  FREE(a->rightascension_hours);
+  FREE(a->declination_degrees);
+  for (i = 0; i < a->num_ifs; i++) {
+    if ((a->if_stokes_names != NULL) && (a->if_stokes_names[i] != NULL)) {
+      for (j = 0; j < a->if_num_stokes[i]; j++) {
+	FREE(a->if_stokes_names[i][j]);
+      }
+      FREE(a->if_stokes_names[i]);
+    }
+    if ((a->if_name != NULL) && (a->if_name[i] != NULL)) {
+      for (j = 0; j < 3; j++) {
+	FREE(a->if_name[i][j]);
+      }
+      FREE(a->if_name[i]);
+    }
+  }
+  FREE(a->if_centre_freq);
+  FREE(a->if_bandwidth);
+  FREE(a->if_num_channels);
+  FREE(a->if_num_stokes);
+  FREE(a->if_sideband);
+  FREE(a->if_chain);
+  FREE(a->if_label);
+  FREE(a->if_name);
+  FREE(a->if_stokes_names);
+  for (i = 0; (a->ant_name != NULL) && (i < a->num_ants); i++) {
+    FREE(a->ant_name[i]);
+  }
+  for (i = 0; (a->ant_cartesian != NULL) && (i < a->num_ants); i++) {
+    FREE(a->ant_cartesian[i]);
+  }
+  FREE(a->ant_label);
+  FREE(a->ant_name);
+  FREE(a->ant_cartesian);
+}
+
+/*!
+ *  \brief Read a scan header from an index, without exiting if it can't be
+ *         decoded
+ *  \param cmp the CMP stream to read from
+ *  \param a the scan header to fill, which must start out zeroed
+ *  \return true if the header was read; if not, the header may be partly
+ *          filled, and should be freed with free_index_scan_header
+ *
+ * This reads the same layout as unpack_scan_header_data. Each count is only
+ * set once the arrays it describes have been allocated, so a partly read
+ * header can always be freed.
+ */
+bool read_index_scan_header(cmp_ctx_t *cmp, struct scan_header_data *a) {
+  int i, j, n;
+  uint32_t string_size;
+
+  // Time variables.
+  string_size = OBSDATE_LENGTH;
+  if (!cmp_read_str(cmp, a->obsdate, &string_size) ||
+      !cmp_read_float(cmp, &(a->ut_seconds))) {
+    return false;
+  }
+
+  // Details about the observation.
+  string_size = OBSTYPE_LENGTH;
+  if (!cmp_read_str(cmp, a->obstype, &string_size)) {
+    return false;
+  }
+  string_size = CALCODE_LENGTH;
+  if (!cmp_read_str(cmp, a->calcode, &string_size) ||
+      !index_read_sint(cmp, &(a->cycle_time))) {
+    return false;
+  }
+
+  // The sources. Each array gets one more element than it needs, so that
+  // nothing asks for zero bytes.
+  if (!index_read_count(cmp, &n)) {
+    return false;
+  }
+  CALLOC(a->source_name, n + 1);
+  CALLOC(a->rightascension_hours, n + 1);
+  CALLOC(a->declination_degrees, n + 1);
+  for (i = 0; i < n; i++) {
+    CALLOC(a->source_name[i], SOURCE_LENGTH);
+  }
+  a->num_sources = n;
+  for (i = 0; i < n; i++) {
+    string_size = SOURCE_LENGTH;
+    if (!cmp_read_str(cmp, a->source_name[i], &string_size)) {
+      return false;
+    }
+  }
+  if (!index_readarray_float(cmp, n, a->rightascension_hours) ||
+      !index_readarray_float(cmp, n, a->declination_degrees)) {
+    return false;
+  }
+
+  // Frequency configuration.
+  if (!index_read_count(cmp, &n)) {
+    return false;
+  }
+  CALLOC(a->if_centre_freq, n + 1);
+  CALLOC(a->if_bandwidth, n + 1);
+  CALLOC(a->if_num_channels, n + 1);
+  CALLOC(a->if_num_stokes, n + 1);
+  CALLOC(a->if_sideband, n + 1);
+  CALLOC(a->if_chain, n + 1);
+  CALLOC(a->if_label, n + 1);
+  CALLOC(a->if_name, n + 1);
+  CALLOC(a->if_stokes_names, n + 1);
+  a->num_ifs = n;
+  if (!index_readarray_float(cmp, n, a->if_centre_freq) ||
+      !index_readarray_float(cmp, n, a->if_bandwidth) ||
+      !index_readarray_sint(cmp, n, a->if_num_channels) ||
+      !index_readarray_sint(cmp, n, a->if_num_stokes) ||
+      !index_readarray_sint(cmp, n, a->if_sideband) ||
+      !index_readarray_sint(cmp, n, a->if_chain) ||
+      !index_readarray_sint(cmp, n, a->if_label)) {
+    return false;
+  }
+  for (i = 0; i < n; i++) {
+    if (a->if_num_stokes[i] < 0) {
+      return false;
+    }
+    CALLOC(a->if_name[i], 3);
+    for (j = 0; j < 3; j++) {
+      CALLOC(a->if_name[i][j], 8);
+    }
+    CALLOC(a->if_stokes_names[i], a->if_num_stokes[i] + 1);
+    for (j = 0; j < a->if_num_stokes[i]; j++) {
+      CALLOC(a->if_stokes_names[i][j], 3);
+    }
+    if (!index_readarray_string(cmp, 3, a->if_name[i], 8) ||
+	!index_readarray_string(cmp, a->if_num_stokes[i], a->if_stokes_names[i], 3)) {
+      return false;
+    }
+  }
+
+  // The antennas.
+  if (!index_read_count(cmp, &n)) {
+    return false;
+  }
+  CALLOC(a->ant_label, n + 1);
+  CALLOC(a->ant_name, n + 1);
+  CALLOC(a->ant_cartesian, n + 1);
+  for (i = 0; i < n; i++) {
+    CALLOC(a->ant_name[i], 9);
+    CALLOC(a->ant_cartesian[i], 3);
+  }
+  a->num_ants = n;
+  if (!index_readarray_sint(cmp, n, a->ant_label) ||
+      !index_readarray_string(cmp, n, a->ant_name, 9)) {
+    return false;
+  }
+  for (i = 0; i < n; i++) {
+    if (!index_readarray_double(cmp, 3, a->ant_cartesian[i])) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/*!
+ *  \brief Free the scan metadata in a file information structure that may
+ *         only have been partly read from an index, and mark it as having no
+ *         scans
+ *  \param info the file information structure
+ *  \param n_scans the number of scans that the metadata arrays were allocated
+ *                 for
+ */
+void free_index_metadata(struct rpfits_file_information *info, int n_scans) {
+  int i;
+
+  for (i = 0; i < n_scans; i++) {
+    if (info->scan_headers[i] != NULL) {
+      free_index_scan_header(info->scan_headers[i]);
+      FREE(info->scan_headers[i]);
+    }
+    FREE(info->cycle_mjd[i]);
+    FREE(info->cycle_offset[i]);
+  }
+  FREE(info->scan_headers);
+  FREE(info->scan_start_mjd);
+  FREE(info->scan_end_mjd);
+  FREE(info->n_cycles);
+  FREE(info->cycle_mjd);
+  FREE(info->scan_offset);
+  FREE(info->cycle_offset);
+  info->n_scans = 0;
+}
+
+/*!
+ *  \brief Load the scan metadata for an RPFITS file from its index file, if
+ *         that index is up to date
+ *  \param info the file information structure, which should have its filename
+ *              set and no scans yet; the metadata arrays are allocated and filled
+ *              by this routine if the index is usable
+ *  \param mjd_low the MJD before which no data will be read
+ *  \param mjd_high the MJD after which no data will be read
+ *  \return true if the metadata was loaded, or false if the file needs to be
+ *          scanned with data_reader
+ */
+bool read_rpfits_index(struct rpfits_file_information *info,
+		       double mjd_low, double mjd_high) {
+  int i, j, n_scans;
+  bool complete = true;
+  char index_filename[RPSBUFSIZE + 32];
+  struct stat st;
+  FILE *fh = NULL;
+  cmp_ctx_t cmp;
+
+  if (stat(info->filename, &st) != 0) {
+    return false;
+  }
+  snprintf(index_filename, sizeof(index_filename), "%s%s", info->filename, RPFITS_INDEX_SUFFIX);
+  fh = fopen(index_filename, "rb");
+  if (fh == NULL) {
+    return false;
+  }
+  cmp_init(&cmp, fh, file_reader, file_skipper, file_writer);
+  if (!check_rpfits_index_key(&cmp, &st, mjd_low, mjd_high)) {
+    printf("[read_rpfits_index] index for %s is stale\n", info->filename);
+    fclose(fh);
+    return false;
+  }
+
+  // The rest of the index is read without the pack_read_* routines, since
+  // those exit if the stream can't be decoded, and a damaged index should
+  // only mean that the file gets scanned again.
+  if (!index_read_count(&cmp, &n_scans)) {
+    printf("[read_rpfits_index] index for %s is damaged\n", info->filename);
+    fclose(fh);
+    return false;
+  }
+  if (n_scans > 0) {
+    CALLOC(info->scan_headers, n_scans);
+    CALLOC(info->scan_start_mjd, n_scans);
+    CALLOC(info->scan_end_mjd, n_scans);
+    CALLOC(info->n_cycles, n_scans);
+    CALLOC(info->cycle_mjd, n_scans);
+    CALLOC(info->scan_offset, n_scans);
+    CALLOC(info->cycle_offset, n_scans);
+  }
+  for (i = 0, complete = true; (i < n_scans) && complete; i++) {
+    complete = (index_read_slong(&cmp, &(info->scan_offset[i])) &&
+		cmp_read_double(&cmp, &(info->scan_start_mjd[i])) &&
+		cmp_read_double(&cmp, &(info->scan_end_mjd[i])) &&
+		index_read_count(&cmp, &(info->n_cycles[i])));
+    if (!complete) {
+      break;
+    }
+    CALLOC(info->cycle_mjd[i], info->n_cycles[i] + 1);
+    CALLOC(info->cycle_offset[i], info->n_cycles[i] + 1);
+    complete = index_readarray_double(&cmp, info->n_cycles[i], info->cycle_mjd[i]);
+    for (j = 0; (j < info->n_cycles[i]) && complete; j++) {
+      complete = index_read_slong(&cmp, &(info->cycle_offset[i][j]));
+    }
+    if (complete) {
+      CALLOC(info->scan_headers[i], 1);
+      complete = read_index_scan_header(&cmp, info->scan_headers[i]);
+    }
+  }
+  fclose(fh);
+  if (!complete) {
+    printf("[read_rpfits_index] index for %s is damaged\n", info->filename);
+    free_index_metadata(info, n_scans);
+    return false;
+  }
+  info->n_scans = n_scans;
+  info->scanned_stat = st;
+  info->scanned_stat_valid = true;
+
+  return true;
+}
+
+/*!
+ *  \brief Save the scan metadata for an RPFITS file into an index file next
+ *         to it, so it can be loaded quickly the next time
+ *  \param info the file information structure, filled by data_reader, with
+ *              `scanned_stat` taken before the file was read; if that stat
+ *              isn't available, no index is written
+ *  \param mjd_low the MJD before which no data was read
+ *  \param mjd_high the MJD after which no data was read
+ *
+ * The index is written to a temporary file which is then renamed, so that a
+ * partially written index can never be read. If the index cannot be written
+ * (perhaps because the directory is read-only), a warning is printed and
+ * nothing else happens.
+ */
+void write_rpfits_index(struct rpfits_file_information *info,
+			double mjd_low, double mjd_high) {
+  int i, j;
+  char index_filename[RPSBUFSIZE + 32], temp_filename[RPSBUFSIZE + 64];
+  FILE *fh = NULL;
+  cmp_ctx_t cmp;
+
+  // The index can only describe the file as it was when it was scanned.
+  if (!info->scanned_stat_valid) {
+    return;
+  }
+  snprintf(index_filename, sizeof(index_filename), "%s%s", info->filename, RPFITS_INDEX_SUFFIX);
+  snprintf(temp_filename, sizeof(temp_filename), "%s.%d", index_filename, (int)getpid());
+  fh = fopen(temp_filename, "wb");
+  if (fh == NULL) {
+    fprintf(stderr, "[write_rpfits_index] unable to write index %s\n", index_filename);
+    return;
+  }
+  cmp_init(&cmp, fh, file_reader, file_skipper, file_writer);
+  write_rpfits_index_key(&cmp, &(info->scanned_stat), mjd_low, mjd_high);
+
+  // Every scan is stored, even those without any cycles, so that loading the
+  // index gives the same list of scans as reading the file would.
+  pack_write_sint(&cmp, info->n_scans);
+  for (i = 0; i < info->n_scans; i++) {
+    pack_write_slong(&cmp, info->scan_offset[i]);
+    pack_write_double(&cmp, info->scan_start_mjd[i]);
+    pack_write_double(&cmp, info->scan_end_mjd[i]);
+    pack_write_sint(&cmp, info->n_cycles[i]);
+    pack_writearray_double(&cmp, info->n_cycles[i], info->cycle_mjd[i]);
+    for (j = 0; j < info->n_cycles[i]; j++) {
+      pack_write_slong(&cmp, info->cycle_offset[i][j]);
+    }
+    pack_scan_header_data(&cmp, info->scan_headers[i]);
+  }
+  if ((fclose(fh) != 0) || (rename(temp_filename, index_filename) != 0)) {
+    fprintf(stderr, "[write_rpfits_index] unable to write index %s\n", index_filename);
+    unlink(temp_filename);
+  }
+}
+
+/*! \struct client_ampphase_options
+ *  \brief Structure to hold the last-used ampphase_options set for each
+ *         different user or client
+ */
+struct client_ampphase_options {
+  /*! \var num_clients
+   *  \brief The number of clients we hold data for
+   */
+  int num_clients;
+  /*! \var client_id
+   *  \brief The ID of each of the clients
+   *
+   * This array of strings has size `num_clients`, and is indexed starting
+   * at 0. Each string has length CLIENTIDLENGTH.
+   */
+  char **client_id;
+  /*! \var client_username
+   *  \brief The username of each of the clients
+   *
+   * This array of strings has size `num_clients`, and is indexed starting
+   * at 0. Each string has length CLIENTIDLENGTH.
+   */
+  char **client_username;
+  /*! \var n_ampphase_options
+   *  \brief The number of ampphase_options provided by each client
+   *
+   * This array has size `num_clients`, and is indexed starting at 0.
+   */
+  int *n_ampphase_options;
+  /*! \var ampphase_options
+   *  \brief The set of ampphase_options provided by each client
+   *
+   * This 2-D array has size `num_clients` for the first index, and
+   * `n_ampphase_options[i]` for the second index, where `i` is the position
+   * along the first index. Both indices start at 0.
+   */
+  struct ampphase_options ***ampphase_options;
+};
+
+/*!
+ *  \brief Add a SPD cache entry, labelled with a provided set of options
+ *  \param num_options the number of options in the set
+ *  \param options the set of options with which to label the SPD cache entry
+ *  \param data the data to store in the cache
+ *  \return an indication of whether the data was added to the cache; false
+ *          if an existing entry was found with the same options set, or true
+ *          if the set was added
+ */
+bool add_cache_spd_data(int num_options, struct ampphase_options **options,
+                        struct spectrum_data *data) {
+  int i, j, n;
   bool match_found = false;
-  
+  char details[RPSBUFSIZE], time[RPSBUFSIZE];
+
   if (num_options == 0) {
-    // No chance of a match.
+    // What??
     return false;
   }
-  /* fprintf(stderr, "[get_cache_spd_data] looking for MJD %.8f within %.8f, %d\n", */
-  /*         mjd, tol, options->phase_in_degrees); */
+  
+  /* fprintf(stderr, "[add_cache_spd_data] trying to cache data at %s %.1f %d\n", */
+  /*         data->header_data->obsdate, data->spectrum[0][0]->ut_seconds, */
+  /*         options->phase_in_degrees); */
+  // Check that we don't already know about the data.
   for (i = 0; i < cache_spd_data.num_cache_spd_data; i++) {
+    /* fprintf(stderr, "[add_cache_spd_data] checking cache entry %d %s %.1f %d\n", */
+    /*         i, cache_spd_data.spectrum_data[i]->header_data->obsdate, */
+    /*         cache_spd_data.spectrum_data[i]->spectrum[0][0]->ut_seconds, */
+    /*         cache_spd_data.ampphase_options[i]->phase_in_degrees); */
     if (cache_spd_data.num_options[i] != num_options) {
       // Can't be this one.
       continue;
     }
-    // Calculate MJD of this cache entry.
-    tmjd = date2mjd(cache_spd_data.spectrum_data[i]->header_data->obsdate,
-                    cache_spd_data.spectrum_data[i]->spectrum[0][0]->ut_seconds);
-    /* fprintf(stderr, "[get_cache_spd_data] cache entry %d MJD %.8f %d %d\n", */
-    /*         i, tmjd, (fabs(mjd - tmjd) <= tol), */
-    /*         cache_spd_data.ampphase_options[i]->phase_in_degrees); */
-    if (fabs(mjd - tmjd) > tol) {
-      // Not a good enough match.
+    if ((strncmp(cache_spd_data.spectrum_data[i]->header_data->obsdate,
+		 data->header_data->obsdate, OBSDATE_LENGTH) != 0) ||
+	(cache_spd_data.spectrum_data[i]->spectrum[0][0]->ut_seconds !=
+	 data->spectrum[0][0]->ut_seconds)) {
+      // Not a match.
       continue;
     }
     match_found = true;
     for (j = 0; j < cache_spd_data.num_options[i]; j++) {
+      /* if (options[j]->phase_in_degrees != */
+      /* 	  cache_spd_data.ampphase_options[i][j]->phase_in_degrees) { */
       if (ampphase_options_match(options[j],
 				 cache_spd_data.ampphase_options[i][j]) == false) {
-	// Not a perfect match.
 	match_found = false;
 	break;
       }
     }
     if (match_found) {
-      /* fprintf(stderr, "[get_cache_spd_data] cache hit %s %.1f %d\n", */
-      /*         cache_spd_data.spectrum_data[i]->header_data->obsdate, */
-      /*         cache_spd_data.spectrum_data[i]->spectrum[0][0]->ut_seconds, */
-      /*         cache_spd_data.ampphase_options[i]->phase_in_degrees); */
-      if (*data == NULL) {
-        // Occurs in the child computer usually.
-        *data = cache_spd_data.spectrum_data[i];
-      } else {
-        copy_spectrum_data(*data, cache_spd_data.spectrum_data[i]);
+      /* fprintf(stderr, "[add_cache_spd_data] match found!\n"); */
+      print_options_set(num_options, options, details, RPSBUFSIZE);
+      angle_to_string((24.0 * data->spectrum[0][0]->ut_seconds / 86400.0),
+		      time, ATS_ANGLE_IN_HOURS | ATS_STRING_IN_HOURS |
+		      ATS_STRING_SEP_COLON | ATS_STRING_ZERO_PAD_FIRST, 0);
+      fprintf(stderr, "[add_cache_spd_data] found SPD match for data at "
+	      "time %s %s with options:\n%s", data->header_data->obsdate,
+	      time, details);
+      return false;
+    }
+  }
+
+  // If we get here, this is new data.
+  print_options_set(num_options, options, details, RPSBUFSIZE);
+  angle_to_string((24.0 * data->spectrum[0][0]->ut_seconds / 86400.0),
+		  time, ATS_ANGLE_IN_HOURS | ATS_STRING_IN_HOURS |
+		  ATS_STRING_SEP_COLON | ATS_STRING_ZERO_PAD_FIRST, 0);
+  fprintf(stderr, "[add_cache_spd_data] adding SPD cache entry for data at "
+	  "time %s %s with options:\n%s", data->header_data->obsdate,
+	  time, details);
+  n = cache_spd_data.num_cache_spd_data + 1;
+  REALLOC(cache_spd_data.num_options, n);
+  REALLOC(cache_spd_data.ampphase_options, n);
+  cache_spd_data.num_options[n - 1] = num_options;
+  MALLOC(cache_spd_data.ampphase_options[n - 1], num_options);
+  for (i = 0; i < num_options; i++) {
+    MALLOC(cache_spd_data.ampphase_options[n - 1][i], 1);
+    set_default_ampphase_options(cache_spd_data.ampphase_options[n - 1][i]);
+    copy_ampphase_options(cache_spd_data.ampphase_options[n - 1][i], options[i]);
+  }
+  REALLOC(cache_spd_data.spectrum_data, n);
+  MALLOC(cache_spd_data.spectrum_data[n - 1], 1);
+  copy_spectrum_data(cache_spd_data.spectrum_data[n - 1], data);
+  cache_spd_data.num_cache_spd_data = n;
+  
+  return true;
+}
+
+/*!
+ *  \brief Add a vis cache entry, labelled with a provided set of options
+ *  \param num_options the number of options in the set
+ *  \param options the set of options with which to label the vis cache entry
+ *  \param data the data to store in the cache
+ *  \return an indication of whether the data was added to the cache; false
+ *          if an existing entry was found with the same options set, or true
+ *          if the set was added
+ */
+bool add_cache_vis_data(int num_options, struct ampphase_options **options,
+                        struct vis_data *data) {
+  int i, j, n;
+  bool match_found = false;
+
+  if (num_options == 0) {
+    // What??
+    return false;
+  }
+
+  // Check that we don't already know about the data.
+  for (i = 0; i < cache_vis_data.num_cache_vis_data; i++) {
+    if (cache_vis_data.num_options[i] != num_options) {
+      // Can't be this one.
+      continue;
+    }
+    match_found = true;
+    for (j = 0; j < cache_vis_data.num_options[i]; j++) {
+      if (ampphase_options_match(options[j],
+				 cache_vis_data.ampphase_options[i][j]) == false) {
+	// Not a perfect match.
+	match_found = false;
+	break;
+      }
+    }
+    if (match_found) {
+      // Don't need to add this data, we already have it.
+      return false;
+    }
+  }
+
+  // If we get here, this is new data.
+  n = cache_vis_data.num_cache_vis_data + 1;
+  REALLOC(cache_vis_data.num_options, n);
+  REALLOC(cache_vis_data.ampphase_options, n);
+  REALLOC(cache_vis_data.vis_data, n);
+  cache_vis_data.num_options[n - 1] = num_options;
+  MALLOC(cache_vis_data.ampphase_options[n - 1], num_options);
+  for (i = 0; i < num_options; i++) {
+    MALLOC(cache_vis_data.ampphase_options[n - 1][i], 1);
+    set_default_ampphase_options(cache_vis_data.ampphase_options[n - 1][i]);
+    copy_ampphase_options(cache_vis_data.ampphase_options[n - 1][i], options[i]);
+  }
+  MALLOC(cache_vis_data.vis_data[n - 1], 1);
+  copy_vis_data(cache_vis_data.vis_data[n - 1], data);
+  cache_vis_data.num_cache_vis_data = n;
+
+  return true;
+}
+
+/*!
+ *  \brief Get a SPD cache entry, labelled with a provided set of options
+ *  \param num_options the number of options in the set
+ *  \param options the set of options to consider while searching
+ *  \param mjd the MJD of the cycle to search for
+ *  \param tol the tolerance on the MJD (in days) in assessing a match
+ *  \param data a pointer to a data variable which, if a match is found will
+ *              be filled with the matching cache entry; if the pointer is to
+ *              NULL, the pointer will be redirected to the actual cache
+ *              entry, otherwise a copy of the data will be made
+ *  \return an indication of whether the search found a match; true if a
+ *          match was found, or false if not
+ */
+bool get_cache_spd_data(int num_options, struct ampphase_options **options,
+                        double mjd, double tol,
+                        struct spectrum_data **data) {
+  int i, j;
+  double tmjd;
+  bool match_found = false;
+  
+  if (num_options == 0) {
+    // No chance of a match.
+    return false;
+  }
+  /* fprintf(stderr, "[get_cache_spd_data] looking for MJD %.8f within %.8f, %d\n", */
+  /*         mjd, tol, options->phase_in_degrees); */
+  for (i = 0; i < cache_spd_data.num_cache_spd_data; i++) {
+    if (cache_spd_data.num_options[i] != num_options) {
+      // Can't be this one.
+      continue;
+    }
+    // Calculate MJD of this cache entry.
+    tmjd = date2mjd(cache_spd_data.spectrum_data[i]->header_data->obsdate,
+                    cache_spd_data.spectrum_data[i]->spectrum[0][0]->ut_seconds);
+    /* fprintf(stderr, "[get_cache_spd_data] cache entry %d MJD %.8f %d %d\n", */
+    /*         i, tmjd, (fabs(mjd - tmjd) <= tol), */
+    /*         cache_spd_data.ampphase_options[i]->phase_in_degrees); */
+    if (fabs(mjd - tmjd) > tol) {
+      // Not a good enough match.
+      continue;
+    }
+    match_found = true;
+    for (j = 0; j < cache_spd_data.num_options[i]; j++) {
+      if (ampphase_options_match(options[j],
+				 cache_spd_data.ampphase_options[i][j]) == false) {
+	// Not a perfect match.
+	match_found = false;
+	break;
+      }
+    }
+    if (match_found) {
+      /* fprintf(stderr, "[get_cache_spd_data] cache hit %s %.1f %d\n", */
+      /*         cache_spd_data.spectrum_data[i]->header_data->obsdate, */
+      /*         cache_spd_data.spectrum_data[i]->spectrum[0][0]->ut_seconds, */
+      /*         cache_spd_data.ampphase_options[i]->phase_in_degrees); */
+      if (*data == NULL) {
+        // Occurs in the child computer usually.
+        *data = cache_spd_data.spectrum_data[i];
+      } else {
+        copy_spectrum_data(*data, cache_spd_data.spectrum_data[i]);
+      }
+      return true;
+    }
+  }
+  
+  return false;
+}
+
+/*!
+ *  \brief Check whether some SPD data is an entry in the SPD cache
+ *  \param data the data to check
+ *  \return true if \a data is the cache entry itself (as returned by
+ *          get_cache_spd_data when it was passed a pointer to NULL), or
+ *          false if it is separate memory
+ */
+bool spd_data_cached(struct spectrum_data *data) {
+  int i;
+
+  for (i = 0; i < cache_spd_data.num_cache_spd_data; i++) {
+    if (cache_spd_data.spectrum_data[i] == data) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+/*!
+ *  \brief Search for a vis cache entry matching the provided set of options
+ *  \param num_options the number of options in the set
+ *  \param options the set of options to consider while searching
+ *  \param data a pointer to a data variable which, if a match is found will
+ *              be filled with the matching cache entry; if the pointer is
+ *              to NULL, the pointer will be redirected to the actual cache
+ *              entry, otherwise a copy of the data will be made
+ *  \return an indication of whether the search found a match; true if a
+ *          match was found, or false if not
+ */
+bool get_cache_vis_data(int num_options, struct ampphase_options **options,
+                        struct vis_data **data) {
+  int i, j;
+  bool match_found = false;
+
+  if (num_options == 0) {
+    // No chance of a match.
+    return false;
+  }
+  for (i = 0; i < cache_vis_data.num_cache_vis_data; i++) {
+    if (cache_vis_data.num_options[i] != num_options) {
+      // Can't be this one.
+      continue;
+    }
+    match_found = true;
+    for (j = 0; j < cache_vis_data.num_options[i]; j++) {
+      if (ampphase_options_match(options[j],
+				 cache_vis_data.ampphase_options[i][j]) == false) {
+	// Not a perfect match.
+	match_found = false;
+	break;
+      }
+    }
+    if (match_found) {
+      if (*data == NULL) {
+        // Occurs in the child computer usually.
+        *data = cache_vis_data.vis_data[i];
+      } else {
+        copy_vis_data(*data, cache_vis_data.vis_data[i]);
+      }
+      return true;
+    }
+  }
+
+  return false;
+}
+
+/*!
+ *  \brief Search for a vis cache entry that was computed with options which
+ *         only differ from the provided set in their modifiers
+ *  \param num_options the number of options in the set
+ *  \param options the set of options to consider while searching
+ *  \param mjd_low the MJD before which the data should not have been read
+ *  \param mjd_high the MJD after which the data should not have been read
+ *  \param data a pointer which will be redirected to the matching cache entry
+ *  \param n_windows a pointer to the number of time ranges in \a windows, which
+ *                   is set to the number of ranges in which the products
+ *                   from the cache entry would be different
+ *  \param windows a pointer to the list of the start and end MJD of each time
+ *                 range, which is allocated here and should be freed by the
+ *                 caller
+ *  \return an indication of whether the search found a match; true if a
+ *          match was found, or false if not
+ *
+ * Only the cycles inside the time ranges need to be computed again, while the
+ * others can be taken from the cache entry.
+ */
+bool get_cache_vis_data_windows(int num_options, struct ampphase_options **options,
+				double mjd_low, double mjd_high, struct vis_data **data,
+				int *n_windows, double **windows) {
+  int i, j;
+  bool match_found = false;
+
+  *n_windows = 0;
+  *windows = NULL;
+  for (i = 0; i < cache_vis_data.num_cache_vis_data; i++) {
+    if ((cache_vis_data.num_options[i] != num_options) ||
+	(cache_vis_data.vis_data[i]->mjd_low != mjd_low) ||
+	(cache_vis_data.vis_data[i]->mjd_high != mjd_high)) {
+      // Can't be this one.
+      continue;
+    }
+    match_found = true;
+    for (j = 0; j < num_options; j++) {
+      if (!ampphase_options_modifier_windows(options[j],
+					     cache_vis_data.ampphase_options[i][j],
+					     n_windows, windows)) {
+	match_found = false;
+	break;
+      }
+    }
+    if (match_found) {
+      *data = cache_vis_data.vis_data[i];
+      return true;
+    }
+    *n_windows = 0;
+    FREE(*windows);
+  }
+
+  return false;
+}
+
+/*!
+ *  \brief Get a noise diode averages cache entry
+ *  \param num_options the number of options in the set
+ *  \param options the set of options the averages were made with
+ *  \param mjd the MJD of the cycle to search for
+ *  \param tol the tolerance on the MJD (in days) in assessing a match
+ *  \param window the window number to search for
+ *  \return the cache entry, which must not be freed, or NULL if there isn't
+ *          a match
+ */
+struct noise_diode_sums *get_cache_acal_sums(int num_options,
+					     struct ampphase_options **options,
+					     double mjd, double tol, int window) {
+  int i, j;
+  bool match_found = false;
+
+  for (i = 0; i < cache_acal_sums.num_cache_acal_sums; i++) {
+    if ((cache_acal_sums.num_options[i] != num_options) ||
+	(cache_acal_sums.sums[i]->window != window) ||
+	(fabs(cache_acal_sums.sums[i]->mjd - mjd) > tol)) {
+      // Can't be this one.
+      continue;
+    }
+    match_found = true;
+    for (j = 0; j < num_options; j++) {
+      if (ampphase_options_match(options[j],
+				 cache_acal_sums.ampphase_options[i][j]) == false) {
+	// Not a perfect match.
+	match_found = false;
+	break;
+      }
+    }
+    if (match_found) {
+      return cache_acal_sums.sums[i];
+    }
+  }
+
+  return NULL;
+}
+
+/*!
+ *  \brief Add a noise diode averages cache entry, labelled with a provided set
+ *         of options
+ *  \param num_options the number of options in the set
+ *  \param options the set of options with which to label the cache entry
+ *  \param sums the averages to store in the cache, which the cache takes
+ *              ownership of if they are added
+ *  \return an indication of whether the averages were added to the cache;
+ *          false if an existing entry was found for the same cycle, window and
+ *          options, or true if they were added
+ */
+bool add_cache_acal_sums(int num_options, struct ampphase_options **options,
+			 struct noise_diode_sums *sums) {
+  int i, n;
+
+  if ((num_options == 0) ||
+      (get_cache_acal_sums(num_options, options, sums->mjd, 0, sums->window) != NULL)) {
+    return false;
+  }
+
+  n = cache_acal_sums.num_cache_acal_sums + 1;
+  REALLOC(cache_acal_sums.num_options, n);
+  REALLOC(cache_acal_sums.ampphase_options, n);
+  REALLOC(cache_acal_sums.sums, n);
+  cache_acal_sums.num_options[n - 1] = num_options;
+  MALLOC(cache_acal_sums.ampphase_options[n - 1], num_options);
+  for (i = 0; i < num_options; i++) {
+    MALLOC(cache_acal_sums.ampphase_options[n - 1][i], 1);
+    set_default_ampphase_options(cache_acal_sums.ampphase_options[n - 1][i]);
+    copy_ampphase_options(cache_acal_sums.ampphase_options[n - 1][i], options[i]);
+  }
+  cache_acal_sums.sums[n - 1] = sums;
+  cache_acal_sums.num_cache_acal_sums = n;
+
+  return true;
+}
+
+/*!
+ *  \brief Check whether an MJD lies in any of a list of time ranges
+ *  \param mjd the MJD to check
+ *  \param margin the amount by which each range is extended at either end
+ *  \param n_windows the number of time ranges
+ *  \param windows the start and end MJD of each time range
+ *  \return true if \a mjd is in one of the ranges, or false otherwise
+ */
+bool mjd_in_windows(double mjd, double margin, int n_windows, double *windows) {
+  int i;
+
+  for (i = 0; i < n_windows; i++) {
+    if ((mjd >= (windows[2 * i] - margin)) &&
+	(mjd <= (windows[2 * i + 1] + margin))) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// The ways in which we can read data.
+/*! \def READ_SCAN_METADATA
+ *  \brief Magic number to tell data_reader that we would like to read the
+ *         information about scans present in an RPFITS file
+ *
+ * This magic number can be combined in a bitwise-OR with COMPUTE_VIS_PRODUCTS
+ * and GRAB_SPECTRUM.
+ */
+#define READ_SCAN_METADATA   1<<1
+/*! \def COMPUTE_VIS_PRODUCTS
+ *  \brief Magic number to tell data_reader that we would like to compute the
+ *         products that will go to an NVIS client while reading the RPFITS file
+ *
+ * This magic number can be combined in a bitwise-OR with READ_SCAN_METADATA
+ * and GRAB_SPECTRUM.
+ */
+#define COMPUTE_VIS_PRODUCTS 1<<2
+/*! \def GRAB_SPECTRUM
+ *  \brief Magic number to tell data_reader that we would like to compute the
+ *         products that will go to an NSPD client while reading the RPFITS file
+ *
+ * This magic number can be combined in a bitwise-OR with READ_SCAN_METADATA
+ * and COMPUTE_VIS_PRODUCTS.
+ */
+#define GRAB_SPECTRUM        1<<3
+/*! \def GRAB_MJDS_SPECTRA
+ *  \brief Magic number to tell data_reader that we would like to get several
+ *         spectrum products, determined by a list of MJDs passed to the routine
+ *
+ * This magic number can be combined in a bitwise-OR with READ_SCAN_METADATA,
+ * COMPUTE_VIS_PRODUCTS and GRAB_SPECTRUM. Any spectra already in the list
+ * passed to data_reader aren't grabbed again.
+ */
+#define GRAB_MJDS_SPECTRA    1<<4
+/*! \def IGNORE_CACHE
+ *  \brief Magic number to tell data_reader not to look for the products it
+ *         has been asked for in the caches, but to always compute them
+ *
+ * This magic number can be combined in a bitwise-OR with COMPUTE_VIS_PRODUCTS,
+ * GRAB_SPECTRUM and GRAB_MJDS_SPECTRA, and is used when computing products for
+ * data that has only just been read, or when the caches have already been
+ * searched.
+ */
+#define IGNORE_CACHE         1<<5
+
+/*!
+ *  \brief Find the next cycle in a scan that a spectrum grab wants
+ *  \param info the file information structure
+ *  \param scan the index of the scan to search
+ *  \param first_cycle the index of the first cycle to consider
+ *  \param read_type the magic number(s) passed to data_reader
+ *  \param mjd_required the MJD wanted by GRAB_SPECTRUM
+ *  \param num_mjds the number of MJDs wanted by GRAB_MJDS_SPECTRA
+ *  \param mjds the MJDs wanted by GRAB_MJDS_SPECTRA
+ *  \param mjds_cache_hit whether each of \a mjds has already been found in
+ *                        the cache
+ *  \param n_windows the number of time ranges in which COMPUTE_VIS_PRODUCTS
+ *                   needs cycles
+ *  \param windows the start and end MJD of each of those time ranges
+ *  \return the index of the cycle, or -1 if no more cycles in this scan are wanted
+ *
+ * A cycle is wanted if the MJD is within half a cycle time of the cycle's time,
+ * which is the same test that data_reader uses on each cycle it reads.
+ */
+int next_wanted_cycle(struct rpfits_file_information *info, int scan, int first_cycle,
+		      int read_type, double mjd_required, int num_mjds, double *mjds,
+		      bool *mjds_cache_hit, int n_windows, double *windows) {
+  int i, j;
+  double cycle_start, cycle_end, half_cycle;
+
+  half_cycle = (double)info->scan_headers[scan]->cycle_time / (2.0 * 86400.0);
+  for (i = first_cycle; i < info->n_cycles[scan]; i++) {
+    cycle_start = info->cycle_mjd[scan][i] - half_cycle;
+    cycle_end = info->cycle_mjd[scan][i] + half_cycle;
+    if ((read_type & GRAB_SPECTRUM) &&
+	(mjd_required >= cycle_start) && (mjd_required < cycle_end)) {
+      return(i);
+    }
+    if (read_type & GRAB_MJDS_SPECTRA) {
+      for (j = 0; j < num_mjds; j++) {
+	if ((mjds_cache_hit[j] == false) &&
+	    (mjds[j] >= cycle_start) && (mjds[j] < cycle_end)) {
+	  return(i);
+	}
+      }
+    }
+    if ((read_type & COMPUTE_VIS_PRODUCTS) &&
+	mjd_in_windows(info->cycle_mjd[scan][i], half_cycle, n_windows, windows)) {
+      return(i);
+    }
+  }
+
+  return(-1);
+}
+
+/*! \struct vis_products_job
+ *  \brief Everything needed to compute the products for a single cycle, and
+ *         the products once they've been computed
+ */
+struct vis_products_job {
+  /*! \var sh
+   *  \brief The header of the scan the cycle is from, as it was read along
+   *         with the cycle
+   */
+  struct scan_header_data *sh;
+  /*! \var header_data
+   *  \brief The header of the scan the cycle is from, as it is stored in the
+   *         file information structure
+   */
+  struct scan_header_data *header_data;
+  /*! \var cycle_data
+   *  \brief The cycle, after its system temperatures have been calculated
+   */
+  struct cycle_data *cycle_data;
+  /*! \var free_cycle_data
+   *  \brief Whether the cycle should be freed once the products are computed
+   */
+  bool free_cycle_data;
+  /*! \var compute_vis
+   *  \brief Whether the NVIS products are wanted from this cycle
+   */
+  bool compute_vis;
+  /*! \var keep_spectrum
+   *  \brief Whether the spectra should be kept once the products are computed
+   */
+  bool keep_spectrum;
+  /*! \var num_options
+   *  \brief The number of options structures in `options`
+   */
+  int num_options;
+  /*! \var options
+   *  \brief The job's own copy of the options, which the computations may add to
+   */
+  struct ampphase_options **options;
+  /*! \var spectrum
+   *  \brief The spectra computed from the cycle, or NULL if they weren't kept
+   */
+  struct spectrum_data *spectrum;
+  /*! \var num_pols
+   *  \brief The number of polarisations in each window of `vis_quantities`
+   */
+  int *num_pols;
+  /*! \var vis_quantities
+   *  \brief The NVIS products, indexed [window][pol] as in vis_data
+   */
+  struct vis_quantities ***vis_quantities;
+  /*! \var metinfo
+   *  \brief The weather information for the cycle
+   */
+  struct metinfo *metinfo;
+  /*! \var syscal_data
+   *  \brief The calibration parameters for the cycle
+   */
+  struct syscal_data *syscal_data;
+  /*! \var vis_cycled
+   *  \brief Whether any NVIS products were computed
+   */
+  bool vis_cycled;
+  /*! \var done
+   *  \brief Whether the computations have finished
+   */
+  bool done;
+};
+
+/*!
+ *  \brief Make a job to compute the products for a single cycle
+ *  \param sh the header of the scan the cycle is from, as read with the cycle
+ *  \param header_data the header of the scan from the file information structure
+ *  \param cycle_data the cycle, after its system temperatures have been calculated
+ *  \param compute_vis whether the NVIS products are wanted from this cycle
+ *  \param num_options the number of options structures in \a options
+ *  \param options the options to compute with, which are copied into the job
+ *  \return the job
+ */
+struct vis_products_job *new_vis_products_job(struct scan_header_data *sh,
+					      struct scan_header_data *header_data,
+					      struct cycle_data *cycle_data, bool compute_vis,
+					      int num_options,
+					      struct ampphase_options **options) {
+  int i;
+  struct vis_products_job *job = NULL;
+
+  CALLOC(job, 1);
+  job->sh = sh;
+  job->header_data = header_data;
+  job->cycle_data = cycle_data;
+  job->free_cycle_data = false;
+  job->compute_vis = compute_vis;
+  job->keep_spectrum = false;
+  job->num_options = num_options;
+  MALLOC(job->options, job->num_options);
+  for (i = 0; i < job->num_options; i++) {
+    CALLOC(job->options[i], 1);
+    set_default_ampphase_options(job->options[i]);
+    copy_ampphase_options(job->options[i], options[i]);
+  }
+  job->vis_cycled = false;
+  job->done = false;
+
+  return job;
+}
+
+/*!
+ *  \brief Free a spectrum_data structure made by compute_vis_products
+ *  \param spectrum the spectra to free
+ *  \param sh the header of the scan the spectra are from
+ */
+void free_cycle_spectrum(struct spectrum_data *spectrum, struct scan_header_data *sh) {
+  int idx_if, idx_pol;
+
+  for (idx_if = 0; idx_if < spectrum->num_ifs; idx_if++) {
+    for (idx_pol = 0; idx_pol < sh->if_num_stokes[idx_if]; idx_pol++) {
+      free_ampphase(&(spectrum->spectrum[idx_if][idx_pol]));
+    }
+    FREE(spectrum->spectrum[idx_if]);
+  }
+  FREE(spectrum->spectrum);
+  FREE(spectrum);
+}
+
+/*!
+ *  \brief Compute the spectra and, if wanted, the NVIS products for a cycle
+ *  \param job the job describing the cycle
+ *  \param workspace the scratch space for ampphase_average, which can't be
+ *                   shared with any job being computed at the same time
+ *
+ * This uses only the memory belonging to the job and the workspace (and reads
+ * the scan header), so any number of jobs can be computed at the same time.
+ */
+void compute_vis_products(struct vis_products_job *job,
+			  struct ampphase_average_workspace *workspace) {
+  int idx_if, idx_pol, calcres;
+  int pols[4] = { POL_XX, POL_YY, POL_XY, POL_YX };
+  struct scan_header_data *sh = job->sh;
+  struct spectrum_data *temp_spectrum = NULL;
+
+  MALLOC(temp_spectrum, 1);
+  // Prepare the spectrum data structure.
+  temp_spectrum->num_ifs = sh->num_ifs;
+  temp_spectrum->header_data = job->header_data;
+  MALLOC(temp_spectrum->spectrum, temp_spectrum->num_ifs);
+  for (idx_if = 0; idx_if < temp_spectrum->num_ifs; idx_if++) {
+    CALLOC(temp_spectrum->spectrum[idx_if], sh->if_num_stokes[idx_if]);
+  }
+  temp_spectrum->num_pols = sh->if_num_stokes[temp_spectrum->num_ifs - 1];
+  if (job->compute_vis) {
+    MALLOC(job->num_pols, temp_spectrum->num_ifs);
+    MALLOC(job->vis_quantities, temp_spectrum->num_ifs);
+  }
+  // Get all the windows and polarisations in a single pass through the cycle.
+  calcres = vis_ampphase_cycle(sh, job->cycle_data, temp_spectrum->spectrum,
+			       4, pols, &(job->num_options), &(job->options));
+  for (idx_if = 0; idx_if < temp_spectrum->num_ifs; idx_if++) {
+    if (job->compute_vis) {
+      job->num_pols[idx_if] = sh->if_num_stokes[idx_if];
+      CALLOC(job->vis_quantities[idx_if], sh->if_num_stokes[idx_if]);
+    }
+    for (idx_pol = 0; idx_pol < sh->if_num_stokes[idx_if]; idx_pol++) {
+      if (temp_spectrum->spectrum[idx_if][idx_pol] == NULL) {
+	fprintf(stderr, "CALCULATING AMP AND PHASE FAILED FOR IF %d POL %d, CODE %d\n",
+		sh->if_label[idx_if], pols[idx_pol], calcres);
+	continue;
+      }
+      if (job->compute_vis) {
+	ampphase_average(sh, temp_spectrum->spectrum[idx_if][idx_pol],
+			 &(job->vis_quantities[idx_if][idx_pol]),
+			 &(job->num_options), &(job->options), workspace);
+	job->vis_cycled = true;
+      }
+    }
+  }
+  if (job->vis_cycled) {
+    // Compile the metinfo and calibration data.
+    CALLOC(job->metinfo, 1);
+    copy_metinfo(job->metinfo, &(temp_spectrum->spectrum[0][0]->metinfo));
+    spectrum_data_compile_system_temperatures(temp_spectrum, &(job->syscal_data));
+  }
+
+  if (job->keep_spectrum) {
+    job->spectrum = temp_spectrum;
+  } else {
+    free_cycle_spectrum(temp_spectrum, sh);
+  }
+  if (job->free_cycle_data) {
+    free_cycle_data(job->cycle_data);
+    FREE(job->cycle_data);
+  }
+}
+
+/*!
+ *  \brief Add the products computed by a job to the vis data, and free the job
+ *  \param job the job, whose computations must have finished
+ *  \param num_options a pointer to the number of options structures in
+ *                     \a ampphase_options
+ *  \param ampphase_options the options that data_reader was given, to which
+ *                          any bands that the job added are appended
+ *  \param vis_data the vis data to add the products to
+ *
+ * Jobs must be committed in the order that their cycles were read. The job's
+ * spectra aren't freed, so if they were kept they should be taken from the
+ * job first.
+ */
+void commit_vis_products(struct vis_products_job *job, int *num_options,
+			 struct ampphase_options ***ampphase_options,
+			 struct vis_data **vis_data) {
+  int j, k, idx_if, n;
+  bool known_band;
+
+  // The job started with a copy of the options as they were when its cycle
+  // was read, and the options may have gained other bands since then, so
+  // we only take the bands that the job added and that we don't yet have.
+  for (j = 0; j < job->num_options; j++) {
+    known_band = false;
+    for (k = 0; k < *num_options; k++) {
+      if (ampphase_options_same_band((*ampphase_options)[k], job->options[j])) {
+	known_band = true;
+	break;
+      }
+    }
+    if (known_band == false) {
+      REALLOC(*ampphase_options, (*num_options + 1));
+      CALLOC((*ampphase_options)[*num_options], 1);
+      copy_ampphase_options((*ampphase_options)[*num_options], job->options[j]);
+      *num_options += 1;
+    }
+  }
+
+  if (job->vis_cycled) {
+    n = (*vis_data)->nviscycles;
+    REALLOC((*vis_data)->vis_quantities, (n + 1));
+    REALLOC((*vis_data)->header_data, (n + 1));
+    REALLOC((*vis_data)->num_ifs, (n + 1));
+    REALLOC((*vis_data)->num_pols, (n + 1));
+    REALLOC((*vis_data)->metinfo, (n + 1));
+    REALLOC((*vis_data)->syscal_data, (n + 1));
+    (*vis_data)->num_ifs[n] = job->sh->num_ifs;
+    (*vis_data)->header_data[n] = job->header_data;
+    (*vis_data)->num_pols[n] = job->num_pols;
+    (*vis_data)->vis_quantities[n] = job->vis_quantities;
+    (*vis_data)->metinfo[n] = job->metinfo;
+    (*vis_data)->syscal_data[n] = job->syscal_data;
+    (*vis_data)->nviscycles += 1;
+
+    // Copy the merged options to the vis data structure as well.
+    for (j = 0; j < (*vis_data)->num_options; j++) {
+      free_ampphase_options((*vis_data)->options[j]);
+      FREE((*vis_data)->options[j]);
+    }
+    (*vis_data)->num_options = *num_options;
+    REALLOC((*vis_data)->options, (*vis_data)->num_options);
+    for (j = 0; j < (*vis_data)->num_options; j++) {
+      CALLOC((*vis_data)->options[j], 1);
+      copy_ampphase_options((*vis_data)->options[j], (*ampphase_options)[j]);
+    }
+  } else if (job->vis_quantities != NULL) {
+    // Nothing could be computed, so there are only empty arrays to free.
+    for (idx_if = 0; idx_if < job->sh->num_ifs; idx_if++) {
+      FREE(job->vis_quantities[idx_if]);
+    }
+    FREE(job->vis_quantities);
+    FREE(job->num_pols);
+  }
+
+  // Free the job's local ampphase options.
+  for (j = 0; j < job->num_options; j++) {
+    free_ampphase_options(job->options[j]);
+    FREE(job->options[j]);
+  }
+  FREE(job->options);
+  FREE(job);
+}
+
+/*! \struct vis_products_pipeline
+ *  \brief A pool of threads that compute the products for cycles while
+ *         data_reader reads the cycles that follow them
+ *
+ * The jobs are kept in a ring in the order that their cycles were read. The
+ * threads take jobs from the ring in that order, and data_reader commits them
+ * from the oldest end, so the products always go into the vis data in cycle
+ * order no matter which thread finishes first.
+ */
+struct vis_products_pipeline {
+  /*! \var n_threads
+   *  \brief The number of threads in the pool
+   */
+  int n_threads;
+  /*! \var threads
+   *  \brief The threads in the pool
+   */
+  pthread_t *threads;
+  /*! \var max_jobs
+   *  \brief The number of jobs that can be in the ring, which limits how many
+   *         cycles are held in memory at once
+   */
+  int max_jobs;
+  /*! \var jobs
+   *  \brief The ring of jobs, which has length `max_jobs`
+   */
+  struct vis_products_job **jobs;
+  /*! \var first_job
+   *  \brief The position in the ring of the oldest job
+   */
+  int first_job;
+  /*! \var n_jobs
+   *  \brief The number of jobs in the ring
+   */
+  int n_jobs;
+  /*! \var n_started
+   *  \brief The number of jobs, counting from the oldest, that have been
+   *         taken by a thread
+   */
+  int n_started;
+  /*! \var stopping
+   *  \brief Set to tell the threads to finish
+   */
+  bool stopping;
+  /*! \var lock
+   *  \brief Protects all the other members of this structure, and the `done`
+   *         flag of each job
+   */
+  pthread_mutex_t lock;
+  /*! \var job_added
+   *  \brief Signalled when a job is added to the ring, or the threads should stop
+   */
+  pthread_cond_t job_added;
+  /*! \var job_done
+   *  \brief Signalled when a job has been computed
+   */
+  pthread_cond_t job_done;
+};
+
+/*! \def VIS_PRODUCTS_JOBS_PER_THREAD
+ *  \brief The number of jobs that can wait in the pipeline for each thread
+ */
+#define VIS_PRODUCTS_JOBS_PER_THREAD 4
+
+/*!
+ *  \brief The routine run by each thread in the vis products pipeline
+ *  \param arg a pointer to the vis_products_pipeline structure
+ *  \return NULL
+ */
+void *vis_products_thread(void *arg) {
+  struct vis_products_pipeline *pipeline = (struct vis_products_pipeline *)arg;
+  struct vis_products_job *job = NULL;
+  struct ampphase_average_workspace *workspace = prepare_ampphase_average_workspace();
+
+  pthread_mutex_lock(&(pipeline->lock));
+  while (true) {
+    while ((pipeline->n_started == pipeline->n_jobs) && !pipeline->stopping) {
+      pthread_cond_wait(&(pipeline->job_added), &(pipeline->lock));
+    }
+    if (pipeline->n_started == pipeline->n_jobs) {
+      break;
+    }
+    job = pipeline->jobs[(pipeline->first_job + pipeline->n_started) % pipeline->max_jobs];
+    pipeline->n_started += 1;
+    pthread_mutex_unlock(&(pipeline->lock));
+
+    compute_vis_products(job, workspace);
+
+    pthread_mutex_lock(&(pipeline->lock));
+    job->done = true;
+    pthread_cond_broadcast(&(pipeline->job_done));
+  }
+  pthread_mutex_unlock(&(pipeline->lock));
+  free_ampphase_average_workspace(&workspace);
+
+  return NULL;
+}
+
+/*!
+ *  \brief Start a pool of threads to compute vis products
+ *  \return the pipeline, or NULL if there's only one CPU or no threads could
+ *          be started, in which case the products should be computed serially
+ */
+struct vis_products_pipeline *start_vis_products_pipeline(void) {
+  int i;
+  long n_cpus;
+  struct vis_products_pipeline *pipeline = NULL;
+
+  n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if (n_cpus <= 1) {
+    return NULL;
+  }
+  CALLOC(pipeline, 1);
+  pipeline->max_jobs = (int)n_cpus * VIS_PRODUCTS_JOBS_PER_THREAD;
+  CALLOC(pipeline->jobs, pipeline->max_jobs);
+  pipeline->first_job = 0;
+  pipeline->n_jobs = 0;
+  pipeline->n_started = 0;
+  pipeline->stopping = false;
+  pthread_mutex_init(&(pipeline->lock), NULL);
+  pthread_cond_init(&(pipeline->job_added), NULL);
+  pthread_cond_init(&(pipeline->job_done), NULL);
+  MALLOC(pipeline->threads, n_cpus);
+  for (i = 0; i < n_cpus; i++) {
+    if (pthread_create(&(pipeline->threads[pipeline->n_threads]), NULL,
+		       vis_products_thread, pipeline) != 0) {
+      fprintf(stderr, "[start_vis_products_pipeline] unable to start thread %d\n", i);
+      break;
+    }
+    pipeline->n_threads++;
+  }
+  if (pipeline->n_threads == 0) {
+    FREE(pipeline->threads);
+    FREE(pipeline->jobs);
+    pthread_mutex_destroy(&(pipeline->lock));
+    pthread_cond_destroy(&(pipeline->job_added));
+    pthread_cond_destroy(&(pipeline->job_done));
+    FREE(pipeline);
+  }
+
+  return pipeline;
+}
+
+/*!
+ *  \brief Wait for the oldest job in the pipeline to be computed, then commit it
+ *  \param pipeline the pipeline, which must have at least one job in it
+ *  \param num_options passed to commit_vis_products
+ *  \param ampphase_options passed to commit_vis_products
+ *  \param vis_data passed to commit_vis_products
+ */
+void commit_oldest_vis_products(struct vis_products_pipeline *pipeline, int *num_options,
+				struct ampphase_options ***ampphase_options,
+				struct vis_data **vis_data) {
+  struct vis_products_job *job = NULL;
+
+  pthread_mutex_lock(&(pipeline->lock));
+  job = pipeline->jobs[pipeline->first_job];
+  while (!job->done) {
+    pthread_cond_wait(&(pipeline->job_done), &(pipeline->lock));
+  }
+  pipeline->jobs[pipeline->first_job] = NULL;
+  pipeline->first_job = (pipeline->first_job + 1) % pipeline->max_jobs;
+  pipeline->n_jobs -= 1;
+  pipeline->n_started -= 1;
+  pthread_mutex_unlock(&(pipeline->lock));
+
+  commit_vis_products(job, num_options, ampphase_options, vis_data);
+}
+
+/*!
+ *  \brief Give a job to the pipeline
+ *  \param pipeline the pipeline
+ *  \param job the job, which now belongs to the pipeline
+ *  \param num_options passed to commit_vis_products
+ *  \param ampphase_options passed to commit_vis_products
+ *  \param vis_data passed to commit_vis_products
+ *
+ * If the pipeline is full, the oldest job is waited for and committed first.
+ */
+void submit_vis_products(struct vis_products_pipeline *pipeline,
+			 struct vis_products_job *job, int *num_options,
+			 struct ampphase_options ***ampphase_options,
+			 struct vis_data **vis_data) {
+  if (pipeline->n_jobs == pipeline->max_jobs) {
+    commit_oldest_vis_products(pipeline, num_options, ampphase_options, vis_data);
+  }
+  pthread_mutex_lock(&(pipeline->lock));
+  pipeline->jobs[(pipeline->first_job + pipeline->n_jobs) % pipeline->max_jobs] = job;
+  pipeline->n_jobs += 1;
+  pthread_cond_signal(&(pipeline->job_added));
+  pthread_mutex_unlock(&(pipeline->lock));
+}
+
+/*!
+ *  \brief Wait for all the jobs in the pipeline and commit them
+ *  \param pipeline the pipeline, which may be NULL
+ *  \param num_options passed to commit_vis_products
+ *  \param ampphase_options passed to commit_vis_products
+ *  \param vis_data passed to commit_vis_products
+ */
+void drain_vis_products(struct vis_products_pipeline *pipeline, int *num_options,
+			struct ampphase_options ***ampphase_options,
+			struct vis_data **vis_data) {
+  if (pipeline == NULL) {
+    return;
+  }
+  // Only data_reader adds or removes jobs, so we don't need the lock here.
+  while (pipeline->n_jobs > 0) {
+    commit_oldest_vis_products(pipeline, num_options, ampphase_options, vis_data);
+  }
+}
+
+/*!
+ *  \brief Stop the threads in a pipeline and free it
+ *  \param pipeline the pipeline, which may be NULL, and which must be empty
+ */
+void stop_vis_products_pipeline(struct vis_products_pipeline *pipeline) {
+  int i;
+
+  if (pipeline == NULL) {
+    return;
+  }
+  pthread_mutex_lock(&(pipeline->lock));
+  pipeline->stopping = true;
+  pthread_cond_broadcast(&(pipeline->job_added));
+  pthread_mutex_unlock(&(pipeline->lock));
+  for (i = 0; i < pipeline->n_threads; i++) {
+    pthread_join(pipeline->threads[i], NULL);
+  }
+  FREE(pipeline->threads);
+  FREE(pipeline->jobs);
+  pthread_mutex_destroy(&(pipeline->lock));
+  pthread_cond_destroy(&(pipeline->job_added));
+  pthread_cond_destroy(&(pipeline->job_done));
+  FREE(pipeline);
+}
+
+/*! \struct acal_sums_batch
+ *  \brief A set of noise diode averages to be made in parallel
+ *
+ * Each job makes the averages of one cycle in one window. The jobs don't
+ * depend on each other, so the threads just take the next job until there
+ * are none left.
+ */
+struct acal_sums_batch {
+  /*! \var n_jobs
+   *  \brief The number of jobs
+   */
+  int n_jobs;
+  /*! \var spectra
+   *  \brief The cycle for each job
+   *
+   * This array of pointers has length `n_jobs`, and is indexed starting at 0.
+   */
+  struct spectrum_data **spectra;
+  /*! \var windows
+   *  \brief The window number for each job
+   *
+   * This array has length `n_jobs`, and is indexed starting at 0.
+   */
+  int *windows;
+  /*! \var sums
+   *  \brief The structure to fill for each job
+   *
+   * This array of pointers has length `n_jobs`, and is indexed starting at 0.
+   */
+  struct noise_diode_sums **sums;
+  /*! \var options
+   *  \brief The options that specify the tvchannels, shared by all the jobs
+   */
+  struct ampphase_options *options;
+  /*! \var next_job
+   *  \brief The index of the next job to be taken by a thread
+   */
+  int next_job;
+  /*! \var lock
+   *  \brief Protects `next_job`
+   */
+  pthread_mutex_t lock;
+};
+
+/*!
+ *  \brief The routine run by each thread making noise diode averages
+ *  \param arg a pointer to the acal_sums_batch structure
+ *  \return NULL
+ */
+void *acal_sums_thread(void *arg) {
+  int job;
+  struct acal_sums_batch *batch = (struct acal_sums_batch *)arg;
+
+  while (true) {
+    pthread_mutex_lock(&(batch->lock));
+    job = batch->next_job;
+    batch->next_job += 1;
+    pthread_mutex_unlock(&(batch->lock));
+    if (job >= batch->n_jobs) {
+      break;
+    }
+    compute_noise_diode_sums(batch->spectra[job], batch->windows[job],
+			     batch->options, batch->sums[job]);
+  }
+
+  return NULL;
+}
+
+/*!
+ *  \brief Make all the noise diode averages in a batch, using as many threads
+ *         as there are CPUs
+ *  \param batch the batch, with its jobs and options set
+ *
+ * The calling thread works on the jobs as well, so if no other threads can be
+ * started, the batch is still completed serially.
+ */
+void compute_acal_sums_batch(struct acal_sums_batch *batch) {
+  int i, n_threads = 0;
+  long n_cpus;
+  pthread_t *threads = NULL;
+
+  batch->next_job = 0;
+  pthread_mutex_init(&(batch->lock), NULL);
+  n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if (n_cpus > batch->n_jobs) {
+    n_cpus = batch->n_jobs;
+  }
+  if (n_cpus > 1) {
+    MALLOC(threads, n_cpus - 1);
+    for (i = 0; i < (n_cpus - 1); i++) {
+      if (pthread_create(&(threads[n_threads]), NULL, acal_sums_thread, batch) != 0) {
+	fprintf(stderr, "[compute_acal_sums_batch] unable to start thread %d\n", i);
+	break;
+      }
+      n_threads++;
+    }
+  }
+  acal_sums_thread(batch);
+  for (i = 0; i < n_threads; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  FREE(threads);
+  pthread_mutex_destroy(&(batch->lock));
+}
+
+/*!
+ *  \brief The routine run by the thread that fills the cycle cache
+ *  \param arg unused
+ *  \return NULL
+ *
+ * Files which already have an up-to-date columnar file on disk aren't cached,
+ * since they can already be read without decoding. A file whose image would
+ * not fit in the remaining memory is left to be read from disk.
+ */
+void *cycle_cache_thread(void *arg) {
+  int i, fd;
+  size_t length;
+  char columnar_filename[RPSBUFSIZE + 32];
+  struct columnar_file *columnar_file = NULL;
+
+  for (i = 0; i < cache_cycle_data.n_files; i++) {
+    if ((cache_cycle_data.files[i] == cache_cycle_data.skip_file) ||
+	(cache_cycle_data.used_bytes >= cache_cycle_data.max_bytes)) {
+      continue;
+    }
+    snprintf(columnar_filename, sizeof(columnar_filename), "%s%s",
+	     cache_cycle_data.files[i]->filename, COLUMNAR_SUFFIX);
+    if (columnar_open(columnar_filename, cache_cycle_data.files[i]->filename,
+		      RPFITSIO_ACCESS_SEQUENTIAL, &columnar_file) == JSTAT_SUCCESSFUL) {
+      columnar_close(columnar_file);
+      continue;
+    }
+    if (columnar_convert_memory(cache_cycle_data.files[i]->filename,
+				(cache_cycle_data.max_bytes - cache_cycle_data.used_bytes),
+				&fd, &length) == JSTAT_SUCCESSFUL) {
+      cache_cycle_data.used_bytes += length;
+      __atomic_store_n(&(cache_cycle_data.fd[i]), fd, __ATOMIC_RELEASE);
+    }
+  }
+
+  return arg;
+}
+
+/*!
+ *  \brief Start filling the cycle cache in the background
+ *  \param n_files the number of files
+ *  \param files the information structures of the files
+ *  \param max_megabytes the most memory the cache may use, in MB; if this is
+ *                       0 the cache isn't used
+ *  \param skip_file a file which must not be cached, or NULL
+ *
+ * The thread is detached, since nothing needs to wait for it; until a file's
+ * image is ready, that file is just read from disk.
+ */
+void start_cycle_cache(int n_files, struct rpfits_file_information **files,
+		       int max_megabytes, struct rpfits_file_information *skip_file) {
+  int i;
+  pthread_t thread;
+
+  cache_cycle_data.n_files = 0;
+  if (max_megabytes <= 0) {
+    return;
+  }
+  cache_cycle_data.files = files;
+  MALLOC(cache_cycle_data.fd, n_files);
+  for (i = 0; i < n_files; i++) {
+    cache_cycle_data.fd[i] = -1;
+  }
+  cache_cycle_data.max_bytes = (size_t)max_megabytes * 1024 * 1024;
+  cache_cycle_data.used_bytes = 0;
+  cache_cycle_data.skip_file = skip_file;
+  cache_cycle_data.n_files = n_files;
+  if (pthread_create(&thread, NULL, cycle_cache_thread, NULL) != 0) {
+    fprintf(stderr, "[start_cycle_cache] unable to start thread\n");
+    cache_cycle_data.n_files = 0;
+    return;
+  }
+  pthread_detach(thread);
+}
+
+/*!
+ *  \brief Find the in-memory columnar image of a file
+ *  \param info the information structure of the file
+ *  \return the descriptor of the image, or -1 if the file isn't cached
+ */
+int cycle_cache_fd(struct rpfits_file_information *info) {
+  int i;
+
+  for (i = 0; i < cache_cycle_data.n_files; i++) {
+    if (cache_cycle_data.files[i] == info) {
+      return(__atomic_load_n(&(cache_cycle_data.fd[i]), __ATOMIC_ACQUIRE));
+    }
+  }
+
+  return(-1);
+}
+
+/*!
+ *  \brief Get the time of a cycle in a vis data structure
+ *  \param vis_data the vis data
+ *  \param cycle the index of the cycle
+ *  \return the MJD of the cycle, or -1 if it has no products
+ */
+double vis_cycle_mjd(struct vis_data *vis_data, int cycle) {
+  int i, j;
+  struct vis_quantities *vq = NULL;
+
+  for (i = 0; i < vis_data->num_ifs[cycle]; i++) {
+    for (j = 0; j < vis_data->num_pols[cycle][i]; j++) {
+      vq = vis_data->vis_quantities[cycle][i][j];
+      if (vq != NULL) {
+	return(date2mjd(vq->obsdate, vq->ut_seconds));
       }
-      return true;
     }
   }
-  
-  return false;
+  return(-1);
 }
 
 /*!
- *  \brief Search for a vis cache entry matching the provided set of options
- *  \param num_options the number of options in the set
- *  \param options the set of options to consider while searching
- *  \param data a pointer to a data variable which, if a match is found will
- *              be filled with the matching cache entry; if the pointer is
- *              to NULL, the pointer will be redirected to the actual cache
- *              entry, otherwise a copy of the data will be made
- *  \return an indication of whether the search found a match; true if a
- *          match was found, or false if not
+ *  \brief Put recomputed cycles in place of those in a cached vis data
+ *  \param base the cached vis data
+ *  \param computed the vis data holding only the recomputed cycles, in the
+ *                  order they were read; on success this holds every cycle
+ *  \param margin the amount by which each time range is extended at either end
+ *  \param n_windows the number of time ranges that were recomputed
+ *  \param windows the start and end MJD of each time range
+ *  \param num_options the number of options in \a options
+ *  \param options the options the cycles were recomputed with
+ *  \return true if every cycle of \a base inside the time ranges had a
+ *          recomputed cycle at the same time, or false otherwise, in which
+ *          case \a computed is left unchanged
+ *
+ * The cycles outside the time ranges are copied from \a base, since both
+ * end up in the cache; no memory is shared between the two, so each can be
+ * freed (or extended by follow_extend_vis_data) on its own. Only the header
+ * data pointers are shared, as those belong to the file information.
  */
-bool get_cache_vis_data(int num_options, struct ampphase_options **options,
-                        struct vis_data **data) {
-  int i, j;
-  bool match_found = false;
+bool splice_vis_data(struct vis_data *base, struct vis_data *computed, double margin,
+		     int n_windows, double *windows, int num_options,
+		     struct ampphase_options **options) {
+  int i, j, k, l, n = base->nviscycles, **num_pols = NULL, *num_ifs = NULL;
+  double mjd;
+  struct scan_header_data **header_data = NULL;
+  struct vis_quantities ****vis_quantities = NULL;
+  struct metinfo **metinfo = NULL;
+  struct syscal_data **syscal_data = NULL;
 
-  if (num_options == 0) {
-    // No chance of a match.
-    return false;
-  }
-  for (i = 0; i < cache_vis_data.num_cache_vis_data; i++) {
-    if (cache_vis_data.num_options[i] != num_options) {
-      // Can't be this one.
-      continue;
-    }
-    match_found = true;
-    for (j = 0; j < cache_vis_data.num_options[i]; j++) {
-      if (ampphase_options_match(options[j],
-				 cache_vis_data.ampphase_options[i][j]) == false) {
-	// Not a perfect match.
-	match_found = false;
-	break;
+  MALLOC(header_data, n);
+  MALLOC(num_ifs, n);
+  MALLOC(num_pols, n);
+  MALLOC(vis_quantities, n);
+  MALLOC(metinfo, n);
+  MALLOC(syscal_data, n);
+  for (i = 0, j = 0; i < n; i++) {
+    mjd = vis_cycle_mjd(base, i);
+    if (!mjd_in_windows(mjd, margin, n_windows, windows)) {
+      // The base stays in the cache, so it gets its own copy of this cycle.
+      header_data[i] = base->header_data[i];
+      num_ifs[i] = base->num_ifs[i];
+      MALLOC(num_pols[i], num_ifs[i] + 1);
+      MALLOC(vis_quantities[i], num_ifs[i] + 1);
+      for (k = 0; k < num_ifs[i]; k++) {
+	num_pols[i][k] = base->num_pols[i][k];
+	MALLOC(vis_quantities[i][k], num_pols[i][k] + 1);
+	for (l = 0; l < num_pols[i][k]; l++) {
+	  vis_quantities[i][k][l] = prepare_vis_quantities();
+	  copy_vis_quantities(vis_quantities[i][k][l], base->vis_quantities[i][k][l]);
+	}
       }
+      MALLOC(metinfo[i], 1);
+      copy_metinfo(metinfo[i], base->metinfo[i]);
+      CALLOC(syscal_data[i], 1);
+      copy_syscal_data(syscal_data[i], base->syscal_data[i]);
+    } else if ((j < computed->nviscycles) && (vis_cycle_mjd(computed, j) == mjd)) {
+      header_data[i] = computed->header_data[j];
+      num_ifs[i] = computed->num_ifs[j];
+      num_pols[i] = computed->num_pols[j];
+      vis_quantities[i] = computed->vis_quantities[j];
+      metinfo[i] = computed->metinfo[j];
+      syscal_data[i] = computed->syscal_data[j];
+      j++;
+    } else {
+      break;
     }
-    if (match_found) {
-      if (*data == NULL) {
-        // Occurs in the child computer usually.
-        *data = cache_vis_data.vis_data[i];
-      } else {
-        copy_vis_data(*data, cache_vis_data.vis_data[i]);
+  }
+  if ((i < n) || (j < computed->nviscycles)) {
+    // Free the copies made so far, but not the recomputed cycles.
+    for (n = i, i = 0; i < n; i++) {
+      if (mjd_in_windows(vis_cycle_mjd(base, i), margin, n_windows, windows)) {
+	continue;
       }
-      return true;
+      for (k = 0; k < num_ifs[i]; k++) {
+	for (l = 0; l < num_pols[i][k]; l++) {
+	  free_vis_quantities(&(vis_quantities[i][k][l]));
+	}
+	FREE(vis_quantities[i][k]);
+      }
+      FREE(vis_quantities[i]);
+      FREE(num_pols[i]);
+      FREE(metinfo[i]);
+      free_syscal_data(syscal_data[i]);
+      FREE(syscal_data[i]);
     }
+    FREE(header_data);
+    FREE(num_ifs);
+    FREE(num_pols);
+    FREE(vis_quantities);
+    FREE(metinfo);
+    FREE(syscal_data);
+    return false;
   }
 
-  return false;
-}
+  FREE(computed->header_data);
+  FREE(computed->num_ifs);
+  FREE(computed->num_pols);
+  FREE(computed->vis_quantities);
+  FREE(computed->metinfo);
+  FREE(computed->syscal_data);
+  computed->nviscycles = n;
+  computed->header_data = header_data;
+  computed->num_ifs = num_ifs;
+  computed->num_pols = num_pols;
+  computed->vis_quantities = vis_quantities;
+  computed->metinfo = metinfo;
+  computed->syscal_data = syscal_data;
+  if (computed->num_options == 0) {
+    // Nothing was recomputed, so the options weren't stored.
+    computed->num_options = num_options;
+    MALLOC(computed->options, num_options);
+    for (i = 0; i < num_options; i++) {
+      CALLOC(computed->options[i], 1);
+      copy_ampphase_options(computed->options[i], options[i]);
+    }
+  }
 
-// The ways in which we can read data.
-/*! \def READ_SCAN_METADATA
- *  \brief Magic number to tell data_reader that we would like to read the
- *         information about scans present in an RPFITS file
- *
- * This magic number can be combined in a bitwise-OR with COMPUTE_VIS_PRODUCTS
- * and GRAB_SPECTRUM.
- */
-#define READ_SCAN_METADATA   1<<1
-/*! \def COMPUTE_VIS_PRODUCTS
- *  \brief Magic number to tell data_reader that we would like to compute the
- *         products that will go to an NVIS client while reading the RPFITS file
- *
- * This magic number can be combined in a bitwise-OR with READ_SCAN_METADATA
- * and GRAB_SPECTRUM.
- */
-#define COMPUTE_VIS_PRODUCTS 1<<2
-/*! \def GRAB_SPECTRUM
- *  \brief Magic number to tell data_reader that we would like to compute the
- *         products that will go to an NSPD client while reading the RPFITS file
- *
- * This magic number can be combined in a bitwise-OR with READ_SCAN_METADATA
- * and COMPUTE_VIS_PRODUCTS.
- */
-#define GRAB_SPECTRUM        1<<3
-/*! \def GRAB_MJDS_SPECTRA
- *  \brief Magic number to tell data_reader that we would like to get several
- *         spectrum products, determined by a list of MJDs passed to the routine
- *
- * This magic number can be combined in a bitwise-OR with READ_SCAN_METADATA,
- * COMPUTE_VIS_PRODUCTS and GRAB_SPECTRUM.
- */
-#define GRAB_MJDS_SPECTRA    1<<4
+  return true;
+}
 
 void data_reader(int read_type, int n_rpfits_files,
                  double mjd_required, double mjd_low, double mjd_high,
@@ -873,16 +2674,23 @@ void data_reader(int read_type, int n_rpfits_files,
                  struct spectrum_data **spectrum_data,
                  struct vis_data **vis_data,
 		 struct spectrum_data ***spectrum_mjds) {
-  int i, j, res, n, calcres, curr_header, idx_if, idx_pol, local_num_options;
-  int pols[4] = { POL_XX, POL_YY, POL_XY, POL_YX }, idx_return, num_mjds_grabbed = 0;
-  bool open_file, keep_reading, header_free, read_cycles, keep_cycling;
-  bool cycle_free, spectrum_return, vis_cycled, cache_hit_vis_data;
+  int i, j, res, n, curr_header, idx_return, num_mjds_grabbed = 0;
+  int next_scan, next_cycle = 0, first_scan, cache_fd, n_windows = 0;
+  long cycle_offset;
+  bool open_file, keep_reading, header_free, read_cycles, keep_cycling, seek_cycles;
+  bool cycle_free, spectrum_return, cache_hit_vis_data;
   bool cache_hit_spectrum_data, nocompute, *mjds_cache_hit = NULL;
-  double cycle_mjd, cycle_start, cycle_end, half_cycle;
+  char columnar_filename[RPSBUFSIZE + 32];
+  struct rpfits_file *rpfits_file = NULL;
+  struct columnar_file *columnar_file = NULL;
+  double cycle_mjd, cycle_start, cycle_end, half_cycle, *windows = NULL;
   struct scan_header_data *sh = NULL;
   struct cycle_data *cycle_data = NULL;
   struct spectrum_data *temp_spectrum = NULL;
-  struct ampphase_options **local_ampphase_options = NULL;
+  struct vis_data *splice_base = NULL;
+  struct vis_products_job *job = NULL;
+  struct vis_products_pipeline *pipeline = NULL;
+  struct ampphase_average_workspace *workspace = NULL;
 
   if (vis_data == NULL) {
     // Resist warnings.
@@ -898,7 +2706,17 @@ void data_reader(int read_type, int n_rpfits_files,
     /*        (ampphase_options->phase_in_degrees ? "degrees" : "radians"), */
     /*        ampphase_options->delay_averaging, ampphase_options->averaging_method); */
 
-    cache_hit_vis_data = get_cache_vis_data(*num_options, *ampphase_options, vis_data);
+    if (!(read_type & IGNORE_CACHE)) {
+      cache_hit_vis_data = get_cache_vis_data(*num_options, *ampphase_options, vis_data);
+    }
+    if ((cache_hit_vis_data == false) && (read_type == COMPUTE_VIS_PRODUCTS) &&
+	get_cache_vis_data_windows(*num_options, *ampphase_options, mjd_low, mjd_high,
+				   &splice_base, &n_windows, &windows)) {
+      // Only the cycles affected by the modifiers that were changed need
+      // to be computed.
+      printf("[data_reader] cache hit apart from modifiers, recomputing %d time ranges\n",
+	     n_windows);
+    }
     if (cache_hit_vis_data == false) {
       printf("[data_reader] no cache hit\n");
       if ((vis_data != NULL) && (*vis_data == NULL)) {
@@ -921,6 +2739,13 @@ void data_reader(int read_type, int n_rpfits_files,
       read_type -= COMPUTE_VIS_PRODUCTS;
     }
   }
+  if (read_type & COMPUTE_VIS_PRODUCTS) {
+    // Everything after the decoding is independent for each cycle, so
+    // the products are computed by a pool of threads.
+    pipeline = start_vis_products_pipeline();
+  }
+  // The cycles computed here rather than by the pool share this scratch space.
+  workspace = prepare_ampphase_average_workspace();
 
   half_cycle = -1;
   for (i = 0; i < n_rpfits_files; i++) {
@@ -939,8 +2764,10 @@ void data_reader(int read_type, int n_rpfits_files,
   if (read_type & GRAB_SPECTRUM) {
     // Check whether we have a cached product for this.
     //half_cycle = (double)info_rpfits_files[0]->scan_headers[0]->cycle_time / (2.0 * 86400.0);
-    cache_hit_spectrum_data = get_cache_spd_data(*num_options, *ampphase_options, mjd_required,
-						 half_cycle, spectrum_data);
+    if (!(read_type & IGNORE_CACHE)) {
+      cache_hit_spectrum_data = get_cache_spd_data(*num_options, *ampphase_options,
+						   mjd_required, half_cycle, spectrum_data);
+    }
     if (cache_hit_spectrum_data == true) {
       read_type -= GRAB_SPECTRUM;
     }
@@ -959,12 +2786,21 @@ void data_reader(int read_type, int n_rpfits_files,
       CALLOC(*spectrum_mjds, num_mjds);
     }
     CALLOC(mjds_cache_hit, num_mjds);
-    // Check whether we have cached products for any of these MJDs.
+    // Check whether we already have any of these MJDs, either from the
+    // caller or in the cache. Those count as already grabbed, so we stop
+    // reading as soon as the others have been found.
     for (i = 0; i < num_mjds; i++) {
-      mjds_cache_hit[i] = get_cache_spd_data(*num_options, *ampphase_options, mjds[i],
-					     half_cycle, &((*spectrum_mjds)[i]));
+      if ((*spectrum_mjds)[i] != NULL) {
+	mjds_cache_hit[i] = true;
+      } else if (!(read_type & IGNORE_CACHE)) {
+	mjds_cache_hit[i] = get_cache_spd_data(*num_options, *ampphase_options, mjds[i],
+					       half_cycle, &((*spectrum_mjds)[i]));
+      }
       printf("  %s cache hit for MJD %.6f\n", (mjds_cache_hit[i] ? "GOT" : "NO"),
 	     mjds[i]);
+      if (mjds_cache_hit[i]) {
+	num_mjds_grabbed++;
+      }
     }
   }
 
@@ -980,7 +2816,7 @@ void data_reader(int read_type, int n_rpfits_files,
     }
     // When we start storing things in memory later, we will need to alter
     // this section.
-    if (read_type & GRAB_SPECTRUM) {
+    if ((read_type & GRAB_SPECTRUM) && (info_rpfits_files[i]->n_scans > 0)) {
       // Does this file encompass the time we want?
       //half_cycle = (double)info_rpfits_files[i]->scan_headers[0]->cycle_time / (2.0 * 86400.0);
       if ((mjd_required >= (info_rpfits_files[i]->scan_start_mjd[0] - half_cycle)) &&
@@ -992,10 +2828,11 @@ void data_reader(int read_type, int n_rpfits_files,
         /* 	       info_rpfits_files[i]->filename, mjd_required); */
       }
     }
-    if (read_type & GRAB_MJDS_SPECTRA) {
-      // Does this file encompass any of the times we want.
+    if ((read_type & GRAB_MJDS_SPECTRA) && (info_rpfits_files[i]->n_scans > 0)) {
+      // Does this file encompass any of the times we still need.
       for (j = 0; j < num_mjds; j++) {
-	if ((mjds[j] >= (info_rpfits_files[i]->scan_start_mjd[0] - half_cycle)) &&
+	if ((mjds_cache_hit[j] == false) &&
+	    (mjds[j] >= (info_rpfits_files[i]->scan_start_mjd[0] - half_cycle)) &&
 	    (mjds[j] <= (info_rpfits_files[i]->scan_end_mjd[info_rpfits_files[i]->n_scans - 1]
 			 + half_cycle))) {
 	  open_file = true;
@@ -1005,23 +2842,104 @@ void data_reader(int read_type, int n_rpfits_files,
 	printf(" opening file %d to grab MJDS\n", i);
       }
     }
+    first_scan = 0;
     if (read_type & COMPUTE_VIS_PRODUCTS) {
       open_file = true;
+      if (!(read_type & READ_SCAN_METADATA)) {
+	// Scans that finish before the earliest time we want don't need to
+	// be read at all.
+	while ((first_scan < info_rpfits_files[i]->n_scans) &&
+	       (mjd_low > info_rpfits_files[i]->scan_end_mjd[first_scan])) {
+	  first_scan++;
+	}
+	if (first_scan >= info_rpfits_files[i]->n_scans) {
+	  open_file = false;
+	}
+      }
     }
     
     if (!open_file) {
       continue;
     }
-    res = open_rpfits_file(info_rpfits_files[i]->filename);
-    if (res) {
-      fprintf(stderr, "OPEN FAILED FOR FILE %s, CODE %d\n",
-              info_rpfits_files[i]->filename, res);
-      continue;
+    // If we only want some spectra, we can use the offsets found while
+    // reading the metadata to go straight to the cycles we need.
+    // The same goes for the cycles that need to be recomputed because of
+    // a change in the modifiers.
+    seek_cycles = (!(read_type & (READ_SCAN_METADATA | COMPUTE_VIS_PRODUCTS)) ||
+		   (splice_base != NULL));
+    // If the file has been converted to the columnar format, either in the
+    // cycle cache or on disk, we can get the data from there without decoding
+    // the RPFITS file. The metadata always comes from the RPFITS file itself
+    // though.
+    columnar_file = NULL;
+    if (!(read_type & READ_SCAN_METADATA) &&
+	((cache_fd = cycle_cache_fd(info_rpfits_files[i])) >= 0)) {
+      columnar_open_fd(cache_fd, info_rpfits_files[i]->filename,
+		       (seek_cycles ? RPFITSIO_ACCESS_RANDOM : RPFITSIO_ACCESS_SEQUENTIAL),
+		       &columnar_file);
+    }
+    if (!(read_type & READ_SCAN_METADATA) && (columnar_file == NULL)) {
+      snprintf(columnar_filename, sizeof(columnar_filename), "%s%s",
+	       info_rpfits_files[i]->filename, COLUMNAR_SUFFIX);
+      columnar_open(columnar_filename, info_rpfits_files[i]->filename,
+		    (seek_cycles ? RPFITSIO_ACCESS_RANDOM : RPFITSIO_ACCESS_SEQUENTIAL),
+		    &columnar_file);
+    }
+    if (columnar_file == NULL) {
+      res = open_rpfits_file(info_rpfits_files[i]->filename, &rpfits_file);
+      if (res) {
+	fprintf(stderr, "OPEN FAILED FOR FILE %s, CODE %d\n",
+		info_rpfits_files[i]->filename, res);
+	continue;
+      }
+      // Reading through a memory mapping is faster, and the kernel can be told
+      // whether we'll be reading straight through or jumping around. A file
+      // being followed could be truncated or replaced, which would make
+      // touching the mapping fatal, so that one is read with stdio.
+      if (!info_rpfits_files[i]->followed) {
+	rpfitsio_map(rpfits_file, (seek_cycles ? RPFITSIO_ACCESS_RANDOM :
+				   RPFITSIO_ACCESS_SEQUENTIAL));
+      }
     }
     keep_reading = true;
     curr_header = -1;
+    next_scan = 0;
+    if (first_scan > 0) {
+      if (((columnar_file != NULL) ?
+	   columnar_seek(columnar_file, info_rpfits_files[i]->scan_offset[first_scan]) :
+	   rpfitsio_seek(rpfits_file, info_rpfits_files[i]->scan_offset[first_scan])) !=
+	  JSTAT_SUCCESSFUL) {
+	fprintf(stderr, "[data_reader] unable to seek to scan %d in file %s\n",
+		first_scan, info_rpfits_files[i]->filename);
+	keep_reading = false;
+      }
+      curr_header = first_scan - 1;
+    }
     while (keep_reading) {
       n = info_rpfits_files[i]->n_scans;
+      if (seek_cycles) {
+	while ((next_scan < n) &&
+	       (next_wanted_cycle(info_rpfits_files[i], next_scan, 0, read_type,
+				  mjd_required, num_mjds, mjds, mjds_cache_hit,
+				  n_windows, windows) < 0)) {
+	  next_scan++;
+	}
+	if (next_scan >= n) {
+	  break;
+	}
+	if (((columnar_file != NULL) ?
+	     columnar_seek(columnar_file, info_rpfits_files[i]->scan_offset[next_scan]) :
+	     rpfitsio_seek(rpfits_file, info_rpfits_files[i]->scan_offset[next_scan])) !=
+	    JSTAT_SUCCESSFUL) {
+	  fprintf(stderr, "[data_reader] unable to seek to scan %d in file %s\n",
+		  next_scan, info_rpfits_files[i]->filename);
+	  break;
+	}
+	// The header we read next will be this scan.
+	curr_header = next_scan - 1;
+	next_scan++;
+	next_cycle = 0;
+      }
       
       if (read_type & READ_SCAN_METADATA) {
         // We need to expand our metadata arrays as we go.
@@ -1030,6 +2948,9 @@ void data_reader(int read_type, int n_rpfits_files,
         REALLOC(info_rpfits_files[i]->scan_end_mjd, (n + 1));
         REALLOC(info_rpfits_files[i]->n_cycles, (n + 1));
         REALLOC(info_rpfits_files[i]->cycle_mjd, (n + 1));
+        REALLOC(info_rpfits_files[i]->scan_offset, (n + 1));
+        REALLOC(info_rpfits_files[i]->cycle_offset, (n + 1));
+        info_rpfits_files[i]->n_cycles[n] = 0;
       }
       // We always need to read the scan headers to move through
       // the file, but where we direct the information changes.
@@ -1041,7 +2962,8 @@ void data_reader(int read_type, int n_rpfits_files,
         sh = info_rpfits_files[i]->scan_headers[n];
         header_free = false;
       }
-      res = read_scan_header(sh);
+      res = ((columnar_file != NULL) ? columnar_read_scan_header(columnar_file, sh) :
+	     read_scan_header(rpfits_file, sh));
       /* printf("[data_reader] read scan header\n"); */
       if (sh->num_sources > 0) {
         curr_header += 1;
@@ -1062,6 +2984,8 @@ void data_reader(int read_type, int n_rpfits_files,
 	    info_rpfits_files[i]->scan_end_mjd[n] = 0;
           info_rpfits_files[i]->n_cycles[n] = 0;
           info_rpfits_files[i]->cycle_mjd[n] = NULL;
+          info_rpfits_files[i]->scan_offset[n] = rpfits_file->header_offset;
+          info_rpfits_files[i]->cycle_offset[n] = NULL;
           info_rpfits_files[i]->n_scans += 1;
         }
         // HERE WILL GO THE LOGIC TO WORK OUT IF WE NEED TO READ
@@ -1111,14 +3035,38 @@ void data_reader(int read_type, int n_rpfits_files,
 	    printf("  reading from scan header %d to grab MJDS\n", curr_header);
 	  }
 	}
+	if (seek_cycles) {
+	  // We've already determined that this scan has a cycle we want.
+	  read_cycles = true;
+	}
         if (read_cycles && (res & READER_DATA_AVAILABLE)) {
           /* printf("[data_reader] reading cycles from this scan...\n"); */
           keep_cycling = true;
           while (keep_cycling) {
+	    if (seek_cycles) {
+	      next_cycle = next_wanted_cycle(info_rpfits_files[i], curr_header, next_cycle,
+					     read_type, mjd_required, num_mjds, mjds,
+					     mjds_cache_hit, n_windows, windows);
+	      if ((next_cycle < 0) ||
+		  (((columnar_file != NULL) ?
+		    columnar_seek(columnar_file,
+				  info_rpfits_files[i]->cycle_offset[curr_header][next_cycle]) :
+		    rpfitsio_seek(rpfits_file,
+				  info_rpfits_files[i]->cycle_offset[curr_header][next_cycle])) !=
+		   JSTAT_SUCCESSFUL)) {
+		keep_cycling = false;
+		continue;
+	      }
+	      next_cycle++;
+	    }
+	    cycle_offset = ((columnar_file != NULL) ? columnar_tell(columnar_file) :
+			    rpfitsio_tell(rpfits_file));
             /* fprintf(stderr, "[data_reader] preparing new cycle data...\n"); */
             cycle_data = prepare_new_cycle_data();
             /* fprintf(stderr, "[data_reader] reading cycle data...\n"); */
-            res = read_cycle_data(sh, cycle_data);
+            res = ((columnar_file != NULL) ?
+		   columnar_read_cycle_data(columnar_file, sh, cycle_data) :
+		   read_cycle_data(rpfits_file, sh, cycle_data));
             cycle_free = true;
             if (!(res & READER_DATA_AVAILABLE)) {
               keep_cycling = false;
@@ -1151,6 +3099,9 @@ void data_reader(int read_type, int n_rpfits_files,
 		REALLOC(info_rpfits_files[i]->cycle_mjd[n], info_rpfits_files[i]->n_cycles[n]);
 		info_rpfits_files[i]->cycle_mjd[n][info_rpfits_files[i]->n_cycles[n] - 1] =
 		  cycle_mjd;
+		REALLOC(info_rpfits_files[i]->cycle_offset[n], info_rpfits_files[i]->n_cycles[n]);
+		info_rpfits_files[i]->cycle_offset[n][info_rpfits_files[i]->n_cycles[n] - 1] =
+		  cycle_offset;
 	      }
             }
             if ((read_type & GRAB_SPECTRUM) ||
@@ -1203,152 +3154,40 @@ void data_reader(int read_type, int n_rpfits_files,
 		/* printf("[data_reader] system temperatures just calculated\n"); */
 		/* print_options_set(*num_options, *ampphase_options); */
 
-                // Allocate all the memory we need.
-                /* printf("cycle found!\n"); */
-                /* fprintf(stderr, "[data_reader] making a temporary spectrum...\n"); */
-                MALLOC(temp_spectrum, 1);
-                // Prepare the spectrum data structure.
-                temp_spectrum->num_ifs = sh->num_ifs;
-                temp_spectrum->header_data = info_rpfits_files[i]->scan_headers[curr_header];
-                /* fprintf(stderr, "[data_reader] allocating some memory...\n"); */
-                MALLOC(temp_spectrum->spectrum, temp_spectrum->num_ifs);
-                if ((read_type & COMPUTE_VIS_PRODUCTS) && (nocompute == false)) {
-                  REALLOC((*vis_data)->vis_quantities,
-                          ((*vis_data)->nviscycles + 1));
-                  REALLOC((*vis_data)->header_data,
-                          ((*vis_data)->nviscycles + 1));
-                  REALLOC((*vis_data)->num_ifs,
-                          ((*vis_data)->nviscycles + 1));
-                  REALLOC((*vis_data)->num_pols,
-                          ((*vis_data)->nviscycles + 1));
-                  REALLOC((*vis_data)->metinfo, ((*vis_data)->nviscycles + 1));
-                  REALLOC((*vis_data)->syscal_data, ((*vis_data)->nviscycles + 1));
-                  CALLOC((*vis_data)->metinfo[(*vis_data)->nviscycles], 1);
-                  //CALLOC((*vis_data)->syscal_data[(*vis_data)->nviscycles], 1);
-                  (*vis_data)->num_ifs[(*vis_data)->nviscycles] = temp_spectrum->num_ifs;
-                  (*vis_data)->header_data[(*vis_data)->nviscycles] =
-                    info_rpfits_files[i]->scan_headers[curr_header];
-                  MALLOC((*vis_data)->num_pols[(*vis_data)->nviscycles],
-                         temp_spectrum->num_ifs);
-                  MALLOC((*vis_data)->vis_quantities[(*vis_data)->nviscycles],
-                         temp_spectrum->num_ifs);
-                }
-                vis_cycled = false;
-                for (idx_if = 0; idx_if < temp_spectrum->num_ifs; idx_if++) {
-                  temp_spectrum->num_pols = sh->if_num_stokes[idx_if];
-                  CALLOC(temp_spectrum->spectrum[idx_if], temp_spectrum->num_pols);
-                  if ((read_type & COMPUTE_VIS_PRODUCTS) && (nocompute == false)) {
-                    (*vis_data)->num_pols[(*vis_data)->nviscycles][idx_if] =
-                      temp_spectrum->num_pols;
-                    CALLOC((*vis_data)->vis_quantities[(*vis_data)->nviscycles][idx_if],
-                           temp_spectrum->num_pols);
-                  }
-                  for (idx_pol = 0; idx_pol < temp_spectrum->num_pols; idx_pol++) {
-		    local_num_options = *num_options;
-                    MALLOC(local_ampphase_options, local_num_options);
-		    for (j = 0; j < local_num_options; j++) {
-		      CALLOC(local_ampphase_options[j], 1);
-		      set_default_ampphase_options(local_ampphase_options[j]);
-		      copy_ampphase_options(local_ampphase_options[j], (*ampphase_options)[j]);
+		job = new_vis_products_job(sh, info_rpfits_files[i]->scan_headers[curr_header],
+					   cycle_data, ((read_type & COMPUTE_VIS_PRODUCTS) &&
+							(nocompute == false)),
+					   *num_options, *ampphase_options);
+		if ((pipeline != NULL) && (job->compute_vis) && (spectrum_return == false)) {
+		  // The pool can compute this cycle while we read the next ones,
+		  // and the job will free the cycle when it's done.
+		  job->free_cycle_data = true;
+		  cycle_free = false;
+		  submit_vis_products(pipeline, job, num_options, ampphase_options,
+				      vis_data);
+		} else {
+		  // The cycles still in the pipeline need to be stored before
+		  // this one.
+		  drain_vis_products(pipeline, num_options, ampphase_options, vis_data);
+		  job->keep_spectrum = true;
+		  compute_vis_products(job, workspace);
+		  temp_spectrum = job->spectrum;
+		  commit_vis_products(job, num_options, ampphase_options, vis_data);
+		  if (spectrum_return) {
+		    // Copy the pointer.
+		    if (read_type & GRAB_SPECTRUM) {
+		      *spectrum_data = temp_spectrum;
 		    }
-                    /* fprintf(stderr, "[data_reader] calculating amp products\n"); */
-                    calcres = vis_ampphase(sh, cycle_data,
-                                           &(temp_spectrum->spectrum[idx_if][idx_pol]),
-                                           pols[idx_pol], sh->if_label[idx_if],
-					   &local_num_options, &local_ampphase_options);
-                    if (calcres < 0) {
-                      fprintf(stderr, "CALCULATING AMP AND PHASE FAILED FOR IF %d POL %d, CODE %d\n",
-                              sh->if_label[idx_if], pols[idx_pol], calcres);
-                    /* } else if (read_type & COMPUTE_VIS_PRODUCTS) { */
-                    /*     printf("CONVERTED SPECTRUM FOR CYCLE IF %d POL %d AT MJD %.6f\n", */
-                    /*            sh->if_label[idx_if], pols[idx_pol], cycle_mjd); */
-                    /* } else { */
-                    /*   // TODO: perhaps make the Tsys calculations an option for */
-                    /*   // when nobody cares. */
-                    /*   calculate_system_temperatures(temp_spectrum->spectrum[idx_if][idx_pol], */
-                    /*                                 local_ampphase_options); */
-                    }
-                    if ((read_type & COMPUTE_VIS_PRODUCTS) && (nocompute == false)) {
-                      /* MALLOC(local_ampphase_options, 1); */
-		      /* for (j = 0; j < local_num_options; j++) { */
-		      /* 	free_ampphase_options(local_ampphase_options[j]); */
-		      /* 	set_default_ampphase_options(local_ampphase_options[j]); */
-		      /* 	copy_ampphase_options(local_ampphase_options[j], (*ampphase_options)[j]); */
-		      /* } */
-                      /* fprintf(stderr, "[data_reader] calculating vis products\n"); */
-                      ampphase_average(sh, temp_spectrum->spectrum[idx_if][idx_pol],
-                                       &((*vis_data)->vis_quantities[(*vis_data)->nviscycles][idx_if][idx_pol]),
-                                       &local_num_options, &local_ampphase_options);
-                      // Copy the ampphase_options back.
-		      if (local_num_options > *num_options) {
-			// Something got added.
-			REALLOC(*ampphase_options, local_num_options);
-			for (j = *num_options; j < local_num_options; j++) {
-			  CALLOC((*ampphase_options)[j], 1);
-			  copy_ampphase_options((*ampphase_options)[j],
-						local_ampphase_options[j]);
-			}
-		      }
-		      // And copy them to the vis data structure as well.
-		      for (j = 0; j < (*vis_data)->num_options; j++) {
-			free_ampphase_options((*vis_data)->options[j]);
-			FREE((*vis_data)->options[j]);
-		      }
-		      (*vis_data)->num_options = local_num_options;
-		      REALLOC((*vis_data)->options, (*vis_data)->num_options);
-		      for (j = 0; j < (*vis_data)->num_options; j++) {
-			CALLOC((*vis_data)->options[j], 1);
-			copy_ampphase_options((*vis_data)->options[j],
-					      local_ampphase_options[j]);
-		      }
-		      // Free the options we were sent.
-		      for (j = 0; j < *num_options; j++) {
-			free_ampphase_options((*ampphase_options)[j]);
-		      }
-		      *num_options = local_num_options;
-		      for (j = 0; j < *num_options; j++) {
-			copy_ampphase_options((*ampphase_options)[j], local_ampphase_options[j]);
-		      }
-                      /* fprintf(stderr, "[data_reader] calculated vis products\n"); */
-                      vis_cycled = true;
-                    }
-		    // Free our local ampphase options.
-		    for (j = 0; j < local_num_options; j++) {
-		      free_ampphase_options(local_ampphase_options[j]);
-		      FREE(local_ampphase_options[j]);
+		    if ((read_type & GRAB_MJDS_SPECTRA) &&
+			(idx_return >= 0)) {
+		      (*spectrum_mjds)[idx_return] = temp_spectrum;
+		      num_mjds_grabbed++;
 		    }
-		    FREE(local_ampphase_options);
-                  }
-                }
-                if (vis_cycled) {
-                  // Compile the metinfo and calibration data.
-                  copy_metinfo((*vis_data)->metinfo[(*vis_data)->nviscycles],
-                               &(temp_spectrum->spectrum[0][0]->metinfo));
-                  spectrum_data_compile_system_temperatures(temp_spectrum,
-                                                            &((*vis_data)->syscal_data[(*vis_data)->nviscycles]));
-                  (*vis_data)->nviscycles += 1;
-                }
-                if (spectrum_return) {
-                  // Copy the pointer.
-		  if (read_type & GRAB_SPECTRUM) {
-		    *spectrum_data = temp_spectrum;
+		  } else {
+		    // Free the temporary spectrum memory.
+		    free_cycle_spectrum(temp_spectrum, sh);
 		  }
-		  if ((read_type & GRAB_MJDS_SPECTRA) &&
-		      (idx_return >= 0)) {
-		    (*spectrum_mjds)[idx_return] = temp_spectrum;
-		    num_mjds_grabbed++;
-		  }
-                } else {
-                  // Free the temporary spectrum memory.
-                  for (idx_if = 0; idx_if < temp_spectrum->num_ifs; idx_if++) {
-                    for (idx_pol = 0; idx_pol < temp_spectrum->num_pols; idx_pol++) {
-                      free_ampphase(&(temp_spectrum->spectrum[idx_if][idx_pol]));
-                    }
-                    FREE(temp_spectrum->spectrum[idx_if]);
-                  }
-                  FREE(temp_spectrum->spectrum);
-                  FREE(temp_spectrum);
-                }
+		}
                 //if (!(read_type & COMPUTE_VIS_PRODUCTS)) {
 		if (((read_type & GRAB_SPECTRUM) && !(read_type & COMPUTE_VIS_PRODUCTS)) ||
 		    ((read_type & GRAB_MJDS_SPECTRA) &&
@@ -1374,46 +3213,813 @@ void data_reader(int read_type, int n_rpfits_files,
         keep_reading = false;
       }
 
-      // Discard this "scan" if it didn't contain cycles.
-      if ((read_type & READ_SCAN_METADATA) &&
-	  (info_rpfits_files[i]->n_cycles[n] == 0)) {
-	// We also need to deallocate the scan header.
-	header_free = true;
-	// Change the size of the arrays.
-	if (n > 0) {
-	  // Don't change the size of the arrays if this cycle is the
-	  // first one!
-	  REALLOC(info_rpfits_files[i]->scan_headers, n);
-	  REALLOC(info_rpfits_files[i]->scan_start_mjd, n);
-	  REALLOC(info_rpfits_files[i]->scan_end_mjd, n);
-	  REALLOC(info_rpfits_files[i]->n_cycles, n);
-	  REALLOC(info_rpfits_files[i]->cycle_mjd, n);
-	  info_rpfits_files[i]->n_scans = n;
+      // Discard this "scan" if it didn't contain cycles.
+      if ((read_type & READ_SCAN_METADATA) &&
+	  (info_rpfits_files[i]->n_cycles[n] == 0)) {
+	// We also need to deallocate the scan header.
+	header_free = true;
+	// Change the size of the arrays.
+	if (n > 0) {
+	  // Don't change the size of the arrays if this cycle is the
+	  // first one!
+	  REALLOC(info_rpfits_files[i]->scan_headers, n);
+	  REALLOC(info_rpfits_files[i]->scan_start_mjd, n);
+	  REALLOC(info_rpfits_files[i]->scan_end_mjd, n);
+	  REALLOC(info_rpfits_files[i]->n_cycles, n);
+	  REALLOC(info_rpfits_files[i]->cycle_mjd, n);
+	  REALLOC(info_rpfits_files[i]->scan_offset, n);
+	  REALLOC(info_rpfits_files[i]->cycle_offset, n);
+	}
+	info_rpfits_files[i]->n_scans = n;
+      }
+
+      if (header_free) {
+	// Any cycles still being computed need the header.
+	drain_vis_products(pipeline, num_options, ampphase_options, vis_data);
+        free_scan_header_data(sh);
+        FREE(sh);
+      }
+    }
+
+    // If we get here we must have opened the RPFITS or columnar file.
+    if (columnar_file != NULL) {
+      res = columnar_close(columnar_file);
+      columnar_file = NULL;
+    } else {
+      res = close_rpfits_file(rpfits_file);
+      rpfits_file = NULL;
+    }
+    if (res) {
+      fprintf(stderr, "CLOSE FAILED FOR FILE %s, CODE %d\n",
+              info_rpfits_files[i]->filename, res);
+      // Don't read any more files, but finish up as usual so nothing is
+      // left behind.
+      break;
+    }
+
+    
+  }
+
+  stop_vis_products_pipeline(pipeline);
+  free_ampphase_average_workspace(&workspace);
+
+  if (read_type & GRAB_MJDS_SPECTRA) {
+    FREE(mjds_cache_hit);
+  }
+
+  if (splice_base != NULL) {
+    if (!splice_vis_data(splice_base, *vis_data, half_cycle, n_windows, windows,
+			 *num_options, *ampphase_options)) {
+      // The cycles we computed don't line up with the cached ones, so we
+      // have to compute everything.
+      printf("[data_reader] unable to use cached cycles, recomputing all\n");
+      free_vis_data(*vis_data);
+      data_reader(read_type | IGNORE_CACHE, n_rpfits_files, mjd_required, mjd_low,
+		  mjd_high, num_mjds, mjds, num_options, ampphase_options,
+		  info_rpfits_files, spectrum_data, vis_data, spectrum_mjds);
+    }
+    FREE(windows);
+  }
+
+  
+}
+
+/*! \struct metadata_scan_queue
+ *  \brief The list of files that the metadata scanning threads work through
+ */
+struct metadata_scan_queue {
+  /*! \var n_files
+   *  \brief The number of files to scan
+   */
+  int n_files;
+  /*! \var next_file
+   *  \brief The index of the next file that a thread should take
+   */
+  int next_file;
+  /*! \var files
+   *  \brief The information structures of the files to scan
+   *
+   * This array has length `n_files`, and is indexed starting at 0.
+   */
+  struct rpfits_file_information **files;
+  /*! \var mjd_low
+   *  \brief The MJD before which no data will be read
+   */
+  double mjd_low;
+  /*! \var mjd_high
+   *  \brief The MJD after which no data will be read
+   */
+  double mjd_high;
+  /*! \var lock
+   *  \brief Protects `next_file`
+   */
+  pthread_mutex_t lock;
+};
+
+/*!
+ *  \brief The routine run by each metadata scanning thread
+ *  \param arg a pointer to the metadata_scan_queue structure
+ *  \return NULL
+ *
+ * Each thread takes the next file from the queue, reads its metadata and writes
+ * its index, until there are no more files. Every file has its own information
+ * structure and RPFITS reader, so nothing else needs to be shared.
+ */
+void *metadata_scan_thread(void *arg) {
+  int idx, num_options = 0;
+  struct metadata_scan_queue *queue = (struct metadata_scan_queue *)arg;
+  struct ampphase_options **ampphase_options = NULL;
+  struct spectrum_data *spectrum_data = NULL;
+  struct vis_data *vis_data = NULL;
+
+  while (true) {
+    pthread_mutex_lock(&(queue->lock));
+    idx = queue->next_file;
+    queue->next_file += 1;
+    pthread_mutex_unlock(&(queue->lock));
+    if (idx >= queue->n_files) {
+      break;
+    }
+    // The file may grow while it is being read, so the index key has to
+    // come from before the read.
+    queue->files[idx]->scanned_stat_valid =
+      (stat(queue->files[idx]->filename, &(queue->files[idx]->scanned_stat)) == 0);
+    data_reader(READ_SCAN_METADATA, 1, 0.0, queue->mjd_low, queue->mjd_high,
+		0, NULL, &num_options, &ampphase_options, &(queue->files[idx]),
+		&spectrum_data, &vis_data, NULL);
+    write_rpfits_index(queue->files[idx], queue->mjd_low, queue->mjd_high);
+  }
+
+  return NULL;
+}
+
+/*!
+ *  \brief Read the metadata from a number of RPFITS files at the same time
+ *  \param n_files the number of files to read
+ *  \param files the information structures of the files, which will be filled
+ *  \param mjd_low the MJD before which no data will be read
+ *  \param mjd_high the MJD after which no data will be read
+ *
+ * One thread is started per online CPU (but not more than there are files),
+ * and the threads share out the files between them. Since each file's metadata
+ * goes into its own structure, the result doesn't depend on which thread read
+ * which file. If no threads can be started, the files are read here instead.
+ */
+void scan_rpfits_files_metadata(int n_files, struct rpfits_file_information **files,
+				double mjd_low, double mjd_high) {
+  int i, n_threads, n_started = 0;
+  long n_cpus;
+  pthread_t *threads = NULL;
+  struct metadata_scan_queue queue;
+
+  queue.n_files = n_files;
+  queue.next_file = 0;
+  queue.files = files;
+  queue.mjd_low = mjd_low;
+  queue.mjd_high = mjd_high;
+  pthread_mutex_init(&(queue.lock), NULL);
+
+  n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  n_threads = (n_cpus > 0) ? (int)n_cpus : 1;
+  if (n_threads > n_files) {
+    n_threads = n_files;
+  }
+  MALLOC(threads, n_threads);
+  for (i = 0; i < n_threads; i++) {
+    if (pthread_create(&(threads[n_started]), NULL, metadata_scan_thread, &queue) != 0) {
+      fprintf(stderr, "[scan_rpfits_files_metadata] unable to start thread %d\n", i);
+      break;
+    }
+    n_started++;
+  }
+  if (n_started == 0) {
+    // Do all the work in this thread.
+    metadata_scan_thread(&queue);
+  }
+  for (i = 0; i < n_started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  FREE(threads);
+  pthread_mutex_destroy(&(queue.lock));
+}
+
+/*! \struct acal_job
+ *  \brief A request for noise diode amplitudes, which is worked on by a thread
+ *         of its own so the server can keep answering its other clients
+ *
+ * The job is set up by the main loop, which also looks for the wanted cycles
+ * in the spectrum cache before the thread starts. The thread then only reads
+ * the files, the cycle cache and the noise diode averages cache, none of which
+ * the main loop changes while a job is running. When it's done, the thread
+ * writes the address of the job to `notify_fd`, and the main loop adds what
+ * was made to the caches and tells the client.
+ */
+struct acal_job {
+  /*! \var client_id
+   *  \brief The ID of the client that made the request
+   */
+  char client_id[CLIENTIDLENGTH];
+  /*! \var n_rpfits_files
+   *  \brief The number of files the cycles can come from
+   */
+  int n_rpfits_files;
+  /*! \var info_rpfits_files
+   *  \brief The information structures of the files the cycles can come from
+   */
+  struct rpfits_file_information **info_rpfits_files;
+  /*! \var mjd_low
+   *  \brief The MJD before which no data will be read
+   */
+  double mjd_low;
+  /*! \var mjd_high
+   *  \brief The MJD after which no data will be read
+   */
+  double mjd_high;
+  /*! \var n_client_options
+   *  \brief The number of options structures in `client_options`
+   */
+  int n_client_options;
+  /*! \var client_options
+   *  \brief The options to read the cycles with, to which the noise diode
+   *         amplitudes are added
+   */
+  struct ampphase_options **client_options;
+  /*! \var n_copied_options
+   *  \brief The number of options structures in `copied_options`
+   */
+  int n_copied_options;
+  /*! \var copied_options
+   *  \brief The options as they were before any cycles were read, which label
+   *         the cache entries
+   */
+  struct ampphase_options **copied_options;
+  /*! \var n_cycles
+   *  \brief The number of cycles requested
+   */
+  int n_cycles;
+  /*! \var cycle_mjds
+   *  \brief The MJD of each cycle requested
+   *
+   * This array has length `n_cycles`, and is indexed starting at 0.
+   */
+  double *cycle_mjds;
+  /*! \var spectra
+   *  \brief The spectra of the cycles; those found in the cache are the cache
+   *         entries themselves
+   *
+   * This array of pointers has length `n_cycles`, and is indexed starting at
+   * 0. Once the thread is done, only the first `n_grabbed` are set.
+   */
+  struct spectrum_data **spectra;
+  /*! \var n_grabbed
+   *  \brief The number of cycles that could be found
+   */
+  int n_grabbed;
+  /*! \var n_fluxdensities
+   *  \brief The number of flux densities specified by the client
+   */
+  int n_fluxdensities;
+  /*! \var fluxdensities
+   *  \brief The flux densities specified by the client, or NULL if the
+   *         flux density models should be used
+   */
+  float *fluxdensities;
+  /*! \var batch
+   *  \brief The noise diode averages that weren't in the cache and had to be made
+   */
+  struct acal_sums_batch batch;
+  /*! \var options_idx
+   *  \brief The index of the options in `client_options` that were modified
+   */
+  int options_idx;
+  /*! \var fd_spec
+   *  \brief The flux densities used to compute the amplitudes
+   */
+  struct fluxdensity_specification fd_spec;
+  /*! \var computed
+   *  \brief Whether the amplitudes could be computed
+   */
+  bool computed;
+  /*! \var notify_fd
+   *  \brief The descriptor the finished job is written to
+   */
+  int notify_fd;
+  /*! \var thread_started
+   *  \brief Whether `thread` was started and needs to be joined
+   */
+  bool thread_started;
+  /*! \var thread
+   *  \brief The thread working on the job
+   */
+  pthread_t thread;
+  /*! \var next
+   *  \brief The job that is waiting to be started after this one, or NULL
+   */
+  struct acal_job *next;
+};
+
+/*!
+ *  \brief The routine run by the thread working on an acal job
+ *  \param arg a pointer to the acal_job structure
+ *  \return NULL
+ *
+ * The cycles that aren't already in `spectra` are read, the noise diode
+ * averages are made, and the amplitudes are solved for and attached to the
+ * client's options.
+ */
+void *acal_thread(void *arg) {
+  int i, j, k, n_ifs, window, model_num_terms;
+  float fd, *model_terms = NULL;
+  bool model_log, source_recognised;
+  char *source = NULL;
+  struct acal_job *job = (struct acal_job *)arg;
+  struct noise_diode_sums ***sums = NULL;
+  struct ampphase_options *spectrum_options = NULL;
+  struct ampphase_modifiers *fd_modifier = NULL;
+
+  // Get the cycles that aren't in the cache. The cache was searched before
+  // we started, so it isn't touched here.
+  data_reader(GRAB_MJDS_SPECTRA | IGNORE_CACHE, job->n_rpfits_files, -1,
+	      job->mjd_low, job->mjd_high, job->n_cycles, job->cycle_mjds,
+	      &(job->n_client_options), &(job->client_options),
+	      job->info_rpfits_files, NULL, NULL, &(job->spectra));
+  // Drop any cycles that couldn't be found.
+  job->n_grabbed = 0;
+  for (i = 0; i < job->n_cycles; i++) {
+    if (job->spectra[i] != NULL) {
+      job->spectra[job->n_grabbed] = job->spectra[i];
+      job->n_grabbed++;
+    }
+  }
+  job->computed = (job->n_grabbed > 0);
+  job->batch.n_jobs = 0;
+  job->batch.spectra = NULL;
+  job->batch.windows = NULL;
+  job->batch.sums = NULL;
+
+  if (job->computed) {
+    printf(" Data obtained, computing parameters...\n");
+    n_ifs = job->spectra[0]->num_ifs;
+    // Find the correct set of options.
+    spectrum_options = find_ampphase_options(job->n_client_options,
+					     job->client_options,
+					     job->spectra[0]->header_data,
+					     &(job->options_idx));
+    // The averages of each cycle in each window don't depend on the
+    // flux density, so we only make the ones that aren't in the cache,
+    // and we make them all at once.
+    job->batch.options = spectrum_options;
+    MALLOC(sums, n_ifs);
+    for (i = 0; i < n_ifs; i++) {
+      window = job->spectra[0]->header_data->if_label[i];
+      MALLOC(sums[i], job->n_grabbed);
+      for (j = 0; j < job->n_grabbed; j++) {
+	sums[i][j] =
+	  get_cache_acal_sums(job->n_copied_options, job->copied_options,
+			      date2mjd(job->spectra[j]->header_data->obsdate,
+				       job->spectra[j]->spectrum[i][0]->ut_seconds),
+			      ((double)job->spectra[j]->header_data->cycle_time /
+			       (2.0 * 86400.0)), window);
+	if (sums[i][j] == NULL) {
+	  k = job->batch.n_jobs + 1;
+	  REALLOC(job->batch.spectra, k);
+	  REALLOC(job->batch.windows, k);
+	  REALLOC(job->batch.sums, k);
+	  job->batch.spectra[k - 1] = job->spectra[j];
+	  job->batch.windows[k - 1] = window;
+	  CALLOC(job->batch.sums[k - 1], 1);
+	  sums[i][j] = job->batch.sums[k - 1];
+	  job->batch.n_jobs = k;
+	}
+      }
+    }
+    printf(" Averaging %d of %d cycle windows, the rest were cached\n",
+	   job->batch.n_jobs, n_ifs * job->n_grabbed);
+    compute_acal_sums_batch(&(job->batch));
+    // And compute the amplitude calibration parameters.
+    if (job->n_fluxdensities <= 0) {
+      source =
+	job->spectra[0]->header_data->source_name[job->spectra[0]->spectrum[0][0]->source_no];
+      // We make a very simplistic flux density specifier here, but this will
+      // need to be changed when we want to move to a better method of acal.
+      // We do this now to match how CABB acal works.
+      job->fd_spec.num_models = n_ifs;
+    } else {
+      // We use the numbers that came along with the request.
+      job->fd_spec.num_models = job->n_fluxdensities;
+    }
+    CALLOC(job->fd_spec.model_frequency, job->fd_spec.num_models);
+    CALLOC(job->fd_spec.model_frequency_tolerance, job->fd_spec.num_models);
+    CALLOC(job->fd_spec.model_num_terms, job->fd_spec.num_models);
+    CALLOC(job->fd_spec.model_terms, job->fd_spec.num_models);
+    if (job->n_fluxdensities > 0) {
+      j = 0;
+      for (i = 0; i < job->n_fluxdensities; i++) {
+	// We find the next available continuum band.
+	for (k = j; k < n_ifs; k++) {
+	  if (job->spectra[0]->header_data->if_bandwidth[k] > 1000) {
+	    j = k + 1;
+	    job->fd_spec.model_frequency[i] =
+	      job->spectra[0]->header_data->if_centre_freq[k];
+	    job->fd_spec.model_frequency_tolerance[i] =
+	      job->spectra[0]->header_data->if_bandwidth[k] / 2;
+	    break;
+	  }
+	}
+	job->fd_spec.model_num_terms[i] = 1;
+	CALLOC(job->fd_spec.model_terms[i], job->fd_spec.model_num_terms[i]);
+	job->fd_spec.model_terms[i][0] = job->fluxdensities[i];
+      }
+    }
+    for (i = 0; i < n_ifs; i++) {
+      // Find the correct window number.
+      window = job->spectra[0]->header_data->if_label[i];
+      if (job->n_fluxdensities == 0) {
+	// Work out the correct flux density to use.
+	source_recognised =
+	  source_model(source, job->spectra[0]->header_data->if_centre_freq[i],
+		       &model_num_terms, &model_log, &model_terms);
+	job->fd_spec.model_frequency[i] = job->spectra[0]->header_data->if_centre_freq[i];
+	job->fd_spec.model_frequency_tolerance[i] =
+	  job->spectra[0]->header_data->if_bandwidth[i] / 2;
+	job->fd_spec.model_num_terms[i] = 1;
+	REALLOC(job->fd_spec.model_terms[i], job->fd_spec.model_num_terms[i]);
+	if (source_recognised) {
+	  fd = fluxdensity_model_evaluate(model_num_terms, model_log, model_terms,
+					  job->spectra[0]->header_data->if_centre_freq[i]);
+	  job->fd_spec.model_terms[i][0] = fd;
+	} else {
+	  job->fd_spec.model_terms[i][0] = 1;
+	}
+	FREE(model_terms);
+      }
+      solve_noise_diode_amplitudes(&(job->fd_spec), job->n_grabbed, sums[i],
+				   &fd_modifier);
+      // Attach the modifier to the options now.
+      add_modifier(spectrum_options, window, fd_modifier);
+      free_ampphase_modifiers(fd_modifier);
+      FREE(fd_modifier);
+    }
+    for (i = 0; i < n_ifs; i++) {
+      FREE(sums[i]);
+    }
+    FREE(sums);
+  }
+
+  // Hand the job back to the main loop.
+  if (write(job->notify_fd, &job, sizeof(job)) != sizeof(job)) {
+    fprintf(stderr, "[acal_thread] unable to return the job for client %s\n",
+	    job->client_id);
+  }
+
+  return NULL;
+}
+
+/*!
+ *  \brief Start the thread for an acal job
+ *  \param job the job, which must have been set up by the main loop
+ *
+ * If the thread can't be started, the work is done here instead; either way
+ * the finished job is written to its descriptor.
+ */
+void start_acal_job(struct acal_job *job) {
+  printf(" Calculating acal parameters for client %s...\n", job->client_id);
+  job->thread_started =
+    (pthread_create(&(job->thread), NULL, acal_thread, job) == 0);
+  if (job->thread_started == false) {
+    fprintf(stderr, "[start_acal_job] unable to start thread\n");
+    acal_thread(job);
+  }
+}
+
+/*!
+ *  \brief Store what a finished acal job made in the caches
+ *  \param job the job, whose thread must be finished
+ *  \param n_rpfits_files the number of files
+ *  \param info_rpfits_files the information structures of the files
+ *
+ * The cycles that were read and the averages that were made are cached for
+ * the next time. Those that the caches already have are freed, along with the
+ * header of any such cycle that isn't one of the files' own scan headers.
+ */
+void finish_acal_job(struct acal_job *job, int n_rpfits_files,
+		     struct rpfits_file_information **info_rpfits_files) {
+  int i, j, k;
+  bool stored_header;
+  struct scan_header_data *header_data = NULL;
+
+  if (job->thread_started) {
+    pthread_join(job->thread, NULL);
+    job->thread_started = false;
+  }
+
+  for (i = 0; i < job->batch.n_jobs; i++) {
+    if (add_cache_acal_sums(job->n_copied_options, job->copied_options,
+			    job->batch.sums[i]) == false) {
+      free_noise_diode_sums(job->batch.sums[i]);
+      FREE(job->batch.sums[i]);
+    }
+  }
+  FREE(job->batch.spectra);
+  FREE(job->batch.windows);
+  FREE(job->batch.sums);
+  job->batch.n_jobs = 0;
+
+  for (i = 0; i < job->n_grabbed; i++) {
+    if (spd_data_cached(job->spectra[i])) {
+      continue;
+    }
+    // The cache takes over the spectra if it adds them.
+    if (add_cache_spd_data(job->n_copied_options, job->copied_options,
+			   job->spectra[i]) == false) {
+      header_data = job->spectra[i]->header_data;
+      stored_header = false;
+      for (j = 0; (j < n_rpfits_files) && (stored_header == false); j++) {
+	for (k = 0; k < info_rpfits_files[j]->n_scans; k++) {
+	  if (info_rpfits_files[j]->scan_headers[k] == header_data) {
+	    stored_header = true;
+	    break;
+	  }
 	}
       }
+      free_spectrum_data(job->spectra[i]);
+      if ((header_data != NULL) && (stored_header == false)) {
+	free_scan_header_data(header_data);
+	FREE(header_data);
+      }
+    }
+    FREE(job->spectra[i]);
+  }
+  job->n_grabbed = 0;
+}
 
-      if (header_free) {
-        free_scan_header_data(sh);
-        FREE(sh);
+/*!
+ *  \brief Free an acal job
+ *  \param job the job, which must not be running
+ *
+ * Any cycles still in the job are cache entries, so they are left alone.
+ */
+void free_acal_job(struct acal_job *job) {
+  int i;
+
+  for (i = 0; i < job->n_client_options; i++) {
+    free_ampphase_options(job->client_options[i]);
+    FREE(job->client_options[i]);
+  }
+  FREE(job->client_options);
+  for (i = 0; i < job->n_copied_options; i++) {
+    free_ampphase_options(job->copied_options[i]);
+    FREE(job->copied_options[i]);
+  }
+  FREE(job->copied_options);
+  FREE(job->cycle_mjds);
+  FREE(job->spectra);
+  FREE(job->fluxdensities);
+  if (job->computed) {
+    free_fluxdensity_specification(&(job->fd_spec));
+  }
+  FREE(job);
+}
+
+/*! \def RPFITS_FOLLOW_INTERVAL
+ *  \brief The number of seconds between checks for new data in the file
+ *         we are following
+ */
+#define RPFITS_FOLLOW_INTERVAL 5
+
+/*!
+ *  \brief Read cycles from a scan and add them to a file's metadata
+ *  \param rpfits_file the RPFITS file, positioned at the start of a cycle
+ *  \param info the file information structure
+ *  \param scan the index of the scan in \a info that the cycles belong to
+ *  \param sh the scan header, as read from the file
+ *  \param mjd_low the MJD before which no data will be read
+ *  \param mjd_high the MJD after which no data will be read
+ *  \return the value returned by read_cycle_data for the last cycle read
+ *
+ * Just as when data_reader reads the metadata, a cycle which ends at the end of
+ * the file isn't recorded, since it may not have been completely written yet.
+ */
+int follow_scan_cycles(struct rpfits_file *rpfits_file,
+		       struct rpfits_file_information *info, int scan,
+		       struct scan_header_data *sh, double mjd_low, double mjd_high) {
+  int res = READER_DATA_AVAILABLE, n;
+  long cycle_offset;
+  bool usable;
+  double cycle_mjd;
+  struct cycle_data *cycle_data = NULL;
+
+  while (res & READER_DATA_AVAILABLE) {
+    cycle_offset = rpfitsio_tell(rpfits_file);
+    cycle_data = prepare_new_cycle_data();
+    res = read_cycle_data(rpfits_file, sh, cycle_data);
+    usable = ((res != READER_EXHAUSTED) && (cycle_data->num_points > 0));
+    if (usable) {
+      cycle_mjd = date2mjd(sh->obsdate, cycle_data->ut_seconds);
+      if ((cycle_mjd >= mjd_low) && (cycle_mjd <= mjd_high)) {
+	if (info->scan_start_mjd[scan] == 0) {
+	  info->scan_start_mjd[scan] = cycle_mjd;
+	}
+	info->scan_end_mjd[scan] = cycle_mjd;
+	n = info->n_cycles[scan] + 1;
+	ARRAY_APPEND(info->cycle_mjd[scan], n, cycle_mjd);
+	ARRAY_APPEND(info->cycle_offset[scan], n, cycle_offset);
+	info->n_cycles[scan] = n;
       }
     }
+    free_cycle_data(cycle_data);
+    FREE(cycle_data);
+    if (!usable) {
+      break;
+    }
+  }
 
-    // If we get here we must have opened the RPFITS file.
-    res = close_rpfits_file();
-    if (res) {
-      fprintf(stderr, "CLOSE FAILED FOR FILE %s, CODE %d\n",
-              info_rpfits_files[i]->filename, res);
-      return;
+  return res;
+}
+
+/*!
+ *  \brief Read any data that has been added to an RPFITS file since we last
+ *         looked at it
+ *  \param info the file information structure, which will be extended with any
+ *              new scans and cycles
+ *  \param mjd_low the MJD before which no data will be read
+ *  \param mjd_high the MJD after which no data will be read
+ *  \return the number of new cycles found
+ *
+ * Nothing is read unless the file has changed size. The last cycle we know
+ * about is read again to leave the reader in the same state as if it had read
+ * the file from the start, and then the reading continues from there. If the
+ * last scan has no cycles yet, its header is read again instead.
+ */
+int follow_rpfits_file(struct rpfits_file_information *info,
+		       double mjd_low, double mjd_high) {
+  int i, n, res = READER_EXHAUSTED, n_previous = 0, n_now = 0;
+  bool keep_reading = true;
+  struct stat st;
+  struct rpfits_file *rpfits_file = NULL;
+  struct scan_header_data *sh = NULL;
+  struct cycle_data *cycle_data = NULL;
+
+  if ((stat(info->filename, &st) != 0) || (st.st_size == info->followed_size)) {
+    return 0;
+  }
+  info->followed_size = st.st_size;
+  info->scanned_stat = st;
+  info->scanned_stat_valid = true;
+  for (i = 0; i < info->n_scans; i++) {
+    n_previous += info->n_cycles[i];
+  }
+
+  if (open_rpfits_file(info->filename, &rpfits_file)) {
+    fprintf(stderr, "[follow_rpfits_file] unable to open %s\n", info->filename);
+    return 0;
+  }
+  // The file is still being written, so it isn't mapped into memory; see
+  // data_reader.
+
+  if (info->n_scans > 0) {
+    n = info->n_scans - 1;
+    CALLOC(sh, 1);
+    if ((rpfitsio_seek(rpfits_file, info->scan_offset[n]) == JSTAT_SUCCESSFUL) &&
+	(read_scan_header(rpfits_file, sh) & READER_DATA_AVAILABLE)) {
+      if (info->n_cycles[n] > 0) {
+	if (rpfitsio_seek(rpfits_file, info->cycle_offset[n][info->n_cycles[n] - 1]) ==
+	    JSTAT_SUCCESSFUL) {
+	  cycle_data = prepare_new_cycle_data();
+	  res = read_cycle_data(rpfits_file, sh, cycle_data);
+	  free_cycle_data(cycle_data);
+	  FREE(cycle_data);
+	} else {
+	  fprintf(stderr, "[follow_rpfits_file] unable to find the last cycle in %s\n",
+		  info->filename);
+	  res = READER_EXHAUSTED;
+	}
+      } else {
+	// The scan had no cycles yet, so the reader is already at the start
+	// of its first cycle, just after the header.
+	res = READER_DATA_AVAILABLE;
+      }
+      if (res & READER_DATA_AVAILABLE) {
+	res = follow_scan_cycles(rpfits_file, info, n, sh, mjd_low, mjd_high);
+      }
+    } else {
+      fprintf(stderr, "[follow_rpfits_file] unable to find the last scan in %s\n",
+	      info->filename);
+      res = READER_EXHAUSTED;
+    }
+    free_scan_header_data(sh);
+    FREE(sh);
+    if (res == READER_EXHAUSTED) {
+      keep_reading = false;
     }
+  }
 
-    
+  // Now look for new scans.
+  while (keep_reading) {
+    n = info->n_scans;
+    REALLOC(info->scan_headers, (n + 1));
+    REALLOC(info->scan_start_mjd, (n + 1));
+    REALLOC(info->scan_end_mjd, (n + 1));
+    REALLOC(info->n_cycles, (n + 1));
+    REALLOC(info->cycle_mjd, (n + 1));
+    REALLOC(info->scan_offset, (n + 1));
+    REALLOC(info->cycle_offset, (n + 1));
+    info->scan_start_mjd[n] = info->scan_end_mjd[n] = 0;
+    info->n_cycles[n] = 0;
+    info->cycle_mjd[n] = NULL;
+    info->cycle_offset[n] = NULL;
+    CALLOC(sh, 1);
+    res = read_scan_header(rpfits_file, sh);
+    if ((sh->num_sources > 0) && (res & READER_DATA_AVAILABLE)) {
+      info->scan_offset[n] = rpfits_file->header_offset;
+      res = follow_scan_cycles(rpfits_file, info, n, sh, mjd_low, mjd_high);
+    }
+    if (info->n_cycles[n] > 0) {
+      info->scan_headers[n] = sh;
+      info->n_scans += 1;
+    } else {
+      // We only keep scans with cycles; if this one is still being written
+      // we'll find it again next time.
+      free_scan_header_data(sh);
+      FREE(sh);
+    }
+    if (res == READER_EXHAUSTED) {
+      keep_reading = false;
+    }
   }
+  close_rpfits_file(rpfits_file);
 
-  if (read_type & GRAB_MJDS_SPECTRA) {
-    FREE(mjds_cache_hit);
+  for (i = 0; i < info->n_scans; i++) {
+    n_now += info->n_cycles[i];
   }
+  return (n_now - n_previous);
+}
 
-  
+/*!
+ *  \brief Add the vis products for newly read cycles to the cached vis data
+ *  \param info the information structure for the file that has new cycles
+ *  \param first_mjd the MJD of the first new cycle
+ *  \param last_mjd the MJD of the last new cycle
+ *  \param client_vis_data the client vis data cache, whose entries will be
+ *                         kept in step with the cache they were copied from
+ *  \param vis_data another copy of a cache entry, also kept in step
+ *  \param n_previous upon exit, this will be an array with one entry for each
+ *                    entry in the vis data cache, giving the number of cycles
+ *                    it held before the new ones were added; it is the
+ *                    caller's responsibility to free this memory
+ *
+ * Each cache entry is extended by computing only the new cycles, with the
+ * options that entry was computed with. Since the client caches only hold
+ * shallow copies of the cache entries, they are copied again afterwards.
+ */
+void follow_extend_vis_data(struct rpfits_file_information *info,
+			    double first_mjd, double last_mjd,
+			    struct client_vis_data *client_vis_data,
+			    struct vis_data *vis_data, int **n_previous) {
+  int i, j, num_options;
+  struct ampphase_options **options = NULL, **old_options = NULL;
+  struct spectrum_data *spectrum_data = NULL;
+  struct vis_data *new_data = NULL;
+
+  MALLOC(*n_previous, cache_vis_data.num_cache_vis_data);
+  for (i = 0; i < cache_vis_data.num_cache_vis_data; i++) {
+    (*n_previous)[i] = cache_vis_data.vis_data[i]->nviscycles;
+    // data_reader can change the options it is given.
+    num_options = cache_vis_data.num_options[i];
+    MALLOC(options, num_options);
+    for (j = 0; j < num_options; j++) {
+      CALLOC(options[j], 1);
+      set_default_ampphase_options(options[j]);
+      copy_ampphase_options(options[j], cache_vis_data.ampphase_options[i][j]);
+    }
+    // We compute only between a fraction of a second either side of the new
+    // cycles, which excludes the cycles we already have, and any which have
+    // been written since the metadata was read.
+    data_reader(COMPUTE_VIS_PRODUCTS | IGNORE_CACHE, 1, 0.0,
+		first_mjd - (0.1 / 86400.0), last_mjd + (0.1 / 86400.0), 0, NULL,
+		&num_options, &options, &info, &spectrum_data, &new_data, NULL);
+    if (new_data->nviscycles > 0) {
+      old_options = cache_vis_data.vis_data[i]->options;
+      append_vis_data(cache_vis_data.vis_data[i], new_data);
+      for (j = 0; j < client_vis_data->num_clients; j++) {
+	if (client_vis_data->vis_data[j]->options == old_options) {
+	  copy_vis_data(client_vis_data->vis_data[j], cache_vis_data.vis_data[i]);
+	}
+      }
+      if ((vis_data != NULL) && (vis_data->options == old_options)) {
+	copy_vis_data(vis_data, cache_vis_data.vis_data[i]);
+      }
+    } else {
+      free_vis_data(new_data);
+    }
+    FREE(new_data);
+    for (j = 0; j < num_options; j++) {
+      free_ampphase_options(options[j]);
+      FREE(options[j]);
+    }
+    FREE(options);
+  }
 }
 
 /*! \def RPSENDBUFSIZE
@@ -1780,23 +4386,25 @@ struct spectrum_data* get_client_spd_data(struct client_spd_data *client_spd_dat
 int main(int argc, char *argv[]) {
   struct rpfitsfile_server_arguments arguments;
   int i, j, k, l, ri, rj, bytes_received, r, n_cycle_mjd = 0, n_client_options = 0;
+  int n_stale_files = 0, follow_idx = -1, n_new_cycles, *follow_n_previous = NULL;
   int n_alert_sockets = 0, n_ampphase_options = 0, *client_indices = NULL;
   int removed_client_type, total_n_scans = 0, loop_limit, n_acal_cycles = 0;
-  int acal_window, acal_model_num_terms = 0, n_acal_fluxdensities = 0;
-  int n_copied_options = 0, acal_options_idx;
+  int n_acal_fluxdensities = 0, acal_pipe[2];
   bool pointer_found = false, vis_cache_updated = false, notify_required = false;
   bool spd_cache_updated = false, outside_mjd_range = false, succ = false;
-  bool client_added = false, determine_params = false;
-  bool quit_when_closed = false, acal_source_recognised = false, acal_model_log = false;
-  float acal_fd, *acal_model_terms = NULL, *acal_fluxdensities = NULL;
+  bool client_added = false, determine_params = false, acal_started = false;
+  bool quit_when_closed = false;
+  float *acal_fluxdensities = NULL;
   double mjd_grab, earliest_mjd, latest_mjd, mjd_cycletime;
   double *all_cycle_mjd = NULL, *acal_cycle_mjds = NULL;
+  double follow_first_mjd, follow_last_mjd;
+  time_t last_follow_time = 0, newest_mtime = 0;
   struct rpfits_file_information **info_rpfits_files = NULL;
+  struct rpfits_file_information **stale_rpfits_files = NULL;
   struct ampphase_options **ampphase_options = NULL, **client_options = NULL;
-  struct ampphase_options *spectrum_options = NULL, **copied_options = NULL;
   struct spectrum_data *spectrum_data = NULL, *child_spectrum_data = NULL;
-  struct spectrum_data **acal_spectra = NULL;
-  struct vis_data *vis_data = NULL, *child_vis_data = NULL;
+  struct vis_data *vis_data = NULL, *child_vis_data = NULL, *follow_vis_data = NULL;
+  struct vis_data appended_vis_data;
   FILE *fh = NULL;
   cmp_ctx_t cmp, child_cmp;
   cmp_mem_access_t mem, child_mem;
@@ -1804,11 +4412,12 @@ int main(int argc, char *argv[]) {
   char port_string[RPSBUFSIZE], address_buffer[RPSBUFSIZE], clienttype_string[RPSBUFSIZE];
   char *recv_buffer = NULL, *send_buffer = NULL, *child_send_buffer = NULL;
   char removed_id[CLIENTIDLENGTH], removed_username[CLIENTIDLENGTH];
-  char *acal_source = NULL;
   SOCKET socket_listen, max_socket, loop_i, socket_client, child_socket;
   SOCKET *alert_socket = NULL;
   fd_set master, reads;
   struct sockaddr_storage client_address;
+  struct timeval follow_timeout;
+  struct stat st;
   socklen_t client_len;
   struct requests client_request, child_request;
   struct responses client_response;
@@ -1820,8 +4429,8 @@ int main(int argc, char *argv[]) {
   struct client_sockets clients;
   struct client_ampphase_options client_ampphase_options;
   struct file_instructions *testing_instructions = NULL, *file_instructions_ptr = NULL;
-  struct fluxdensity_specification fd_spec;
-  struct ampphase_modifiers *fd_modifier = NULL;
+  struct acal_job *acal_jobs = NULL, *new_acal_job = NULL, *last_acal_job = NULL;
+  struct acal_job *finished_acal_job = NULL;
   
   // Set the defaults for the arguments.
   arguments.n_rpfits_files = 0;
@@ -1833,6 +4442,8 @@ int main(int argc, char *argv[]) {
   arguments.testing_instruction_files = NULL;
   arguments.minimum_read_mjd = -INFINITY;
   arguments.maximum_read_mjd = INFINITY;
+  arguments.follow_operation = false;
+  arguments.cache_memory = 1024;
   
   // And the default for the calculator options.
   /* MALLOC(ampphase_options, 1); */
@@ -1863,6 +4474,10 @@ int main(int argc, char *argv[]) {
   cache_spd_data.num_options = NULL;
   cache_spd_data.ampphase_options = NULL;
   cache_spd_data.spectrum_data = NULL;
+  cache_acal_sums.num_cache_acal_sums = 0;
+  cache_acal_sums.num_options = NULL;
+  cache_acal_sums.ampphase_options = NULL;
+  cache_acal_sums.sums = NULL;
 
   // And initialise the clients.
   client_vis_data.num_clients = 0;
@@ -1914,22 +4529,33 @@ int main(int argc, char *argv[]) {
   for (i = 0; i < arguments.n_rpfits_files; i++) {
     info_rpfits_files[i] = new_rpfits_file();
     strncpy(info_rpfits_files[i]->filename, arguments.rpfits_files[i], RPSBUFSIZE);
+    // Use the index for this file if it is up to date, otherwise we have
+    // to scan the file.
+    if (!read_rpfits_index(info_rpfits_files[i], arguments.minimum_read_mjd,
+			   arguments.maximum_read_mjd)) {
+      n_stale_files += 1;
+      ARRAY_APPEND(stale_rpfits_files, n_stale_files, info_rpfits_files[i]);
+    }
+  }
+  if (n_stale_files > 0) {
+    // The files are independent, so we scan them at the same time.
+    scan_rpfits_files_metadata(n_stale_files, stale_rpfits_files,
+			       arguments.minimum_read_mjd, arguments.maximum_read_mjd);
+    FREE(stale_rpfits_files);
   }
-  data_reader(READ_SCAN_METADATA, arguments.n_rpfits_files, 0.0,
-	      arguments.minimum_read_mjd, arguments.maximum_read_mjd, 0, NULL,
-	      &n_ampphase_options, &ampphase_options,
-              info_rpfits_files, &spectrum_data, &vis_data, NULL);
   // We can now work out which time range we cover and the cycle time.
   for (i = 0, determine_params = true; i < arguments.n_rpfits_files; i++) {
     total_n_scans += info_rpfits_files[i]->n_scans;
     for (j = 0; j < info_rpfits_files[i]->n_scans; j++) {
+      if (info_rpfits_files[i]->n_cycles[j] == 0) {
+	// A scan without cycles has no times.
+	continue;
+      }
       if (determine_params) {
-	if (info_rpfits_files[i]->n_cycles[j] > 0) {
-	  mjd_cycletime = (double)info_rpfits_files[i]->scan_headers[j]->cycle_time / 86400.0;
-	  earliest_mjd = info_rpfits_files[i]->scan_start_mjd[j] - (mjd_cycletime / 2.0);
-	  latest_mjd = info_rpfits_files[i]->scan_end_mjd[j] + (mjd_cycletime / 2.0);
-	  determine_params = false;
-	}
+	mjd_cycletime = (double)info_rpfits_files[i]->scan_headers[j]->cycle_time / 86400.0;
+	earliest_mjd = info_rpfits_files[i]->scan_start_mjd[j] - (mjd_cycletime / 2.0);
+	latest_mjd = info_rpfits_files[i]->scan_end_mjd[j] + (mjd_cycletime / 2.0);
+	determine_params = false;
       } else {
         MINASSIGN(earliest_mjd, info_rpfits_files[i]->scan_start_mjd[j] - (mjd_cycletime / 2.0));
         MAXASSIGN(latest_mjd, info_rpfits_files[i]->scan_end_mjd[j] + (mjd_cycletime / 2.0));
@@ -1967,6 +4593,28 @@ int main(int argc, char *argv[]) {
     printf("\n");
   }
 
+  // Work out which file we should follow, which is the one that was
+  // most recently changed.
+  if (arguments.follow_operation) {
+    if (!arguments.network_operation) {
+      fprintf(stderr, "FILES CAN ONLY BE FOLLOWED BY A NETWORK SERVER\n");
+      arguments.follow_operation = false;
+    }
+    for (i = 0; i < arguments.n_rpfits_files; i++) {
+      if ((stat(info_rpfits_files[i]->filename, &st) == 0) &&
+	  ((follow_idx < 0) || (st.st_mtime >= newest_mtime))) {
+	follow_idx = i;
+	newest_mtime = st.st_mtime;
+      }
+    }
+    if (follow_idx < 0) {
+      arguments.follow_operation = false;
+    } else if (arguments.follow_operation) {
+      printf("Following RPFITS file %s\n\n", info_rpfits_files[follow_idx]->filename);
+      info_rpfits_files[follow_idx]->followed = true;
+    }
+  }
+
   // Let's try to load one of the spectra at startup, so we can send
   // something if required to.
   printf("Preparing for operation...\n");
@@ -2005,6 +4653,11 @@ int main(int argc, char *argv[]) {
   // And these are now the default ampphase options.
   add_client_ampphase_options(&client_ampphase_options, "DEFAULT", "",
 			      n_ampphase_options, ampphase_options);
+  // Now we can start keeping the decoded cycles, so that computing with other
+  // options won't need the files to be decoded again. The file we're following
+  // changes all the time, so it's always read from disk.
+  start_cycle_cache(arguments.n_rpfits_files, info_rpfits_files, arguments.cache_memory,
+		    (arguments.follow_operation ? info_rpfits_files[follow_idx] : NULL));
   
   // Now go through any testing data specifications and store those.
   
@@ -2065,10 +4718,19 @@ int main(int argc, char *argv[]) {
       return(1);
     }
 
+    // The acal threads tell us they're done through a pipe, which is
+    // watched along with the sockets.
+    if (pipe(acal_pipe) != 0) {
+      fprintf(stderr, "pipe() failed. (%d)\n", errno);
+      return(1);
+    }
+
     // Enter our main loop.
     FD_ZERO(&master);
     FD_SET(socket_listen, &master);
     max_socket = socket_listen;
+    FD_SET(acal_pipe[0], &master);
+    MAXASSIGN(max_socket, acal_pipe[0]);
 
     printf("Waiting for connections...\n");
     while (true) {
@@ -2080,7 +4742,14 @@ int main(int argc, char *argv[]) {
 	break;
       }
 
-      r = select(max_socket + 1, &reads, 0, 0, 0);
+      if (arguments.follow_operation) {
+	// We need to wake up regularly to check for new data.
+	follow_timeout.tv_sec = RPFITS_FOLLOW_INTERVAL;
+	follow_timeout.tv_usec = 0;
+	r = select(max_socket + 1, &reads, 0, 0, &follow_timeout);
+      } else {
+	r = select(max_socket + 1, &reads, 0, 0, 0);
+      }
       if ((r < 0) && (errno != EINTR)) {
         fprintf(stderr, "select() failed. (%d)\n", GETSOCKETERRNO());
         break;
@@ -2109,6 +4778,95 @@ int main(int argc, char *argv[]) {
 	quit_when_closed = true;
       }
 
+      // The acal thread reads the file information structures, so they
+      // can't be changed until it has finished.
+      if (arguments.follow_operation && !quit_when_closed && (acal_jobs == NULL) &&
+	  ((time(NULL) - last_follow_time) >= RPFITS_FOLLOW_INTERVAL)) {
+	// Check if any more data has been written to the file we're following.
+	last_follow_time = time(NULL);
+	follow_last_mjd = (info_rpfits_files[follow_idx]->n_scans > 0) ?
+	  info_rpfits_files[follow_idx]->scan_end_mjd[info_rpfits_files[follow_idx]->n_scans - 1] :
+	  -INFINITY;
+	n_new_cycles = follow_rpfits_file(info_rpfits_files[follow_idx],
+					  arguments.minimum_read_mjd,
+					  arguments.maximum_read_mjd);
+	if (n_new_cycles > 0) {
+	  printf("Found %d new cycles in %s\n", n_new_cycles,
+		 info_rpfits_files[follow_idx]->filename);
+	  // Keep our list of cycle times and time range up to date.
+	  follow_first_mjd = -1;
+	  for (j = 0; j < info_rpfits_files[follow_idx]->n_scans; j++) {
+	    for (k = 0; k < info_rpfits_files[follow_idx]->n_cycles[j]; k++) {
+	      if (info_rpfits_files[follow_idx]->cycle_mjd[j][k] > follow_last_mjd) {
+		if (follow_first_mjd < 0) {
+		  follow_first_mjd = info_rpfits_files[follow_idx]->cycle_mjd[j][k];
+		}
+		n_cycle_mjd += 1;
+		ARRAY_APPEND(all_cycle_mjd, n_cycle_mjd,
+			     info_rpfits_files[follow_idx]->cycle_mjd[j][k]);
+	      }
+	    }
+	  }
+	  follow_last_mjd =
+	    info_rpfits_files[follow_idx]->scan_end_mjd[info_rpfits_files[follow_idx]->n_scans - 1];
+	  MAXASSIGN(latest_mjd, follow_last_mjd + (mjd_cycletime / 2.0));
+	  write_rpfits_index(info_rpfits_files[follow_idx], arguments.minimum_read_mjd,
+			     arguments.maximum_read_mjd);
+
+	  // Compute the new cycles for all the vis data we have, and send
+	  // each NVIS client just the cycles it is missing.
+	  follow_extend_vis_data(info_rpfits_files[follow_idx], follow_first_mjd,
+				 follow_last_mjd, &client_vis_data, vis_data,
+				 &follow_n_previous);
+	  for (i = 0; i < clients.num_sockets; i++) {
+	    if (clients.client_type[i] != CLIENTTYPE_NVIS) {
+	      continue;
+	    }
+	    follow_vis_data = get_client_vis_data(&client_vis_data, clients.client_id[i]);
+	    for (j = 0; j < cache_vis_data.num_cache_vis_data; j++) {
+	      if ((follow_vis_data != NULL) &&
+		  (cache_vis_data.vis_data[j]->options == follow_vis_data->options)) {
+		break;
+	      }
+	    }
+	    if ((j >= cache_vis_data.num_cache_vis_data) ||
+		(follow_vis_data->nviscycles <= follow_n_previous[j])) {
+	      continue;
+	    }
+	    // Make a structure that points to only the new cycles.
+	    k = follow_n_previous[j];
+	    appended_vis_data.nviscycles = follow_vis_data->nviscycles - k;
+	    appended_vis_data.mjd_low = follow_vis_data->mjd_low;
+	    appended_vis_data.mjd_high = follow_vis_data->mjd_high;
+	    appended_vis_data.header_data = follow_vis_data->header_data + k;
+	    appended_vis_data.num_ifs = follow_vis_data->num_ifs + k;
+	    appended_vis_data.num_pols = follow_vis_data->num_pols + k;
+	    appended_vis_data.vis_quantities = follow_vis_data->vis_quantities + k;
+	    appended_vis_data.metinfo = follow_vis_data->metinfo + k;
+	    appended_vis_data.syscal_data = follow_vis_data->syscal_data + k;
+	    appended_vis_data.num_options = follow_vis_data->num_options;
+	    appended_vis_data.options = follow_vis_data->options;
+
+	    CALLOC(send_buffer, RPSENDBUFSIZE);
+	    client_response.response_type = RESPONSE_APPENDED_VISDATA;
+	    strncpy(client_response.client_id, clients.client_id[i], CLIENTIDLENGTH);
+	    init_cmp_memory_buffer(&cmp, &mem, send_buffer, (size_t)RPSENDBUFSIZE);
+	    pack_responses(&cmp, &client_response);
+	    pack_write_sint(&cmp, appended_vis_data.num_options);
+	    for (l = 0; l < appended_vis_data.num_options; l++) {
+	      pack_ampphase_options(&cmp, appended_vis_data.options[l]);
+	    }
+	    pack_vis_data(&cmp, &appended_vis_data);
+	    printf(" %s to client %s.\n",
+		   get_type_string(TYPE_RESPONSE, client_response.response_type),
+		   client_response.client_id);
+	    bytes_sent = socket_send_buffer(clients.socket[i], send_buffer,
+					    cmp_mem_access_get_pos(&mem));
+	    FREE(send_buffer);
+	  }
+	  FREE(follow_n_previous);
+	}
+      }
       
       if (r < 0) {
         // Nothing got selected.
@@ -2118,7 +4876,58 @@ int main(int argc, char *argv[]) {
       for (loop_i = 1; loop_i <= max_socket; ++loop_i) {
         if (FD_ISSET(loop_i, &reads)) {
           // Handle this request.
-          if (loop_i == socket_listen) {
+          if (loop_i == acal_pipe[0]) {
+	    // An acal job has finished.
+	    if (read(acal_pipe[0], &finished_acal_job, sizeof(finished_acal_job)) !=
+		sizeof(finished_acal_job)) {
+	      fprintf(stderr, "read() of finished acal job failed. (%d)\n", errno);
+	      continue;
+	    }
+	    finish_acal_job(finished_acal_job, arguments.n_rpfits_files,
+			    info_rpfits_files);
+	    // Tell the client their acal information is ready.
+	    // Find the client's socket.
+	    find_client(&clients, finished_acal_job->client_id, "",
+			&n_alert_sockets, &alert_socket, NULL);
+	    for (i = 0; i < n_alert_sockets; i++) {
+	      if (ISVALIDSOCKET(alert_socket[i])) {
+		fprintf(stderr, " alerting client %s\n", finished_acal_job->client_id);
+		client_response.response_type = (finished_acal_job->computed ?
+						 RESPONSE_ACAL_COMPUTED :
+						 RESPONSE_ACAL_REQUEST_INVALID);
+		strncpy(client_response.client_id, finished_acal_job->client_id,
+			CLIENTIDLENGTH);
+		MALLOC(send_buffer, RPSENDBUFSIZE);
+		init_cmp_memory_buffer(&cmp, &mem, send_buffer, RPSENDBUFSIZE);
+		pack_responses(&cmp, &client_response);
+		if (finished_acal_job->computed) {
+		  // Send the new options with the modifiers.
+		  pack_write_sint(&cmp, finished_acal_job->n_client_options);
+		  for (j = 0; j < finished_acal_job->n_client_options; j++) {
+		    pack_ampphase_options(&cmp, finished_acal_job->client_options[j]);
+		  }
+		  // Tell them which index was modified.
+		  pack_write_sint(&cmp, finished_acal_job->options_idx);
+		  // And send the flux density models.
+		  pack_fluxdensity_specification(&cmp, &(finished_acal_job->fd_spec));
+		}
+		printf(" %s to client %s.\n",
+		       get_type_string(TYPE_RESPONSE, client_response.response_type),
+		       finished_acal_job->client_id);
+		bytes_sent = socket_send_buffer(alert_socket[i], send_buffer,
+						cmp_mem_access_get_pos(&mem));
+		FREE(send_buffer);
+	      }
+	    }
+	    FREE(alert_socket);
+	    n_alert_sockets = 0;
+	    // Start the next job that's waiting.
+	    acal_jobs = finished_acal_job->next;
+	    free_acal_job(finished_acal_job);
+	    if (acal_jobs != NULL) {
+	      start_acal_job(acal_jobs);
+	    }
+	  } else if (loop_i == socket_listen) {
             client_len = sizeof(client_address);
             socket_client = accept(socket_listen,
                                    (struct sockaddr*)&client_address,
@@ -2459,8 +5268,8 @@ int main(int argc, char *argv[]) {
 	      n_client_options = 0;
 	      n_alert_sockets = 0;
             } else if (client_request.request_type == REQUEST_SERVERTYPE) {
-              // Tell the client we're a simulator or a tester, depending on how
-              // we were started.
+              // Tell the client we're a simulator, a correlator or a tester,
+              // depending on how we were started.
               client_response.response_type = RESPONSE_SERVERTYPE;
               strncpy(client_response.client_id, client_request.client_id, CLIENTIDLENGTH);
               MALLOC(send_buffer, JUSTRESPONSESIZE);
@@ -2468,6 +5277,8 @@ int main(int argc, char *argv[]) {
               pack_responses(&cmp, &client_response);
               if (arguments.testing_operation) {
                 pack_write_sint(&cmp, SERVERTYPE_TESTING);
+              } else if (arguments.follow_operation) {
+                pack_write_sint(&cmp, SERVERTYPE_CORRELATOR);
               } else {
                 pack_write_sint(&cmp, SERVERTYPE_SIMULATOR);
               }
@@ -2810,304 +5621,94 @@ int main(int argc, char *argv[]) {
 		  outside_mjd_range = true;
 		}
 	      }
+	      acal_started = false;
 	      if ((outside_mjd_range == false) && (n_acal_cycles > 0)) {
-		// We're going to fork and compute in the background.
-		pid = fork();
-	      } else {
-		pid = 1;
-	      }
-	      if (pid == 0) {
-		// We're the child.
-		// First close our sockets.
-		CLOSESOCKET(socket_listen);
-		CLOSESOCKET(loop_i);
-		printf("CHILD STARTED! Calculating acal parameters...\n");
-		// Keep a copy of the options to send later.
-		n_copied_options = n_client_options;
-		MALLOC(copied_options, n_client_options);
-		for (i = 0; i < n_copied_options; i++) {
-		  CALLOC(copied_options[i], 1);
+		// The cycles are read and the amplitudes computed by a thread,
+		// so we can keep answering other clients in the meantime.
+		CALLOC(new_acal_job, 1);
+		strncpy(new_acal_job->client_id, client_request.client_id, CLIENTIDLENGTH);
+		new_acal_job->n_rpfits_files = arguments.n_rpfits_files;
+		new_acal_job->info_rpfits_files = info_rpfits_files;
+		new_acal_job->mjd_low = arguments.minimum_read_mjd;
+		new_acal_job->mjd_high = arguments.maximum_read_mjd;
+		// Keep a copy of the options to label the cache entries.
+		new_acal_job->n_copied_options = n_client_options;
+		MALLOC(new_acal_job->copied_options, n_client_options);
+		for (i = 0; i < n_client_options; i++) {
+		  CALLOC(new_acal_job->copied_options[i], 1);
 		  // Set the options to have no Tsys calibration applied.
 		  client_options[i]->systemp_reverse_online = true;
 		  client_options[i]->systemp_apply_computed = false;
-		  copy_ampphase_options(copied_options[i], client_options[i]);
-		}
-		printf(" Getting %d cycles:\n", n_acal_cycles);
-		for (i = 0; i < n_acal_cycles; i++) {
-		  printf("   MJD %.6f\n", acal_cycle_mjds[i]);
-		}
-		// Get the cycles.
-		data_reader(GRAB_MJDS_SPECTRA, arguments.n_rpfits_files, -1,
-			    arguments.minimum_read_mjd, arguments.maximum_read_mjd,
-			    n_acal_cycles, acal_cycle_mjds, &n_client_options,
-			    &client_options, info_rpfits_files,
-			    NULL, NULL, &acal_spectra);
-		printf(" Data obtained, computing parameters...\n");
-		// And compute the amplitude calibration parameters.
-		if (n_acal_fluxdensities <= 0) {
-		  acal_source =
-		    acal_spectra[0]->header_data->source_name[acal_spectra[0]->spectrum[0][0]->source_no];
-		  // We make a very simplistic flux density specifier here, but this will
-		  // need to be changed when we want to move to a better method of acal.
-		  // We do this now to match how CABB acal works.
-		  fd_spec.num_models = acal_spectra[0]->num_ifs;
-		} else {
-		  // We use the numbers that came along with the request.
-		  fd_spec.num_models = n_acal_fluxdensities;
-		}
-		/* printf(" Working with %d flux density models\n", fd_spec.num_models); */
-		CALLOC(fd_spec.model_frequency, fd_spec.num_models);
-		CALLOC(fd_spec.model_frequency_tolerance, fd_spec.num_models);
-		CALLOC(fd_spec.model_num_terms, fd_spec.num_models);
-		CALLOC(fd_spec.model_terms, fd_spec.num_models);
-		// Find the correct set of options.
-		spectrum_options = find_ampphase_options(n_client_options,
-							 client_options,
-							 acal_spectra[0]->header_data,
-							 &acal_options_idx);
-		if (n_acal_fluxdensities > 0) {
-		  j = 0;
-		  for (i = 0; i < n_acal_fluxdensities; i++) {
-		    // We find the next available continuum band.
-		    for (k = j; k < acal_spectra[0]->num_ifs; k++) {
-		      if (acal_spectra[0]->header_data->if_bandwidth[k] > 1000) {
-			j = k + 1;
-			fd_spec.model_frequency[i] =
-			  acal_spectra[0]->header_data->if_centre_freq[k];
-			fd_spec.model_frequency_tolerance[i] =
-			  acal_spectra[0]->header_data->if_bandwidth[k] / 2;
-			break;
-		      }
-		    }
-		    fd_spec.model_num_terms[i] = 1;
-		    CALLOC(fd_spec.model_terms[i], fd_spec.model_num_terms[i]);
-		    fd_spec.model_terms[i][0] = acal_fluxdensities[i];
-		  }
-		}
-		for (i = 0; i < acal_spectra[0]->num_ifs; i++) {
-		  // Find the correct window number.
-		  acal_window = acal_spectra[0]->header_data->if_label[i];
-		  if (n_acal_fluxdensities == 0) {
-		    // Work out the correct flux density to use.
-		    acal_source_recognised =
-		      source_model(acal_source,
-				   acal_spectra[0]->header_data->if_centre_freq[i],
-				   &acal_model_num_terms, &acal_model_log,
-				   &acal_model_terms);
-		    fd_spec.model_frequency[i] = acal_spectra[0]->header_data->if_centre_freq[i];
-		    fd_spec.model_frequency_tolerance[i] =
-		      acal_spectra[0]->header_data->if_bandwidth[i] / 2;
-		    fd_spec.model_num_terms[i] = 1;
-		    REALLOC(fd_spec.model_terms[i], fd_spec.model_num_terms[i]);
-		    if (acal_source_recognised) {
-		      acal_fd =
-			fluxdensity_model_evaluate(acal_model_num_terms, acal_model_log,
-						   acal_model_terms,
-						   acal_spectra[0]->header_data->if_centre_freq[i]);
-		      fd_spec.model_terms[i][0] = acal_fd;
-		    } else {
-		      fd_spec.model_terms[i][0] = 1;
-		    }
-		  }
-		  compute_noise_diode_amplitudes(&fd_spec, n_acal_cycles, acal_window,
-						 spectrum_options,
-						 acal_spectra, &fd_modifier);
-		  // Attach the modifier to the options now.
-		  add_modifier(spectrum_options, acal_window, fd_modifier);
-		  free_ampphase_modifiers(fd_modifier);
-		  FREE(fd_modifier);
-		}
-		
-		// We send the data back to our parent over the network.
-		if (prepare_client_connection("127.0.0.1", arguments.port_number,
-					      &child_socket, false)) {
-		  // We have a connection.
-		  child_request.request_type = CHILDREQUEST_MJDS_SPECTRA;
-		  strncpy(child_request.client_id, client_request.client_id, CLIENTIDLENGTH);
-		  strncpy(child_request.client_username, client_request.client_username,
-			  CLIENTIDLENGTH);
-		  child_request.client_type = CLIENTTYPE_CHILD;
-		  MALLOC(child_send_buffer, RPSENDBUFSIZE);
-		  init_cmp_memory_buffer(&child_cmp, &child_mem, child_send_buffer,
-					 (size_t)RPSENDBUFSIZE);
-		  pack_requests(&child_cmp, &child_request);
-		  // Send the original options back for caching.
-		  pack_write_sint(&child_cmp, n_copied_options);
-		  for (i = 0; i < n_copied_options; i++) {
-		    pack_ampphase_options(&child_cmp, copied_options[i]);
-		  }
-		  // Send back the new options with the modifiers.
-		  pack_write_sint(&child_cmp, n_client_options);
-		  for (i = 0; i < n_client_options; i++) {
-		    pack_ampphase_options(&child_cmp, client_options[i]);
-		  }
-		  // Specify the index of the options we modified.
-		  pack_write_sint(&child_cmp, acal_options_idx);
-		  // Send back the flux density specification for the user.
-		  pack_fluxdensity_specification(&child_cmp, &fd_spec);
-		  // Pack the MJDs of each of the data grabs. We send the grabs back so
-		  // they can be cached.
-		  pack_write_sint(&child_cmp, n_acal_cycles);
-		  pack_writearray_double(&child_cmp, n_acal_cycles, acal_cycle_mjds);
-		  for (i = 0; i < n_acal_cycles; i++) {
-		    pack_spectrum_data(&child_cmp, acal_spectra[i]);
-		  }
-		  printf("[CHILD] %s for client %s.\n",
-			 get_type_string(TYPE_REQUEST, child_request.request_type),
-			 client_request.client_id);
-		  bytes_sent = socket_send_buffer(child_socket, child_send_buffer,
-						  cmp_mem_access_get_pos(&child_mem));
-		  FREE(child_send_buffer);
-		}
-		// Don't bother with the response.
-		CLOSESOCKET(child_socket);
-		// Clean up.
-		for (i = 0; i < n_client_options; i++) {
-		  free_ampphase_options(client_options[i]);
-		  FREE(client_options[i]);
+		  copy_ampphase_options(new_acal_job->copied_options[i], client_options[i]);
 		}
-		FREE(client_options);
-		for (i = 0; i < n_copied_options; i++) {
-		  free_ampphase_options(copied_options[i]);
-		  FREE(copied_options[i]);
-		}
-		free_fluxdensity_specification(&fd_spec);
-		// Die.
-		printf("CHILD IS FINISHED!\n");
-		exit(0);
-	      } else {
-		// Free the memory we used.
-		for (i = 0; i < n_client_options; i++) {
-		  free_ampphase_options(client_options[i]);
-		  FREE(client_options[i]);
-		}
-		FREE(client_options);
+		// The job takes over the rest of the request.
+		new_acal_job->n_client_options = n_client_options;
+		new_acal_job->client_options = client_options;
 		n_client_options = 0;
-		FREE(acal_cycle_mjds);
+		client_options = NULL;
+		new_acal_job->n_cycles = n_acal_cycles;
+		new_acal_job->cycle_mjds = acal_cycle_mjds;
 		n_acal_cycles = 0;
-		FREE(acal_fluxdensities);
+		acal_cycle_mjds = NULL;
+		new_acal_job->n_fluxdensities = n_acal_fluxdensities;
+		new_acal_job->fluxdensities = acal_fluxdensities;
 		n_acal_fluxdensities = 0;
-		if (pid == 1) {
-		  // Return an error code.
-		  client_response.response_type = RESPONSE_ACAL_REQUEST_INVALID;
-		} else {
-		  client_response.response_type = RESPONSE_ACAL_COMPUTING;
-		}
-		strncpy(client_response.client_id, client_request.client_id, CLIENTIDLENGTH);
-		comp_buffer_length = JUSTRESPONSESIZE;
-		MALLOC(send_buffer, comp_buffer_length);
-		init_cmp_memory_buffer(&cmp, &mem, send_buffer, comp_buffer_length);
-		pack_responses(&cmp, &client_response);
-		printf(" %s to client %s.\n",
-		       get_type_string(TYPE_RESPONSE, client_response.response_type),
-		       client_response.client_id);
-		bytes_sent = socket_send_buffer(loop_i, send_buffer,
-						cmp_mem_access_get_pos(&mem));
-		FREE(send_buffer);
-	      }
-	    } else if (client_request.request_type == CHILDREQUEST_MJDS_SPECTRA) {
-	      // Receive some information coming back from an acal request.
-	      // Free the current client ampphase options.
-	      for (i = 0; i < n_client_options; i++) {
-		free_ampphase_options(client_options[i]);
-		FREE(client_options[i]);
-	      }
-	      FREE(client_options);
-	      n_client_options = 0;
-	      for (i = 0; i < n_copied_options; i++) {
-		free_ampphase_options(copied_options[i]);
-		FREE(copied_options[i]);
-	      }
-	      FREE(copied_options);
-	      n_copied_options = 0;
-	      // Read the original options now to label the cache.
-	      pack_read_sint(&cmp, &n_copied_options);
-	      MALLOC(copied_options, n_copied_options);
-	      for (i = 0; i < n_copied_options; i++) {
-		CALLOC(copied_options[i], 1);
-		unpack_ampphase_options(&cmp, copied_options[i]);
-	      }
-	      // And read the new client options now.
-	      pack_read_sint(&cmp, &n_client_options);
-	      MALLOC(client_options, n_client_options);
-	      for (i = 0; i < n_client_options; i++) {
-		CALLOC(client_options[i], 1);
-		unpack_ampphase_options(&cmp, client_options[i]);
-	      }
-	      // Read the index of the modified options.
-	      pack_read_sint(&cmp, &acal_options_idx);
-	      // Get the flux density specification.
-	      unpack_fluxdensity_specification(&cmp, &fd_spec);
-	      // Unpack the MJDs of each of the cycles that were requested, as
-	      // we will cache them for later use.
-	      pack_read_sint(&cmp, &n_acal_cycles);
-	      CALLOC(acal_cycle_mjds, n_acal_cycles);
-	      pack_readarray_double(&cmp, n_acal_cycles, acal_cycle_mjds);
-	      for (i = 0; i < n_acal_cycles; i++) {
-		unpack_spectrum_data(&cmp, spectrum_data);
-		spd_cache_updated = add_cache_spd_data(n_copied_options,
-						       copied_options, spectrum_data);
-		if (spd_cache_updated == false) {
-		  // The unpacked data can be freed.
-		  free_scan_header_data(spectrum_data->header_data);
-		  FREE(spectrum_data->header_data);
-		  free_spectrum_data(spectrum_data);
+		acal_fluxdensities = NULL;
+		new_acal_job->notify_fd = acal_pipe[1];
+		printf(" Getting %d cycles:\n", new_acal_job->n_cycles);
+		// The thread can't look in the spectrum cache while we might be
+		// adding to it, so the cycles that are already there are found now.
+		CALLOC(new_acal_job->spectra, new_acal_job->n_cycles);
+		for (i = 0; i < new_acal_job->n_cycles; i++) {
+		  get_cache_spd_data(new_acal_job->n_client_options,
+				     new_acal_job->client_options,
+				     new_acal_job->cycle_mjds[i], (mjd_cycletime / 2.0),
+				     &(new_acal_job->spectra[i]));
+		  printf("   MJD %.6f%s\n", new_acal_job->cycle_mjds[i],
+			 ((new_acal_job->spectra[i] != NULL) ? " (cached)" : ""));
 		}
-	      }
-	      // Tell the client their acal information is ready.
-	      // Find the client's socket.
-	      find_client(&clients, client_request.client_id, "",
-			  &n_alert_sockets, &alert_socket, NULL);
-	      for (i = 0; i < n_alert_sockets; i++) {
-		if (ISVALIDSOCKET(alert_socket[i])) {
-		  fprintf(stderr, " alerting client %s\n", client_request.client_id);
-		  client_response.response_type = RESPONSE_ACAL_COMPUTED;
-		  strncpy(client_response.client_id, client_request.client_id,
-			  CLIENTIDLENGTH);
-		  MALLOC(send_buffer, RPSENDBUFSIZE);
-		  init_cmp_memory_buffer(&cmp, &mem, send_buffer, RPSENDBUFSIZE);
-		  pack_responses(&cmp, &client_response);
-		  /* fprintf(stderr, "  response header packed\n"); */
-		  // Send the new options with the modifiers.
-		  pack_write_sint(&cmp, n_client_options);
-		  /* fprintf(stderr, "  client option number %d packed\n", n_client_options); */
-		  for (j = 0; j < n_client_options; j++) {
-		    fprintf(stderr, "   ... %d\n", j);
-		    pack_ampphase_options(&cmp, client_options[j]);
+		// Only one job runs at a time, and the others wait their turn.
+		if (acal_jobs == NULL) {
+		  acal_jobs = new_acal_job;
+		  start_acal_job(new_acal_job);
+		} else {
+		  last_acal_job = acal_jobs;
+		  while (last_acal_job->next != NULL) {
+		    last_acal_job = last_acal_job->next;
 		  }
-		  /* fprintf(stderr, "  all options packed\n"); */
-		  // Tell them which index was modified.
-		  /* fprintf(stderr, "  packing options index %d\n", acal_options_idx); */
-		  pack_write_sint(&cmp, acal_options_idx);
-		  // And send the flux density models.
-		  pack_fluxdensity_specification(&cmp, &fd_spec);
-		  printf(" %s to client %s.\n",
-			 get_type_string(TYPE_RESPONSE, client_response.response_type),
-			 client_request.client_id);
-		  bytes_sent = socket_send_buffer(alert_socket[i], send_buffer,
-						  cmp_mem_access_get_pos(&mem));
-		  FREE(send_buffer);
+		  last_acal_job->next = new_acal_job;
 		}
+		new_acal_job = NULL;
+		acal_started = true;
 	      }
-	      FREE(alert_socket);
-	      n_alert_sockets = 0;
-	      // Free the options again.
+	      FREE(acal_cycle_mjds);
+	      n_acal_cycles = 0;
+	      FREE(acal_fluxdensities);
+	      n_acal_fluxdensities = 0;
+	      if (acal_started == false) {
+		// Return an error code.
+		client_response.response_type = RESPONSE_ACAL_REQUEST_INVALID;
+	      } else {
+		client_response.response_type = RESPONSE_ACAL_COMPUTING;
+	      }
+	      strncpy(client_response.client_id, client_request.client_id, CLIENTIDLENGTH);
+	      comp_buffer_length = JUSTRESPONSESIZE;
+	      MALLOC(send_buffer, comp_buffer_length);
+	      init_cmp_memory_buffer(&cmp, &mem, send_buffer, comp_buffer_length);
+	      pack_responses(&cmp, &client_response);
+	      printf(" %s to client %s.\n",
+		     get_type_string(TYPE_RESPONSE, client_response.response_type),
+		     client_response.client_id);
+	      bytes_sent = socket_send_buffer(loop_i, send_buffer,
+					      cmp_mem_access_get_pos(&mem));
+	      FREE(send_buffer);
+	      // Free the memory we used.
 	      for (i = 0; i < n_client_options; i++) {
 		free_ampphase_options(client_options[i]);
 		FREE(client_options[i]);
 	      }
 	      FREE(client_options);
 	      n_client_options = 0;
-	      for (i = 0; i < n_copied_options; i++) {
-		free_ampphase_options(copied_options[i]);
-		FREE(copied_options[i]);
-	      }
-	      FREE(copied_options);
-	      n_copied_options = 0;
-	      // And free the other received memory.
-	      FREE(acal_cycle_mjds);
-	      n_acal_cycles = 0;
-	      free_fluxdensity_specification(&fd_spec);
 	    }
             printf(" Sent %ld bytes\n", bytes_sent);
 
@@ -3174,6 +5775,16 @@ int main(int argc, char *argv[]) {
         }
       }
     }
+
+    // Wait for the acal job that's running, and drop any still waiting.
+    while (acal_jobs != NULL) {
+      finished_acal_job = acal_jobs;
+      acal_jobs = acal_jobs->next;
+      finish_acal_job(finished_acal_job, arguments.n_rpfits_files, info_rpfits_files);
+      free_acal_job(finished_acal_job);
+    }
+    close(acal_pipe[0]);
+    close(acal_pipe[1]);
   }
   // Free the vis cache.
   for (l = 0; l < cache_vis_data.num_cache_vis_data; l++) {
@@ -3270,6 +5881,7 @@ int main(int argc, char *argv[]) {
 	free_scan_header_data(info_rpfits_files[i]->scan_headers[j]);
 	FREE(info_rpfits_files[i]->scan_headers[j]);
 	FREE(info_rpfits_files[i]->cycle_mjd[j]);
+	FREE(info_rpfits_files[i]->cycle_offset[j]);
       }
     }
     FREE(info_rpfits_files[i]->scan_headers);
@@ -3277,6 +5889,8 @@ int main(int argc, char *argv[]) {
     FREE(info_rpfits_files[i]->scan_end_mjd);
     FREE(info_rpfits_files[i]->n_cycles);
     FREE(info_rpfits_files[i]->cycle_mjd);
+    FREE(info_rpfits_files[i]->scan_offset);
+    FREE(info_rpfits_files[i]->cycle_offset);
     FREE(info_rpfits_files[i]);
   }
   FREE(info_rpfits_files);
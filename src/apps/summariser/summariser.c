@@ -115,6 +115,7 @@ int main(int argc, char *argv[]) {
   char sourcename[SBUFSIZE], scantype[BUFSIZE], antname[SBUFSIZE];
   struct scan_data *scan_data = NULL, **all_scans = NULL;
   struct cycle_data *cycle_data = NULL;
+  struct rpfits_file *rpfits_file = NULL;
   struct summariser_arguments arguments;
   struct ampphase_options **ampphase_options = NULL;
   struct array_information *array_information = NULL;
@@ -135,12 +136,15 @@ int main(int argc, char *argv[]) {
   
   for (k = 0; k < arguments.n_rpfits_files; k++) {
     // Try to open the RPFITS file.
-    res = open_rpfits_file(arguments.rpfits_files[k]);
+    res = open_rpfits_file(arguments.rpfits_files[k], &rpfits_file);
     if (arguments.verbosity >= VERBOSITY_NORMAL) {
       snprintf(emsg, SBUFSIZE, " error code %d", res);
       printf("RPFITS file %s: %s\n", arguments.rpfits_files[k],
 	     ((res == 0) ? "OK" : emsg));
     }
+    if (res) {
+      continue;
+    }
     keep_reading = 1;
     while (keep_reading) {
       // Make a new scan and add it to the list.
@@ -149,7 +153,7 @@ int main(int argc, char *argv[]) {
       ARRAY_APPEND(all_scans, nscans, scan_data);
 
       // Read in the scan header.
-      read_response = read_scan_header(&(scan_data->header_data));
+      read_response = read_scan_header(rpfits_file, &(scan_data->header_data));
       if (arguments.verbosity >= VERBOSITY_NORMAL) {
 	seconds_to_hourlabel(scan_data->header_data.ut_seconds, emsg);
 	printf("\n\nScan %d at %s %s\n", nscans,
@@ -249,7 +253,7 @@ int main(int argc, char *argv[]) {
 	//ampphase_options = ampphase_options_default();
 	while (read_cycle) {
 	  cycle_data = scan_add_cycle(scan_data);
-	  read_response = read_cycle_data(&(scan_data->header_data),
+	  read_response = read_cycle_data(rpfits_file, &(scan_data->header_data),
 					  cycle_data);
 	  // Compute the system temperatures.
 	  calculate_system_temperatures_cycle_data(cycle_data, &(scan_data->header_data),
@@ -308,7 +312,8 @@ int main(int argc, char *argv[]) {
     }
 
     // Close it before moving on.
-    res = close_rpfits_file();
+    res = close_rpfits_file(rpfits_file);
+    rpfits_file = NULL;
     printf("Attempt to close RPFITS file, %d\n", res);
   }
 
@@ -255,6 +255,7 @@ int main(int argc, char *argv[]) {
   int global_max_cycletime = 0;
   struct scan_data *scan_data = NULL, **all_scans = NULL;
   struct cycle_data *cycle_data = NULL;
+  struct rpfits_file *rpfits_file = NULL;
   struct ampphase ***cycle_ampphase = NULL;
   struct vis_quantities ****cycle_vis_quantities = NULL;
   char defselect[BUFSIZE];
@@ -370,8 +371,11 @@ int main(int argc, char *argv[]) {
   nviscycle = 0;
   for (i = 0; i < arguments.n_rpfits_files; i++) {
     // Try to open the RPFITS file.
-    res = open_rpfits_file(arguments.rpfits_files[i]);
+    res = open_rpfits_file(arguments.rpfits_files[i], &rpfits_file);
     printf("Attempt to open RPFITS file %s, %d\n", arguments.rpfits_files[i], res);
+    if (res) {
+      continue;
+    }
     keep_reading = 1;
     while (keep_reading) {
       // Make a new scan and add it to the list.
@@ -380,7 +384,7 @@ int main(int argc, char *argv[]) {
       ARRAY_APPEND(all_scans, nscans, scan_data);
 
       // Read in the scan header.
-      read_response = read_scan_header(&(scan_data->header_data));
+      read_response = read_scan_header(rpfits_file, &(scan_data->header_data));
       // Adjust the number of IFs.
       num_ifs = (scan_data->header_data.num_ifs < arguments.nifs) ?
         scan_data->header_data.num_ifs : arguments.nifs;
@@ -405,7 +409,7 @@ int main(int argc, char *argv[]) {
         while (read_cycle) {
           //printf("reading cycle\n");
           cycle_data = scan_add_cycle(scan_data);
-          read_response = read_cycle_data(&(scan_data->header_data),
+          read_response = read_cycle_data(rpfits_file, &(scan_data->header_data),
                                           cycle_data);
           /* fprintf(stderr, "found read response %d\n", read_response); */
           /* printf("cycle has %d points\n", cycle_data->num_points); */
@@ -534,7 +538,8 @@ int main(int argc, char *argv[]) {
     old_num_ifs = 0;
     
     // Close it before moving on.
-    res = close_rpfits_file();
+    res = close_rpfits_file(rpfits_file);
+    rpfits_file = NULL;
     printf("Attempt to close RPFITS file, %d\n", res);
 
   }
@@ -180,6 +180,16 @@ struct requests {
 #define RESPONSE_ACAL_COMPUTING         19
 #define RESPONSE_ACAL_REQUEST_INVALID   20
 #define RESPONSE_ACAL_COMPUTED          21
+/*! \def RESPONSE_APPENDED_VISDATA
+ *  \brief The server has read new cycles from the file it is following, and
+ *         is supplying the vis data for only those new cycles
+ *
+ * This response is sent without being requested, and is followed by the
+ * options used to compute the data, and then the data, just like with
+ * RESPONSE_COMPUTED_VISDATA. The client should add these cycles to the end of
+ * the data it already has.
+ */
+#define RESPONSE_APPENDED_VISDATA       22
 
 /*! \struct responses
  *  \brief Structure to use when responding to a request
@@ -117,6 +117,29 @@ void pack_write_sint(cmp_ctx_t *cmp, int value) {
   if (!cmp_write_sint(cmp, value)) CMPERROR(cmp);
 }
 
+// Long signed integer.
+// Reader.
+/*!
+ *  \brief Read a long signed integer value from the data stream
+ *  \param cmp the CMP stream
+ *  \param value a pointer to the variable in which the value read from the
+ *               stream will be stored
+ */
+void pack_read_slong(cmp_ctx_t *cmp, long *value) {
+  int64_t v;
+  if (!cmp_read_sinteger(cmp, &v)) CMPERROR(cmp);
+  *value = (long)v;
+}
+// Writer.
+/*!
+ *  \brief Write a long signed integer value into the data stream
+ *  \param cmp the CMP stream
+ *  \param value the value to encode into the stream
+ */
+void pack_write_slong(cmp_ctx_t *cmp, long value) {
+  if (!cmp_write_sint(cmp, (int64_t)value)) CMPERROR(cmp);
+}
+
 // Unsigned integer.
 // Reader.
 /*!
@@ -384,6 +407,43 @@ void pack_writearray_sint(cmp_ctx_t *cmp, unsigned int length,
   }
 }
 
+// Unsigned integer.
+// Reader.
+/*!
+ *  \brief Read an array of unsigned integer values from the data stream
+ *  \param cmp the CMP stream
+ *  \param expected_length the number of elements to read from the array
+ *  \param array a pointer to the variable in which the \a expected_length values
+ *               will be stored; the variable must already be allocated to the
+ *               required size
+ */
+void pack_readarray_uint(cmp_ctx_t *cmp, unsigned int expected_length,
+                         unsigned int *array) {
+  unsigned int i;
+  pack_readarray_checksize(cmp, expected_length);
+
+  for (i = 0; i < expected_length; i++) {
+    pack_read_uint(cmp, &(array[i]));
+  }
+}
+// Writer.
+/*!
+ *  \brief Write an array of unsigned integer values into the data stream
+ *  \param cmp the CMP stream
+ *  \param length the number of elements to write
+ *  \param array a pointer to the variable from which the \a expected_length
+ *               values will be read
+ */
+void pack_writearray_uint(cmp_ctx_t *cmp, unsigned int length,
+                          unsigned int *array) {
+  unsigned int i;
+  CMPW_ARRAYINIT(cmp, length);
+
+  for (i = 0; i < length; i++) {
+    pack_write_uint(cmp, array[i]);
+  }
+}
+
 // String.
 // Reader.
 /*!
@@ -589,7 +649,6 @@ void unpack_ampphase_options(cmp_ctx_t *cmp, struct ampphase_options *a) {
 
 void pack_ampphase(cmp_ctx_t *cmp, struct ampphase *a) {
   // This routine takes an ampphase structure and packs it for transport.
-  int i, j;
   // The number of quantities in each array.
   pack_write_sint(cmp, a->nchannels);
   pack_write_sint(cmp, a->nbaselines);
@@ -611,36 +670,19 @@ void pack_ampphase(cmp_ctx_t *cmp, struct ampphase *a) {
   // The bin arrays have one element per baseline.
   pack_writearray_sint(cmp, a->nbaselines, a->nbins);
 
-  // The flag array has the indexing:
-  // array[baseline][bin]
-  for (i = 0; i < a->nbaselines; i++) {
-    pack_writearray_sint(cmp, a->nbins[i], a->flagged_bad[i]);
-  }
-
-  // The arrays here have the following indexing.
-  // array[baseline][bin][channel]
-  for (i = 0; i < a->nbaselines; i++) {
-    for (j = 0; j < a->nbins[i]; j++) {
-      pack_writearray_float(cmp, a->nchannels, a->weight[i][j]);
-      pack_writearray_float(cmp, a->nchannels, a->amplitude[i][j]);
-      pack_writearray_float(cmp, a->nchannels, a->phase[i][j]);
-      pack_writearray_floatcomplex(cmp, a->nchannels, a->raw[i][j]);
-    }
-  }
+  // Each of the baseline and bin arrays is stored in a single block, so
+  // each one goes out as a single array, with the spectra ordered by
+  // baseline and then by bin.
+  pack_writearray_sint(cmp, a->nspectra, a->flagged_bad_block);
+  pack_writearray_float(cmp, a->nspectra * a->nchannels, a->weight_block);
+  pack_writearray_float(cmp, a->nspectra * a->nchannels, a->amplitude_block);
+  pack_writearray_float(cmp, a->nspectra * a->nchannels, a->phase_block);
+  pack_writearray_floatcomplex(cmp, a->nspectra * a->nchannels, a->raw_block);
 
-  // These next arrays contain the same data as above, but
-  // do not include the flagged channels.
-  for (i = 0; i < a->nbaselines; i++) {
-    for (j = 0; j < a->nbins[i]; j++) {
-      pack_write_sint(cmp, a->f_nchannels[i][j]);
-      pack_writearray_float(cmp, a->f_nchannels[i][j], a->f_channel[i][j]);
-      pack_writearray_float(cmp, a->f_nchannels[i][j], a->f_frequency[i][j]);
-      pack_writearray_float(cmp, a->f_nchannels[i][j], a->f_weight[i][j]);
-      pack_writearray_float(cmp, a->f_nchannels[i][j], a->f_amplitude[i][j]);
-      pack_writearray_float(cmp, a->f_nchannels[i][j], a->f_phase[i][j]);
-      pack_writearray_floatcomplex(cmp, a->f_nchannels[i][j], a->f_raw[i][j]);
-    }
-  }
+  // The good channels in each spectrum are marked in its mask.
+  pack_writearray_sint(cmp, a->nspectra, a->f_nchannels_block);
+  pack_writearray_uint(cmp, a->nspectra * AMPPHASE_MASK_WORDS(a->nchannels),
+		       a->valid_block);
 
   // Some metadata.
   pack_write_float(cmp, a->min_amplitude_global);
@@ -664,7 +706,6 @@ void pack_ampphase(cmp_ctx_t *cmp, struct ampphase *a) {
 void unpack_ampphase(cmp_ctx_t *cmp, struct ampphase *a) {
   // This routine unpacks an ampphase structure from the
   // serializer and stores it in the passed structure.
-  int i, j;
   // The number of quantities in each array.
   pack_read_sint(cmp, &(a->nchannels));
   pack_read_sint(cmp, &(a->nbaselines));
@@ -690,71 +731,18 @@ void unpack_ampphase(cmp_ctx_t *cmp, struct ampphase *a) {
   MALLOC(a->nbins, a->nbaselines);
   pack_readarray_sint(cmp, a->nbaselines, a->nbins);
 
-  // The flag array has the indexing:
-  // array[baseline][bin]
-  MALLOC(a->flagged_bad, a->nbaselines);
-  for (i = 0; i < a->nbaselines; i++) {
-    MALLOC(a->flagged_bad[i], a->nbins[i]);
-    pack_readarray_sint(cmp, a->nbins[i], a->flagged_bad[i]);
-  }
-
-  // The arrays here have the following indexing.
-  // array[baseline][bin][channel]
-  MALLOC(a->weight, a->nbaselines);
-  MALLOC(a->amplitude, a->nbaselines);
-  MALLOC(a->phase, a->nbaselines);
-  MALLOC(a->raw, a->nbaselines);
-  for (i = 0; i < a->nbaselines; i++) {
-    MALLOC(a->weight[i], a->nbins[i]);
-    MALLOC(a->amplitude[i], a->nbins[i]);
-    MALLOC(a->phase[i], a->nbins[i]);
-    MALLOC(a->raw[i], a->nbins[i]);
-    for (j = 0; j < a->nbins[i]; j++) {
-      MALLOC(a->weight[i][j], a->nchannels);
-      pack_readarray_float(cmp, a->nchannels, a->weight[i][j]);
-      MALLOC(a->amplitude[i][j], a->nchannels);
-      pack_readarray_float(cmp, a->nchannels, a->amplitude[i][j]);
-      MALLOC(a->phase[i][j], a->nchannels);
-      pack_readarray_float(cmp, a->nchannels, a->phase[i][j]);
-      MALLOC(a->raw[i][j], a->nchannels);
-      pack_readarray_floatcomplex(cmp, a->nchannels, a->raw[i][j]);
-    }
-  }
+  // The baseline and bin arrays each come as a single array.
+  allocate_ampphase_spectra(a);
+  pack_readarray_sint(cmp, a->nspectra, a->flagged_bad_block);
+  pack_readarray_float(cmp, a->nspectra * a->nchannels, a->weight_block);
+  pack_readarray_float(cmp, a->nspectra * a->nchannels, a->amplitude_block);
+  pack_readarray_float(cmp, a->nspectra * a->nchannels, a->phase_block);
+  pack_readarray_floatcomplex(cmp, a->nspectra * a->nchannels, a->raw_block);
 
-  
-  // These next arrays contain the same data as above, but
-  // do not include the flagged channels.
-  MALLOC(a->f_nchannels, a->nbaselines);
-  MALLOC(a->f_channel, a->nbaselines);
-  MALLOC(a->f_frequency, a->nbaselines);
-  MALLOC(a->f_weight, a->nbaselines);
-  MALLOC(a->f_amplitude, a->nbaselines);
-  MALLOC(a->f_phase, a->nbaselines);
-  MALLOC(a->f_raw, a->nbaselines);
-  for (i = 0; i < a->nbaselines; i++) {
-    MALLOC(a->f_nchannels[i], a->nbins[i]);
-    MALLOC(a->f_channel[i], a->nbins[i]);
-    MALLOC(a->f_frequency[i], a->nbins[i]);
-    MALLOC(a->f_weight[i], a->nbins[i]);
-    MALLOC(a->f_amplitude[i], a->nbins[i]);
-    MALLOC(a->f_phase[i], a->nbins[i]);
-    MALLOC(a->f_raw[i], a->nbins[i]);
-    for (j = 0; j < a->nbins[i]; j++) {
-      pack_read_sint(cmp, &(a->f_nchannels[i][j]));
-      MALLOC(a->f_channel[i][j], a->f_nchannels[i][j]);
-      pack_readarray_float(cmp, a->f_nchannels[i][j], a->f_channel[i][j]);
-      MALLOC(a->f_frequency[i][j], a->f_nchannels[i][j]);
-      pack_readarray_float(cmp, a->f_nchannels[i][j], a->f_frequency[i][j]);
-      MALLOC(a->f_weight[i][j], a->f_nchannels[i][j]);
-      pack_readarray_float(cmp, a->f_nchannels[i][j], a->f_weight[i][j]);
-      MALLOC(a->f_amplitude[i][j], a->f_nchannels[i][j]);
-      pack_readarray_float(cmp, a->f_nchannels[i][j], a->f_amplitude[i][j]);
-      MALLOC(a->f_phase[i][j], a->f_nchannels[i][j]);
-      pack_readarray_float(cmp, a->f_nchannels[i][j], a->f_phase[i][j]);
-      MALLOC(a->f_raw[i][j], a->f_nchannels[i][j]);
-      pack_readarray_floatcomplex(cmp, a->f_nchannels[i][j], a->f_raw[i][j]);
-    }
-  }
+  // The good channels in each spectrum are marked in its mask.
+  pack_readarray_sint(cmp, a->nspectra, a->f_nchannels_block);
+  pack_readarray_uint(cmp, a->nspectra * AMPPHASE_MASK_WORDS(a->nchannels),
+		      a->valid_block);
 
   // Some metadata.
   pack_read_float(cmp, &(a->min_amplitude_global));
@@ -830,7 +818,9 @@ void free_spectrum_data(struct spectrum_data *spectrum_data) {
   int i, j;
   for (i = 0; i < spectrum_data->num_ifs; i++) {
     for (j = 0; j < spectrum_data->num_pols; j++) {
-      free_ampphase(&(spectrum_data->spectrum[i][j]));
+      if (spectrum_data->spectrum[i][j] != NULL) {
+	free_ampphase(&(spectrum_data->spectrum[i][j]));
+      }
     }
     FREE(spectrum_data->spectrum[i]);
   }
@@ -930,6 +920,7 @@ void unpack_vis_quantities(cmp_ctx_t *cmp, struct vis_quantities *a) {
   a->ntriangles = 0;
   a->triangles = NULL;
   a->closure_phase = NULL;
+  a->closure_reference_antenna = -1;
 
 }
 
@@ -982,6 +973,49 @@ void copy_vis_data(struct vis_data *dest,
   dest->options = src->options;
 }
 
+void append_vis_data(struct vis_data *dest,
+		     struct vis_data *src) {
+  // Move the cycles from one vis_data structure onto the end of another.
+  int i, n;
+  n = dest->nviscycles + src->nviscycles;
+  REALLOC(dest->header_data, n);
+  REALLOC(dest->num_ifs, n);
+  REALLOC(dest->num_pols, n);
+  REALLOC(dest->vis_quantities, n);
+  REALLOC(dest->metinfo, n);
+  REALLOC(dest->syscal_data, n);
+  for (i = 0; i < src->nviscycles; i++) {
+    dest->header_data[dest->nviscycles + i] = src->header_data[i];
+    dest->num_ifs[dest->nviscycles + i] = src->num_ifs[i];
+    dest->num_pols[dest->nviscycles + i] = src->num_pols[i];
+    dest->vis_quantities[dest->nviscycles + i] = src->vis_quantities[i];
+    dest->metinfo[dest->nviscycles + i] = src->metinfo[i];
+    dest->syscal_data[dest->nviscycles + i] = src->syscal_data[i];
+  }
+  dest->nviscycles = n;
+  if (src->mjd_high > dest->mjd_high) {
+    dest->mjd_high = src->mjd_high;
+  }
+
+  // The new cycles may have needed more options, in which case we keep
+  // the larger set.
+  if (src->num_options > dest->num_options) {
+    for (i = 0; i < dest->num_options; i++) {
+      free_ampphase_options(dest->options[i]);
+      FREE(dest->options[i]);
+    }
+    FREE(dest->options);
+    dest->num_options = src->num_options;
+    dest->options = src->options;
+    src->num_options = 0;
+    src->options = NULL;
+  }
+
+  // The cycles now belong to dest, so we only free the arrays from src.
+  src->nviscycles = 0;
+  free_vis_data(src);
+}
+
 void pack_vis_data(cmp_ctx_t *cmp, struct vis_data *a) {
   int i, j, k;
   // The number of cycles contained here.
@@ -1575,6 +1609,84 @@ void unpack_fluxdensity_specification(cmp_ctx_t *cmp, struct fluxdensity_specifi
   }
 }
 
+/*!
+ *  \brief Pack a noise_diode_sums structure into the data stream
+ *  \param cmp the CMP buffer object
+ *  \param a the noise_diode_sums structure
+ */
+void pack_noise_diode_sums(cmp_ctx_t *cmp, struct noise_diode_sums *a) {
+  int i;
+
+  // The cycle and window.
+  pack_write_double(cmp, a->mjd);
+  pack_write_sint(cmp, a->window);
+  pack_write_bool(cmp, a->window_found);
+  pack_write_bool(cmp, a->pols_found);
+
+  // The antennas.
+  pack_write_sint(cmp, a->num_ants);
+  pack_writearray_sint(cmp, a->num_ants, a->ant_label);
+  for (i = 0; i < (2 * a->num_ants); i++) {
+    pack_write_bool(cmp, a->on_source[i]);
+  }
+
+  // The frequencies.
+  pack_write_sint(cmp, a->nchannels);
+  pack_writearray_float(cmp, a->nchannels, a->frequency);
+
+  // The averages.
+  pack_write_sint(cmp, a->nbaselines);
+  pack_writearray_sint(cmp, (2 * a->nbaselines), a->baseline);
+  pack_writearray_sint(cmp, (2 * a->nbaselines), a->nbins);
+  pack_writearray_sint(cmp, (2 * a->nbaselines), a->offset);
+  pack_write_sint(cmp, a->nvalues);
+  pack_writearray_float(cmp, a->nvalues, a->rsum);
+  pack_writearray_float(cmp, a->nvalues, a->isum);
+}
+
+/*!
+ *  \brief Unpack a noise_diode_sums structure from the data stream
+ *  \param cmp the CMP buffer object
+ *  \param a the noise_diode_sums structure
+ */
+void unpack_noise_diode_sums(cmp_ctx_t *cmp, struct noise_diode_sums *a) {
+  int i;
+
+  // The cycle and window.
+  pack_read_double(cmp, &(a->mjd));
+  pack_read_sint(cmp, &(a->window));
+  pack_read_bool(cmp, &(a->window_found));
+  pack_read_bool(cmp, &(a->pols_found));
+
+  // The antennas.
+  pack_read_sint(cmp, &(a->num_ants));
+  MALLOC(a->ant_label, a->num_ants + 1);
+  pack_readarray_sint(cmp, a->num_ants, a->ant_label);
+  MALLOC(a->on_source, 2 * a->num_ants + 1);
+  for (i = 0; i < (2 * a->num_ants); i++) {
+    pack_read_bool(cmp, &(a->on_source[i]));
+  }
+
+  // The frequencies.
+  pack_read_sint(cmp, &(a->nchannels));
+  MALLOC(a->frequency, a->nchannels + 1);
+  pack_readarray_float(cmp, a->nchannels, a->frequency);
+
+  // The averages.
+  pack_read_sint(cmp, &(a->nbaselines));
+  MALLOC(a->baseline, 2 * a->nbaselines + 1);
+  pack_readarray_sint(cmp, (2 * a->nbaselines), a->baseline);
+  MALLOC(a->nbins, 2 * a->nbaselines + 1);
+  pack_readarray_sint(cmp, (2 * a->nbaselines), a->nbins);
+  MALLOC(a->offset, 2 * a->nbaselines + 1);
+  pack_readarray_sint(cmp, (2 * a->nbaselines), a->offset);
+  pack_read_sint(cmp, &(a->nvalues));
+  MALLOC(a->rsum, a->nvalues + 1);
+  pack_readarray_float(cmp, a->nvalues, a->rsum);
+  MALLOC(a->isum, a->nvalues + 1);
+  pack_readarray_float(cmp, a->nvalues, a->isum);
+}
+
 void init_cmp_memory_buffer(cmp_ctx_t *cmp, cmp_mem_access_t *mem, void *buffer,
                             size_t buffer_len) {
   cmp_mem_access_init(cmp, mem, buffer, buffer_len);
@@ -25,6 +25,8 @@ void pack_read_bool(cmp_ctx_t *cmp, bool *value);
 void pack_write_bool(cmp_ctx_t *cmp, bool value);
 void pack_read_sint(cmp_ctx_t *cmp, int *value);
 void pack_write_sint(cmp_ctx_t *cmp, int value);
+void pack_read_slong(cmp_ctx_t *cmp, long *value);
+void pack_write_slong(cmp_ctx_t *cmp, long value);
 void pack_read_uint(cmp_ctx_t *cmp, unsigned int *value);
 void pack_write_uint(cmp_ctx_t *cmp, unsigned int value);
 void pack_read_float(cmp_ctx_t *cmp, float *value);
@@ -44,6 +46,10 @@ void pack_writearray_floatcomplex(cmp_ctx_t *cmp, unsigned int length,
                                   float complex *array);
 void pack_readarray_sint(cmp_ctx_t *cmp, unsigned int expected_length, int *array);
 void pack_writearray_sint(cmp_ctx_t *cmp, unsigned int length, int *array);
+void pack_readarray_uint(cmp_ctx_t *cmp, unsigned int expected_length,
+                         unsigned int *array);
+void pack_writearray_uint(cmp_ctx_t *cmp, unsigned int length,
+                          unsigned int *array);
 void pack_readarray_string(cmp_ctx_t *cmp, unsigned int expected_length, char **array,
                            long unsigned int maxlength);
 void pack_writearray_string(cmp_ctx_t *cmp, unsigned int length, char **array,
@@ -61,6 +67,7 @@ void pack_vis_quantities(cmp_ctx_t *cmp, struct vis_quantities *a);
 void unpack_vis_quantities(cmp_ctx_t *cmp, struct vis_quantities *a);
 void copy_spectrum_data(struct spectrum_data *dest, struct spectrum_data *src);
 void copy_vis_data(struct vis_data *dest, struct vis_data *src);
+void append_vis_data(struct vis_data *dest, struct vis_data *src);
 void pack_vis_data(cmp_ctx_t *cmp, struct vis_data *a);
 void unpack_vis_data(cmp_ctx_t *cmp, struct vis_data *a);
 void free_vis_data(struct vis_data *vis_data);
@@ -76,6 +83,8 @@ void pack_syscal_data(cmp_ctx_t *cmp, struct syscal_data *a);
 void unpack_syscal_data(cmp_ctx_t *cmp, struct syscal_data *a);
 void pack_fluxdensity_specification(cmp_ctx_t *cmp, struct fluxdensity_specification *a);
 void unpack_fluxdensity_specification(cmp_ctx_t *cmp, struct fluxdensity_specification *a);
+void pack_noise_diode_sums(cmp_ctx_t *cmp, struct noise_diode_sums *a);
+void unpack_noise_diode_sums(cmp_ctx_t *cmp, struct noise_diode_sums *a);
 void init_cmp_memory_buffer(cmp_ctx_t *cmp, cmp_mem_access_t *mem, void *buffer,
                             size_t buffer_len);
 
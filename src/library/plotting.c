@@ -775,31 +775,33 @@ void plotpanel_minmax(struct ampphase **plot_ampphase,
 	  }
 	  continue;
 	}
-	for (k = 0; k < plot_ampphase[polidx[i]]->f_nchannels[plot_baseline_idx][j]; k++) {
-	  if ((plot_ampphase[polidx[i]]->f_channel[plot_baseline_idx][j][k] >=
-	       channelmin) &&
-	      (plot_ampphase[polidx[i]]->f_channel[plot_baseline_idx][j][k] <=
-	       channelmax)) {
+	for (k = ampphase_next_valid_channel(plot_ampphase[polidx[i]],
+					     plot_baseline_idx, j, 0);
+	     k < plot_ampphase[polidx[i]]->nchannels;
+	     k = ampphase_next_valid_channel(plot_ampphase[polidx[i]],
+					     plot_baseline_idx, j, (k + 1))) {
+	  if ((plot_ampphase[polidx[i]]->channel[k] >= channelmin) &&
+	      (plot_ampphase[polidx[i]]->channel[k] <= channelmax)) {
 	    if (plot_controls->plot_options & PLOT_AMPLITUDE) {
 	      MINASSIGN(*plotmin_y,
-			plot_ampphase[polidx[i]]->f_amplitude[plot_baseline_idx][j][k]);
+			plot_ampphase[polidx[i]]->amplitude[plot_baseline_idx][j][k]);
 	      MAXASSIGN(*plotmax_y,
-			plot_ampphase[polidx[i]]->f_amplitude[plot_baseline_idx][j][k]);
+			plot_ampphase[polidx[i]]->amplitude[plot_baseline_idx][j][k]);
 	    } else if (plot_controls->plot_options & PLOT_PHASE) {
 	      MINASSIGN(*plotmin_y,
-			plot_ampphase[polidx[i]]->f_phase[plot_baseline_idx][j][k]);
+			plot_ampphase[polidx[i]]->phase[plot_baseline_idx][j][k]);
 	      MAXASSIGN(*plotmax_y,
-			plot_ampphase[polidx[i]]->f_phase[plot_baseline_idx][j][k]);
+			plot_ampphase[polidx[i]]->phase[plot_baseline_idx][j][k]);
 	    } else if (plot_controls->plot_options & PLOT_REAL) {
 	      MINASSIGN(*plotmin_y,
-			crealf(plot_ampphase[polidx[i]]->f_raw[plot_baseline_idx][j][k]));
+			crealf(plot_ampphase[polidx[i]]->raw[plot_baseline_idx][j][k]));
 	      MAXASSIGN(*plotmax_y,
-			crealf(plot_ampphase[polidx[i]]->f_raw[plot_baseline_idx][j][k]));
+			crealf(plot_ampphase[polidx[i]]->raw[plot_baseline_idx][j][k]));
 	    } else if (plot_controls->plot_options & PLOT_IMAG) {
 	      MINASSIGN(*plotmin_y,
-			cimagf(plot_ampphase[polidx[i]]->f_raw[plot_baseline_idx][j][k]));
+			cimagf(plot_ampphase[polidx[i]]->raw[plot_baseline_idx][j][k]));
 	      MAXASSIGN(*plotmax_y,
-			cimagf(plot_ampphase[polidx[i]]->f_raw[plot_baseline_idx][j][k]));
+			cimagf(plot_ampphase[polidx[i]]->raw[plot_baseline_idx][j][k]));
 	    }
 	  }
 	}
@@ -2368,11 +2370,63 @@ void make_vis_plot(struct vis_quantities ****cycle_vis_quantities,
   FREE(plot_vis_lines);
 }
 
+/*!
+ *  \brief Fill the arrays of values to plot for the good channels of a
+ *         spectrum
+ *  \param ampphase the ampphase structure holding the spectrum
+ *  \param baseline the baseline index of the spectrum
+ *  \param bin the bin index of the spectrum
+ *  \param plot_options bitwise OR of the PLOT_* magic numbers, which select
+ *                      the quantities to put on each axis
+ *  \param inverted set to YES to put the values in reverse channel order, for
+ *                  an inverted band
+ *  \param ylog_max the value that a logarithmic amplitude is relative to
+ *  \param xvalues on exit, the x values of the good channels; must have room
+ *                 for `nchannels` values
+ *  \param yvalues on exit, the y values of the good channels; must have room
+ *                 for `nchannels` values
+ *  \return the number of values put into each of \a xvalues and \a yvalues
+ */
+static int spectrum_plot_values(struct ampphase *ampphase, int baseline, int bin,
+				long int plot_options, int inverted, float ylog_max,
+				float *xvalues, float *yvalues) {
+  int k, n, ri, nvalues;
+
+  nvalues = ampphase->f_nchannels[baseline][bin];
+  for (k = ampphase_next_valid_channel(ampphase, baseline, bin, 0), n = 0;
+       (k < ampphase->nchannels) && (n < nvalues);
+       k = ampphase_next_valid_channel(ampphase, baseline, bin, (k + 1)), n++) {
+    // Fill from the end if the band is inverted.
+    ri = (inverted == YES) ? (nvalues - 1 - n) : n;
+    if (plot_options & PLOT_FREQUENCY) {
+      xvalues[ri] = ampphase->frequency[k];
+    } else if (plot_options & PLOT_CHANNEL) {
+      xvalues[ri] = ampphase->channel[k];
+    }
+    if (plot_options & PLOT_AMPLITUDE) {
+      if (plot_options & PLOT_AMPLITUDE_LOG) {
+	LOGAMP(ampphase->amplitude[baseline][bin][k], ylog_max, yvalues[ri]);
+      } else {
+	yvalues[ri] = ampphase->amplitude[baseline][bin][k];
+      }
+    } else if (plot_options & PLOT_PHASE) {
+      yvalues[ri] = ampphase->phase[baseline][bin][k];
+    } else if (plot_options & PLOT_REAL) {
+      yvalues[ri] = crealf(ampphase->raw[baseline][bin][k]);
+    } else if (plot_options & PLOT_IMAG) {
+      yvalues[ri] = cimagf(ampphase->raw[baseline][bin][k]);
+    }
+  }
+
+  return n;
+}
+
 // Definition to align text on a certain line, for use in make_spd_plot.
 // Line 0 is at the top of the information area.
 #define YPOS_LINE(l) (1.0 - (float)(l + 1) / (float)(panelspec->num_information_lines))
 
-void make_spd_plot(struct ampphase ***cycle_ampphase, struct panelspec *panelspec,
+void make_spd_plot(struct ampphase ***cycle_ampphase,
+		   struct ampphase ***cycle_avg_ampphase, struct panelspec *panelspec,
                    struct spd_plotcontrols *plot_controls,
                    struct scan_header_data *scan_header_data,
 		   struct syscal_data *compiled_tsys_data,
@@ -2477,14 +2531,7 @@ void make_spd_plot(struct ampphase ***cycle_ampphase, struct panelspec *panelspe
       }
 
       if (plot_controls->plot_options & PLOT_AVERAGED_DATA) {
-	CALLOC(all_avg_ampphase, npols);
-	for (rp = 0; rp < npols; rp++) {
-	  all_avg_ampphase[polidx[rp]] = prepare_ampphase();
-	  chanaverage_ampphase(ampphase_if[polidx[rp]], all_avg_ampphase[polidx[rp]],
-			       ampphase_if[polidx[rp]]->options->delay_averaging[idxif + 1],
-			       ampphase_if[polidx[rp]]->options->averaging_method[idxif + 1],
-			       ampphase_if[polidx[rp]]->options->phase_in_degrees);
-	}
+	all_avg_ampphase = cycle_avg_ampphase[ni];
       }
       
       if (plot_controls->plot_options & PLOT_DELAY) {
@@ -2749,17 +2796,16 @@ void make_spd_plot(struct ampphase ***cycle_ampphase, struct panelspec *panelspe
           
           // Check if we need to make an inverted frequency array.
           if (plot_controls->plot_options & PLOT_FREQUENCY) {
-            if (ampphase_if[0]->f_frequency[i][0][0] >
-                ampphase_if[0]->f_frequency[i][0]
-                [ampphase_if[0]->f_nchannels[i][0] - 1]) {
+            if (ampphase_if[0]->frequency[0] >
+                ampphase_if[0]->frequency[ampphase_if[0]->nchannels - 1]) {
               // Inverted band.
               inverted = YES;
             }
           }
 
           // Allocate the output arrays.
-          MALLOC(plot_xvalues, ampphase_if[0]->f_nchannels[i][0]);
-          MALLOC(plot_yvalues, ampphase_if[0]->f_nchannels[i][0]);
+          MALLOC(plot_xvalues, ampphase_if[0]->nchannels);
+          MALLOC(plot_yvalues, ampphase_if[0]->nchannels);
           
           pc = 1;
           for (rp = 0; rp < npols; rp++) {
@@ -2827,58 +2873,10 @@ void make_spd_plot(struct ampphase ***cycle_ampphase, struct panelspec *panelspe
 		hline_yvals[0] = hline_yvals[1] = median_chan_delays[polidx[rp]][i][bi];
 		cpgline(2, hline_xvals, hline_yvals);
 	      } else {
-		for (ri = 0, rj = ampphase_if[polidx[rp]]->f_nchannels[i][bi] - 1;
-		     ri < ampphase_if[polidx[rp]]->f_nchannels[i][bi];
-		     ri++, rj--) {
-		  if (inverted == YES) {
-		    // Swap the frequencies.
-		    if (plot_controls->plot_options & PLOT_FREQUENCY) {
-		      plot_xvalues[ri] =
-			ampphase_if[polidx[rp]]->f_frequency[i][bi][rj];
-		    } else if (plot_controls->plot_options & PLOT_CHANNEL) {
-		      plot_xvalues[ri] =
-			ampphase_if[polidx[rp]]->f_channel[i][bi][rj];
-		    }
-		    if (plot_controls->plot_options & PLOT_AMPLITUDE) {
-		      if (plot_controls->plot_options & PLOT_AMPLITUDE_LOG) {
-			LOGAMP(ampphase_if[polidx[rp]]->f_amplitude[i][bi][rj], ylog_max,
-			       plot_yvalues[ri]);
-		      } else {
-			plot_yvalues[ri] = 
-			  ampphase_if[polidx[rp]]->f_amplitude[i][bi][rj];
-		      }
-		    } else if (plot_controls->plot_options & PLOT_PHASE) {
-		      plot_yvalues[ri] =
-			ampphase_if[polidx[rp]]->f_phase[i][bi][rj];
-		    } else if (plot_controls->plot_options & PLOT_REAL) {
-		      plot_yvalues[ri] = crealf(ampphase_if[polidx[rp]]->f_raw[i][bi][rj]);
-		    } else if (plot_controls->plot_options & PLOT_IMAG) {
-		      plot_yvalues[ri] = cimagf(ampphase_if[polidx[rp]]->f_raw[i][bi][rj]);
-		    }
-		  } else {
-		    if (plot_controls->plot_options & PLOT_FREQUENCY) {
-		      plot_xvalues[ri] = ampphase_if[polidx[rp]]->f_frequency[i][bi][ri];
-		    } else if (plot_controls->plot_options & PLOT_CHANNEL) {
-		      plot_xvalues[ri] = ampphase_if[polidx[rp]]->f_channel[i][bi][ri];
-		    }
-		    if (plot_controls->plot_options & PLOT_AMPLITUDE) {
-		      if (plot_controls->plot_options & PLOT_AMPLITUDE_LOG) {
-			LOGAMP(ampphase_if[polidx[rp]]->f_amplitude[i][bi][ri], ylog_max,
-			       plot_yvalues[ri]);
-		      } else {
-			plot_yvalues[ri] = ampphase_if[polidx[rp]]->f_amplitude[i][bi][ri];
-		      }
-		    } else if (plot_controls->plot_options & PLOT_PHASE) {
-		      plot_yvalues[ri] = ampphase_if[polidx[rp]]->f_phase[i][bi][ri];
-		    } else if (plot_controls->plot_options & PLOT_REAL) {
-		      plot_yvalues[ri] = crealf(ampphase_if[polidx[rp]]->f_raw[i][bi][ri]);
-		    } else if (plot_controls->plot_options & PLOT_IMAG) {
-		      plot_yvalues[ri] = cimagf(ampphase_if[polidx[rp]]->f_raw[i][bi][ri]);
-		    }
-		  }
-		}
-		cpgline(ampphase_if[polidx[rp]]->f_nchannels[i][bi],
-			plot_xvalues, plot_yvalues);
+		rj = spectrum_plot_values(ampphase_if[polidx[rp]], i, bi,
+					  plot_controls->plot_options, inverted,
+					  ylog_max, plot_xvalues, plot_yvalues);
+		cpgline(rj, plot_xvalues, plot_yvalues);
 	      }
 	      // Check if the user wants to display the averaged data.
 	      if (plot_controls->plot_options & PLOT_AVERAGED_DATA) {
@@ -2902,52 +2900,10 @@ void make_spd_plot(struct ampphase ***cycle_ampphase, struct panelspec *panelspe
 		  cpgline(2, hline_xvals, hline_yvals);
 		} else {
 		  // Remake the plot values again with the averaged data.
-		  for (ri = 0, rj = avg_ampphase->f_nchannels[i][bi] - 1;
-		       ri < avg_ampphase->f_nchannels[i][bi]; ri++, rj--) {
-		    if (inverted == YES) {
-		      // Swap the frequencies.
-		      if (plot_controls->plot_options & PLOT_FREQUENCY) {
-			plot_xvalues[ri] = avg_ampphase->f_frequency[i][bi][rj];
-		      } else if (plot_controls->plot_options & PLOT_CHANNEL) {
-			plot_xvalues[ri] = avg_ampphase->f_channel[i][bi][rj];
-		      }
-		      if (plot_controls->plot_options & PLOT_AMPLITUDE) {
-			if (plot_controls->plot_options & PLOT_AMPLITUDE_LOG) {
-			  LOGAMP(avg_ampphase->f_amplitude[i][bi][rj], ylog_max,
-				 plot_yvalues[ri]);
-			} else {
-			  plot_yvalues[ri] = avg_ampphase->f_amplitude[i][bi][rj];
-			}
-		      } else if (plot_controls->plot_options & PLOT_PHASE) {
-			plot_yvalues[ri] = avg_ampphase->f_phase[i][bi][rj];
-		      } else if (plot_controls->plot_options & PLOT_REAL) {
-			plot_yvalues[ri] = crealf(avg_ampphase->f_raw[i][bi][rj]);
-		      } else if (plot_controls->plot_options & PLOT_IMAG) {
-			plot_yvalues[ri] = cimagf(avg_ampphase->f_raw[i][bi][rj]);
-		      }
-		    } else {
-		      if (plot_controls->plot_options & PLOT_FREQUENCY) {
-			plot_xvalues[ri] = avg_ampphase->f_frequency[i][bi][ri];
-		      } else if (plot_controls->plot_options & PLOT_CHANNEL) {
-			plot_xvalues[ri] = avg_ampphase->f_channel[i][bi][ri];
-		      }
-		      if (plot_controls->plot_options & PLOT_AMPLITUDE) {
-			if (plot_controls->plot_options & PLOT_AMPLITUDE_LOG) {
-			  LOGAMP(avg_ampphase->f_amplitude[i][bi][ri], ylog_max,
-				 plot_yvalues[ri]);
-			} else {
-			  plot_yvalues[ri] = avg_ampphase->f_amplitude[i][bi][ri];
-			}
-		      } else if (plot_controls->plot_options & PLOT_PHASE) {
-			plot_yvalues[ri] = avg_ampphase->f_phase[i][bi][ri];
-		      } else if (plot_controls->plot_options & PLOT_REAL) {
-			plot_yvalues[ri] = crealf(avg_ampphase->f_raw[i][bi][ri]);
-		      } else if (plot_controls->plot_options & PLOT_IMAG) {
-			plot_yvalues[ri] = cimagf(avg_ampphase->f_raw[i][bi][ri]);
-		      }
-		    }
-		  }
-		  cpgline(avg_ampphase->f_nchannels[i][bi], plot_xvalues, plot_yvalues);
+		  rj = spectrum_plot_values(avg_ampphase, i, bi,
+					    plot_controls->plot_options, inverted,
+					    ylog_max, plot_xvalues, plot_yvalues);
+		  cpgline(rj, plot_xvalues, plot_yvalues);
 		}
 		cpgsci(pc);
 	      }
@@ -3112,13 +3068,6 @@ void make_spd_plot(struct ampphase ***cycle_ampphase, struct panelspec *panelspe
 	}
       }
 
-      if (plot_controls->plot_options & PLOT_AVERAGED_DATA) {
-	for (rp = 0; rp < npols; rp++) {
-	  free_ampphase(&(all_avg_ampphase[polidx[rp]]));
-	}
-	FREE(all_avg_ampphase);
-      }
-      
     } else if (all_data_present == true) {
       ni++;
     }
@@ -466,7 +466,8 @@ void make_vis_plot(struct vis_quantities ****cycle_vis_quantities,
                    struct scan_header_data **header_data,
                    struct metinfo **metinfo, struct syscal_data **syscal_data,
 		   int num_times, float *times, int *time_display, float *time_deltas);
-void make_spd_plot(struct ampphase ***cycle_ampphase, struct panelspec *panelspec,
+void make_spd_plot(struct ampphase ***cycle_ampphase,
+                   struct ampphase ***cycle_avg_ampphase, struct panelspec *panelspec,
                    struct spd_plotcontrols *plot_controls,
                    struct scan_header_data *scan_header_data,
                    struct syscal_data *compiled_tsys_data,
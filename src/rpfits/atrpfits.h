@@ -462,8 +462,8 @@ struct cycle_data {
 
   // Data.
   /*! \var vis_size
-   *  \brief The return value from max_size_of_vis during this read operation,
-   *         which is also the size of the vis and wgt arrays
+   *  \brief The number of values in the vis and wgt arrays for this point,
+   *         which is the return value from size_of_if_vis for its IF
    *
    * This array has length of `num_points` and is indexed starting at 0.
    */
@@ -489,6 +489,37 @@ struct cycle_data {
    */
   float **wgt;
 
+  // Storage.
+  /*! \var max_points
+   *  \brief The number of points that the per-point arrays have been allocated
+   *         to hold
+   */
+  int max_points;
+  /*! \var vis_slab
+   *  \brief The contiguous storage for the channel data of all the points
+   *
+   * This array has length `slab_length`, and each element of `vis` points
+   * somewhere within it.
+   */
+  float complex *vis_slab;
+  /*! \var wgt_slab
+   *  \brief The contiguous storage for the weights of all the points
+   *
+   * This array has length `slab_length`, and each element of `wgt` points
+   * somewhere within it.
+   */
+  float *wgt_slab;
+  /*! \var slab_length
+   *  \brief The number of values that `vis_slab` and `wgt_slab` have been
+   *         allocated to hold
+   */
+  size_t slab_length;
+  /*! \var slab_used
+   *  \brief The number of values at the start of `vis_slab` and `wgt_slab`
+   *         which are in use
+   */
+  size_t slab_used;
+
   // Labelling.
   /*! \var bin
    *  \brief The bin number pertaining to this point
@@ -595,6 +626,30 @@ struct cycle_data {
    * `cal_ants` respectively.
    */
   int ***computed_tsys_applied;
+  /*! \var tsys_scale
+   *  \brief The factor that each visibility needs to be multiplied by to have
+   *         the system temperatures described by `tsys_applied` and
+   *         `computed_tsys_applied` applied to it
+   *
+   * This flat array has length `tsys_scale_num_ifs` * `n_baselines` *
+   * `tsys_scale_num_stokes`, and is indexed as ((IF index * `n_baselines`) +
+   * baseline index) * `tsys_scale_num_stokes` + Stokes index, where the baseline
+   * index is one less than the value in `all_baselines`. Each index starts at 0.
+   *
+   * Changing the system temperature only changes this table, and leaves the
+   * `vis` data as it was read. If this is NULL, the `vis` data doesn't need
+   * any scaling.
+   */
+  float *tsys_scale;
+  /*! \var tsys_scale_num_ifs
+   *  \brief The number of IFs in the `tsys_scale` table
+   */
+  int tsys_scale_num_ifs;
+  /*! \var tsys_scale_num_stokes
+   *  \brief The number of Stokes parameters for each IF and baseline in the
+   *         `tsys_scale` table
+   */
+  int tsys_scale_num_stokes;
 
   // These are indexed [IF][ANT].
   /*! \var xyphase
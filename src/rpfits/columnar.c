@@ -0,0 +1,1024 @@
+/** \file columnar.c
+ *  \brief Routines to write and read the pre-compiled columnar observation
+ *         format
+ *
+ * ATCA Training Library
+ * (C) Jamie Stevens CSIRO 2020
+ *
+ * The converter reads an RPFITS file in exactly the way the server does, and
+ * stores everything the reader gave back (including the return codes), so
+ * that reading the columnar file gives the same scan headers and cycles in
+ * the same order, and can be swapped in for the RPFITS reader without any
+ * other changes.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <complex.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "atrpfits.h"
+#include "reader.h"
+#include "rpfitsio.h"
+#include "columnar.h"
+#include "packing.h"
+#include "memory.h"
+
+/*!
+ *  \brief Get one of the system calibration values for the columnar file
+ *  \param cycle_data the cycle to get the value from
+ *  \param column the index of the float column, as listed in the description
+ *                of COLUMNAR_SYSCAL_NFLOAT
+ *  \param sif the calibration IF index
+ *  \param ant the calibration antenna index
+ *  \return the value
+ */
+static float syscal_float_value(struct cycle_data *cycle_data, int column,
+				int sif, int ant) {
+  switch (column) {
+  case 0:
+    return cycle_data->tsys[sif][ant][CAL_XX];
+  case 1:
+    return cycle_data->tsys[sif][ant][CAL_YY];
+  case 2:
+    return cycle_data->xyphase[sif][ant];
+  case 3:
+    return cycle_data->xyamp[sif][ant];
+  case 4:
+    return cycle_data->parangle[sif][ant];
+  case 5:
+    return cycle_data->tracking_error_max[sif][ant];
+  case 6:
+    return cycle_data->tracking_error_rms[sif][ant];
+  case 7:
+    return cycle_data->gtp_x[sif][ant];
+  case 8:
+    return cycle_data->gtp_y[sif][ant];
+  case 9:
+    return cycle_data->sdo_x[sif][ant];
+  case 10:
+    return cycle_data->sdo_y[sif][ant];
+  case 11:
+    return cycle_data->caljy_x[sif][ant];
+  case 12:
+    return cycle_data->caljy_y[sif][ant];
+  }
+  return 0;
+}
+
+/*!
+ *  \brief Set one of the system calibration values from the columnar file
+ *  \param cycle_data the cycle to set the value in
+ *  \param column the index of the float column, as listed in the description
+ *                of COLUMNAR_SYSCAL_NFLOAT
+ *  \param sif the calibration IF index
+ *  \param ant the calibration antenna index
+ *  \param value the value to set
+ */
+static void syscal_float_set(struct cycle_data *cycle_data, int column,
+			     int sif, int ant, float value) {
+  switch (column) {
+  case 0:
+    cycle_data->tsys[sif][ant][CAL_XX] = value;
+    break;
+  case 1:
+    cycle_data->tsys[sif][ant][CAL_YY] = value;
+    break;
+  case 2:
+    cycle_data->xyphase[sif][ant] = value;
+    break;
+  case 3:
+    cycle_data->xyamp[sif][ant] = value;
+    break;
+  case 4:
+    cycle_data->parangle[sif][ant] = value;
+    break;
+  case 5:
+    cycle_data->tracking_error_max[sif][ant] = value;
+    break;
+  case 6:
+    cycle_data->tracking_error_rms[sif][ant] = value;
+    break;
+  case 7:
+    cycle_data->gtp_x[sif][ant] = value;
+    break;
+  case 8:
+    cycle_data->gtp_y[sif][ant] = value;
+    break;
+  case 9:
+    cycle_data->sdo_x[sif][ant] = value;
+    break;
+  case 10:
+    cycle_data->sdo_y[sif][ant] = value;
+    break;
+  case 11:
+    cycle_data->caljy_x[sif][ant] = value;
+    // The reader starts with the used CalJy being the one from the file.
+    cycle_data->used_caljy_x[sif][ant] = value;
+    break;
+  case 12:
+    cycle_data->caljy_y[sif][ant] = value;
+    cycle_data->used_caljy_y[sif][ant] = value;
+    break;
+  }
+}
+
+/*!
+ *  \brief Get one of the integer system calibration values for the
+ *         columnar file
+ *  \param cycle_data the cycle to get the value from
+ *  \param column the index of the int column, as listed in the description
+ *                of COLUMNAR_SYSCAL_NINT
+ *  \param sif the calibration IF index
+ *  \param ant the calibration antenna index
+ *  \return the value
+ */
+static int syscal_int_value(struct cycle_data *cycle_data, int column,
+			    int sif, int ant) {
+  switch (column) {
+  case 0:
+    return cycle_data->tsys_applied[sif][ant][CAL_XX];
+  case 1:
+    return cycle_data->tsys_applied[sif][ant][CAL_YY];
+  case 2:
+    return cycle_data->flagging[sif][ant];
+  }
+  return 0;
+}
+
+/*!
+ *  \brief Set one of the integer system calibration values from the
+ *         columnar file
+ *  \param cycle_data the cycle to set the value in
+ *  \param column the index of the int column, as listed in the description
+ *                of COLUMNAR_SYSCAL_NINT
+ *  \param sif the calibration IF index
+ *  \param ant the calibration antenna index
+ *  \param value the value to set
+ */
+static void syscal_int_set(struct cycle_data *cycle_data, int column,
+			   int sif, int ant, int value) {
+  switch (column) {
+  case 0:
+    cycle_data->tsys_applied[sif][ant][CAL_XX] = value;
+    break;
+  case 1:
+    cycle_data->tsys_applied[sif][ant][CAL_YY] = value;
+    break;
+  case 2:
+    cycle_data->flagging[sif][ant] = value;
+    break;
+  }
+}
+
+/*!
+ *  \brief Get a pointer to one of the floating point weather values in a cycle
+ *  \param cycle_data the cycle
+ *  \param column the index of the float column, as listed in the description
+ *                of COLUMNAR_MET_NFLOAT
+ *  \return a pointer to the value in the cycle
+ */
+static float* met_float_pointer(struct cycle_data *cycle_data, int column) {
+  switch (column) {
+  case 0:
+    return &(cycle_data->temperature);
+  case 1:
+    return &(cycle_data->air_pressure);
+  case 2:
+    return &(cycle_data->humidity);
+  case 3:
+    return &(cycle_data->wind_speed);
+  case 4:
+    return &(cycle_data->wind_direction);
+  case 5:
+    return &(cycle_data->rain_gauge);
+  case 6:
+    return &(cycle_data->seemon_phase);
+  }
+  return &(cycle_data->seemon_rms);
+}
+
+/*!
+ *  \brief Get a pointer to one of the integer weather values in a cycle
+ *  \param cycle_data the cycle
+ *  \param column the index of the int column, as listed in the description
+ *                of COLUMNAR_MET_NINT
+ *  \return a pointer to the value in the cycle
+ */
+static int* met_int_pointer(struct cycle_data *cycle_data, int column) {
+  if (column == 0) {
+    return &(cycle_data->weather_valid);
+  }
+  return &(cycle_data->seemon_valid);
+}
+
+/*!
+ *  \brief Pad a file being written so the next block will be aligned
+ *  \param fh the file being written
+ *  \return the byte offset of the next block
+ */
+static int64_t write_alignment(FILE *fh) {
+  long position;
+  char padding[COLUMNAR_ALIGNMENT] = { 0 };
+
+  position = ftell(fh);
+  if ((position % COLUMNAR_ALIGNMENT) != 0) {
+    fwrite(padding, 1, COLUMNAR_ALIGNMENT - (position % COLUMNAR_ALIGNMENT), fh);
+    position += COLUMNAR_ALIGNMENT - (position % COLUMNAR_ALIGNMENT);
+  }
+  return (int64_t)position;
+}
+
+/*!
+ *  \brief Write some bytes to a file, doing nothing if there aren't any
+ *  \param fh the file being written
+ *  \param data the bytes to write, which may be NULL if \a length is 0
+ *  \param length the number of bytes to write
+ */
+static void write_bytes(FILE *fh, const void *data, size_t length) {
+  if (length > 0) {
+    fwrite(data, 1, length, fh);
+  }
+}
+
+/*!
+ *  \brief Write out the columns for a single cycle
+ *  \param fh the file being written
+ *  \param cycle_data the cycle that was read
+ *  \param entry the cycle table entry, which gets the offsets of the columns
+ */
+static void write_cycle_columns(FILE *fh, struct cycle_data *cycle_data,
+				struct columnar_cycle_entry *entry) {
+  int i, j, k, np = cycle_data->num_points, nci = cycle_data->num_cal_ifs;
+  int nca = cycle_data->num_cal_ants, *baselines = NULL, *icolumn = NULL;
+  float *fcolumn = NULL;
+
+  entry->ut_seconds = cycle_data->ut_seconds;
+  entry->num_points = np;
+  entry->n_baselines = cycle_data->n_baselines;
+  entry->num_cal_ifs = nci;
+  entry->num_cal_ants = nca;
+  entry->slab_length = cycle_data->slab_used;
+
+  // The point columns.
+  entry->points_offset = write_alignment(fh);
+  write_bytes(fh, cycle_data->u, np * sizeof(float));
+  write_bytes(fh, cycle_data->v, np * sizeof(float));
+  write_bytes(fh, cycle_data->w, np * sizeof(float));
+  write_bytes(fh, cycle_data->ant1, np * sizeof(int));
+  write_bytes(fh, cycle_data->ant2, np * sizeof(int));
+  write_bytes(fh, cycle_data->flag, np * sizeof(int));
+  write_bytes(fh, cycle_data->bin, np * sizeof(int));
+  write_bytes(fh, cycle_data->if_no, np * sizeof(int));
+  write_bytes(fh, cycle_data->source_no, np * sizeof(int));
+  write_bytes(fh, cycle_data->vis_size, np * sizeof(int));
+  // The baselines are stored in the order they were first seen, so the
+  // all_baselines lookup can be remade.
+  if (cycle_data->n_baselines > 0) {
+    MALLOC(baselines, cycle_data->n_baselines);
+    for (i = 0; i < MAX_BASELINENUM; i++) {
+      if ((cycle_data->all_baselines[i] > 0) &&
+	  (cycle_data->all_baselines[i] <= cycle_data->n_baselines)) {
+	baselines[cycle_data->all_baselines[i] - 1] = i;
+      }
+    }
+    write_bytes(fh, baselines, cycle_data->n_baselines * sizeof(int));
+    FREE(baselines);
+  }
+
+  // The data slabs.
+  entry->vis_offset = write_alignment(fh);
+  write_bytes(fh, cycle_data->vis_slab, cycle_data->slab_used * sizeof(float complex));
+  entry->wgt_offset = write_alignment(fh);
+  write_bytes(fh, cycle_data->wgt_slab, cycle_data->slab_used * sizeof(float));
+
+  // The system calibration columns.
+  entry->syscal_offset = write_alignment(fh);
+  write_bytes(fh, cycle_data->cal_ifs, nci * sizeof(int));
+  if (nci > 0) {
+    write_bytes(fh, cycle_data->cal_ants, nca * sizeof(int));
+  }
+  if ((nci > 0) && (nca > 0)) {
+    MALLOC(fcolumn, nci * nca);
+    for (k = 0; k < COLUMNAR_SYSCAL_NFLOAT; k++) {
+      for (i = 0; i < nci; i++) {
+	for (j = 0; j < nca; j++) {
+	  fcolumn[i * nca + j] = syscal_float_value(cycle_data, k, i, j);
+	}
+      }
+      write_bytes(fh, fcolumn, nci * nca * sizeof(float));
+    }
+    FREE(fcolumn);
+    MALLOC(icolumn, nci * nca);
+    for (k = 0; k < COLUMNAR_SYSCAL_NINT; k++) {
+      for (i = 0; i < nci; i++) {
+	for (j = 0; j < nca; j++) {
+	  icolumn[i * nca + j] = syscal_int_value(cycle_data, k, i, j);
+	}
+      }
+      write_bytes(fh, icolumn, nci * nca * sizeof(int));
+    }
+    FREE(icolumn);
+  }
+}
+
+/*!
+ *  \brief Write the columnar form of an RPFITS file
+ *  \param rpfits_filename the name of the RPFITS file to read
+ *  \param fh the file to write to, which should be empty
+ *  \param max_length the largest number of bytes that may be written, or 0
+ *                    for no limit
+ *  \return JSTAT_SUCCESSFUL if the whole file was written, or
+ *          JSTAT_UNSUCCESSFUL if the RPFITS file couldn't be read or the
+ *          limit was reached
+ *
+ * The file is read with the same rules as the server uses: the cycles in each
+ * scan are read until the reader says the scan has ended or a cycle comes
+ * back without any data.
+ */
+static int columnar_write(char *rpfits_filename, FILE *fh, size_t max_length) {
+  int res, cres, i, n_scans = 0, n_cycles = 0, **met_int = NULL;
+  float ut_saved, **met_float = NULL;
+  bool keep_reading = true, keep_cycling, too_long = false;
+  long cycle_offset;
+  struct stat st;
+  struct rpfits_file *rpfits_file = NULL;
+  struct scan_header_data *sh = NULL;
+  struct cycle_data *cycle_data = NULL;
+  struct columnar_file_header header;
+  struct columnar_scan_entry *scans = NULL, scan_entry;
+  struct columnar_cycle_entry *cycles = NULL, cycle_entry;
+  cmp_ctx_t cmp;
+
+  if (stat(rpfits_filename, &st) != 0) {
+    fprintf(stderr, "[columnar_write] unable to find %s\n", rpfits_filename);
+    return(JSTAT_UNSUCCESSFUL);
+  }
+  if (open_rpfits_file(rpfits_filename, &rpfits_file) != JSTAT_SUCCESSFUL) {
+    return(JSTAT_UNSUCCESSFUL);
+  }
+  rpfitsio_map(rpfits_file, RPFITSIO_ACCESS_SEQUENTIAL);
+  // The header gets filled in at the end.
+  memset(&header, 0, sizeof(header));
+  fwrite(&header, sizeof(header), 1, fh);
+  cmp_init(&cmp, fh, file_reader, file_skipper, file_writer);
+  MALLOC(met_float, COLUMNAR_MET_NFLOAT);
+  MALLOC(met_int, COLUMNAR_MET_NINT);
+
+  while (keep_reading) {
+    CALLOC(sh, 1);
+    res = read_scan_header(rpfits_file, sh);
+    memset(&scan_entry, 0, sizeof(scan_entry));
+    scan_entry.rpfits_offset = rpfits_file->header_offset;
+    scan_entry.read_result = res;
+    if (sh->num_sources > 0) {
+      scan_entry.header_offset = write_alignment(fh);
+      pack_scan_header_data(&cmp, sh);
+      scan_entry.header_length = (int64_t)ftell(fh) - scan_entry.header_offset;
+    }
+
+    n_cycles = 0;
+    for (i = 0; i < COLUMNAR_MET_NFLOAT; i++) {
+      met_float[i] = NULL;
+    }
+    for (i = 0; i < COLUMNAR_MET_NINT; i++) {
+      met_int[i] = NULL;
+    }
+    keep_cycling = ((sh->num_sources > 0) && (res & READER_DATA_AVAILABLE));
+    while (keep_cycling) {
+      memset(&cycle_entry, 0, sizeof(cycle_entry));
+      cycle_offset = rpfitsio_tell(rpfits_file);
+      cycle_data = prepare_new_cycle_data();
+      // Find out what time this read would give the header if it didn't
+      // already have one.
+      ut_saved = sh->ut_seconds;
+      sh->ut_seconds = -1;
+      cres = read_cycle_data(rpfits_file, sh, cycle_data);
+      cycle_entry.header_ut_seconds = sh->ut_seconds;
+      if (ut_saved >= 0) {
+	sh->ut_seconds = ut_saved;
+      }
+      cycle_entry.rpfits_offset = cycle_offset;
+      cycle_entry.read_result = cres;
+      write_cycle_columns(fh, cycle_data, &cycle_entry);
+      n_cycles++;
+      REALLOC(cycles, n_cycles);
+      cycles[n_cycles - 1] = cycle_entry;
+      for (i = 0; i < COLUMNAR_MET_NFLOAT; i++) {
+	ARRAY_APPEND(met_float[i], n_cycles, *met_float_pointer(cycle_data, i));
+      }
+      for (i = 0; i < COLUMNAR_MET_NINT; i++) {
+	ARRAY_APPEND(met_int[i], n_cycles, *met_int_pointer(cycle_data, i));
+      }
+      if (!(cres & READER_DATA_AVAILABLE) || (cycle_data->num_points == 0)) {
+	keep_cycling = false;
+      }
+      if (cres == READER_EXHAUSTED) {
+	res = READER_EXHAUSTED;
+      }
+      free_cycle_data(cycle_data);
+      FREE(cycle_data);
+      if ((max_length > 0) && ((size_t)ftell(fh) > max_length)) {
+	too_long = true;
+	keep_cycling = false;
+	res = READER_EXHAUSTED;
+      }
+    }
+
+    // Write out the cycle table and the weather columns for this scan.
+    scan_entry.n_cycles = n_cycles;
+    scan_entry.cycle_table_offset = write_alignment(fh);
+    write_bytes(fh, cycles, n_cycles * sizeof(struct columnar_cycle_entry));
+    scan_entry.met_offset = write_alignment(fh);
+    for (i = 0; i < COLUMNAR_MET_NFLOAT; i++) {
+      write_bytes(fh, met_float[i], n_cycles * sizeof(float));
+      FREE(met_float[i]);
+    }
+    for (i = 0; i < COLUMNAR_MET_NINT; i++) {
+      write_bytes(fh, met_int[i], n_cycles * sizeof(int));
+      FREE(met_int[i]);
+    }
+    FREE(cycles);
+    n_scans++;
+    REALLOC(scans, n_scans);
+    scans[n_scans - 1] = scan_entry;
+
+    free_scan_header_data(sh);
+    FREE(sh);
+    if (res == READER_EXHAUSTED) {
+      keep_reading = false;
+    }
+  }
+  FREE(met_float);
+  FREE(met_int);
+  close_rpfits_file(rpfits_file);
+  if (too_long) {
+    FREE(scans);
+    return(JSTAT_UNSUCCESSFUL);
+  }
+
+  // Finish with the scan table and the header.
+  memcpy(header.magic, COLUMNAR_MAGIC, COLUMNAR_MAGIC_LENGTH);
+  header.version = COLUMNAR_VERSION;
+  header.n_scans = n_scans;
+  header.source_size = (int64_t)st.st_size;
+  header.source_mtime_sec = (int64_t)st.st_mtim.tv_sec;
+  header.source_mtime_nsec = (int64_t)st.st_mtim.tv_nsec;
+  header.scan_table_offset = write_alignment(fh);
+  write_bytes(fh, scans, n_scans * sizeof(struct columnar_scan_entry));
+  FREE(scans);
+  fseek(fh, 0, SEEK_SET);
+  fwrite(&header, sizeof(header), 1, fh);
+
+  return((ferror(fh) == 0) ? JSTAT_SUCCESSFUL : JSTAT_UNSUCCESSFUL);
+}
+
+/*!
+ *  \brief Convert an RPFITS file into the columnar format
+ *  \param rpfits_filename the name of the RPFITS file to read
+ *  \param columnar_filename the name of the columnar file to write
+ *  \return JSTAT_SUCCESSFUL if the conversion worked, or JSTAT_UNSUCCESSFUL
+ *          otherwise
+ *
+ * The columnar file is written to a temporary file which is then renamed, so
+ * a partially written file can never be read.
+ */
+int columnar_convert(char *rpfits_filename, char *columnar_filename) {
+  int res;
+  char *temp_filename = NULL;
+  FILE *fh = NULL;
+
+  MALLOC(temp_filename, strlen(columnar_filename) + 32);
+  snprintf(temp_filename, strlen(columnar_filename) + 32, "%s.%d", columnar_filename,
+	   (int)getpid());
+  fh = fopen(temp_filename, "wb");
+  if (fh == NULL) {
+    fprintf(stderr, "[columnar_convert] unable to write %s\n", columnar_filename);
+    FREE(temp_filename);
+    return(JSTAT_UNSUCCESSFUL);
+  }
+  res = columnar_write(rpfits_filename, fh, 0);
+  if ((fclose(fh) != 0) || (res != JSTAT_SUCCESSFUL) ||
+      (rename(temp_filename, columnar_filename) != 0)) {
+    fprintf(stderr, "[columnar_convert] unable to write %s\n", columnar_filename);
+    unlink(temp_filename);
+    FREE(temp_filename);
+    return(JSTAT_UNSUCCESSFUL);
+  }
+  FREE(temp_filename);
+
+  return(JSTAT_SUCCESSFUL);
+}
+
+/*!
+ *  \brief Convert an RPFITS file into the columnar format, keeping the result
+ *         in memory instead of a file
+ *  \param rpfits_filename the name of the RPFITS file to read
+ *  \param max_length the largest number of bytes the image may use, or 0 for
+ *                    no limit
+ *  \param fd a pointer which is set to a descriptor for the in-memory image,
+ *            which can be given to columnar_open_fd, or -1 if the conversion
+ *            failed
+ *  \param length a pointer which is set to the number of bytes in the image
+ *  \return JSTAT_SUCCESSFUL if the conversion worked, or JSTAT_UNSUCCESSFUL
+ *          if the RPFITS file couldn't be read or the image would be longer
+ *          than \a max_length
+ *
+ * The image is anonymous memory, which is released when the descriptor is
+ * closed (and no mappings of it remain).
+ */
+int columnar_convert_memory(char *rpfits_filename, size_t max_length,
+			    int *fd, size_t *length) {
+  int res, wfd;
+  struct stat st;
+  FILE *fh = NULL;
+
+  *fd = -1;
+  *length = 0;
+  wfd = memfd_create("columnar", MFD_CLOEXEC);
+  if (wfd < 0) {
+    fprintf(stderr, "[columnar_convert_memory] unable to make memory image\n");
+    return(JSTAT_UNSUCCESSFUL);
+  }
+  fh = fdopen(dup(wfd), "wb");
+  if (fh == NULL) {
+    close(wfd);
+    return(JSTAT_UNSUCCESSFUL);
+  }
+  res = columnar_write(rpfits_filename, fh, max_length);
+  if ((fclose(fh) != 0) || (res != JSTAT_SUCCESSFUL) || (fstat(wfd, &st) != 0)) {
+    close(wfd);
+    return(JSTAT_UNSUCCESSFUL);
+  }
+  *fd = wfd;
+  *length = (size_t)st.st_size;
+
+  return(JSTAT_SUCCESSFUL);
+}
+
+/*!
+ *  \brief Check that a block lies within a mapped columnar file
+ *  \param columnar_file the file context
+ *  \param offset the byte offset of the block
+ *  \param length the number of bytes in the block
+ *  \return true if the whole block is inside the mapping
+ */
+static bool block_valid(struct columnar_file *columnar_file, int64_t offset,
+			int64_t length) {
+  return ((offset >= 0) && (length >= 0) &&
+	  ((uint64_t)offset <= columnar_file->map_length) &&
+	  ((uint64_t)length <= (columnar_file->map_length - (uint64_t)offset)));
+}
+
+/*!
+ *  \brief Map a columnar file from an open descriptor and check it
+ *  \param fd the descriptor, which is left open
+ *  \param name the name to use in any messages
+ *  \param rpfits_filename the name of the RPFITS file it was made from, or
+ *                         NULL to skip the check that it hasn't changed
+ *  \param access one of the RPFITSIO_ACCESS_* hints
+ *  \param columnar_file a pointer which is set to the new file context, or
+ *                       NULL if the file can't be used
+ *  \return JSTAT_SUCCESSFUL, or JSTAT_UNSUCCESSFUL if the file can't be used
+ */
+static int columnar_map(int fd, char *name, char *rpfits_filename, int access,
+			struct columnar_file **columnar_file) {
+  int i;
+  struct stat st, source_st;
+  struct columnar_file *rv = NULL;
+  struct columnar_scan_entry *scan = NULL;
+  void *map = NULL;
+
+  *columnar_file = NULL;
+  if ((fstat(fd, &st) != 0) ||
+      ((size_t)st.st_size < sizeof(struct columnar_file_header))) {
+    return(JSTAT_UNSUCCESSFUL);
+  }
+  map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED) {
+    return(JSTAT_UNSUCCESSFUL);
+  }
+  (void)madvise(map, st.st_size, ((access == RPFITSIO_ACCESS_RANDOM) ?
+				  MADV_RANDOM : MADV_SEQUENTIAL));
+
+  CALLOC(rv, 1);
+  rv->map = map;
+  rv->map_length = st.st_size;
+  rv->header = (struct columnar_file_header *)rv->map;
+  rv->current_scan = -1;
+  rv->next_scan = 0;
+  rv->next_cycle = 0;
+
+  // Check that this is a columnar file, and is up to date.
+  if ((memcmp(rv->header->magic, COLUMNAR_MAGIC, COLUMNAR_MAGIC_LENGTH) != 0) ||
+      (rv->header->version != COLUMNAR_VERSION) ||
+      (rv->header->n_scans < 0) ||
+      !block_valid(rv, rv->header->scan_table_offset,
+		   (int64_t)rv->header->n_scans * sizeof(struct columnar_scan_entry))) {
+    fprintf(stderr, "[columnar_open] %s is not a usable columnar file\n", name);
+    columnar_close(rv);
+    return(JSTAT_UNSUCCESSFUL);
+  }
+  if ((rpfits_filename != NULL) &&
+      ((stat(rpfits_filename, &source_st) != 0) ||
+       (rv->header->source_size != (int64_t)source_st.st_size) ||
+       (rv->header->source_mtime_sec != (int64_t)source_st.st_mtim.tv_sec) ||
+       (rv->header->source_mtime_nsec != (int64_t)source_st.st_mtim.tv_nsec))) {
+    printf("[columnar_open] %s is stale\n", name);
+    columnar_close(rv);
+    return(JSTAT_UNSUCCESSFUL);
+  }
+  rv->scans = (struct columnar_scan_entry *)(rv->map + rv->header->scan_table_offset);
+  for (i = 0; i < rv->header->n_scans; i++) {
+    scan = &(rv->scans[i]);
+    if ((scan->n_cycles < 0) ||
+	!block_valid(rv, scan->header_offset, scan->header_length) ||
+	!block_valid(rv, scan->cycle_table_offset,
+		     (int64_t)scan->n_cycles * sizeof(struct columnar_cycle_entry)) ||
+	!block_valid(rv, scan->met_offset, (int64_t)scan->n_cycles *
+		     (COLUMNAR_MET_NFLOAT * sizeof(float) + COLUMNAR_MET_NINT * sizeof(int)))) {
+      fprintf(stderr, "[columnar_open] %s is damaged\n", name);
+      columnar_close(rv);
+      return(JSTAT_UNSUCCESSFUL);
+    }
+  }
+
+  *columnar_file = rv;
+  return(JSTAT_SUCCESSFUL);
+}
+
+/*!
+ *  \brief Open and map a columnar file
+ *  \param columnar_filename the name of the columnar file
+ *  \param rpfits_filename the name of the RPFITS file it was made from, which
+ *                         is checked to make sure it hasn't changed since the
+ *                         conversion; or NULL to skip this check
+ *  \param access one of the RPFITSIO_ACCESS_* hints, describing how the file
+ *                will be read
+ *  \param columnar_file a pointer which is set to the new file context
+ *  \return JSTAT_SUCCESSFUL, or JSTAT_UNSUCCESSFUL if the file can't be used,
+ *          in which case \a columnar_file is set to NULL
+ *
+ * The mapping is private and writable, so the visibilities given out by
+ * columnar_read_cycle_data can be modified (eg. by a Tsys correction)
+ * just like those from read_cycle_data, without changing the file. Since
+ * those changes stay in the mapping until the file is closed, each cycle
+ * should only be read once each time the file is opened.
+ */
+int columnar_open(char *columnar_filename, char *rpfits_filename, int access,
+		  struct columnar_file **columnar_file) {
+  int fd, res;
+
+  *columnar_file = NULL;
+  fd = open(columnar_filename, O_RDONLY);
+  if (fd < 0) {
+    return(JSTAT_UNSUCCESSFUL);
+  }
+  res = columnar_map(fd, columnar_filename, rpfits_filename, access, columnar_file);
+  close(fd);
+
+  return(res);
+}
+
+/*!
+ *  \brief Open a columnar image made by columnar_convert_memory
+ *  \param fd the descriptor of the image, which is left open
+ *  \param rpfits_filename the name of the RPFITS file it was made from, or
+ *                         NULL to skip the check that it hasn't changed
+ *  \param access one of the RPFITSIO_ACCESS_* hints
+ *  \param columnar_file a pointer which is set to the new file context
+ *  \return JSTAT_SUCCESSFUL, or JSTAT_UNSUCCESSFUL if the image can't be used
+ *
+ * This works just like columnar_open, and the mapping is private in the same
+ * way, so the image itself is never changed and can be opened again.
+ */
+int columnar_open_fd(int fd, char *rpfits_filename, int access,
+		     struct columnar_file **columnar_file) {
+  return(columnar_map(fd, "memory image", rpfits_filename, access, columnar_file));
+}
+
+/*!
+ *  \brief Close a columnar file
+ *  \param columnar_file the file context, which is freed by this routine
+ *  \return JSTAT_SUCCESSFUL, or JSTAT_UNSUCCESSFUL if the mapping could not
+ *          be released
+ *
+ * Any cycle_data that was filled from this file must not be used after this.
+ */
+int columnar_close(struct columnar_file *columnar_file) {
+  int rv = JSTAT_SUCCESSFUL;
+
+  if (columnar_file == NULL) {
+    return(JSTAT_UNSUCCESSFUL);
+  }
+  if ((columnar_file->map != NULL) &&
+      (munmap(columnar_file->map, columnar_file->map_length) != 0)) {
+    rv = JSTAT_UNSUCCESSFUL;
+  }
+  FREE(columnar_file);
+
+  return(rv);
+}
+
+/*!
+ *  \brief Read the next scan header from a columnar file
+ *  \param columnar_file the file context
+ *  \param scan_header_data the structure to fill, which should be empty
+ *  \return the same READER_* value that read_scan_header gave for this header
+ *
+ * Any cycles left unread in the previous scan are skipped, as read_scan_header
+ * would do.
+ */
+int columnar_read_scan_header(struct columnar_file *columnar_file,
+			      struct scan_header_data *scan_header_data) {
+  struct columnar_scan_entry *scan = NULL;
+  cmp_ctx_t cmp;
+  cmp_mem_access_t mem;
+
+  if (columnar_file->next_scan >= columnar_file->header->n_scans) {
+    return(READER_EXHAUSTED);
+  }
+  columnar_file->current_scan = columnar_file->next_scan;
+  columnar_file->next_scan += 1;
+  columnar_file->next_cycle = 0;
+  scan = &(columnar_file->scans[columnar_file->current_scan]);
+  if (scan->header_length > 0) {
+    cmp_mem_access_ro_init(&cmp, &mem, columnar_file->map + scan->header_offset,
+			   scan->header_length);
+    unpack_scan_header_data(&cmp, scan_header_data);
+  }
+
+  return(scan->read_result);
+}
+
+/*!
+ *  \brief Read the next cycle from a columnar file
+ *  \param columnar_file the file context
+ *  \param scan_header_data the header of the scan being read
+ *  \param cycle_data the structure to fill, which should have just been made
+ *                    by prepare_new_cycle_data
+ *  \return the same READER_* value that read_cycle_data gave for this cycle
+ *
+ * The visibility and weight pointers in \a cycle_data point into the mapped
+ * file, so the cycle must be freed before the file is closed. The cycle
+ * doesn't own any slab storage, so it can still be freed with free_cycle_data.
+ */
+int columnar_read_cycle_data(struct columnar_file *columnar_file,
+			     struct scan_header_data *scan_header_data,
+			     struct cycle_data *cycle_data) {
+  int i, j, k, np, nci, nca, *icolumn = NULL;
+  float *fcolumn = NULL;
+  size_t slab_position = 0;
+  struct columnar_scan_entry *scan = NULL;
+  struct columnar_cycle_entry *entry = NULL;
+  float complex *vis_slab = NULL;
+  float *wgt_slab = NULL;
+  unsigned char *block = NULL;
+
+  if ((columnar_file->current_scan < 0) ||
+      (columnar_file->next_cycle >=
+       columnar_file->scans[columnar_file->current_scan].n_cycles)) {
+    return(READER_EXHAUSTED);
+  }
+  scan = &(columnar_file->scans[columnar_file->current_scan]);
+  entry = (struct columnar_cycle_entry *)(columnar_file->map + scan->cycle_table_offset) +
+    columnar_file->next_cycle;
+  np = entry->num_points;
+  nci = entry->num_cal_ifs;
+  nca = entry->num_cal_ants;
+  if (!block_valid(columnar_file, entry->points_offset,
+		   (int64_t)np * (3 * sizeof(float) + 7 * sizeof(int)) +
+		   (int64_t)entry->n_baselines * sizeof(int)) ||
+      !block_valid(columnar_file, entry->vis_offset,
+		   entry->slab_length * sizeof(float complex)) ||
+      !block_valid(columnar_file, entry->wgt_offset,
+		   entry->slab_length * sizeof(float)) ||
+      !block_valid(columnar_file, entry->syscal_offset,
+		   (int64_t)(nci + nca) * sizeof(int) +
+		   (int64_t)nci * nca * (COLUMNAR_SYSCAL_NFLOAT * sizeof(float) +
+					 COLUMNAR_SYSCAL_NINT * sizeof(int)))) {
+    fprintf(stderr, "[columnar_read_cycle_data] cycle is damaged\n");
+    return(READER_EXHAUSTED);
+  }
+
+  if (scan_header_data->ut_seconds < 0) {
+    scan_header_data->ut_seconds = entry->header_ut_seconds;
+  }
+  cycle_data->ut_seconds = entry->ut_seconds;
+  cycle_data->num_points = np;
+  cycle_data->max_points = np;
+
+  // The point columns are copied, since the cycle owns these arrays.
+  block = columnar_file->map + entry->points_offset;
+#define COPY_COLUMN(member)						\
+  MALLOC(cycle_data->member, np);					\
+  memcpy(cycle_data->member, block, np * sizeof(*(cycle_data->member))); \
+  block += np * sizeof(*(cycle_data->member))
+  COPY_COLUMN(u);
+  COPY_COLUMN(v);
+  COPY_COLUMN(w);
+  COPY_COLUMN(ant1);
+  COPY_COLUMN(ant2);
+  COPY_COLUMN(flag);
+  COPY_COLUMN(bin);
+  COPY_COLUMN(if_no);
+  COPY_COLUMN(source_no);
+  COPY_COLUMN(vis_size);
+#undef COPY_COLUMN
+  cycle_data->n_baselines = entry->n_baselines;
+  icolumn = (int *)block;
+  for (i = 0; i < entry->n_baselines; i++) {
+    if ((icolumn[i] >= 0) && (icolumn[i] < MAX_BASELINENUM)) {
+      cycle_data->all_baselines[icolumn[i]] = i + 1;
+    }
+  }
+
+  // But the data stays in the mapping.
+  vis_slab = (float complex *)(columnar_file->map + entry->vis_offset);
+  wgt_slab = (float *)(columnar_file->map + entry->wgt_offset);
+  MALLOC(cycle_data->vis, np);
+  MALLOC(cycle_data->wgt, np);
+  for (i = 0; i < np; i++) {
+    if ((cycle_data->vis_size[i] < 0) ||
+	((slab_position + cycle_data->vis_size[i]) > (size_t)entry->slab_length)) {
+      fprintf(stderr, "[columnar_read_cycle_data] cycle is damaged\n");
+      cycle_data->num_points = i;
+      break;
+    }
+    cycle_data->vis[i] = vis_slab + slab_position;
+    cycle_data->wgt[i] = wgt_slab + slab_position;
+    slab_position += cycle_data->vis_size[i];
+  }
+
+  // The system calibration data is put back into the same shapes that
+  // read_cycle_data makes.
+  cycle_data->num_cal_ifs = nci;
+  cycle_data->num_cal_ants = nca;
+  icolumn = (int *)(columnar_file->map + entry->syscal_offset);
+  if (nci > 0) {
+    MALLOC(cycle_data->cal_ifs, nci);
+    memcpy(cycle_data->cal_ifs, icolumn, nci * sizeof(int));
+    MALLOC(cycle_data->cal_ants, nca);
+    memcpy(cycle_data->cal_ants, icolumn + nci, nca * sizeof(int));
+    MALLOC(cycle_data->tsys, nci);
+    MALLOC(cycle_data->tsys_applied, nci);
+    MALLOC(cycle_data->computed_tsys, nci);
+    MALLOC(cycle_data->computed_tsys_applied, nci);
+    MALLOC(cycle_data->xyphase, nci);
+    MALLOC(cycle_data->xyamp, nci);
+    MALLOC(cycle_data->parangle, nci);
+    MALLOC(cycle_data->tracking_error_max, nci);
+    MALLOC(cycle_data->tracking_error_rms, nci);
+    MALLOC(cycle_data->gtp_x, nci);
+    MALLOC(cycle_data->gtp_y, nci);
+    MALLOC(cycle_data->computed_gtp_x, nci);
+    MALLOC(cycle_data->computed_gtp_y, nci);
+    MALLOC(cycle_data->sdo_x, nci);
+    MALLOC(cycle_data->sdo_y, nci);
+    MALLOC(cycle_data->computed_sdo_x, nci);
+    MALLOC(cycle_data->computed_sdo_y, nci);
+    MALLOC(cycle_data->caljy_x, nci);
+    MALLOC(cycle_data->caljy_y, nci);
+    MALLOC(cycle_data->used_caljy_x, nci);
+    MALLOC(cycle_data->used_caljy_y, nci);
+    MALLOC(cycle_data->flagging, nci);
+  }
+  for (i = 0; i < nci; i++) {
+    MALLOC(cycle_data->tsys[i], nca);
+    MALLOC(cycle_data->tsys_applied[i], nca);
+    MALLOC(cycle_data->computed_tsys[i], nca);
+    MALLOC(cycle_data->computed_tsys_applied[i], nca);
+    MALLOC(cycle_data->xyphase[i], nca);
+    MALLOC(cycle_data->xyamp[i], nca);
+    MALLOC(cycle_data->parangle[i], nca);
+    MALLOC(cycle_data->tracking_error_max[i], nca);
+    MALLOC(cycle_data->tracking_error_rms[i], nca);
+    MALLOC(cycle_data->gtp_x[i], nca);
+    MALLOC(cycle_data->gtp_y[i], nca);
+    CALLOC(cycle_data->computed_gtp_x[i], nca);
+    CALLOC(cycle_data->computed_gtp_y[i], nca);
+    MALLOC(cycle_data->sdo_x[i], nca);
+    MALLOC(cycle_data->sdo_y[i], nca);
+    CALLOC(cycle_data->computed_sdo_x[i], nca);
+    CALLOC(cycle_data->computed_sdo_y[i], nca);
+    MALLOC(cycle_data->caljy_x[i], nca);
+    MALLOC(cycle_data->caljy_y[i], nca);
+    MALLOC(cycle_data->used_caljy_x[i], nca);
+    MALLOC(cycle_data->used_caljy_y[i], nca);
+    MALLOC(cycle_data->flagging[i], nca);
+    for (j = 0; j < nca; j++) {
+      MALLOC(cycle_data->tsys[i][j], 2);
+      MALLOC(cycle_data->tsys_applied[i][j], 2);
+      CALLOC(cycle_data->computed_tsys[i][j], 2);
+      CALLOC(cycle_data->computed_tsys_applied[i][j], 2);
+    }
+  }
+  fcolumn = (float *)(icolumn + nci + nca);
+  for (k = 0; k < COLUMNAR_SYSCAL_NFLOAT; k++) {
+    for (i = 0; i < nci; i++) {
+      for (j = 0; j < nca; j++) {
+	syscal_float_set(cycle_data, k, i, j, fcolumn[i * nca + j]);
+      }
+    }
+    fcolumn += nci * nca;
+  }
+  icolumn = (int *)fcolumn;
+  for (k = 0; k < COLUMNAR_SYSCAL_NINT; k++) {
+    for (i = 0; i < nci; i++) {
+      for (j = 0; j < nca; j++) {
+	syscal_int_set(cycle_data, k, i, j, icolumn[i * nca + j]);
+      }
+    }
+    icolumn += nci * nca;
+  }
+
+  // The weather columns for this scan.
+  fcolumn = (float *)(columnar_file->map + scan->met_offset);
+  for (k = 0; k < COLUMNAR_MET_NFLOAT; k++) {
+    *met_float_pointer(cycle_data, k) = fcolumn[columnar_file->next_cycle];
+    fcolumn += scan->n_cycles;
+  }
+  icolumn = (int *)fcolumn;
+  for (k = 0; k < COLUMNAR_MET_NINT; k++) {
+    *met_int_pointer(cycle_data, k) = icolumn[columnar_file->next_cycle];
+    icolumn += scan->n_cycles;
+  }
+
+  columnar_file->next_cycle += 1;
+  return(entry->read_result);
+}
+
+/*!
+ *  \brief Get the position of the reader in a columnar file
+ *  \param columnar_file the file context
+ *  \return the offset in the RPFITS file that corresponds to the next cycle
+ *          that will be read, or the next header if there are no more cycles
+ *          in this scan, or -1 at the end of the file
+ *
+ * Like rpfitsio_tell, the position returned can be given to columnar_seek.
+ */
+long columnar_tell(struct columnar_file *columnar_file) {
+  struct columnar_scan_entry *scan = NULL;
+  struct columnar_cycle_entry *entry = NULL;
+
+  if (columnar_file->current_scan >= 0) {
+    scan = &(columnar_file->scans[columnar_file->current_scan]);
+    if (columnar_file->next_cycle < scan->n_cycles) {
+      entry = (struct columnar_cycle_entry *)(columnar_file->map + scan->cycle_table_offset) +
+	columnar_file->next_cycle;
+      return((long)entry->rpfits_offset);
+    }
+  }
+  if (columnar_file->next_scan < columnar_file->header->n_scans) {
+    return((long)columnar_file->scans[columnar_file->next_scan].rpfits_offset);
+  }
+
+  return(-1);
+}
+
+/*!
+ *  \brief Move the reader in a columnar file to a position in the RPFITS
+ *         file it was made from
+ *  \param columnar_file the file context
+ *  \param offset a position in the RPFITS file, which must be one recorded
+ *                as the start of a header or cycle, like the `scan_offset` and
+ *                `cycle_offset` values in the server's metadata
+ *  \return JSTAT_SUCCESSFUL, or JSTAT_UNSUCCESSFUL if the offset isn't the
+ *          start of any header or cycle
+ *
+ * After seeking to a header, the next call should be to
+ * columnar_read_scan_header. After seeking to a cycle, the next call can be
+ * to columnar_read_cycle_data with the header of that cycle's scan.
+ */
+int columnar_seek(struct columnar_file *columnar_file, long offset) {
+  int i, j;
+  struct columnar_scan_entry *scan = NULL;
+  struct columnar_cycle_entry *entries = NULL;
+
+  for (i = 0; i < columnar_file->header->n_scans; i++) {
+    if (columnar_file->scans[i].rpfits_offset == offset) {
+      columnar_file->current_scan = -1;
+      columnar_file->next_scan = i;
+      columnar_file->next_cycle = 0;
+      return(JSTAT_SUCCESSFUL);
+    }
+  }
+  for (i = 0; i < columnar_file->header->n_scans; i++) {
+    scan = &(columnar_file->scans[i]);
+    entries = (struct columnar_cycle_entry *)(columnar_file->map + scan->cycle_table_offset);
+    for (j = 0; j < scan->n_cycles; j++) {
+      if (entries[j].rpfits_offset == offset) {
+	columnar_file->current_scan = i;
+	columnar_file->next_scan = i + 1;
+	columnar_file->next_cycle = j;
+	return(JSTAT_SUCCESSFUL);
+      }
+    }
+  }
+
+  return(JSTAT_UNSUCCESSFUL);
+}
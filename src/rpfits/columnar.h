@@ -0,0 +1,276 @@
+/** \file columnar.h
+ *  \brief Definitions for the pre-compiled columnar observation format
+ *
+ * ATCA Training Library
+ * (C) Jamie Stevens CSIRO 2020
+ *
+ * An RPFITS file can be converted once into this format, which holds the
+ * already-decoded data for each cycle as a set of columns: one per
+ * quantity for the data points (u, v, w, antennas, flags...), a contiguous
+ * slab of visibilities in the same layout that read_cycle_data produces,
+ * and separate columns for the system calibration and weather data. A file
+ * in this format is memory mapped when it is read, and the visibilities
+ * handed out point straight into the mapping, so serving the same
+ * observation again needs no RPFITS decoding at all.
+ *
+ * The file is a local cache of an RPFITS file, so it is written in native
+ * byte order, and it records the size and modification time of the RPFITS
+ * file it was made from so that it won't be used if that file changes.
+ */
+
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include "atrpfits.h"
+#include "reader.h"
+
+/*! \def COLUMNAR_SUFFIX
+ *  \brief The suffix added to the name of an RPFITS file to make the name of
+ *         its columnar file
+ */
+#define COLUMNAR_SUFFIX ".col"
+/*! \def COLUMNAR_MAGIC
+ *  \brief The bytes at the start of every columnar file
+ */
+#define COLUMNAR_MAGIC "ATCOLOBS"
+/*! \def COLUMNAR_MAGIC_LENGTH
+ *  \brief The number of bytes in COLUMNAR_MAGIC
+ */
+#define COLUMNAR_MAGIC_LENGTH 8
+/*! \def COLUMNAR_VERSION
+ *  \brief The version of the columnar file format, which must be incremented
+ *         whenever the layout of the file changes
+ */
+#define COLUMNAR_VERSION 1
+/*! \def COLUMNAR_ALIGNMENT
+ *  \brief Every block in a columnar file starts at a multiple of this many
+ *         bytes, so the columns can be used directly from the mapping
+ */
+#define COLUMNAR_ALIGNMENT 8
+/*! \def COLUMNAR_MET_NFLOAT
+ *  \brief The number of floating point weather columns stored for each scan,
+ *         which are (in order) temperature, air pressure, humidity, wind speed,
+ *         wind direction, rain gauge, seeing monitor phase and seeing
+ *         monitor RMS
+ */
+#define COLUMNAR_MET_NFLOAT 8
+/*! \def COLUMNAR_MET_NINT
+ *  \brief The number of integer weather columns stored for each scan, which
+ *         are (in order) the weather validity and seeing monitor validity
+ */
+#define COLUMNAR_MET_NINT 2
+/*! \def COLUMNAR_SYSCAL_NFLOAT
+ *  \brief The number of floating point system calibration columns stored
+ *         for each cycle, which are (in order) Tsys X, Tsys Y, XY phase,
+ *         XY amplitude, parallactic angle, maximum tracking error, RMS tracking
+ *         error, GTP X, GTP Y, SDO X, SDO Y, CalJy X and CalJy Y
+ */
+#define COLUMNAR_SYSCAL_NFLOAT 13
+/*! \def COLUMNAR_SYSCAL_NINT
+ *  \brief The number of integer system calibration columns stored for each
+ *         cycle, which are (in order) Tsys X applied, Tsys Y applied and flagging
+ */
+#define COLUMNAR_SYSCAL_NINT 3
+
+/*! \struct columnar_file_header
+ *  \brief The header at the very start of a columnar file
+ */
+struct columnar_file_header {
+  /*! \var magic
+   *  \brief The bytes COLUMNAR_MAGIC, not null-terminated
+   */
+  char magic[COLUMNAR_MAGIC_LENGTH];
+  /*! \var version
+   *  \brief The COLUMNAR_VERSION the file was written with
+   */
+  int32_t version;
+  /*! \var n_scans
+   *  \brief The number of entries in the scan table
+   */
+  int32_t n_scans;
+  /*! \var source_size
+   *  \brief The size in bytes of the RPFITS file this file was made from
+   */
+  int64_t source_size;
+  /*! \var source_mtime_sec
+   *  \brief The modification time (seconds) of the RPFITS file this file
+   *         was made from
+   */
+  int64_t source_mtime_sec;
+  /*! \var source_mtime_nsec
+   *  \brief The modification time (nanoseconds) of the RPFITS file this
+   *         file was made from
+   */
+  int64_t source_mtime_nsec;
+  /*! \var scan_table_offset
+   *  \brief The byte offset of the scan table, which is an array of
+   *         `n_scans` columnar_scan_entry structures
+   */
+  int64_t scan_table_offset;
+};
+
+/*! \struct columnar_scan_entry
+ *  \brief The description of each scan header that was found in the
+ *         RPFITS file
+ */
+struct columnar_scan_entry {
+  /*! \var rpfits_offset
+   *  \brief The offset of this header in the RPFITS file, as it was recorded
+   *         in the `header_offset` of the RPFITS reader
+   */
+  int64_t rpfits_offset;
+  /*! \var header_offset
+   *  \brief The byte offset of the scan header, packed with
+   *         pack_scan_header_data
+   */
+  int64_t header_offset;
+  /*! \var header_length
+   *  \brief The number of bytes in the packed scan header, which is 0 if the
+   *         header had no sources
+   */
+  int64_t header_length;
+  /*! \var cycle_table_offset
+   *  \brief The byte offset of this scan's cycle table, which is an array of
+   *         `n_cycles` columnar_cycle_entry structures
+   */
+  int64_t cycle_table_offset;
+  /*! \var met_offset
+   *  \brief The byte offset of this scan's weather columns, which are
+   *         COLUMNAR_MET_NFLOAT float columns followed by COLUMNAR_MET_NINT
+   *         int columns, each `n_cycles` long
+   */
+  int64_t met_offset;
+  /*! \var read_result
+   *  \brief The value that read_scan_header returned for this header
+   */
+  int32_t read_result;
+  /*! \var n_cycles
+   *  \brief The number of cycles that were read after this header
+   */
+  int32_t n_cycles;
+};
+
+/*! \struct columnar_cycle_entry
+ *  \brief The description of each cycle that was read from the RPFITS file
+ */
+struct columnar_cycle_entry {
+  /*! \var rpfits_offset
+   *  \brief The offset in the RPFITS file that the reader was at before
+   *         reading this cycle, as returned by rpfitsio_tell
+   */
+  int64_t rpfits_offset;
+  /*! \var points_offset
+   *  \brief The byte offset of this cycle's point columns, which are the
+   *         float columns u, v and w, then the int columns ant1, ant2, flag,
+   *         bin, if_no, source_no and vis_size, each `num_points` long, then
+   *         the `n_baselines` baseline numbers in order of first appearance
+   */
+  int64_t points_offset;
+  /*! \var vis_offset
+   *  \brief The byte offset of this cycle's slab of visibilities
+   */
+  int64_t vis_offset;
+  /*! \var wgt_offset
+   *  \brief The byte offset of this cycle's slab of weights
+   */
+  int64_t wgt_offset;
+  /*! \var syscal_offset
+   *  \brief The byte offset of this cycle's system calibration columns, which
+   *         are the `num_cal_ifs` IF numbers, the `num_cal_ants` antenna
+   *         numbers, then COLUMNAR_SYSCAL_NFLOAT float columns and
+   *         COLUMNAR_SYSCAL_NINT int columns, each indexed [IF][ANT]
+   */
+  int64_t syscal_offset;
+  /*! \var slab_length
+   *  \brief The number of values in each of the visibility and weight slabs
+   */
+  int64_t slab_length;
+  /*! \var ut_seconds
+   *  \brief The time of the cycle, as in cycle_data
+   */
+  float ut_seconds;
+  /*! \var header_ut_seconds
+   *  \brief The time that read_cycle_data would set in the scan header
+   *         if it did not already have one, or -1 if it would not set it
+   */
+  float header_ut_seconds;
+  /*! \var read_result
+   *  \brief The value that read_cycle_data returned for this cycle
+   */
+  int32_t read_result;
+  /*! \var num_points
+   *  \brief The number of data points in the cycle
+   */
+  int32_t num_points;
+  /*! \var n_baselines
+   *  \brief The number of baselines in the cycle
+   */
+  int32_t n_baselines;
+  /*! \var num_cal_ifs
+   *  \brief The number of IFs in the system calibration columns
+   */
+  int32_t num_cal_ifs;
+  /*! \var num_cal_ants
+   *  \brief The number of antennas in the system calibration columns
+   */
+  int32_t num_cal_ants;
+  /*! \var padding
+   *  \brief Unused, keeps the structure a multiple of COLUMNAR_ALIGNMENT long
+   */
+  int32_t padding;
+};
+
+/*! \struct columnar_file
+ *  \brief All the state associated with reading a columnar file
+ *
+ * The reader steps through the scan headers and cycles in the same order that
+ * they were read from the RPFITS file, so it can be used in place of
+ * read_scan_header and read_cycle_data.
+ */
+struct columnar_file {
+  /*! \var map
+   *  \brief The memory mapping of the file
+   */
+  unsigned char *map;
+  /*! \var map_length
+   *  \brief The number of bytes in the memory mapping
+   */
+  size_t map_length;
+  /*! \var header
+   *  \brief The file header, in the mapping
+   */
+  struct columnar_file_header *header;
+  /*! \var scans
+   *  \brief The scan table, in the mapping
+   */
+  struct columnar_scan_entry *scans;
+  /*! \var current_scan
+   *  \brief The index of the scan whose cycles are being read, or -1 if no
+   *         header has been read yet
+   */
+  int current_scan;
+  /*! \var next_scan
+   *  \brief The index of the scan header that will be read next
+   */
+  int next_scan;
+  /*! \var next_cycle
+   *  \brief The index of the cycle in `current_scan` that will be read next
+   */
+  int next_cycle;
+};
+
+int columnar_convert(char *rpfits_filename, char *columnar_filename);
+int columnar_convert_memory(char *rpfits_filename, size_t max_length,
+			    int *fd, size_t *length);
+int columnar_open(char *columnar_filename, char *rpfits_filename, int access,
+		  struct columnar_file **columnar_file);
+int columnar_open_fd(int fd, char *rpfits_filename, int access,
+		     struct columnar_file **columnar_file);
+int columnar_close(struct columnar_file *columnar_file);
+int columnar_read_scan_header(struct columnar_file *columnar_file,
+			      struct scan_header_data *scan_header_data);
+int columnar_read_cycle_data(struct columnar_file *columnar_file,
+			     struct scan_header_data *scan_header_data,
+			     struct cycle_data *cycle_data);
+long columnar_tell(struct columnar_file *columnar_file);
+int columnar_seek(struct columnar_file *columnar_file, long offset);
@@ -15,10 +15,20 @@
 #include <complex.h>
 #include <stdbool.h>
 #include <stdarg.h>
+#include <unistd.h>
+#include <pthread.h>
 #include "atrpfits.h"
 #include "memory.h"
 #include "compute.h"
 #include "common.h"
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+/*! \def COMPUTE_AVX2
+ *  \brief Defined when the compiler can build the AVX2 versions of the
+ *          spectrum routines, which are used if the CPU supports them
+ */
+#define COMPUTE_AVX2
+#endif
 
 /*!
  *  \brief Get the median value of a float array
@@ -58,6 +68,193 @@ float complex fcmedianfc(float complex *a, int n) {
   }
 }
 
+/*!
+ *  \brief Swap two entries of an array being selected on, along with the
+ *         matching entries of its payload
+ *  \param key the array of values being selected on
+ *  \param payload an array that is reordered along with \a key, or NULL
+ *  \param i the index of one entry
+ *  \param j the index of the other entry
+ */
+static void select_swap(float *key, float complex *payload, int i, int j) {
+  float tkey;
+  float complex tpayload;
+
+  tkey = key[i];
+  key[i] = key[j];
+  key[j] = tkey;
+  if (payload != NULL) {
+    tpayload = payload[i];
+    payload[i] = payload[j];
+    payload[j] = tpayload;
+  }
+}
+
+/*!
+ *  \brief Restore the heap property below one entry of a max-heap
+ *  \param key the array of values, with the heap starting at index \a lo
+ *  \param payload an array that is reordered along with \a key, or NULL
+ *  \param lo the index of the root of the heap
+ *  \param n the number of entries in the heap
+ *  \param root the heap position (relative to \a lo) to sift down from
+ */
+static void select_sift_down(float *key, float complex *payload, int lo, int n,
+			     int root) {
+  int child;
+
+  while ((child = 2 * root + 1) < n) {
+    if ((child + 1 < n) && (key[lo + child] < key[lo + child + 1])) {
+      child++;
+    }
+    if (!(key[lo + root] < key[lo + child])) {
+      return;
+    }
+    select_swap(key, payload, lo + root, lo + child);
+    root = child;
+  }
+}
+
+/*!
+ *  \brief Partially reorder an array so that one entry is where it would be
+ *         if the array was sorted
+ *  \param key the array of values to reorder
+ *  \param payload an array that is reordered along with \a key, or NULL
+ *  \param n the number of values in the arrays
+ *  \param k the index of the entry to put in place
+ *
+ * On exit, no entry before \a k is larger than `key[k]`, and no entry after it
+ * is smaller. This is an introselect: a quickselect using a median-of-three
+ * pivot and a three-way partition, which falls back to sorting the remaining
+ * range with a heapsort if the partitioning isn't converging, so it always
+ * finishes in O(n log n) time and usually in O(n).
+ */
+static void select_kth(float *key, float complex *payload, int n, int k) {
+  int lo = 0, hi = n - 1, depth = 0, i, j, lt, gt, mid;
+  float pivot, t;
+
+  for (i = n; i > 1; i >>= 1) {
+    depth += 2;
+  }
+  while (hi > lo) {
+    if ((hi - lo) < 16) {
+      // Small ranges are quickest to just sort.
+      for (i = lo + 1; i <= hi; i++) {
+	for (j = i; (j > lo) && (key[j] < key[j - 1]); j--) {
+	  select_swap(key, payload, j, j - 1);
+	}
+      }
+      return;
+    }
+    if (depth == 0) {
+      // Heapsort what's left.
+      for (i = (hi - lo + 1) / 2 - 1; i >= 0; i--) {
+	select_sift_down(key, payload, lo, hi - lo + 1, i);
+      }
+      for (i = hi - lo; i > 0; i--) {
+	select_swap(key, payload, lo, lo + i);
+	select_sift_down(key, payload, lo, i, 0);
+      }
+      return;
+    }
+    depth--;
+    // Choose the median of the first, middle and last values as the pivot.
+    mid = lo + (hi - lo) / 2;
+    pivot = key[mid];
+    if (key[lo] < pivot) {
+      t = (key[hi] < pivot) ? ((key[lo] < key[hi]) ? key[hi] : key[lo]) : pivot;
+    } else {
+      t = (key[hi] < key[lo]) ? ((pivot < key[hi]) ? key[hi] : pivot) : key[lo];
+    }
+    pivot = t;
+    // Partition into values less than, equal to and greater than the pivot.
+    for (lt = lo, gt = hi, i = lo; i <= gt;) {
+      if (key[i] < pivot) {
+	select_swap(key, payload, lt, i);
+	lt++;
+	i++;
+      } else if (key[i] > pivot) {
+	select_swap(key, payload, i, gt);
+	gt--;
+      } else {
+	i++;
+      }
+    }
+    if (k < lt) {
+      hi = lt - 1;
+    } else if (k > gt) {
+      lo = gt + 1;
+    } else {
+      return;
+    }
+  }
+}
+
+/*!
+ *  \brief Get the median value of an unsorted float array
+ *  \param a the array of values, which will be partially reordered
+ *  \param n the number of values in the array
+ *  \return the median value of the first \a n entries in the array \a a, or 0
+ *          if \a n <= 0; this is the same value that fmedianf would return
+ *          if the array was sorted first
+ */
+float fselectmedianf(float *a, int n) {
+  int i, k;
+  float lower;
+
+  if (n <= 0) {
+    return 0;
+  }
+  k = n / 2;
+  select_kth(a, NULL, n, k);
+  if (n % 2) {
+    // Odd number of points.
+    return (a[k]);
+  }
+  // The other middle value is the largest of the values before it.
+  for (i = 1, lower = a[0]; i < k; i++) {
+    if (a[i] > lower) {
+      lower = a[i];
+    }
+  }
+  return ((lower + a[k]) / 2.0);
+}
+
+/*!
+ *  \brief Get the median value of an unsorted float complex array, using
+ *         the amplitudes of the values to order them
+ *  \param a the array of values, which will be partially reordered
+ *  \param amplitude an array of at least \a n values which is used to hold
+ *                   the amplitude of each value
+ *  \param n the number of values in the array
+ *  \return the median value of the first \a n entries in the array \a a, or 0
+ *          if \a n <= 0; this is the same value that fcmedianfc would return
+ *          if the array was sorted with cmpfunc_complex first
+ */
+float complex fcselectmedianfc(float complex *a, float *amplitude, int n) {
+  int i, k, lidx;
+
+  if (n <= 0) {
+    return (0 + 0 * I);
+  }
+  // Compute each amplitude only once.
+  for (i = 0; i < n; i++) {
+    amplitude[i] = cabsf(a[i]);
+  }
+  k = n / 2;
+  select_kth(amplitude, a, n, k);
+  if (n % 2) {
+    // Odd number of points.
+    return (a[k]);
+  }
+  // The other middle value is the largest of the values before it.
+  for (i = 1, lidx = 0; i < k; i++) {
+    if (amplitude[i] > amplitude[lidx]) {
+      lidx = i;
+    }
+  }
+  return ((a[lidx] + a[k]) / 2.0);
+}
+
 /*!
  *  \brief Get the total sum of a float array
  *  \param a the array of values
@@ -200,12 +397,20 @@ struct ampphase* prepare_ampphase(void) {
   ampphase->raw = NULL;
   
   ampphase->f_nchannels = NULL;
-  ampphase->f_channel = NULL;
-  ampphase->f_frequency = NULL;
-  ampphase->f_weight = NULL;
-  ampphase->f_amplitude = NULL;
-  ampphase->f_phase = NULL;
-  ampphase->f_raw = NULL;
+  ampphase->valid = NULL;
+
+  ampphase->nspectra = 0;
+  ampphase->spectrum_offset = NULL;
+  ampphase->flagged_bad_block = NULL;
+  ampphase->f_nchannels_block = NULL;
+  ampphase->weight_block = NULL;
+  ampphase->amplitude_block = NULL;
+  ampphase->phase_block = NULL;
+  ampphase->raw_block = NULL;
+  ampphase->valid_block = NULL;
+  ampphase->spectrum_views = NULL;
+  ampphase->complex_spectrum_views = NULL;
+  ampphase->valid_views = NULL;
   
   ampphase->min_amplitude = NULL;
   ampphase->max_amplitude = NULL;
@@ -226,6 +431,231 @@ struct ampphase* prepare_ampphase(void) {
   return(ampphase);
 }
 
+/*!
+ *  \brief Point the baseline and bin arrays of one kind of float quantity
+ *         into its storage block
+ *  \param ampphase the ampphase structure, with its `spectrum_offset` set
+ *  \param views the array of per-baseline pointers to set
+ *  \param table the `nspectra` per-bin pointers to use for this quantity
+ *  \param block the storage for this quantity
+ */
+static void ampphase_float_views(struct ampphase *ampphase, float ***views,
+				 float **table, float *block) {
+  int i, j, s;
+
+  for (i = 0; i < ampphase->nbaselines; i++) {
+    views[i] = table + ampphase->spectrum_offset[i];
+    for (j = 0; j < ampphase->nbins[i]; j++) {
+      s = ampphase->spectrum_offset[i] + j;
+      views[i][j] = block + (size_t)s * ampphase->nchannels;
+    }
+  }
+}
+
+/*!
+ *  \brief Point the baseline and bin arrays of one kind of complex quantity
+ *         into its storage block
+ *  \param ampphase the ampphase structure, with its `spectrum_offset` set
+ *  \param views the array of per-baseline pointers to set
+ *  \param table the `nspectra` per-bin pointers to use for this quantity
+ *  \param block the storage for this quantity
+ */
+static void ampphase_complex_views(struct ampphase *ampphase, float complex ***views,
+				   float complex **table, float complex *block) {
+  int i, j, s;
+
+  for (i = 0; i < ampphase->nbaselines; i++) {
+    views[i] = table + ampphase->spectrum_offset[i];
+    for (j = 0; j < ampphase->nbins[i]; j++) {
+      s = ampphase->spectrum_offset[i] + j;
+      views[i][j] = block + (size_t)s * ampphase->nchannels;
+    }
+  }
+}
+
+/*!
+ *  \brief Allocate the baseline and bin arrays of an ampphase structure
+ *  \param ampphase the ampphase structure, which must already have its
+ *                  `nchannels`, `nbaselines` and `nbins` set, and must not
+ *                  have had these arrays allocated yet
+ *
+ * Each kind of array is given a single block of memory, holding the spectra
+ * of all the baselines and bins one after the other, and the usual
+ * array[baseline][bin][channel] pointers are set to point into these blocks.
+ * All the values start as 0, so every channel starts out marked as bad.
+ */
+void allocate_ampphase_spectra(struct ampphase *ampphase) {
+  int i, j, nspectra, nwords;
+  size_t nvalues;
+
+  MALLOC(ampphase->spectrum_offset, ampphase->nbaselines);
+  for (i = 0, nspectra = 0; i < ampphase->nbaselines; i++) {
+    ampphase->spectrum_offset[i] = nspectra;
+    nspectra += ampphase->nbins[i];
+  }
+  ampphase->nspectra = nspectra;
+  nvalues = (size_t)nspectra * ampphase->nchannels;
+  nwords = AMPPHASE_MASK_WORDS(ampphase->nchannels);
+
+  CALLOC(ampphase->flagged_bad_block, nspectra);
+  CALLOC(ampphase->f_nchannels_block, nspectra);
+  CALLOC(ampphase->weight_block, nvalues);
+  CALLOC(ampphase->amplitude_block, nvalues);
+  CALLOC(ampphase->phase_block, nvalues);
+  CALLOC(ampphase->raw_block, nvalues);
+  CALLOC(ampphase->valid_block, (size_t)nspectra * nwords);
+
+  // The per-bin pointers for the three float quantities share one
+  // allocation.
+  MALLOC(ampphase->spectrum_views, 3 * nspectra);
+  MALLOC(ampphase->complex_spectrum_views, nspectra);
+  MALLOC(ampphase->valid_views, nspectra);
+
+  MALLOC(ampphase->flagged_bad, ampphase->nbaselines);
+  MALLOC(ampphase->f_nchannels, ampphase->nbaselines);
+  MALLOC(ampphase->weight, ampphase->nbaselines);
+  MALLOC(ampphase->amplitude, ampphase->nbaselines);
+  MALLOC(ampphase->phase, ampphase->nbaselines);
+  MALLOC(ampphase->raw, ampphase->nbaselines);
+  MALLOC(ampphase->valid, ampphase->nbaselines);
+  for (i = 0; i < ampphase->nbaselines; i++) {
+    ampphase->flagged_bad[i] = ampphase->flagged_bad_block +
+      ampphase->spectrum_offset[i];
+    ampphase->f_nchannels[i] = ampphase->f_nchannels_block +
+      ampphase->spectrum_offset[i];
+    ampphase->valid[i] = ampphase->valid_views + ampphase->spectrum_offset[i];
+    for (j = 0; j < ampphase->nbins[i]; j++) {
+      ampphase->valid[i][j] = ampphase->valid_block +
+	(size_t)(ampphase->spectrum_offset[i] + j) * nwords;
+    }
+  }
+  ampphase_float_views(ampphase, ampphase->weight,
+		       ampphase->spectrum_views, ampphase->weight_block);
+  ampphase_float_views(ampphase, ampphase->amplitude,
+		       ampphase->spectrum_views + nspectra, ampphase->amplitude_block);
+  ampphase_float_views(ampphase, ampphase->phase,
+		       ampphase->spectrum_views + 2 * nspectra, ampphase->phase_block);
+  ampphase_complex_views(ampphase, ampphase->raw,
+			 ampphase->complex_spectrum_views, ampphase->raw_block);
+}
+
+/*!
+ *  \brief Mark a channel as good in an ampphase structure
+ *  \param ampphase the ampphase structure
+ *  \param baseline the baseline index
+ *  \param bin the bin index
+ *  \param channel the channel index
+ *
+ * The caller is responsible for keeping `f_nchannels` up to date.
+ */
+static void ampphase_set_valid(struct ampphase *ampphase, int baseline, int bin,
+			       int channel) {
+  ampphase->valid[baseline][bin][channel / AMPPHASE_MASK_BITS] |=
+    (1U << (channel % AMPPHASE_MASK_BITS));
+}
+
+/*!
+ *  \brief Check whether a channel is good in an ampphase structure
+ *  \param ampphase the ampphase structure
+ *  \param baseline the baseline index
+ *  \param bin the bin index
+ *  \param channel the channel index
+ *  \return true if the channel was not flagged bad
+ */
+bool ampphase_channel_valid(struct ampphase *ampphase, int baseline, int bin,
+			    int channel) {
+  return ((ampphase->valid[baseline][bin][channel / AMPPHASE_MASK_BITS] >>
+	   (channel % AMPPHASE_MASK_BITS)) & 1U);
+}
+
+/*!
+ *  \brief Find the next good channel in an ampphase structure
+ *  \param ampphase the ampphase structure
+ *  \param baseline the baseline index
+ *  \param bin the bin index
+ *  \param channel the channel index to start looking from
+ *  \return the index of the first good channel at or after \a channel, or
+ *          `nchannels` if there are no more good channels
+ *
+ * All the good channels in a spectrum can be visited with a loop like:
+ *
+ *     for (k = ampphase_next_valid_channel(a, i, j, 0); k < a->nchannels;
+ *          k = ampphase_next_valid_channel(a, i, j, k + 1)) { ... }
+ *
+ * Whole words of flagged channels are skipped at once.
+ */
+int ampphase_next_valid_channel(struct ampphase *ampphase, int baseline, int bin,
+				int channel) {
+  int w, nwords = AMPPHASE_MASK_WORDS(ampphase->nchannels);
+  unsigned int *mask = NULL, word;
+
+  if (channel >= ampphase->nchannels) {
+    return ampphase->nchannels;
+  }
+  mask = ampphase->valid[baseline][bin];
+  w = channel / AMPPHASE_MASK_BITS;
+  word = mask[w] & (~0U << (channel % AMPPHASE_MASK_BITS));
+  while (word == 0) {
+    w++;
+    if (w >= nwords) {
+      return ampphase->nchannels;
+    }
+    word = mask[w];
+  }
+  // Bits are never set past the last channel.
+  return (w * AMPPHASE_MASK_BITS + __builtin_ctz(word));
+}
+
+/*!
+ *  \brief Copy the values of only the good channels in a spectrum into
+ *         a compacted array
+ *  \param ampphase the ampphase structure
+ *  \param baseline the baseline index
+ *  \param bin the bin index
+ *  \param values the `nchannels` values to take the good channels from; this
+ *                can be one of the spectra in \a ampphase, or a per-channel
+ *                array like `channel` or `frequency`
+ *  \param compacted an array with room for `f_nchannels[baseline][bin]`
+ *                   values, which is filled with the values of the good channels
+ *                   in order
+ *  \return the number of values copied into \a compacted
+ */
+int ampphase_compact_float(struct ampphase *ampphase, int baseline, int bin,
+			   float *values, float *compacted) {
+  int k, n = 0;
+
+  for (k = ampphase_next_valid_channel(ampphase, baseline, bin, 0);
+       k < ampphase->nchannels;
+       k = ampphase_next_valid_channel(ampphase, baseline, bin, k + 1)) {
+    compacted[n++] = values[k];
+  }
+  return n;
+}
+
+/*!
+ *  \brief Copy the complex values of only the good channels in a spectrum
+ *         into a compacted array
+ *  \param ampphase the ampphase structure
+ *  \param baseline the baseline index
+ *  \param bin the bin index
+ *  \param values the `nchannels` values to take the good channels from
+ *  \param compacted an array with room for `f_nchannels[baseline][bin]`
+ *                   values, which is filled with the values of the good channels
+ *                   in order
+ *  \return the number of values copied into \a compacted
+ */
+int ampphase_compact_complex(struct ampphase *ampphase, int baseline, int bin,
+			     float complex *values, float complex *compacted) {
+  int k, n = 0;
+
+  for (k = ampphase_next_valid_channel(ampphase, baseline, bin, 0);
+       k < ampphase->nchannels;
+       k = ampphase_next_valid_channel(ampphase, baseline, bin, k + 1)) {
+    compacted[n++] = values[k];
+  }
+  return n;
+}
+
 /*!
  *  \brief Initialise and return a vis_quantities structure
  *  \return a pointer to a properly initialised vis_quantities structure
@@ -247,6 +677,7 @@ struct vis_quantities* prepare_vis_quantities(void) {
   vis_quantities->ntriangles = 0;
   vis_quantities->nbins_cross = 0;
   vis_quantities->triangles = NULL;
+  vis_quantities->closure_reference_antenna = -1;
   
   vis_quantities->amplitude = NULL;
   vis_quantities->phase = NULL;
@@ -273,53 +704,31 @@ struct vis_quantities* prepare_vis_quantities(void) {
  * the ampphase structure, and also frees the structure itself.
  */
 void free_ampphase(struct ampphase **ampphase) {
-  int i = 0, j = 0;
-
-  for (i = 0; i < (*ampphase)->nbaselines; i++) {
-    for (j = 0; j < (*ampphase)->nbins[i]; j++) {
-      FREE((*ampphase)->weight[i][j]);
-      FREE((*ampphase)->amplitude[i][j]);
-      FREE((*ampphase)->phase[i][j]);
-      FREE((*ampphase)->raw[i][j]);
-      FREE((*ampphase)->f_channel[i][j]);
-      FREE((*ampphase)->f_frequency[i][j]);
-      FREE((*ampphase)->f_weight[i][j]);
-      FREE((*ampphase)->f_amplitude[i][j]);
-      FREE((*ampphase)->f_phase[i][j]);
-      FREE((*ampphase)->f_raw[i][j]);
-    }
-    FREE((*ampphase)->flagged_bad[i]);
-    FREE((*ampphase)->weight[i]);
-    FREE((*ampphase)->amplitude[i]);
-    FREE((*ampphase)->phase[i]);
-    FREE((*ampphase)->raw[i]);
-    FREE((*ampphase)->f_nchannels[i]);
-    FREE((*ampphase)->f_channel[i]);
-    FREE((*ampphase)->f_frequency[i]);
-    FREE((*ampphase)->f_weight[i]);
-    FREE((*ampphase)->f_amplitude[i]);
-    FREE((*ampphase)->f_phase[i]);
-    FREE((*ampphase)->f_raw[i]);
-  }
+  // All the baseline and bin arrays are views into a few blocks.
   FREE((*ampphase)->flagged_bad);
   FREE((*ampphase)->weight);
   FREE((*ampphase)->amplitude);
   FREE((*ampphase)->phase);
   FREE((*ampphase)->raw);
   FREE((*ampphase)->f_nchannels);
+  FREE((*ampphase)->valid);
+  FREE((*ampphase)->spectrum_views);
+  FREE((*ampphase)->complex_spectrum_views);
+  FREE((*ampphase)->valid_views);
+  FREE((*ampphase)->spectrum_offset);
+  FREE((*ampphase)->flagged_bad_block);
+  FREE((*ampphase)->f_nchannels_block);
+  FREE((*ampphase)->weight_block);
+  FREE((*ampphase)->amplitude_block);
+  FREE((*ampphase)->phase_block);
+  FREE((*ampphase)->raw_block);
+  FREE((*ampphase)->valid_block);
   FREE((*ampphase)->nbins);
 
   FREE((*ampphase)->channel);
   FREE((*ampphase)->frequency);
   FREE((*ampphase)->baseline);
 
-  FREE((*ampphase)->f_channel);
-  FREE((*ampphase)->f_frequency);
-  FREE((*ampphase)->f_weight);
-  FREE((*ampphase)->f_amplitude);
-  FREE((*ampphase)->f_phase);
-  FREE((*ampphase)->f_raw);
-
   FREE((*ampphase)->min_amplitude);
   FREE((*ampphase)->max_amplitude);
   FREE((*ampphase)->min_phase);
@@ -348,9 +757,9 @@ void free_vis_quantities(struct vis_quantities **vis_quantities) {
   int i;
   free_ampphase_options((*vis_quantities)->options);
   FREE((*vis_quantities)->options);
-  for (i = 0; i < (*vis_quantities)->ntriangles; i++) {
-    FREE((*vis_quantities)->triangles[i]);
-    FREE((*vis_quantities)->closure_phase[i]);
+  if ((*vis_quantities)->ntriangles > 0) {
+    FREE((*vis_quantities)->triangles[0]);
+    FREE((*vis_quantities)->closure_phase[0]);
   }
   FREE((*vis_quantities)->triangles);
   FREE((*vis_quantities)->closure_phase);
@@ -768,6 +1177,32 @@ struct ampphase_options* find_ampphase_options(int num_options,
   return match;
 }
 
+/*!
+ *  \brief Check whether two ampphase_options structures describe the same
+ *         band configuration
+ *  \param a the first options structure
+ *  \param b the second options structure
+ *  \return true if both structures have the same windows, with the same
+ *          centre frequencies, bandwidths and numbers of channels
+ */
+bool ampphase_options_same_band(struct ampphase_options *a,
+				struct ampphase_options *b) {
+  int j;
+
+  if (a->num_ifs != b->num_ifs) {
+    return false;
+  }
+  for (j = 1; j < a->num_ifs; j++) {
+    if ((a->if_centre_freq[j] != b->if_centre_freq[j]) ||
+	(a->if_bandwidth[j] != b->if_bandwidth[j]) ||
+	(a->if_nchannels[j] != b->if_nchannels[j])) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
 /*!
  *  \brief Copy one metinfo structure into another
  *  \param dest the destination structure which will be over-written
@@ -876,6 +1311,74 @@ void copy_syscal_data(struct syscal_data *dest,
   }
 }
 
+/*!
+ *  \brief Copy one vis_quantities structure into another
+ *  \param dest the destination structure which will be over-written
+ *  \param src the source structure from which all values will be copied
+ *
+ * The destination should be freshly made by prepare_vis_quantities, since
+ * all its arrays are allocated here without freeing anything first. Once
+ * copied, the two structures share no memory and can be freed independently.
+ */
+void copy_vis_quantities(struct vis_quantities *dest,
+			 struct vis_quantities *src) {
+  int i;
+  if (src->options != NULL) {
+    CALLOC(dest->options, 1);
+    copy_ampphase_options(dest->options, src->options);
+  }
+  STRUCTCOPY(src, dest, nbaselines);
+  strncpy(dest->obsdate, src->obsdate, OBSDATE_LENGTH);
+  STRUCTCOPY(src, dest, ut_seconds);
+  STRUCTCOPY(src, dest, pol);
+  STRUCTCOPY(src, dest, window);
+  STRUCTCOPY(src, dest, source_no);
+  strncpy(dest->scantype, src->scantype, OBSTYPE_LENGTH);
+  MALLOC(dest->nbins, dest->nbaselines);
+  MALLOC(dest->baseline, dest->nbaselines);
+  MALLOC(dest->flagged_bad, dest->nbaselines);
+  MALLOC(dest->amplitude, dest->nbaselines);
+  MALLOC(dest->phase, dest->nbaselines);
+  MALLOC(dest->delay, dest->nbaselines);
+  for (i = 0; i < dest->nbaselines; i++) {
+    STRUCTCOPY(src, dest, nbins[i]);
+    STRUCTCOPY(src, dest, baseline[i]);
+    STRUCTCOPY(src, dest, flagged_bad[i]);
+    MALLOC(dest->amplitude[i], dest->nbins[i]);
+    MALLOC(dest->phase[i], dest->nbins[i]);
+    MALLOC(dest->delay[i], dest->nbins[i]);
+    memcpy(dest->amplitude[i], src->amplitude[i], dest->nbins[i] * sizeof(float));
+    memcpy(dest->phase[i], src->phase[i], dest->nbins[i] * sizeof(float));
+    memcpy(dest->delay[i], src->delay[i], dest->nbins[i] * sizeof(float));
+  }
+  STRUCTCOPY(src, dest, min_amplitude);
+  STRUCTCOPY(src, dest, max_amplitude);
+  STRUCTCOPY(src, dest, min_phase);
+  STRUCTCOPY(src, dest, max_phase);
+  STRUCTCOPY(src, dest, min_delay);
+  STRUCTCOPY(src, dest, max_delay);
+
+  // The closure phases are kept in single blocks, so they're copied that way.
+  STRUCTCOPY(src, dest, ntriangles);
+  STRUCTCOPY(src, dest, nbins_cross);
+  if (dest->ntriangles > 0) {
+    MALLOC(dest->triangles, dest->ntriangles);
+    MALLOC(dest->closure_phase, dest->ntriangles);
+    MALLOC(dest->triangles[0], 3 * dest->ntriangles);
+    CALLOC(dest->closure_phase[0], dest->ntriangles * dest->nbins_cross + 1);
+    memcpy(dest->triangles[0], src->triangles[0], 3 * dest->ntriangles * sizeof(int));
+    memcpy(dest->closure_phase[0], src->closure_phase[0],
+	   dest->ntriangles * dest->nbins_cross * sizeof(float));
+    for (i = 1; i < dest->ntriangles; i++) {
+      dest->triangles[i] = dest->triangles[0] + 3 * i;
+      dest->closure_phase[i] = dest->closure_phase[0] + dest->nbins_cross * i;
+    }
+  }
+  STRUCTCOPY(src, dest, closure_reference_antenna);
+  STRUCTCOPY(src, dest, min_closure_phase);
+  STRUCTCOPY(src, dest, max_closure_phase);
+}
+
 /*!
  *  \brief Free a syscal_data structure's memory
  *  \param syscal_data a pointer to the syscal_data structure pointer
@@ -1054,119 +1557,192 @@ void add_tvchannels_to_options(struct ampphase_options *ampphase_options, int wi
 
 
 /*!
- *  \brief Compute amplitude and phase from raw data for a single cycle, pol
- *         and window
+ *  \brief Find the index of a window in the arrays of a scan header
  *  \param scan_header_data the header information for the scan
- *  \param cycle_data the raw data and metadata for a cycle within the scan
- *  \param ampphase a pointer to the output ampphase structure that will be filled
- *                  with the computed data; if this dereferenced pointer is NULL,
- *                  this routine will allocate the memory for the output structure
- *  \param pol the polarisation to compute the data for; one of the magic numbers POL_*
- *  \param ifnum the window number to compute the data for; the first window is 1
- *  \param num_options the number of ampphase_options structures in the following
- *                     array
- *  \param options the array of options which can be used when doing the computations;
- *                 this array will be searched for the options matching the band
- *                 configuration present in the scan_header_data, and if no match is
- *                 found, a new set of options will be added to this array
- *  \return an indication of whether the computations have worked:
- *          - -1 means that the specified `ifnum` or `pol` aren't in the raw data
- *          - 0 means the computations were successful
- *
- * This routine takes some raw complex data from a scan's cycle, and computes several
- * parameters, which would normally be thought of as "spectra" and viewed in SPD.
- * The data in the output `ampphase` is formatted in a way to allow for easy plotting,
- * and this routine also computes the maximum and minimum values along the plotting
- * axes. All raw data is available in the output, but a "clean" version is also available
- * which omits any channels that have been flagged bad.
- *
- * The metadata regarding calibration is also collated for the requested window and
- * polarisation.
+ *  \param ifnum the window number; the first window is 1
+ *  \return the index of the window, or -1 if the window isn't in the scan
  */
-int vis_ampphase(struct scan_header_data *scan_header_data,
-                 struct cycle_data *cycle_data,
-                 struct ampphase **ampphase,
-                 int pol, int ifnum, int *num_options,
-                 struct ampphase_options ***options) {
-  int ap_created = 0, reqpol = -1, i = 0, polnum = -1, bl = -1, bidx = -1;
-  int j = 0, k = 0, jflag = 0, vidx = -1, cidx = -1, ifno, syscal_if_idx = -1;
-  int syscal_pol_idx = -1, pidx1, pidx2;
-  float rcheck = 0, chanwidth, firstfreq, nhalfchan, total_delay = 0;
-  float phase_correction_angle, delay_angle;
-  double cmjd;
-  bool needs_new_options = false, correct_delay = false, correct_phase = false;
-  float complex phase_correction;
-  struct ampphase_options *band_options = NULL;
-  
+static int find_window_index(struct scan_header_data *scan_header_data, int ifnum) {
+  int i;
+
   // Check we know about the window number we were given.
   if ((ifnum < 1) || (ifnum > scan_header_data->num_ifs)) {
     return -1;
   }
   // Search for the index of the requested IF.
-  for (i = 0, ifno = -1; i < scan_header_data->num_ifs; i++) {
+  for (i = 0; i < scan_header_data->num_ifs; i++) {
     if (ifnum == scan_header_data->if_label[i]) {
-      ifno = i;
-      break;
+      return i;
     }
   }
-  if (ifno < 0) {
-    return -1;
+
+  return -1;
+}
+
+/*!
+ *  \brief Find where a polarisation is in the interleaved data of a window
+ *  \param scan_header_data the header information for the scan
+ *  \param ifno the index of the window
+ *  \param pol the polarisation; one of the magic numbers POL_*
+ *  \return the Stokes index of the polarisation, or -1 if the window
+ *          doesn't have that polarisation
+ */
+static int find_stokes_index(struct scan_header_data *scan_header_data, int ifno,
+			     int pol) {
+  int i;
+
+  for (i = 0; i < scan_header_data->if_num_stokes[ifno]; i++) {
+    if (polarisation_number(scan_header_data->if_stokes_names[ifno][i]) == pol) {
+      return i;
+    }
   }
 
-  // Try to find the correct options for this band.
-  band_options = find_ampphase_options(*num_options, *options,
-				       scan_header_data, NULL);
-  needs_new_options = (band_options == NULL);
+  return -1;
+}
 
-  /* printf("[vis_ampphase] after finding options\n"); */
-  /* print_options_set(*num_options, *options); */
-  /* printf("[vis_ampphase] band options are\n"); */
-  /* print_options_set(1, &band_options); */
+/*!
+ *  \brief Find the options for the band configuration of a scan, adding a
+ *         default set of options to the list if there isn't one already
+ *  \param scan_header_data the header information for the scan
+ *  \param num_options the number of ampphase_options structures in the
+ *                     following array, which is incremented if a new set is added
+ *  \param options the array of options to search, which is extended if a new
+ *                 set is added
+ *  \return a pointer to the options for the band, which is in the array
+ */
+static struct ampphase_options* find_band_options(struct scan_header_data *scan_header_data,
+						  int *num_options,
+						  struct ampphase_options ***options) {
+  struct ampphase_options *band_options = NULL;
 
-  if (needs_new_options) {
+  band_options = find_ampphase_options(*num_options, *options,
+				       scan_header_data, NULL);
+  if (band_options == NULL) {
     CALLOC(band_options, 1);
     set_default_ampphase_options(band_options);
     *num_options += 1;
     REALLOC(*options, *num_options);
-    CALLOC((*options)[*num_options - 1], 1);
     (*options)[*num_options - 1] = band_options;
   }
 
-  // Determine which of the polarisations is the one requested.
-  for (i = 0; i < scan_header_data->if_num_stokes[ifno]; i++) {
-    polnum = polarisation_number(scan_header_data->if_stokes_names[ifno][i]);
-    if (polnum == pol) {
-      reqpol = i;
-      break;
-    }
-  }
-  if (reqpol == -1) {
-    // Didn't find the requested polarisation.
-    return -1;
-  }
+  return band_options;
+}
+
+/*! \struct ampphase_target
+ *  \brief The state kept for each window and polarisation that is being
+ *         filled while passing through the data of a cycle
+ */
+struct ampphase_target {
+  /*! \var ampphase
+   *  \brief Where the pointer to the output structure is kept
+   */
+  struct ampphase **ampphase;
+  /*! \var created
+   *  \brief Whether the output structure was allocated for this computation
+   */
+  bool created;
+  /*! \var ifno
+   *  \brief The index of the window in the scan header arrays
+   */
+  int ifno;
+  /*! \var ifnum
+   *  \brief The window number; the first window is 1
+   */
+  int ifnum;
+  /*! \var pol
+   *  \brief The polarisation, one of the magic numbers POL_*
+   */
+  int pol;
+  /*! \var reqpol
+   *  \brief The Stokes index of the polarisation in the interleaved data
+   */
+  int reqpol;
+  /*! \var pidx1
+   *  \brief The polarisation (POL_X or POL_Y) to use for the first antenna
+   *         when applying delay and phase modifiers
+   */
+  int pidx1;
+  /*! \var pidx2
+   *  \brief The polarisation (POL_X or POL_Y) to use for the second antenna
+   *         when applying delay and phase modifiers
+   */
+  int pidx2;
+  /*! \var total_delay
+   *  \brief The delay to correct on the current point, in ns
+   */
+  float total_delay;
+  /*! \var phase_correction_angle
+   *  \brief The phase to correct on the current point
+   */
+  float phase_correction_angle;
+  /*! \var correct_delay
+   *  \brief Whether the current point needs a delay correction
+   */
+  bool correct_delay;
+  /*! \var correct_phase
+   *  \brief Whether the current point needs a phase correction
+   */
+  bool correct_phase;
+  /*! \var phasor
+   *  \brief The correction to apply to the next channel of the current point
+   */
+  double complex phasor;
+  /*! \var phasor_step
+   *  \brief The rotation of the correction from one channel to the next on
+   *         the current point
+   */
+  double complex phasor_step;
+  /*! \var tsys_scale
+   *  \brief The system temperature scaling for the current point, from the
+   *         cycle's tsys_scale table
+   */
+  float tsys_scale;
+};
+
+/*!
+ *  \brief Prepare an ampphase structure to receive the data for one
+ *         window and polarisation of a cycle
+ *  \param scan_header_data the header information for the scan
+ *  \param cycle_data the raw data and metadata for a cycle within the scan
+ *  \param target the window and polarisation, with `ampphase`, `ifno`, `ifnum`,
+ *                `pol` and `reqpol` already set; the rest is filled in here
+ *  \param band_options the options for the band configuration of the scan
+ *
+ * The header and calibration information is filled in, and all the arrays
+ * that don't depend on the data points are allocated.
+ */
+static void vis_ampphase_prepare(struct scan_header_data *scan_header_data,
+				 struct cycle_data *cycle_data,
+				 struct ampphase_target *target,
+				 struct ampphase_options *band_options) {
+  int i, ifno = target->ifno, ifnum = target->ifnum, pol = target->pol;
+  int reqpol = target->reqpol, syscal_if_idx = -1, syscal_pol_idx = -1;
+  float chanwidth, firstfreq, nhalfchan;
+  struct ampphase **ampphase = target->ampphase;
 
   // Later, if we need to do delay correction, we will need to know which
   // polarisations to deal with on each antenna, so we determine that here.
   switch (pol) {
   case POL_XX:
-    pidx1 = pidx2 = POL_X;
+    target->pidx1 = target->pidx2 = POL_X;
     break;
   case POL_YY:
-    pidx1 = pidx2 = POL_Y;
+    target->pidx1 = target->pidx2 = POL_Y;
     break;
   case POL_XY:
-    pidx1 = POL_X;
-    pidx2 = POL_Y;
+    target->pidx1 = POL_X;
+    target->pidx2 = POL_Y;
     break;
   case POL_YX:
-    pidx1 = POL_Y;
-    pidx2 = POL_X;
+    target->pidx1 = POL_Y;
+    target->pidx2 = POL_X;
     break;
   }
   
+  target->created = false;
   // Prepare the structure if required.
   if (*ampphase == NULL) {
-    ap_created = 1;
+    target->created = true;
     *ampphase = prepare_ampphase();
   }
   (*ampphase)->window = ifnum;
@@ -1179,7 +1755,6 @@ int vis_ampphase(struct scan_header_data *scan_header_data,
   (*ampphase)->pol = pol;
   strncpy((*ampphase)->obsdate, scan_header_data->obsdate, OBSDATE_LENGTH);
   (*ampphase)->ut_seconds = cycle_data->ut_seconds;
-  cmjd = date2mjd((*ampphase)->obsdate, (*ampphase)->ut_seconds);
   strncpy((*ampphase)->scantype, scan_header_data->obstype, OBSTYPE_LENGTH);
   if (cycle_data->source_no != NULL) {
     (*ampphase)->source_no = cycle_data->source_no[0];
@@ -1354,12 +1929,9 @@ int vis_ampphase(struct scan_header_data *scan_header_data,
   MALLOC((*ampphase)->channel, (*ampphase)->nchannels);
   MALLOC((*ampphase)->frequency, (*ampphase)->nchannels);
 
+  // The baseline and bin arrays are allocated once we know how many bins
+  // each baseline has.
   (*ampphase)->nbaselines = cycle_data->n_baselines;
-  MALLOC((*ampphase)->flagged_bad, (*ampphase)->nbaselines);
-  MALLOC((*ampphase)->weight, (*ampphase)->nbaselines);
-  MALLOC((*ampphase)->amplitude, (*ampphase)->nbaselines);
-  MALLOC((*ampphase)->phase, (*ampphase)->nbaselines);
-  MALLOC((*ampphase)->raw, (*ampphase)->nbaselines);
   MALLOC((*ampphase)->baseline, (*ampphase)->nbaselines);
   MALLOC((*ampphase)->min_amplitude, (*ampphase)->nbaselines);
   MALLOC((*ampphase)->max_amplitude, (*ampphase)->nbaselines);
@@ -1369,21 +1941,9 @@ int vis_ampphase(struct scan_header_data *scan_header_data,
   MALLOC((*ampphase)->max_real, (*ampphase)->nbaselines);
   MALLOC((*ampphase)->min_imag, (*ampphase)->nbaselines);
   MALLOC((*ampphase)->max_imag, (*ampphase)->nbaselines);
-  MALLOC((*ampphase)->f_nchannels, (*ampphase)->nbaselines);
-  MALLOC((*ampphase)->f_channel, (*ampphase)->nbaselines);
-  MALLOC((*ampphase)->f_frequency, (*ampphase)->nbaselines);
-  MALLOC((*ampphase)->f_weight, (*ampphase)->nbaselines);
-  MALLOC((*ampphase)->f_amplitude, (*ampphase)->nbaselines);
-  MALLOC((*ampphase)->f_phase, (*ampphase)->nbaselines);
-  MALLOC((*ampphase)->f_raw, (*ampphase)->nbaselines);
 
   CALLOC((*ampphase)->nbins, (*ampphase)->nbaselines);
   for (i = 0; i < (*ampphase)->nbaselines; i++) {
-    (*ampphase)->flagged_bad[i] = NULL;
-    (*ampphase)->weight[i] = NULL;
-    (*ampphase)->amplitude[i] = NULL;
-    (*ampphase)->phase[i] = NULL;
-    (*ampphase)->raw[i] = NULL;
     (*ampphase)->min_amplitude[i] = INFINITY;
     (*ampphase)->max_amplitude[i] = -INFINITY;
     (*ampphase)->min_phase[i] = INFINITY;
@@ -1393,13 +1953,6 @@ int vis_ampphase(struct scan_header_data *scan_header_data,
     (*ampphase)->min_imag[i] = INFINITY;
     (*ampphase)->max_imag[i] = -INFINITY;
     (*ampphase)->baseline[i] = 0;
-    (*ampphase)->f_nchannels[i] = NULL;
-    (*ampphase)->f_channel[i] = NULL;
-    (*ampphase)->f_frequency[i] = NULL;
-    (*ampphase)->f_weight[i] = NULL;
-    (*ampphase)->f_amplitude[i] = NULL;
-    (*ampphase)->f_phase[i] = NULL;
-    (*ampphase)->f_raw[i] = NULL;
   }
   
   // Fill the arrays.
@@ -1420,232 +1973,769 @@ int vis_ampphase(struct scan_header_data *scan_header_data,
     // Compute the channel frequency.
     (*ampphase)->frequency[i] = firstfreq + (float)i * chanwidth;
   }
+}
 
-  for (i = 0; i < cycle_data->num_points; i++) {
-    // Check this is the IF we are after.
-    if (cycle_data->if_no[i] != (ifno + 1)) {
-      continue;
-    }
-    /*printf("found the bin with point %d, baseline %d-%d!\n", i,
-      cycle_data->ant1[i], cycle_data->ant2[i]); */
-    bl = ants_to_base(cycle_data->ant1[i], cycle_data->ant2[i]);
-    if (bl < 0) {
-      continue;
-    }
-    bidx = cycle_data->all_baselines[bl] - 1;
-    if (bidx < 0) {
-      // This is wrong.
-      if (ap_created) {
-        free_ampphase(ampphase);
-      }
-      return -1;
-    }
-    if ((*ampphase)->baseline[bidx] == 0) {
-      (*ampphase)->baseline[bidx] = bl;
-    }
-    if ((*ampphase)->nbins[bidx] < cycle_data->bin[i]) {
-      // Found another bin, add it to the list.
-      REALLOC((*ampphase)->flagged_bad[bidx], cycle_data->bin[i]);
-      REALLOC((*ampphase)->weight[bidx], cycle_data->bin[i]);
-      REALLOC((*ampphase)->amplitude[bidx], cycle_data->bin[i]);
-      REALLOC((*ampphase)->phase[bidx], cycle_data->bin[i]);
-      REALLOC((*ampphase)->raw[bidx], cycle_data->bin[i]);
-      REALLOC((*ampphase)->f_nchannels[bidx], cycle_data->bin[i]);
-      REALLOC((*ampphase)->f_channel[bidx], cycle_data->bin[i]);
-      REALLOC((*ampphase)->f_frequency[bidx], cycle_data->bin[i]);
-      REALLOC((*ampphase)->f_weight[bidx], cycle_data->bin[i]);
-      REALLOC((*ampphase)->f_amplitude[bidx], cycle_data->bin[i]);
-      REALLOC((*ampphase)->f_phase[bidx], cycle_data->bin[i]);
-      REALLOC((*ampphase)->f_raw[bidx], cycle_data->bin[i]);
-      for (j = (*ampphase)->nbins[bidx]; j < cycle_data->bin[i]; j++) {
-        (*ampphase)->flagged_bad[bidx][j] = cycle_data->flag[i];
-        MALLOC((*ampphase)->weight[bidx][j], (*ampphase)->nchannels);
-        MALLOC((*ampphase)->amplitude[bidx][j], (*ampphase)->nchannels);
-        MALLOC((*ampphase)->phase[bidx][j], (*ampphase)->nchannels);
-        MALLOC((*ampphase)->raw[bidx][j], (*ampphase)->nchannels);
-        (*ampphase)->f_nchannels[bidx][j] = (*ampphase)->nchannels;
-        MALLOC((*ampphase)->f_channel[bidx][j], (*ampphase)->nchannels);
-        MALLOC((*ampphase)->f_frequency[bidx][j], (*ampphase)->nchannels);
-        MALLOC((*ampphase)->f_weight[bidx][j], (*ampphase)->nchannels);
-        MALLOC((*ampphase)->f_amplitude[bidx][j], (*ampphase)->nchannels);
-        MALLOC((*ampphase)->f_phase[bidx][j], (*ampphase)->nchannels);
-        MALLOC((*ampphase)->f_raw[bidx][j], (*ampphase)->nchannels);
+/*!
+ *  \brief Store one channel of raw data in an ampphase structure
+ *  \param ap the ampphase structure
+ *  \param target the state of the window and polarisation being filled
+ *  \param bidx the baseline index
+ *  \param cidx the bin index
+ *  \param j the channel
+ *  \param vis the raw complex data for this channel
+ *  \param wgt the raw weight for this channel
+ *
+ * Only the weight and the corrected complex value are stored here, and the
+ * channel is marked as good if it isn't flagged; everything derived from them
+ * is computed by vis_ampphase_spectrum once the whole spectrum is in place.
+ */
+static void vis_ampphase_channel(struct ampphase *ap, struct ampphase_target *target,
+				 int bidx, int cidx, int j, float complex vis, float wgt) {
+  float rcheck = 0, delay_angle;
+
+  ap->weight[bidx][cidx][j] = wgt;
+  if (target->correct_delay || target->correct_phase) {
+    // The delay angle is linear in frequency, so the correction for each
+    // channel is the previous one rotated by a fixed step. We start again
+    // from the exact value every so often so that rounding errors don't
+    // build up.
+    if ((j % PHASOR_RENORMALISE_CHANNELS) == 0) {
+      if (target->correct_delay) {
+	delay_angle = -2.0 * M_PI * target->total_delay * ap->frequency[j] / 1000.0;
+      } else {
+	delay_angle = 0;
       }
-      (*ampphase)->nbins[bidx] = cycle_data->bin[i];
+      target->phasor = cos(delay_angle - target->phase_correction_angle) +
+	I * sin(delay_angle - target->phase_correction_angle);
     }
-    /*printf("baseline number is %d, index is %d, confirmation %d\n",
-	   bl, bidx, (*ampphase)->baseline[bidx]);
-	   printf("this baseline has %d channels\n", (*ampphase)->nchannels);*/
-    cidx = cycle_data->bin[i] - 1;
-    // Check for a modifier which might need us to add some delay.
-    total_delay = 0;
-    phase_correction_angle = 0;
-    correct_delay = false;
-    correct_phase = false;
-    for (k = 0; k < band_options->num_modifiers[ifnum]; k++) {
-      /* printf(" modifier found MJD %.6f - %.6f\n", */
-      /* 	     band_options->modifiers[ifnum][k]->delay_start_mjd, */
-      /* 	     band_options->modifiers[ifnum][k]->delay_end_mjd); */
-      /* printf(" modifier found for:\n"); */
-      /* if (band_options->modifiers[ifnum][k]->add_delay) { */
-      /* 	printf("   delay (MJD %.6f - %.6f)\n", */
-      /* 	       band_options->modifiers[ifnum][k]->delay_start_mjd, */
-      /* 	       band_options->modifiers[ifnum][k]->delay_end_mjd); */
-      /* } */
-      /* if (band_options->modifiers[ifnum][k]->add_phase) { */
-      /* 	printf("   phase (MJD %.6f - %.6f)\n", */
-      /* 	       band_options->modifiers[ifnum][k]->phase_start_mjd, */
-      /* 	       band_options->modifiers[ifnum][k]->phase_end_mjd); */
-      /* } */
-      if ((band_options->modifiers[ifnum][k]->add_delay) &&
-	  (cmjd >= band_options->modifiers[ifnum][k]->delay_start_mjd) &&
-	  (cmjd <= band_options->modifiers[ifnum][k]->delay_end_mjd)) {
-	if (cycle_data->ant1[i] != cycle_data->ant2[i]) {
-	  total_delay += (band_options->modifiers[ifnum][k]->delay[cycle_data->ant2[i]][pidx2] -
-			  band_options->modifiers[ifnum][k]->delay[cycle_data->ant1[i]][pidx1]);
-	} else if (pol == POL_XY) {
-	  total_delay += band_options->modifiers[ifnum][k]->delay[cycle_data->ant1[i]][POL_XY];
-	} else if (pol == POL_YX) {
-	  total_delay -= band_options->modifiers[ifnum][k]->delay[cycle_data->ant1[i]][POL_XY];
-	}
-	/* printf(" baseline %d-%d pol %d, delay ant %d %.3f ns, delay ant %d %.3f ns, delay %.3f ns\n", */
-	/*        cycle_data->ant1[i], cycle_data->ant2[i], pol, */
-	/*        cycle_data->ant1[i], */
-	/*        band_options->modifiers[ifnum][k]->delay[cycle_data->ant1[i]][pidx1], */
-	/*        cycle_data->ant2[i], */
-	/*        band_options->modifiers[ifnum][k]->delay[cycle_data->ant2[i]][pidx2], */
-	/*        total_delay); */
-	correct_delay = true;
+    ap->raw[bidx][cidx][j] = vis * (float complex)target->phasor;
+    target->phasor *= target->phasor_step;
+  } else {
+    ap->raw[bidx][cidx][j] = vis;
+  }
+  // The flagging is determined by the data before any correction.
+  rcheck = crealf(vis);
+  if (rcheck != rcheck) {
+    // A bad channel.
+    ap->f_nchannels[bidx][cidx] -= 1;
+  } else {
+    ampphase_set_valid(ap, bidx, cidx, j);
+  }
+}
+
+/*! \struct spectrum_extrema
+ *  \brief The limits of the valid data in a single spectrum
+ */
+struct spectrum_extrema {
+  /*! \var min_amplitude
+   *  \brief The minimum amplitude
+   */
+  float min_amplitude;
+  /*! \var max_amplitude
+   *  \brief The maximum amplitude
+   */
+  float max_amplitude;
+  /*! \var min_phase
+   *  \brief The minimum phase
+   */
+  float min_phase;
+  /*! \var max_phase
+   *  \brief The maximum phase
+   */
+  float max_phase;
+  /*! \var min_real
+   *  \brief The minimum real component
+   */
+  float min_real;
+  /*! \var max_real
+   *  \brief The maximum real component
+   */
+  float max_real;
+  /*! \var min_imag
+   *  \brief The minimum imaginary component
+   */
+  float min_imag;
+  /*! \var max_imag
+   *  \brief The maximum imaginary component
+   */
+  float max_imag;
+};
+
+/*!
+ *  \brief Compute the amplitude of each value in a spectrum
+ *  \param n the number of channels
+ *  \param raw the complex values
+ *  \param amplitude the array to fill with the amplitudes
+ */
+static void spectrum_amplitudes_scalar(int n, float complex *raw, float *amplitude) {
+  int j;
+
+  for (j = 0; j < n; j++) {
+    amplitude[j] = cabsf(raw[j]);
+  }
+}
+
+/*!
+ *  \brief Find the limits of the valid data in a spectrum
+ *  \param n the number of channels
+ *  \param raw the complex values
+ *  \param amplitude the amplitude of each channel
+ *  \param phase the phase of each channel
+ *  \param extrema the limits to update; a channel is only considered if its
+ *                 amplitude is not NaN
+ */
+static void spectrum_extrema_scalar(int n, float complex *raw, float *amplitude,
+				    float *phase, struct spectrum_extrema *extrema) {
+  int j;
+
+  for (j = 0; j < n; j++) {
+    if (amplitude[j] != amplitude[j]) {
+      continue;
+    }
+    if (amplitude[j] < extrema->min_amplitude) {
+      extrema->min_amplitude = amplitude[j];
+    }
+    if (amplitude[j] > extrema->max_amplitude) {
+      extrema->max_amplitude = amplitude[j];
+    }
+    if (phase[j] < extrema->min_phase) {
+      extrema->min_phase = phase[j];
+    }
+    if (phase[j] > extrema->max_phase) {
+      extrema->max_phase = phase[j];
+    }
+    if (crealf(raw[j]) < extrema->min_real) {
+      extrema->min_real = crealf(raw[j]);
+    }
+    if (crealf(raw[j]) > extrema->max_real) {
+      extrema->max_real = crealf(raw[j]);
+    }
+    if (cimagf(raw[j]) < extrema->min_imag) {
+      extrema->min_imag = cimagf(raw[j]);
+    }
+    if (cimagf(raw[j]) > extrema->max_imag) {
+      extrema->max_imag = cimagf(raw[j]);
+    }
+  }
+}
+
+#ifdef COMPUTE_AVX2
+/*!
+ *  \brief Compute the amplitude of each value in a spectrum, using AVX2
+ *  \param n the number of channels
+ *  \param raw the complex values
+ *  \param amplitude the array to fill with the amplitudes
+ *
+ * The amplitude is computed in double precision and rounded back to single,
+ * which is how the C library computes cabsf, so the results are identical.
+ * Any block of channels with a non-finite value in it is handed to cabsf
+ * instead, so that infinities and NaNs are treated the same way too.
+ */
+__attribute__((target("avx2")))
+static void spectrum_amplitudes_avx2(int n, float complex *raw, float *amplitude) {
+  int j;
+  const __m256i split = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+  const __m256 sign = _mm256_set1_ps(-0.0f), inf = _mm256_set1_ps(INFINITY);
+  __m256 v;
+  __m256d re, im;
+
+  for (j = 0; j + 4 <= n; j += 4) {
+    v = _mm256_loadu_ps((float *)(raw + j));
+    if (_mm256_movemask_ps(_mm256_cmp_ps(_mm256_andnot_ps(sign, v), inf,
+					 _CMP_NLT_UQ)) != 0) {
+      spectrum_amplitudes_scalar(4, raw + j, amplitude + j);
+      continue;
+    }
+    // Put the real parts in the low half and the imaginary parts in the high half.
+    v = _mm256_permutevar8x32_ps(v, split);
+    re = _mm256_cvtps_pd(_mm256_castps256_ps128(v));
+    im = _mm256_cvtps_pd(_mm256_extractf128_ps(v, 1));
+    re = _mm256_sqrt_pd(_mm256_add_pd(_mm256_mul_pd(re, re), _mm256_mul_pd(im, im)));
+    _mm_storeu_ps(amplitude + j, _mm256_cvtpd_ps(re));
+  }
+  spectrum_amplitudes_scalar(n - j, raw + j, amplitude + j);
+}
+
+/*!
+ *  \brief Find the limits of the valid data in a spectrum, using AVX2
+ *  \param n the number of channels
+ *  \param raw the complex values
+ *  \param amplitude the amplitude of each channel
+ *  \param phase the phase of each channel
+ *  \param extrema the limits to update; a channel is only considered if its
+ *                 amplitude is not NaN
+ *
+ * Eight channels are compared at a time, with each lane keeping its own limits
+ * until they are combined at the end. Channels that shouldn't be considered
+ * are replaced by a value that can't change the limits, and the comparisons
+ * are ordered so that a NaN never replaces a limit, just like the scalar
+ * comparisons.
+ */
+__attribute__((target("avx2")))
+static void spectrum_extrema_avx2(int n, float complex *raw, float *amplitude,
+				  float *phase, struct spectrum_extrema *extrema) {
+  int j, k;
+  const __m256i split = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+  const __m256 pinf = _mm256_set1_ps(INFINITY), ninf = _mm256_set1_ps(-INFINITY);
+  __m256 min_amp = pinf, max_amp = ninf, min_pha = pinf, max_pha = ninf;
+  __m256 min_re = pinf, max_re = ninf, min_im = pinf, max_im = ninf;
+  __m256 amp, pha, lo, hi, re, im, valid;
+  float lanes[8][8];
+  struct spectrum_extrema lane;
+
+  for (j = 0; j + 8 <= n; j += 8) {
+    amp = _mm256_loadu_ps(amplitude + j);
+    pha = _mm256_loadu_ps(phase + j);
+    lo = _mm256_permutevar8x32_ps(_mm256_loadu_ps((float *)(raw + j)), split);
+    hi = _mm256_permutevar8x32_ps(_mm256_loadu_ps((float *)(raw + j + 4)), split);
+    re = _mm256_permute2f128_ps(lo, hi, 0x20);
+    im = _mm256_permute2f128_ps(lo, hi, 0x31);
+    valid = _mm256_cmp_ps(amp, amp, _CMP_ORD_Q);
+    // The min and max instructions return their second operand if the first
+    // is NaN, so the new values always go first.
+    min_amp = _mm256_min_ps(_mm256_blendv_ps(pinf, amp, valid), min_amp);
+    max_amp = _mm256_max_ps(_mm256_blendv_ps(ninf, amp, valid), max_amp);
+    min_pha = _mm256_min_ps(_mm256_blendv_ps(pinf, pha, valid), min_pha);
+    max_pha = _mm256_max_ps(_mm256_blendv_ps(ninf, pha, valid), max_pha);
+    min_re = _mm256_min_ps(_mm256_blendv_ps(pinf, re, valid), min_re);
+    max_re = _mm256_max_ps(_mm256_blendv_ps(ninf, re, valid), max_re);
+    min_im = _mm256_min_ps(_mm256_blendv_ps(pinf, im, valid), min_im);
+    max_im = _mm256_max_ps(_mm256_blendv_ps(ninf, im, valid), max_im);
+  }
+  _mm256_storeu_ps(lanes[0], min_amp);
+  _mm256_storeu_ps(lanes[1], max_amp);
+  _mm256_storeu_ps(lanes[2], min_pha);
+  _mm256_storeu_ps(lanes[3], max_pha);
+  _mm256_storeu_ps(lanes[4], min_re);
+  _mm256_storeu_ps(lanes[5], max_re);
+  _mm256_storeu_ps(lanes[6], min_im);
+  _mm256_storeu_ps(lanes[7], max_im);
+  for (k = 0; k < 8; k++) {
+    lane.min_amplitude = lanes[0][k];
+    lane.max_amplitude = lanes[1][k];
+    lane.min_phase = lanes[2][k];
+    lane.max_phase = lanes[3][k];
+    lane.min_real = lanes[4][k];
+    lane.max_real = lanes[5][k];
+    lane.min_imag = lanes[6][k];
+    lane.max_imag = lanes[7][k];
+    if (lane.min_amplitude < extrema->min_amplitude) {
+      extrema->min_amplitude = lane.min_amplitude;
+    }
+    if (lane.max_amplitude > extrema->max_amplitude) {
+      extrema->max_amplitude = lane.max_amplitude;
+    }
+    if (lane.min_phase < extrema->min_phase) {
+      extrema->min_phase = lane.min_phase;
+    }
+    if (lane.max_phase > extrema->max_phase) {
+      extrema->max_phase = lane.max_phase;
+    }
+    if (lane.min_real < extrema->min_real) {
+      extrema->min_real = lane.min_real;
+    }
+    if (lane.max_real > extrema->max_real) {
+      extrema->max_real = lane.max_real;
+    }
+    if (lane.min_imag < extrema->min_imag) {
+      extrema->min_imag = lane.min_imag;
+    }
+    if (lane.max_imag > extrema->max_imag) {
+      extrema->max_imag = lane.max_imag;
+    }
+  }
+  spectrum_extrema_scalar(n - j, raw + j, amplitude + j, phase + j, extrema);
+}
+#endif
+
+/*!
+ *  \brief Compute the amplitudes, phases and limits of one spectrum in an
+ *         ampphase structure, after all its raw data is stored
+ *  \param ap the ampphase structure
+ *  \param bidx the baseline index
+ *  \param cidx the bin index
+ *  \param phase_in_degrees whether the phase should be stored in degrees
+ *
+ * The amplitudes and the limits are computed with AVX2 if the CPU we're
+ * running on supports it.
+ */
+static void vis_ampphase_spectrum(struct ampphase *ap, int bidx, int cidx,
+				  bool phase_in_degrees) {
+  int j, n = ap->nchannels;
+  float complex *raw = ap->raw[bidx][cidx];
+  float *amplitude = ap->amplitude[bidx][cidx], *phase = ap->phase[bidx][cidx];
+  struct spectrum_extrema extrema = { INFINITY, -INFINITY, INFINITY, -INFINITY,
+				      INFINITY, -INFINITY, INFINITY, -INFINITY };
+#ifdef COMPUTE_AVX2
+  bool use_avx2 = __builtin_cpu_supports("avx2");
+
+  if (use_avx2) {
+    spectrum_amplitudes_avx2(n, raw, amplitude);
+  } else {
+    spectrum_amplitudes_scalar(n, raw, amplitude);
+  }
+#else
+  spectrum_amplitudes_scalar(n, raw, amplitude);
+#endif
+  for (j = 0; j < n; j++) {
+    phase[j] = cargf(raw[j]);
+    if (phase_in_degrees == true) {
+      phase[j] *= (180 / M_PI);
+    }
+  }
+
+  // Assess the limits.
+#ifdef COMPUTE_AVX2
+  if (use_avx2) {
+    spectrum_extrema_avx2(n, raw, amplitude, phase, &extrema);
+  } else {
+    spectrum_extrema_scalar(n, raw, amplitude, phase, &extrema);
+  }
+#else
+  spectrum_extrema_scalar(n, raw, amplitude, phase, &extrema);
+#endif
+  if (extrema.min_amplitude < ap->min_amplitude[bidx]) {
+    ap->min_amplitude[bidx] = extrema.min_amplitude;
+    if (extrema.min_amplitude < ap->min_amplitude_global) {
+      ap->min_amplitude_global = extrema.min_amplitude;
+    }
+  }
+  if (extrema.max_amplitude > ap->max_amplitude[bidx]) {
+    ap->max_amplitude[bidx] = extrema.max_amplitude;
+    if (extrema.max_amplitude > ap->max_amplitude_global) {
+      ap->max_amplitude_global = extrema.max_amplitude;
+    }
+  }
+  if (extrema.min_phase < ap->min_phase[bidx]) {
+    ap->min_phase[bidx] = extrema.min_phase;
+    if (extrema.min_phase < ap->min_phase_global) {
+      ap->min_phase_global = extrema.min_phase;
+    }
+  }
+  if (extrema.max_phase > ap->max_phase[bidx]) {
+    ap->max_phase[bidx] = extrema.max_phase;
+    if (extrema.max_phase > ap->max_phase_global) {
+      ap->max_phase_global = extrema.max_phase;
+    }
+  }
+  if (extrema.min_real < ap->min_real[bidx]) {
+    ap->min_real[bidx] = extrema.min_real;
+  }
+  if (extrema.max_real > ap->max_real[bidx]) {
+    ap->max_real[bidx] = extrema.max_real;
+  }
+  if (extrema.min_imag < ap->min_imag[bidx]) {
+    ap->min_imag[bidx] = extrema.min_imag;
+  }
+  if (extrema.max_imag > ap->max_imag[bidx]) {
+    ap->max_imag[bidx] = extrema.max_imag;
+  }
+}
+
+/*!
+ *  \brief Allocate the baseline and bin arrays of the ampphase structures
+ *         that will be filled from a cycle
+ *  \param cycle_data the raw data and metadata for a cycle within the scan
+ *  \param num_targets the number of windows and polarisations to fill
+ *  \param targets the windows and polarisations, each already prepared with
+ *                 vis_ampphase_prepare
+ *  \return 0 if the arrays were allocated, or -1 if the data contained a
+ *          baseline that wasn't properly indexed
+ *
+ * We count the bins that each baseline will have, so the arrays can be
+ * allocated in one go. The bin counts are then put back to 0, since
+ * vis_ampphase_fill initialises each bin as it first encounters it.
+ */
+static int vis_ampphase_allocate(struct cycle_data *cycle_data, int num_targets,
+				 struct ampphase_target *targets) {
+  int i, t, ifno, bl, bidx, rv = 0;
+  struct ampphase *ap = NULL;
+
+  for (i = 0; i < cycle_data->num_points; i++) {
+    ifno = cycle_data->if_no[i] - 1;
+    bl = ants_to_base(cycle_data->ant1[i], cycle_data->ant2[i]);
+    if (bl < 0) {
+      continue;
+    }
+    bidx = cycle_data->all_baselines[bl] - 1;
+    for (t = 0; t < num_targets; t++) {
+      if (targets[t].ifno != ifno) {
+	continue;
       }
-      if ((band_options->modifiers[ifnum][k]->add_phase) &&
-	  (cmjd >= band_options->modifiers[ifnum][k]->phase_start_mjd) &&
-	  (cmjd <= band_options->modifiers[ifnum][k]->phase_end_mjd)) {
-	if (cycle_data->ant1[i] != cycle_data->ant2[i]) {
-	  phase_correction_angle +=
-	    (band_options->modifiers[ifnum][k]->phase[cycle_data->ant2[i]][pidx2] -
-	     band_options->modifiers[ifnum][k]->phase[cycle_data->ant1[i]][pidx1]);
-	} else if (pol == POL_XY) {
-	  phase_correction_angle +=
-	    band_options->modifiers[ifnum][k]->phase[cycle_data->ant1[i]][POL_XY];
-	} else if (pol == POL_YX) {
-	  phase_correction_angle -=
-	    band_options->modifiers[ifnum][k]->phase[cycle_data->ant1[i]][POL_XY];
-	}
-	correct_phase = true;
+      if (bidx < 0) {
+	rv = -1;
+	break;
+      }
+      ap = *(targets[t].ampphase);
+      if (ap->nbins[bidx] < cycle_data->bin[i]) {
+	ap->nbins[bidx] = cycle_data->bin[i];
       }
     }
-    for (j = 0, jflag = 0; j < (*ampphase)->nchannels; j++) {
-      vidx = reqpol + j * scan_header_data->if_num_stokes[ifno];
-      (*ampphase)->weight[bidx][cidx][j] = cycle_data->wgt[i][vidx];
-      if (correct_delay) {
-	delay_angle = -2.0 * M_PI * total_delay * (*ampphase)->frequency[j] / 1000.0;
-	/* printf(" delay %.3f frequency %.3f angle = %.6f\n", total_delay, (*ampphase)->frequency[j], */
-	/*        delay_angle); */
-      } else {
-	delay_angle = 0;
+    if (rv < 0) {
+      break;
+    }
+  }
+
+  for (t = 0; t < num_targets; t++) {
+    ap = *(targets[t].ampphase);
+    allocate_ampphase_spectra(ap);
+    for (i = 0; i < ap->nbaselines; i++) {
+      ap->nbins[i] = 0;
+    }
+  }
+
+  return rv;
+}
+
+/*!
+ *  \brief Get the factor that a visibility in a cycle needs to be multiplied
+ *         by to have the applied system temperatures
+ *  \param cycle_data the cycle
+ *  \param iidx the index of the visibility's IF
+ *  \param bidx the index of the visibility's baseline, one less than the value
+ *              in the cycle's `all_baselines` array
+ *  \param stokes the Stokes index of the visibility
+ *  \return the factor, which is 1 if the visibility doesn't need scaling
+ */
+static float system_temperature_scale(struct cycle_data *cycle_data, int iidx,
+				      int bidx, int stokes) {
+  if ((cycle_data->tsys_scale == NULL) ||
+      (iidx < 0) || (iidx >= cycle_data->tsys_scale_num_ifs) ||
+      (bidx < 0) || (bidx >= cycle_data->n_baselines) ||
+      (stokes < 0) || (stokes >= cycle_data->tsys_scale_num_stokes)) {
+    return 1.0;
+  }
+  return cycle_data->tsys_scale[(iidx * cycle_data->n_baselines + bidx) *
+				cycle_data->tsys_scale_num_stokes + stokes];
+}
+
+/*!
+ *  \brief Fill the ampphase structures for any number of windows and
+ *         polarisations with a single pass through the data of a cycle
+ *  \param scan_header_data the header information for the scan
+ *  \param cycle_data the raw data and metadata for a cycle within the scan
+ *  \param num_targets the number of windows and polarisations to fill
+ *  \param targets the windows and polarisations, each already prepared with
+ *                 vis_ampphase_prepare
+ *  \param band_options the options for the band configuration of the scan
+ *  \return 0 if the data was stored, or -1 if the data contained a baseline
+ *          that wasn't properly indexed
+ *
+ * Each point's data has all the polarisations interleaved by channel, so
+ * instead of striding through the data once for each polarisation, we pass
+ * through it once and hand each value to the polarisation that wants it.
+ */
+static int vis_ampphase_fill(struct scan_header_data *scan_header_data,
+			     struct cycle_data *cycle_data, int num_targets,
+			     struct ampphase_target *targets,
+			     struct ampphase_options *band_options) {
+  int i, j, k, t, n, ifno, ifnum, pol, bl, bidx, cidx, nstokes, nchannels;
+  int *point_targets = NULL, vidx;
+  double cmjd, step_angle;
+  struct ampphase *ap = NULL;
+  struct ampphase_target *target = NULL;
+  struct ampphase_modifiers *modifier = NULL;
+
+  if (num_targets < 1) {
+    return 0;
+  }
+  if (vis_ampphase_allocate(cycle_data, num_targets, targets) < 0) {
+    // A baseline wasn't properly indexed.
+    return -1;
+  }
+  // All the targets come from the same cycle, so they have the same time.
+  cmjd = date2mjd((*(targets[0].ampphase))->obsdate, (*(targets[0].ampphase))->ut_seconds);
+  MALLOC(point_targets, num_targets);
+
+  for (i = 0; i < cycle_data->num_points; i++) {
+    // Find the targets that want data from this point's IF.
+    ifno = cycle_data->if_no[i] - 1;
+    for (t = 0, n = 0; t < num_targets; t++) {
+      if (targets[t].ifno == ifno) {
+	point_targets[n] = t;
+	n++;
       }
-      if (correct_delay || correct_phase) {
-	phase_correction = cos(delay_angle - phase_correction_angle) +
-	  I * sin(delay_angle - phase_correction_angle);
-	(*ampphase)->raw[bidx][cidx][j] = cycle_data->vis[i][vidx] * phase_correction;
-      } else {
-	(*ampphase)->raw[bidx][cidx][j] = cycle_data->vis[i][vidx];
+    }
+    if (n == 0) {
+      continue;
+    }
+    bl = ants_to_base(cycle_data->ant1[i], cycle_data->ant2[i]);
+    if (bl < 0) {
+      continue;
+    }
+    bidx = cycle_data->all_baselines[bl] - 1;
+    if (bidx < 0) {
+      // This is wrong.
+      FREE(point_targets);
+      return -1;
+    }
+    cidx = cycle_data->bin[i] - 1;
+
+    for (t = 0; t < n; t++) {
+      target = &(targets[point_targets[t]]);
+      ap = *(target->ampphase);
+      ifnum = target->ifnum;
+      pol = target->pol;
+      if (ap->baseline[bidx] == 0) {
+	ap->baseline[bidx] = bl;
       }
-      (*ampphase)->amplitude[bidx][cidx][j] = cabsf((*ampphase)->raw[bidx][cidx][j]);
-      (*ampphase)->phase[bidx][cidx][j] = cargf((*ampphase)->raw[bidx][cidx][j]);
-      if (band_options->phase_in_degrees == true) {
-        (*ampphase)->phase[bidx][cidx][j] *= (180 / M_PI);
+      if (ap->nbins[bidx] < cycle_data->bin[i]) {
+	// Found another bin, add it to the list.
+	// The arrays were allocated for all of this baseline's bins before
+	// we started, so we just need to initialise the new ones.
+	for (j = ap->nbins[bidx]; j < cycle_data->bin[i]; j++) {
+	  ap->flagged_bad[bidx][j] = cycle_data->flag[i];
+	  ap->f_nchannels[bidx][j] = ap->nchannels;
+	}
+	ap->nbins[bidx] = cycle_data->bin[i];
       }
-      // Now assign the data to the arrays considering flagging.
-      rcheck = crealf(cycle_data->vis[i][vidx]);
-      if (rcheck != rcheck) {
-        // A bad channel.
-        (*ampphase)->f_nchannels[bidx][cidx] -= 1;
-      } else {
-        (*ampphase)->f_channel[bidx][cidx][jflag] = (*ampphase)->channel[j];
-        (*ampphase)->f_frequency[bidx][cidx][jflag] = (*ampphase)->frequency[j];
-        (*ampphase)->f_weight[bidx][cidx][jflag] =
-          (*ampphase)->weight[bidx][cidx][j];
-        (*ampphase)->f_amplitude[bidx][cidx][jflag] =
-          (*ampphase)->amplitude[bidx][cidx][j];
-        (*ampphase)->f_phase[bidx][cidx][jflag] =
-          (*ampphase)->phase[bidx][cidx][j];
-        (*ampphase)->f_raw[bidx][cidx][jflag] =
-          (*ampphase)->raw[bidx][cidx][j];
-        jflag++;
+
+      // Check for a modifier which might need us to add some delay.
+      target->total_delay = 0;
+      target->phase_correction_angle = 0;
+      target->correct_delay = false;
+      target->correct_phase = false;
+      for (k = 0; k < band_options->num_modifiers[ifnum]; k++) {
+	modifier = band_options->modifiers[ifnum][k];
+	if ((modifier->add_delay) &&
+	    (cmjd >= modifier->delay_start_mjd) &&
+	    (cmjd <= modifier->delay_end_mjd)) {
+	  if (cycle_data->ant1[i] != cycle_data->ant2[i]) {
+	    target->total_delay += (modifier->delay[cycle_data->ant2[i]][target->pidx2] -
+				    modifier->delay[cycle_data->ant1[i]][target->pidx1]);
+	  } else if (pol == POL_XY) {
+	    target->total_delay += modifier->delay[cycle_data->ant1[i]][POL_XY];
+	  } else if (pol == POL_YX) {
+	    target->total_delay -= modifier->delay[cycle_data->ant1[i]][POL_XY];
+	  }
+	  target->correct_delay = true;
+	}
+	if ((modifier->add_phase) &&
+	    (cmjd >= modifier->phase_start_mjd) &&
+	    (cmjd <= modifier->phase_end_mjd)) {
+	  if (cycle_data->ant1[i] != cycle_data->ant2[i]) {
+	    target->phase_correction_angle +=
+	      (modifier->phase[cycle_data->ant2[i]][target->pidx2] -
+	       modifier->phase[cycle_data->ant1[i]][target->pidx1]);
+	  } else if (pol == POL_XY) {
+	    target->phase_correction_angle +=
+	      modifier->phase[cycle_data->ant1[i]][POL_XY];
+	  } else if (pol == POL_YX) {
+	    target->phase_correction_angle -=
+	      modifier->phase[cycle_data->ant1[i]][POL_XY];
+	  }
+	  target->correct_phase = true;
+	}
       }
-      
-      // Continually assess limits.
-      //if ((*ampphase)->weight[bidx][i] > 0) {
-      if ((*ampphase)->amplitude[bidx][cidx][j] ==
-          (*ampphase)->amplitude[bidx][cidx][j]) {
-        if ((*ampphase)->amplitude[bidx][cidx][j] <
-            (*ampphase)->min_amplitude[bidx]) {
-          (*ampphase)->min_amplitude[bidx] =
-            (*ampphase)->amplitude[bidx][cidx][j];
-          if ((*ampphase)->amplitude[bidx][cidx][j] <
-              (*ampphase)->min_amplitude_global) {
-            (*ampphase)->min_amplitude_global =
-              (*ampphase)->amplitude[bidx][cidx][j];
-          }
-        }
-        if ((*ampphase)->amplitude[bidx][cidx][j] >
-            (*ampphase)->max_amplitude[bidx]) {
-          (*ampphase)->max_amplitude[bidx] =
-            (*ampphase)->amplitude[bidx][cidx][j];
-          if ((*ampphase)->amplitude[bidx][cidx][j] >
-              (*ampphase)->max_amplitude_global) {
-            (*ampphase)->max_amplitude_global =
-              (*ampphase)->amplitude[bidx][cidx][j];
-          }
-        }
-        if ((*ampphase)->phase[bidx][cidx][j] <
-            (*ampphase)->min_phase[bidx]) {
-          (*ampphase)->min_phase[bidx] = (*ampphase)->phase[bidx][cidx][j];
-          if ((*ampphase)->phase[bidx][cidx][j] < (*ampphase)->min_phase_global) {
-            (*ampphase)->min_phase_global = (*ampphase)->phase[bidx][cidx][j];
-          }
-        }
-        if ((*ampphase)->phase[bidx][cidx][j] > (*ampphase)->max_phase[bidx]) {
-          (*ampphase)->max_phase[bidx] = (*ampphase)->phase[bidx][cidx][j];
-          if ((*ampphase)->phase[bidx][cidx][j] > (*ampphase)->max_phase_global) {
-            (*ampphase)->max_phase_global = (*ampphase)->phase[bidx][cidx][j];
-          }
-        }
-        if (crealf((*ampphase)->raw[bidx][cidx][j]) < (*ampphase)->min_real[bidx]) {
-          (*ampphase)->min_real[bidx] = crealf((*ampphase)->raw[bidx][cidx][j]);
-        }
-        if (crealf((*ampphase)->raw[bidx][cidx][j]) > (*ampphase)->max_real[bidx]) {
-          (*ampphase)->max_real[bidx] = crealf((*ampphase)->raw[bidx][cidx][j]);
-        }
-        if (cimagf((*ampphase)->raw[bidx][cidx][j]) < (*ampphase)->min_imag[bidx]) {
-          (*ampphase)->min_imag[bidx] = cimagf((*ampphase)->raw[bidx][cidx][j]);
-        }
-        if (cimagf((*ampphase)->raw[bidx][cidx][j]) > (*ampphase)->max_imag[bidx]) {
-          (*ampphase)->max_imag[bidx] = cimagf((*ampphase)->raw[bidx][cidx][j]);
-        }
+      target->phasor_step = 1;
+      target->tsys_scale = system_temperature_scale(cycle_data, ifno, bidx,
+						    target->reqpol);
+      if ((target->correct_delay) && (ap->nchannels > 1)) {
+	step_angle = -2.0 * M_PI * target->total_delay *
+	  ((double)ap->frequency[ap->nchannels - 1] - (double)ap->frequency[0]) /
+	  (double)(ap->nchannels - 1) / 1000.0;
+	target->phasor_step = cos(step_angle) + I * sin(step_angle);
       }
     }
-    
+
+    // Go through the channels in memory order, de-interleaving the
+    // polarisations and applying the system temperature as we go.
+    nstokes = scan_header_data->if_num_stokes[ifno];
+    nchannels = scan_header_data->if_num_channels[ifno];
+    for (j = 0; j < nchannels; j++) {
+      for (t = 0; t < n; t++) {
+	target = &(targets[point_targets[t]]);
+	vidx = target->reqpol + j * nstokes;
+	vis_ampphase_channel(*(target->ampphase), target, bidx, cidx, j,
+			     cycle_data->vis[i][vidx] * target->tsys_scale,
+			     cycle_data->wgt[i][vidx]);
+      }
+    }
+    for (t = 0; t < n; t++) {
+      target = &(targets[point_targets[t]]);
+      vis_ampphase_spectrum(*(target->ampphase), bidx, cidx,
+			    band_options->phase_in_degrees);
+    }
   }
+  FREE(point_targets);
+
+  return 0;
+}
 
+/*!
+ *  \brief Copy the weather information from a cycle into an ampphase structure
+ *  \param ampphase the ampphase structure
+ *  \param cycle_data the raw data and metadata for the cycle
+ */
+static void vis_ampphase_metinfo(struct ampphase *ampphase,
+				 struct cycle_data *cycle_data) {
   // Fill the metinfo structure.
-  strncpy((*ampphase)->metinfo.obsdate, (*ampphase)->obsdate, OBSDATE_LENGTH);
-  (*ampphase)->metinfo.ut_seconds = (*ampphase)->ut_seconds;
-  (*ampphase)->metinfo.temperature = cycle_data->temperature;
-  (*ampphase)->metinfo.air_pressure = cycle_data->air_pressure;
-  (*ampphase)->metinfo.humidity = cycle_data->humidity;
-  (*ampphase)->metinfo.wind_speed = cycle_data->wind_speed;
-  (*ampphase)->metinfo.wind_direction = cycle_data->wind_direction;
-  (*ampphase)->metinfo.rain_gauge = cycle_data->rain_gauge;
-  (*ampphase)->metinfo.weather_valid = (cycle_data->weather_valid == SYSCAL_VALID);
-  (*ampphase)->metinfo.seemon_phase = cycle_data->seemon_phase;
-  (*ampphase)->metinfo.seemon_rms = cycle_data->seemon_rms;
-  (*ampphase)->metinfo.seemon_valid = (cycle_data->seemon_valid == SYSCAL_VALID);
+  strncpy(ampphase->metinfo.obsdate, ampphase->obsdate, OBSDATE_LENGTH);
+  ampphase->metinfo.ut_seconds = ampphase->ut_seconds;
+  ampphase->metinfo.temperature = cycle_data->temperature;
+  ampphase->metinfo.air_pressure = cycle_data->air_pressure;
+  ampphase->metinfo.humidity = cycle_data->humidity;
+  ampphase->metinfo.wind_speed = cycle_data->wind_speed;
+  ampphase->metinfo.wind_direction = cycle_data->wind_direction;
+  ampphase->metinfo.rain_gauge = cycle_data->rain_gauge;
+  ampphase->metinfo.weather_valid = (cycle_data->weather_valid == SYSCAL_VALID);
+  ampphase->metinfo.seemon_phase = cycle_data->seemon_phase;
+  ampphase->metinfo.seemon_rms = cycle_data->seemon_rms;
+  ampphase->metinfo.seemon_valid = (cycle_data->seemon_valid == SYSCAL_VALID);
+}
+
+/*!
+ *  \brief Compute amplitude and phase from raw data for a single cycle, pol
+ *         and window
+ *  \param scan_header_data the header information for the scan
+ *  \param cycle_data the raw data and metadata for a cycle within the scan
+ *  \param ampphase a pointer to the output ampphase structure that will be filled
+ *                  with the computed data; if this dereferenced pointer is NULL,
+ *                  this routine will allocate the memory for the output structure
+ *  \param pol the polarisation to compute the data for; one of the magic numbers POL_*
+ *  \param ifnum the window number to compute the data for; the first window is 1
+ *  \param num_options the number of ampphase_options structures in the following
+ *                     array
+ *  \param options the array of options which can be used when doing the computations;
+ *                 this array will be searched for the options matching the band
+ *                 configuration present in the scan_header_data, and if no match is
+ *                 found, a new set of options will be added to this array
+ *  \return an indication of whether the computations have worked:
+ *          - -1 means that the specified `ifnum` or `pol` aren't in the raw data
+ *          - 0 means the computations were successful
+ *
+ * This routine takes some raw complex data from a scan's cycle, and computes several
+ * parameters, which would normally be thought of as "spectra" and viewed in SPD.
+ * The data in the output `ampphase` is formatted in a way to allow for easy plotting,
+ * and this routine also computes the maximum and minimum values along the plotting
+ * axes. All raw data is available in the output, but a "clean" version is also available
+ * which omits any channels that have been flagged bad.
+ *
+ * The metadata regarding calibration is also collated for the requested window and
+ * polarisation.
+ */
+int vis_ampphase(struct scan_header_data *scan_header_data,
+                 struct cycle_data *cycle_data,
+                 struct ampphase **ampphase,
+                 int pol, int ifnum, int *num_options,
+                 struct ampphase_options ***options) {
+  int ifno, reqpol;
+  struct ampphase_options *band_options = NULL;
+  struct ampphase_target target;
+
+  ifno = find_window_index(scan_header_data, ifnum);
+  if (ifno < 0) {
+    return -1;
+  }
+
+  // Try to find the correct options for this band.
+  band_options = find_band_options(scan_header_data, num_options, options);
+
+  // Determine which of the polarisations is the one requested.
+  reqpol = find_stokes_index(scan_header_data, ifno, pol);
+  if (reqpol == -1) {
+    // Didn't find the requested polarisation.
+    return -1;
+  }
+
+  target.ampphase = ampphase;
+  target.ifno = ifno;
+  target.ifnum = ifnum;
+  target.pol = pol;
+  target.reqpol = reqpol;
+  vis_ampphase_prepare(scan_header_data, cycle_data, &target, band_options);
+  if (vis_ampphase_fill(scan_header_data, cycle_data, 1, &target, band_options) < 0) {
+    if (target.created) {
+      free_ampphase(ampphase);
+    }
+    return -1;
+  }
+  vis_ampphase_metinfo(*ampphase, cycle_data);
   
   return 0;
 }
 
+/*!
+ *  \brief Compute amplitude and phase from raw data for every window and a
+ *         set of polarisations in a single cycle, with one pass through the data
+ *  \param scan_header_data the header information for the scan
+ *  \param cycle_data the raw data and metadata for a cycle within the scan
+ *  \param ampphase the output ampphase structures, as an array indexed
+ *                  [window index][pol index], with `scan_header_data->num_ifs`
+ *                  windows; each dereferenced pointer that is NULL will be
+ *                  allocated by this routine
+ *  \param num_pols the number of polarisations in \a pols
+ *  \param pols the polarisations to compute the data for; each is one of the
+ *              magic numbers POL_*, and for each window only the first
+ *              `if_num_stokes` of these are computed
+ *  \param num_options the number of ampphase_options structures in the following
+ *                     array
+ *  \param options the array of options which can be used when doing the computations;
+ *                 as for vis_ampphase
+ *  \return an indication of whether the computations have worked:
+ *          - -1 means that at least one polarisation wasn't in the raw data, and
+ *            its output has not been touched, or the raw data had an unindexed
+ *            baseline, in which case none of the outputs are usable and any this
+ *            routine allocated are freed again
+ *          - 0 means the computations were successful
+ *
+ * The results are the same as calling vis_ampphase for each window and
+ * polarisation in turn, but the cycle is only traversed once, and the
+ * interleaved polarisations of each point are read in memory order.
+ */
+int vis_ampphase_cycle(struct scan_header_data *scan_header_data,
+		       struct cycle_data *cycle_data,
+		       struct ampphase ***ampphase, int num_pols, int *pols,
+		       int *num_options, struct ampphase_options ***options) {
+  int i, j, ifno, reqpol, num_targets = 0, rv = 0;
+  struct ampphase_options *band_options = NULL;
+  struct ampphase_target *targets = NULL;
+
+  // Try to find the correct options for this band.
+  band_options = find_band_options(scan_header_data, num_options, options);
+
+  MALLOC(targets, scan_header_data->num_ifs * num_pols);
+  for (i = 0; i < scan_header_data->num_ifs; i++) {
+    ifno = find_window_index(scan_header_data, scan_header_data->if_label[i]);
+    if (ifno < 0) {
+      rv = -1;
+      continue;
+    }
+    for (j = 0; (j < num_pols) && (j < scan_header_data->if_num_stokes[i]); j++) {
+      reqpol = find_stokes_index(scan_header_data, ifno, pols[j]);
+      if (reqpol == -1) {
+	rv = -1;
+	continue;
+      }
+      targets[num_targets].ampphase = &(ampphase[i][j]);
+      targets[num_targets].ifno = ifno;
+      targets[num_targets].ifnum = scan_header_data->if_label[i];
+      targets[num_targets].pol = pols[j];
+      targets[num_targets].reqpol = reqpol;
+      vis_ampphase_prepare(scan_header_data, cycle_data, &(targets[num_targets]),
+			   band_options);
+      num_targets++;
+    }
+  }
+
+  if (vis_ampphase_fill(scan_header_data, cycle_data, num_targets, targets,
+			band_options) < 0) {
+    for (i = 0; i < num_targets; i++) {
+      if (targets[i].created) {
+	free_ampphase(targets[i].ampphase);
+      }
+    }
+    FREE(targets);
+    return -1;
+  }
+  for (i = 0; i < num_targets; i++) {
+    vis_ampphase_metinfo(*(targets[i].ampphase), cycle_data);
+  }
+  FREE(targets);
+
+  return rv;
+}
+
 /*!
  *  \brief A qsort comparator function for float real type numbers
  *  \param a a pointer to a number
@@ -1702,6 +2792,105 @@ int cmpfunc_integer(const void *a, const void *b) {
   return ( (va > vb) - (va < vb) );
 }
 
+/*!
+ *  \brief Make a new, empty workspace for ampphase_average
+ *  \return a pointer to the workspace, which should be freed with
+ *          free_ampphase_average_workspace
+ */
+struct ampphase_average_workspace* prepare_ampphase_average_workspace(void) {
+  struct ampphase_average_workspace *workspace = NULL;
+
+  CALLOC(workspace, 1);
+  return workspace;
+}
+
+/*!
+ *  \brief Free a workspace made by prepare_ampphase_average_workspace
+ *  \param workspace a pointer to the workspace, which is set to NULL on exit
+ */
+void free_ampphase_average_workspace(struct ampphase_average_workspace **workspace) {
+  if (*workspace == NULL) {
+    return;
+  }
+  FREE((*workspace)->median_array_amplitude);
+  FREE((*workspace)->median_array_phase);
+  FREE((*workspace)->median_complex);
+  FREE((*workspace)->median_select_amplitude);
+  FREE((*workspace)->array_frequency);
+  FREE((*workspace)->delavg_frequency);
+  FREE((*workspace)->delavg_phase);
+  FREE((*workspace)->delavg_raw);
+  FREE((*workspace)->delavg_n);
+  FREE((*workspace)->median_array_delay);
+  FREE((*workspace)->n_delavg_median);
+  if ((*workspace)->max_delavg > 0) {
+    FREE((*workspace)->median_delavg_phase[0]);
+    FREE((*workspace)->median_delavg_raw[0]);
+    FREE((*workspace)->median_delavg_frequency[0]);
+  }
+  FREE((*workspace)->median_delavg_phase);
+  FREE((*workspace)->median_delavg_raw);
+  FREE((*workspace)->median_delavg_frequency);
+  FREE(*workspace);
+}
+
+/*!
+ *  \brief Make sure a workspace is big enough to average a band
+ *  \param workspace the workspace
+ *  \param n_points the number of channels in the tvchannel range
+ *  \param n_delavg the number of delay-averaging bins
+ *  \param delavg_width the number of channels in each delay-averaging bin
+ */
+static void reserve_ampphase_average_workspace(struct ampphase_average_workspace *workspace,
+					       int n_points, int n_delavg, int delavg_width) {
+  int i;
+
+  if (n_points > workspace->max_points) {
+    workspace->max_points = n_points;
+    REALLOC(workspace->median_array_amplitude, n_points);
+    REALLOC(workspace->median_array_phase, n_points);
+    REALLOC(workspace->median_complex, n_points);
+    REALLOC(workspace->median_select_amplitude, n_points);
+    REALLOC(workspace->array_frequency, n_points);
+  }
+  if ((n_delavg > workspace->max_delavg) || (delavg_width > workspace->max_delavg_width)) {
+    if (workspace->max_delavg > 0) {
+      FREE(workspace->median_delavg_phase[0]);
+      FREE(workspace->median_delavg_raw[0]);
+      FREE(workspace->median_delavg_frequency[0]);
+    }
+    if (n_delavg > workspace->max_delavg) {
+      workspace->max_delavg = n_delavg;
+      REALLOC(workspace->delavg_frequency, n_delavg);
+      REALLOC(workspace->delavg_phase, n_delavg);
+      REALLOC(workspace->delavg_raw, n_delavg);
+      REALLOC(workspace->delavg_n, n_delavg);
+      REALLOC(workspace->median_array_delay, n_delavg);
+      REALLOC(workspace->n_delavg_median, n_delavg);
+      REALLOC(workspace->median_delavg_phase, n_delavg);
+      REALLOC(workspace->median_delavg_raw, n_delavg);
+      REALLOC(workspace->median_delavg_frequency, n_delavg);
+    }
+    if (delavg_width > workspace->max_delavg_width) {
+      workspace->max_delavg_width = delavg_width;
+    }
+    MALLOC(workspace->median_delavg_phase[0],
+	   workspace->max_delavg * workspace->max_delavg_width);
+    MALLOC(workspace->median_delavg_raw[0],
+	   workspace->max_delavg * workspace->max_delavg_width);
+    MALLOC(workspace->median_delavg_frequency[0],
+	   workspace->max_delavg * workspace->max_delavg_width);
+    for (i = 1; i < workspace->max_delavg; i++) {
+      workspace->median_delavg_phase[i] = workspace->median_delavg_phase[0] +
+	i * workspace->max_delavg_width;
+      workspace->median_delavg_raw[i] = workspace->median_delavg_raw[0] +
+	i * workspace->max_delavg_width;
+      workspace->median_delavg_frequency[i] = workspace->median_delavg_frequency[0] +
+	i * workspace->max_delavg_width;
+    }
+  }
+}
+
 /*!
  *  \brief Calculate average amplitude, phase and delays from data in an
  *         ampphase structure
@@ -1718,6 +2907,9 @@ int cmpfunc_integer(const void *a, const void *b) {
  *                 \a ampphase will be used, and if those options do not have
  *                 already have their tvchannel ranges set, this routine will set
  *                 them to sensible defaults
+ *  \param workspace the scratch arrays to use, which will be grown if necessary;
+ *                   if this is NULL, a workspace will be made and freed within
+ *                   this call
  *  \return an indication of whether this routine was able to successfully complete or
  *          not (0 means success)
  *
@@ -1737,7 +2929,8 @@ int ampphase_average(struct scan_header_data *scan_header_data,
 		     struct ampphase *ampphase,
                      struct vis_quantities **vis_quantities,
 		     int *num_options,
-                     struct ampphase_options ***options) {
+                     struct ampphase_options ***options,
+		     struct ampphase_average_workspace *workspace) {
   int n_points = 0, i, j, k, n_expected = 0, n_delavg_expected = 0;
   int *delavg_n = NULL, delavg_idx = 0, n_delay_points = 0;
   int min_tvchannel, max_tvchannel, a1, a2, *n_delavg_median = NULL;
@@ -1745,13 +2938,13 @@ int ampphase_average(struct scan_header_data *scan_header_data,
   float total_amplitude = 0, total_phase = 0, total_delay = 0;
   float delta_phase, delta_frequency, dp, p1, p2, p3;
   float *median_array_amplitude = NULL, *median_array_phase = NULL;
-  float *median_array_delay = NULL;
+  float *median_array_delay = NULL, *median_select_amplitude = NULL;
   float *array_frequency = NULL, *delavg_frequency = NULL, amp_scaler;
   float *delavg_phase = NULL, **median_delavg_frequency = NULL;
   float **median_delavg_phase = NULL, on_off_diff[MAX_ANTENNANUM];
   float complex total_complex, *median_complex = NULL, average_complex;
   float complex *delavg_raw = NULL, **median_delavg_raw = NULL;
-  bool needs_new_options = false;
+  bool needs_new_options = false, own_workspace = false;
   struct ampphase_options *band_options = NULL;
   /* FILE *debug = NULL; */
   /* char debug_fname[1024]; */
@@ -1838,15 +3031,12 @@ int ampphase_average(struct scan_header_data *scan_header_data,
   (*vis_quantities)->ntriangles = 0;
   (*vis_quantities)->triangles = NULL;
   (*vis_quantities)->closure_phase = NULL;
+  (*vis_quantities)->closure_reference_antenna = -1;
   
   //n_expected = (options->max_tvchannel - options->min_tvchannel) + 1;
   n_expected = (max_tvchannel - min_tvchannel) + 1;
   /* fprintf(stderr, "[ampphase_average] allocating memory for %d samples\n", */
   /*         n_expected); */
-  MALLOC(median_array_amplitude, n_expected);
-  MALLOC(median_array_phase, n_expected);
-  MALLOC(median_complex, n_expected);
-  MALLOC(array_frequency, n_expected);
   // Make some arrays for the delay-averaged phases and frequencies.
   n_delavg_expected = (int)ceilf(n_expected /
 				 band_options->delay_averaging[ampphase->window]);
@@ -1855,20 +3045,28 @@ int ampphase_average(struct scan_header_data *scan_header_data,
   /*         n_delavg_expected); */
   // Safety.
   n_delavg_expected += 1;
-  CALLOC(delavg_frequency, n_delavg_expected);
-  CALLOC(delavg_phase, n_delavg_expected);
-  CALLOC(delavg_raw, n_delavg_expected);
-  CALLOC(delavg_n, n_delavg_expected);
-  CALLOC(median_array_delay, (n_delavg_expected - 1));
-  CALLOC(median_delavg_phase, n_delavg_expected);
-  CALLOC(median_delavg_raw, n_delavg_expected);
-  CALLOC(median_delavg_frequency, n_delavg_expected);
-  CALLOC(n_delavg_median, n_delavg_expected);
-  for (i = 0; i < n_delavg_expected; i++) {
-    CALLOC(median_delavg_phase[i], band_options->delay_averaging[ampphase->window]);
-    CALLOC(median_delavg_raw[i], band_options->delay_averaging[ampphase->window]);
-    CALLOC(median_delavg_frequency[i], band_options->delay_averaging[ampphase->window]);
-  }
+  // The scratch arrays come from the workspace, which only needs to grow
+  // when this band is bigger than any it has seen before.
+  if (workspace == NULL) {
+    workspace = prepare_ampphase_average_workspace();
+    own_workspace = true;
+  }
+  reserve_ampphase_average_workspace(workspace, n_expected, n_delavg_expected,
+				     band_options->delay_averaging[ampphase->window]);
+  median_array_amplitude = workspace->median_array_amplitude;
+  median_array_phase = workspace->median_array_phase;
+  median_complex = workspace->median_complex;
+  median_select_amplitude = workspace->median_select_amplitude;
+  array_frequency = workspace->array_frequency;
+  delavg_frequency = workspace->delavg_frequency;
+  delavg_phase = workspace->delavg_phase;
+  delavg_raw = workspace->delavg_raw;
+  delavg_n = workspace->delavg_n;
+  median_array_delay = workspace->median_array_delay;
+  median_delavg_phase = workspace->median_delavg_phase;
+  median_delavg_raw = workspace->median_delavg_raw;
+  median_delavg_frequency = workspace->median_delavg_frequency;
+  n_delavg_median = workspace->n_delavg_median;
 
   // Find the appropriate window and polarisation index in the syscal data.
   for (i = 0, syscal_window_idx = -1; i < ampphase->syscal_data->num_ifs; i++) {
@@ -1898,11 +3096,13 @@ int ampphase_average(struct scan_header_data *scan_header_data,
 	  }
 	}
 	if (syscal_ant_idx >= 0) {
-	  for (j = 0; j < ampphase->f_nchannels[i][0]; j++) {
-	    if ((ampphase->f_channel[i][0][j] >= min_tvchannel) &&
-		(ampphase->f_channel[i][0][j] < max_tvchannel)) {
-	      on_off_diff[a1] += crealf(ampphase->f_raw[i][1][j]) -
-		crealf(ampphase->f_raw[i][0][j]);
+	  for (j = ampphase_next_valid_channel(ampphase, i, 0, 0);
+	       j < ampphase->nchannels;
+	       j = ampphase_next_valid_channel(ampphase, i, 0, j + 1)) {
+	    if ((ampphase->channel[j] >= min_tvchannel) &&
+		(ampphase->channel[j] < max_tvchannel)) {
+	      on_off_diff[a1] += crealf(ampphase->raw[i][1][j]) -
+		crealf(ampphase->raw[i][0][j]);
 	    }
 	  }
 	  on_off_diff[a1] /=
@@ -1948,34 +3148,36 @@ int ampphase_average(struct scan_header_data *scan_header_data,
       // Prepare our amplitude scaler.
       //amp_scaler = sqrtf(on_off_diff[a1] * on_off_diff[a2]);
       amp_scaler = 1.0;
-      for (j = 0; j < ampphase->f_nchannels[i][k]; j++) {
+      for (j = ampphase_next_valid_channel(ampphase, i, k, 0);
+	   j < ampphase->nchannels;
+	   j = ampphase_next_valid_channel(ampphase, i, k, j + 1)) {
         // Check for in range.
-        if ((ampphase->f_channel[i][k][j] >= min_tvchannel) &&
-            (ampphase->f_channel[i][k][j] < max_tvchannel)) {
-          total_amplitude += ampphase->f_amplitude[i][k][j] * amp_scaler;
-          total_phase += ampphase->f_phase[i][k][j];
-          total_complex += ampphase->f_raw[i][k][j] * amp_scaler;
-          median_array_amplitude[n_points] = ampphase->f_amplitude[i][k][j] * amp_scaler;
-          median_array_phase[n_points] = ampphase->f_phase[i][k][j];
-          median_complex[n_points] = ampphase->f_raw[i][k][j] * amp_scaler;
-          array_frequency[n_points] = ampphase->f_frequency[i][k][j];
+        if ((ampphase->channel[j] >= min_tvchannel) &&
+            (ampphase->channel[j] < max_tvchannel)) {
+          total_amplitude += ampphase->amplitude[i][k][j] * amp_scaler;
+          total_phase += ampphase->phase[i][k][j];
+          total_complex += ampphase->raw[i][k][j] * amp_scaler;
+          median_array_amplitude[n_points] = ampphase->amplitude[i][k][j] * amp_scaler;
+          median_array_phase[n_points] = ampphase->phase[i][k][j];
+          median_complex[n_points] = ampphase->raw[i][k][j] * amp_scaler;
+          array_frequency[n_points] = ampphase->frequency[j];
           n_points++;
           delavg_idx =
-            (int)(floorf(ampphase->f_channel[i][k][j] - min_tvchannel) /
+            (int)(floorf(ampphase->channel[j] - min_tvchannel) /
                   band_options->delay_averaging[ampphase->window]);
-          delavg_frequency[delavg_idx] += ampphase->f_frequency[i][k][j];
-          delavg_raw[delavg_idx] += ampphase->f_raw[i][k][j];
+          delavg_frequency[delavg_idx] += ampphase->frequency[j];
+          delavg_raw[delavg_idx] += ampphase->raw[i][k][j];
 	  // Phase accounting should probably be optimised out at some point since
 	  // for delavg > 1 we recompute it.
-	  delavg_phase[delavg_idx] += ampphase->f_phase[i][k][j];
+	  delavg_phase[delavg_idx] += ampphase->phase[i][k][j];
           delavg_n[delavg_idx] += 1;
 	  median_delavg_frequency[delavg_idx][n_delavg_median[delavg_idx]] =
-	    ampphase->f_frequency[i][k][j];
+	    ampphase->frequency[j];
 	  // Same comment as above.
 	  median_delavg_phase[delavg_idx][n_delavg_median[delavg_idx]] =
-	    ampphase->f_phase[i][k][j];
+	    ampphase->phase[i][k][j];
 	  median_delavg_raw[delavg_idx][n_delavg_median[delavg_idx]] =
-	    ampphase->f_raw[i][k][j];
+	    ampphase->raw[i][k][j];
 	  n_delavg_median[delavg_idx] += 1;
         }
       }
@@ -1994,13 +3196,10 @@ int ampphase_average(struct scan_header_data *scan_header_data,
 	    }
 	  } else if (band_options->averaging_method[ampphase->window] & AVERAGETYPE_MEDIAN) {
 	    if (n_delavg_median[j] > 0) {
-	      qsort(median_delavg_raw[j], n_delavg_median[j], sizeof(float complex),
-		    cmpfunc_complex);
-	      /* qsort(median_delavg_phase[j], n_delavg_median[j], sizeof(float), cmpfunc_real); */
-	      qsort(median_delavg_frequency[j], n_delavg_median[j], sizeof(float), cmpfunc_real);
-	      delavg_raw[j] = fcmedianfc(median_delavg_raw[j], n_delavg_median[j]);
-	      /* delavg_phase[j] = fmedianf(median_delavg_phase[j], n_delavg_median[j]); */
-	      delavg_frequency[j] = fmedianf(median_delavg_frequency[j], n_delavg_median[j]);
+	      delavg_raw[j] = fcselectmedianfc(median_delavg_raw[j], median_select_amplitude,
+					       n_delavg_median[j]);
+	      /* delavg_phase[j] = fselectmedianf(median_delavg_phase[j], n_delavg_median[j]); */
+	      delavg_frequency[j] = fselectmedianf(median_delavg_frequency[j], n_delavg_median[j]);
 	      delavg_n[j] = n_delavg_median[j];
 	    }
 	  }
@@ -2058,13 +3257,11 @@ int ampphase_average(struct scan_header_data *scan_header_data,
             (1E3 * total_delay / (float)n_delay_points) : 0;
         } else if (band_options->averaging_method[ampphase->window] & AVERAGETYPE_MEDIAN) {
           if (band_options->averaging_method[ampphase->window] & AVERAGETYPE_SCALAR) {
-            qsort(median_array_amplitude, n_points, sizeof(float), cmpfunc_real);
-            qsort(median_array_phase, n_points, sizeof(float), cmpfunc_real);
-	    (*vis_quantities)->amplitude[i][k] = fmedianf(median_array_amplitude, n_points);
-	    (*vis_quantities)->phase[i][k] = fmedianf(median_array_phase, n_points);
+	    (*vis_quantities)->amplitude[i][k] = fselectmedianf(median_array_amplitude, n_points);
+	    (*vis_quantities)->phase[i][k] = fselectmedianf(median_array_phase, n_points);
           } else if (band_options->averaging_method[ampphase->window] & AVERAGETYPE_VECTOR) {
-            qsort(median_complex, n_points, sizeof(float complex), cmpfunc_complex);
-	    average_complex = fcmedianfc(median_complex, n_points);
+	    average_complex = fcselectmedianfc(median_complex, median_select_amplitude,
+					       n_points);
             (*vis_quantities)->amplitude[i][k] = cabsf(average_complex);
             (*vis_quantities)->phase[i][k] = cargf(average_complex);
 	    // We have to change to degrees here because that was only done for phase
@@ -2090,24 +3287,9 @@ int ampphase_average(struct scan_header_data *scan_header_data,
   }
   /* fclose(debug); */
   
-  FREE(median_array_amplitude);
-  FREE(median_array_phase);
-  FREE(median_complex);
-  FREE(array_frequency);
-  FREE(delavg_phase);
-  FREE(delavg_raw);
-  FREE(delavg_n);
-  FREE(delavg_frequency);
-  FREE(median_array_delay);
-  for (i = 0; i < n_delavg_expected; i++) {
-    FREE(median_delavg_phase[i]);
-    FREE(median_delavg_raw[i]);
-    FREE(median_delavg_frequency[i]);
-  }
-  FREE(median_delavg_phase);
-  FREE(median_delavg_raw);
-  FREE(median_delavg_frequency);
-  FREE(n_delavg_median);
+  if (own_workspace) {
+    free_ampphase_average_workspace(&workspace);
+  }
   
   return 0;
 }
@@ -2184,6 +3366,37 @@ bool ampphase_modifiers_match(struct ampphase_modifiers *a,
   return match;
 }
 
+/*!
+ *  \brief Compare the settings of two ampphase_options structures, without
+ *         looking at their modifiers
+ *  \param a a pointer to an ampphase_options structure
+ *  \param b a pointer to another ampphase_options structure
+ *  \return true if \a a and \a b have the same values for all their parameters
+ *          other than the modifiers, or false otherwise
+ */
+static bool ampphase_options_settings_match(struct ampphase_options *a,
+					    struct ampphase_options *b) {
+  int i;
+
+  if ((a->phase_in_degrees != b->phase_in_degrees) ||
+      (a->include_flagged_data != b->include_flagged_data) ||
+      (a->num_ifs != b->num_ifs) ||
+      (a->systemp_reverse_online != b->systemp_reverse_online) ||
+      (a->systemp_apply_computed != b->systemp_apply_computed) ||
+      (a->reference_antenna != b->reference_antenna)) {
+    return false;
+  }
+  for (i = 0; i < a->num_ifs; i++) {
+    if ((a->min_tvchannel[i] != b->min_tvchannel[i]) ||
+	(a->max_tvchannel[i] != b->max_tvchannel[i]) ||
+	(a->delay_averaging[i] != b->delay_averaging[i]) ||
+	(a->averaging_method[i] != b->averaging_method[i])) {
+      return false;
+    }
+  }
+  return true;
+}
+
 /*!
  *  \brief Compare two ampphase_options structures to determine if they match
  *  \param a a pointer to an ampphase_options structure
@@ -2194,39 +3407,333 @@ bool ampphase_modifiers_match(struct ampphase_modifiers *a,
 bool ampphase_options_match(struct ampphase_options *a,
                             struct ampphase_options *b) {
   // Check if two ampphase_options structures match.
-  bool match = false;
   int i, j;
 
-  if ((a->phase_in_degrees == b->phase_in_degrees) &&
-      (a->include_flagged_data == b->include_flagged_data) &&
-      (a->num_ifs == b->num_ifs) &&
-      (a->systemp_reverse_online == b->systemp_reverse_online) &&
-      (a->systemp_apply_computed == b->systemp_apply_computed) &&
-      (a->reference_antenna == b->reference_antenna)) {
-    // Looks good so far, now check the tvchannels and the modifiers.
-    match = true;
-    for (i = 0; i < a->num_ifs; i++) {
-      if ((a->min_tvchannel[i] != b->min_tvchannel[i]) ||
-          (a->max_tvchannel[i] != b->max_tvchannel[i]) ||
-          (a->delay_averaging[i] != b->delay_averaging[i]) ||
-          (a->averaging_method[i] != b->averaging_method[i]) ||
-	  (a->num_modifiers[i] != b->num_modifiers[i])) {
-        match = false;
-        break;
+  if (!ampphase_options_settings_match(a, b)) {
+    return false;
+  }
+  // Looks good so far, now check the modifiers.
+  for (i = 0; i < a->num_ifs; i++) {
+    if (a->num_modifiers[i] != b->num_modifiers[i]) {
+      return false;
+    }
+    for (j = 0; j < a->num_modifiers[i]; j++) {
+      if (!ampphase_modifiers_match(a->modifiers[i][j],
+				    b->modifiers[i][j])) {
+	return false;
       }
-      for (j = 0; j < a->num_modifiers[i]; j++) {
-	if (!ampphase_modifiers_match(a->modifiers[i][j],
-				      b->modifiers[i][j])) {
-	  match = false;
+    }
+  }
+  return true;
+}
+
+/*!
+ *  \brief Add the time ranges over which a modifier acts to a list
+ *  \param modifier the modifier
+ *  \param n_windows a pointer to the number of time ranges in the list
+ *  \param windows a pointer to the list, which has the start and end MJD of
+ *                 each range, so has length 2 * \a n_windows
+ */
+static void add_modifier_windows(struct ampphase_modifiers *modifier,
+				 int *n_windows, double **windows) {
+  if (modifier->add_delay) {
+    *n_windows += 1;
+    REALLOC(*windows, 2 * *n_windows);
+    (*windows)[2 * *n_windows - 2] = modifier->delay_start_mjd;
+    (*windows)[2 * *n_windows - 1] = modifier->delay_end_mjd;
+  }
+  if (modifier->add_phase) {
+    *n_windows += 1;
+    REALLOC(*windows, 2 * *n_windows);
+    (*windows)[2 * *n_windows - 2] = modifier->phase_start_mjd;
+    (*windows)[2 * *n_windows - 1] = modifier->phase_end_mjd;
+  }
+  if (modifier->set_noise_diode_amplitude) {
+    *n_windows += 1;
+    REALLOC(*windows, 2 * *n_windows);
+    (*windows)[2 * *n_windows - 2] = modifier->noise_diode_start_mjd;
+    (*windows)[2 * *n_windows - 1] = modifier->noise_diode_end_mjd;
+  }
+}
+
+/*!
+ *  \brief Find the times at which two sets of options would give different
+ *         results, when they only differ in their modifiers
+ *  \param a a pointer to an ampphase_options structure
+ *  \param b a pointer to another ampphase_options structure
+ *  \param n_windows a pointer to the number of time ranges in \a windows,
+ *                   which is added to
+ *  \param windows a pointer to a list of the start and end MJD of each time
+ *                 range, which is added to
+ *  \return true if \a a and \a b match apart from their modifiers, or false
+ *          otherwise, in which case the time ranges are meaningless
+ *
+ * The modifiers which appear in both \a a and \a b in the same order are
+ * paired off, and the time ranges of all the others are added to the list.
+ * Outside those time ranges, both sets of options apply the same modifiers
+ * in the same order, and so give exactly the same results.
+ */
+bool ampphase_options_modifier_windows(struct ampphase_options *a,
+				       struct ampphase_options *b,
+				       int *n_windows, double **windows) {
+  int i, j, k, l;
+  bool *b_paired = NULL;
+
+  if (!ampphase_options_settings_match(a, b)) {
+    return false;
+  }
+  for (i = 0; i < a->num_ifs; i++) {
+    CALLOC(b_paired, b->num_modifiers[i] + 1);
+    for (j = 0, k = 0; j < a->num_modifiers[i]; j++) {
+      for (l = k; l < b->num_modifiers[i]; l++) {
+	if (ampphase_modifiers_match(a->modifiers[i][j], b->modifiers[i][l])) {
 	  break;
 	}
       }
-      if (!match) {
-	break;
+      if (l < b->num_modifiers[i]) {
+	b_paired[l] = true;
+	k = l + 1;
+      } else {
+	add_modifier_windows(a->modifiers[i][j], n_windows, windows);
+      }
+    }
+    for (l = 0; l < b->num_modifiers[i]; l++) {
+      if (!b_paired[l]) {
+	add_modifier_windows(b->modifiers[i][l], n_windows, windows);
+      }
+    }
+    FREE(b_paired);
+  }
+  return true;
+}
+
+/*!
+ *  \brief Work out which system temperature is applied to each IF, antenna and
+ *         polarisation of a cycle, and the factor it scales the data by
+ *  \param cycle_data the cycle
+ *  \param applied the system temperature to describe for all of them, or -1 to
+ *                 describe what is currently applied according to the cycle
+ *  \param state filled with STM_APPLY_CORRELATOR, STM_APPLY_COMPUTED or
+ *               STM_NOT_APPLIED for each IF, antenna and polarisation; this
+ *               flat array must have length `num_cal_ifs * num_cal_ants * 2`,
+ *               indexed as ((IF index * `num_cal_ants`) + antenna index) * 2
+ *               + CAL_XX or CAL_YY
+ *  \param ratio filled with the noise diode amplitude divided by the
+ *               synchronously demodulated output, in the same order as \a state
+ */
+static void system_temperature_factors(struct cycle_data *cycle_data, int applied,
+				       int *state, float *ratio) {
+  int i, j, k, n;
+  float caljy, sdo;
+
+  for (i = 0, n = 0; i < cycle_data->num_cal_ifs; i++) {
+    for (j = 0; j < cycle_data->num_cal_ants; j++) {
+      for (k = CAL_XX; k <= CAL_YY; k++, n++) {
+	if (applied >= 0) {
+	  state[n] = applied;
+	} else if (cycle_data->tsys_applied[i][j][k] == SYSCAL_TSYS_APPLIED) {
+	  state[n] = STM_APPLY_CORRELATOR;
+	} else if (cycle_data->computed_tsys_applied[i][j][k] == SYSCAL_TSYS_APPLIED) {
+	  state[n] = STM_APPLY_COMPUTED;
+	} else {
+	  state[n] = STM_NOT_APPLIED;
+	}
+	caljy = (k == CAL_XX) ? cycle_data->used_caljy_x[i][j] : cycle_data->used_caljy_y[i][j];
+	if (state[n] == STM_APPLY_CORRELATOR) {
+	  sdo = (k == CAL_XX) ? cycle_data->sdo_x[i][j] : cycle_data->sdo_y[i][j];
+	} else if (state[n] == STM_APPLY_COMPUTED) {
+	  sdo = (k == CAL_XX) ? cycle_data->computed_sdo_x[i][j] :
+	    cycle_data->computed_sdo_y[i][j];
+	} else {
+	  sdo = 1;
+	}
+	ratio[n] = caljy / sdo;
+      }
+    }
+  }
+}
+
+/*!
+ *  \brief Work out the factor that the system temperatures scale a visibility by
+ *  \param state the applied system temperatures, from system_temperature_factors
+ *  \param ratio the scaling ratios, from system_temperature_factors
+ *  \param idx1 the index in \a state of the first antenna's polarisation
+ *  \param idx2 the index in \a state of the second antenna's polarisation
+ *  \param mval 1 for an autocorrelation, or 0.5 for a cross-correlation
+ *  \param factor set to the factor
+ *  \return true if a system temperature is applied to the visibility, or false
+ *          if it isn't or the two antennas don't have the same kind applied
+ */
+static bool system_temperature_factor(int *state, float *ratio, int idx1, int idx2,
+				      float mval, float *factor) {
+  if ((state[idx1] == STM_NOT_APPLIED) || (state[idx1] != state[idx2])) {
+    return false;
+  }
+  *factor = mval * sqrtf(ratio[idx1] * ratio[idx2]);
+  return true;
+}
+
+/*!
+ *  \brief Work out which antenna polarisations make up each Stokes parameter
+ *         of each IF in a scan
+ *  \param scan_header_data the header information for the scan
+ *  \param max_stokes set to the largest number of Stokes parameters in any IF
+ *  \param pol1 set to a newly allocated flat array with the CAL_XX or CAL_YY
+ *              index of the first antenna for each IF and Stokes parameter,
+ *              indexed as (IF index * \a max_stokes) + Stokes index, which is
+ *              -1 if the Stokes parameter isn't one that system temperatures
+ *              are applied to
+ *  \param pol2 the same as \a pol1, for the second antenna
+ */
+static void system_temperature_polarisations(struct scan_header_data *scan_header_data,
+					     int *max_stokes, int **pol1, int **pol2) {
+  int i, j, polnum;
+
+  for (i = 0, *max_stokes = 1; i < scan_header_data->num_ifs; i++) {
+    if (scan_header_data->if_num_stokes[i] > *max_stokes) {
+      *max_stokes = scan_header_data->if_num_stokes[i];
+    }
+  }
+  MALLOC(*pol1, *max_stokes * scan_header_data->num_ifs);
+  MALLOC(*pol2, *max_stokes * scan_header_data->num_ifs);
+  for (i = 0; i < scan_header_data->num_ifs; i++) {
+    for (j = 0; j < *max_stokes; j++) {
+      (*pol1)[i * *max_stokes + j] = -1;
+      (*pol2)[i * *max_stokes + j] = -1;
+    }
+    for (j = 0; j < scan_header_data->if_num_stokes[i]; j++) {
+      polnum = polarisation_number(scan_header_data->if_stokes_names[i][j]);
+      if (polnum == POL_XX) {
+	(*pol1)[i * *max_stokes + j] = CAL_XX;
+	(*pol2)[i * *max_stokes + j] = CAL_XX;
+      } else if (polnum == POL_YY) {
+	(*pol1)[i * *max_stokes + j] = CAL_YY;
+	(*pol2)[i * *max_stokes + j] = CAL_YY;
+      } else if (polnum == POL_XY) {
+	(*pol1)[i * *max_stokes + j] = CAL_XX;
+	(*pol2)[i * *max_stokes + j] = CAL_YY;
+      } else if (polnum == POL_YX) {
+	(*pol1)[i * *max_stokes + j] = CAL_YY;
+	(*pol2)[i * *max_stokes + j] = CAL_XX;
+      }
+    }
+  }
+}
+
+/*!
+ *  \brief Change the system temperatures applied to a cycle
+ *  \param cycle_data the cycle
+ *  \param scan_header_data the header information for the scan that the cycle is
+ *                          part of
+ *  \param old_state the system temperatures applied to the visibilities now
+ *  \param old_ratio the scaling ratios of the system temperatures applied now
+ *  \param new_state the system temperatures to apply instead
+ *  \param new_ratio the scaling ratios of the system temperatures to apply
+ *  \param pol1 the CAL_XX or CAL_YY index of the first antenna for each IF and
+ *              Stokes parameter, from system_temperature_polarisations
+ *  \param pol2 the same as \a pol1, for the second antenna
+ *  \param max_stokes the largest number of Stokes parameters in any IF
+ *
+ * The old system temperature is removed from and the new one applied to the
+ * cycle's tsys_scale table entry for each IF, baseline and Stokes parameter,
+ * which vis_ampphase multiplies the visibilities by as it reads them. The
+ * visibilities themselves aren't touched, and entries whose scaling wouldn't
+ * change are left alone.
+ */
+static void system_temperature_rescale(struct cycle_data *cycle_data,
+				       struct scan_header_data *scan_header_data,
+				       int *old_state, float *old_ratio,
+				       int *new_state, float *new_ratio,
+				       int *pol1, int *pol2, int max_stokes) {
+  int i, j, k, a1, a2, bl, bidx, iidx, vidx, idx1, idx2, n_entries;
+  float mval, remove_factor = 1.0, apply_factor = 1.0, *scale = NULL;
+  bool do_remove, do_apply, *done = NULL;
+
+  // Each IF and baseline has the same factors in every bin, so we only
+  // look at the first point we find for each.
+  CALLOC(done, scan_header_data->num_ifs * cycle_data->n_baselines + 1);
+  for (i = 0; i < cycle_data->num_points; i++) {
+    bl = ants_to_base(cycle_data->ant1[i], cycle_data->ant2[i]);
+    if (bl < 0) {
+      continue;
+    }
+    bidx = cycle_data->all_baselines[bl] - 1;
+    a1 = cycle_data->ant1[i] - 1;
+    a2 = cycle_data->ant2[i] - 1;
+    iidx = cycle_data->if_no[i] - 1;
+    if ((bidx < 0) || (bidx >= cycle_data->n_baselines) ||
+	(iidx < 0) || (iidx >= cycle_data->num_cal_ifs) ||
+	(iidx >= scan_header_data->num_ifs) ||
+	(a1 < 0) || (a1 >= cycle_data->num_cal_ants) ||
+	(a2 < 0) || (a2 >= cycle_data->num_cal_ants) ||
+	done[iidx * cycle_data->n_baselines + bidx]) {
+      continue;
+    }
+    done[iidx * cycle_data->n_baselines + bidx] = true;
+    mval = (a1 == a2) ? 1.0 : 0.5;
+    for (j = 0; j < scan_header_data->if_num_stokes[iidx]; j++) {
+      if ((pol1[iidx * max_stokes + j] < 0) || (pol2[iidx * max_stokes + j] < 0)) {
+	// We don't modify weird single polarisation stuff.
+	continue;
+      }
+      idx1 = (iidx * cycle_data->num_cal_ants + a1) * 2 + pol1[iidx * max_stokes + j];
+      idx2 = (iidx * cycle_data->num_cal_ants + a2) * 2 + pol2[iidx * max_stokes + j];
+      if ((old_state[idx1] == new_state[idx1]) && (old_state[idx2] == new_state[idx2]) &&
+	  (old_ratio[idx1] == new_ratio[idx1]) && (old_ratio[idx2] == new_ratio[idx2])) {
+	// The scaling wouldn't change.
+	continue;
+      }
+      do_remove = system_temperature_factor(old_state, old_ratio, idx1, idx2, mval,
+					    &remove_factor);
+      if (do_remove) {
+	remove_factor = 1.0 / remove_factor;
+	do_remove = !((remove_factor != remove_factor) || (remove_factor < 0));
+      }
+      do_apply = system_temperature_factor(new_state, new_ratio, idx1, idx2, mval,
+					   &apply_factor);
+      do_apply = do_apply && !((apply_factor != apply_factor) || (apply_factor < 0));
+      if (!do_remove && !do_apply) {
+	continue;
+      }
+      if (cycle_data->tsys_scale == NULL) {
+	// Make the table now that something needs scaling.
+	cycle_data->tsys_scale_num_ifs = scan_header_data->num_ifs;
+	cycle_data->tsys_scale_num_stokes = max_stokes;
+	n_entries = cycle_data->tsys_scale_num_ifs * cycle_data->n_baselines *
+	  cycle_data->tsys_scale_num_stokes;
+	MALLOC(cycle_data->tsys_scale, n_entries);
+	for (k = 0; k < n_entries; k++) {
+	  cycle_data->tsys_scale[k] = 1.0;
+	}
+      }
+      if ((iidx >= cycle_data->tsys_scale_num_ifs) ||
+	  (j >= cycle_data->tsys_scale_num_stokes)) {
+	continue;
+      }
+      scale = cycle_data->tsys_scale +
+	(iidx * cycle_data->n_baselines + bidx) * cycle_data->tsys_scale_num_stokes + j;
+      if (do_remove) {
+	*scale *= remove_factor;
+      }
+      if (do_apply) {
+	*scale *= apply_factor;
+      }
+    }
+  }
+  FREE(done);
+
+  // Record what is now applied.
+  for (i = 0; i < cycle_data->num_cal_ifs; i++) {
+    for (j = 0; j < cycle_data->num_cal_ants; j++) {
+      for (k = CAL_XX; k <= CAL_YY; k++) {
+	vidx = (i * cycle_data->num_cal_ants + j) * 2 + k;
+	cycle_data->tsys_applied[i][j][k] = (new_state[vidx] == STM_APPLY_CORRELATOR) ?
+	  SYSCAL_TSYS_APPLIED : SYSCAL_TSYS_NOT_APPLIED;
+	cycle_data->computed_tsys_applied[i][j][k] = (new_state[vidx] == STM_APPLY_COMPUTED) ?
+	  SYSCAL_TSYS_APPLIED : SYSCAL_TSYS_NOT_APPLIED;
       }
     }
   }
-  return match;
 }
 
 /*!
@@ -2238,20 +3745,27 @@ bool ampphase_options_match(struct ampphase_options *a,
  *                 this array will be searched for the options matching the band
  *                 configuration present in the \a scan_header_data, and if no match
  *                 is found, a new set of options will be added to this array
+ *
+ * The total powers are gathered from the autocorrelations in a single pass,
+ * into flat arrays indexed by antenna, IF, polarisation and noise diode state.
+ * The system temperature that is currently applied is divided out of each
+ * value as it is read, rather than being removed from the whole cycle first.
+ * The visibilities themselves are never rescaled; the system temperature to
+ * apply is recorded in the cycle's tsys_scale table instead.
  */
 void calculate_system_temperatures_cycle_data(struct cycle_data *cycle_data,
                                               struct scan_header_data *scan_header_data,
 					      int *num_options,
                                               struct ampphase_options ***options) {
-  int i, j, k, bl, bidx, ***n_tp_on_array = NULL, ***n_tp_off_array = NULL;
-  int aidx, iidx, nchannels, ifno, chan_low = -1, chan_high = -1, ifsidx;
-  int reqpol[2], polnum, vidx;
-  float ****tp_on_array = NULL, ****tp_off_array = NULL;
+  int i, j, k, bl, *n_tp = NULL, *tp_offset = NULL, n_slots, n_tp_total;
+  int aidx, iidx, nchannels, ifno, ifsidx, vidx, slot, nstates, max_stokes;
+  int *chan_low = NULL, *chan_high = NULL, *reqpol = NULL, *pol1 = NULL, *pol2 = NULL;
+  int *old_state = NULL, *new_state = NULL, applied;
   float nhalfchan, chanwidth, rcheck, med_tp_on, med_tp_off, tp_on, tp_off;
-  float fs, fd, dx, caljy_x, caljy_y;
+  float fs, fd, dx, caljy_x, caljy_y, remove_factor, *tp_values = NULL, *tp_sum = NULL;
+  float *old_ratio = NULL, *new_ratio = NULL;
   double cycle_mjd;
-  //bool computed_tsys_applied = false;
-  bool needs_new_options = false, acal_override = false;
+  bool needs_new_options = false, acal_override = false, *use_median = NULL;
   struct ampphase_options *band_options = NULL;
   struct ampphase_modifiers *use_modifier = NULL;
   // Recalculate the system temperature from the data within the
@@ -2260,34 +3774,10 @@ void calculate_system_temperatures_cycle_data(struct cycle_data *cycle_data,
   // This routine is designed to run straight after the data is read into
   // the cycle_data structure.
 
-  // Make some initial allocations.
-  CALLOC(tp_on_array, cycle_data->num_cal_ants);
-  CALLOC(tp_off_array, cycle_data->num_cal_ants);
-  CALLOC(n_tp_on_array, cycle_data->num_cal_ants);
-  CALLOC(n_tp_off_array, cycle_data->num_cal_ants);
-  for (i = 0; i < cycle_data->num_cal_ants; i++) {
-    CALLOC(tp_on_array[i], scan_header_data->num_ifs);
-    CALLOC(tp_off_array[i], scan_header_data->num_ifs);
-    CALLOC(n_tp_on_array[i], scan_header_data->num_ifs);
-    CALLOC(n_tp_off_array[i], scan_header_data->num_ifs);
-    for (j = 0; j < scan_header_data->num_ifs; j++) {
-      // Pols, we only care about XX and YY.
-      CALLOC(tp_on_array[i][j], 2);
-      CALLOC(tp_off_array[i][j], 2);
-      CALLOC(n_tp_on_array[i][j], 2);
-      CALLOC(n_tp_off_array[i][j], 2);
-    }
-  }
-
   // Try to find the correct options for this band.
   band_options = find_ampphase_options(*num_options, *options, scan_header_data, NULL);
   needs_new_options = (band_options == NULL);
 
-  /* printf("[calculate_system_temperatures_cycle_data] after finding options\n"); */
-  /* print_options_set(*num_options, *options); */
-  /* printf("[calculate_system_temperatures_cycle_data] band options are\n"); */
-  /* print_options_set(1, &band_options); */
-  
   if (needs_new_options) {
     CALLOC(band_options, 1);
     set_default_ampphase_options(band_options);
@@ -2297,12 +3787,49 @@ void calculate_system_temperatures_cycle_data(struct cycle_data *cycle_data,
     band_options = (*options)[*num_options - 1];
   }
 
-  /* printf("[calculate_system_temperatures_cycle_data] after creating new options\n"); */
-  /* print_options_set(*num_options, *options); */
+  // We can't make sense of a cycle with baselines we don't know about, so
+  // it is left as it is.
+  for (i = 0; i < cycle_data->num_points; i++) {
+    bl = ants_to_base(cycle_data->ant1[i], cycle_data->ant2[i]);
+    if ((bl >= 0) && (cycle_data->all_baselines[bl] < 1)) {
+      return;
+    }
+  }
+
   // The GTP and SDO can only be properly computed with the raw correlation
-  // coefficients.
-  system_temperature_modifier(STM_REMOVE, cycle_data, scan_header_data);
-  
+  // coefficients, so we need to know what is applied to them now.
+  nstates = cycle_data->num_cal_ifs * cycle_data->num_cal_ants * 2;
+  MALLOC(old_state, nstates + 1);
+  MALLOC(old_ratio, nstates + 1);
+  system_temperature_factors(cycle_data, -1, old_state, old_ratio);
+
+  // Work out the tvchannel range and polarisations for each IF.
+  system_temperature_polarisations(scan_header_data, &max_stokes, &pol1, &pol2);
+  MALLOC(chan_low, scan_header_data->num_ifs);
+  MALLOC(chan_high, scan_header_data->num_ifs);
+  MALLOC(use_median, scan_header_data->num_ifs);
+  MALLOC(reqpol, 2 * scan_header_data->num_ifs);
+  for (i = 0; i < scan_header_data->num_ifs; i++) {
+    chan_low[i] = -1;
+    chan_high[i] = -1;
+    reqpol[2 * i + CAL_XX] = -1;
+    reqpol[2 * i + CAL_YY] = -1;
+    for (j = 0; j < scan_header_data->if_num_stokes[i]; j++) {
+      // The total powers come from the parallel hand products.
+      k = pol1[i * max_stokes + j];
+      if ((k >= 0) && (k == pol2[i * max_stokes + j])) {
+	reqpol[2 * i + k] = j;
+      }
+    }
+  }
+
+  // Each slot holds the total powers for one antenna, IF, polarisation and
+  // noise diode state (off then on). We count how many values will go into
+  // each slot first, so all of them fit into a single array.
+  n_slots = cycle_data->num_cal_ants * scan_header_data->num_ifs * 2 * 2;
+  CALLOC(n_tp, n_slots + 1);
+  CALLOC(tp_offset, n_slots + 1);
+  CALLOC(tp_sum, n_slots + 1);
   for (i = 0; i < cycle_data->num_points; i++) {
     bl = ants_to_base(cycle_data->ant1[i], cycle_data->ant2[i]);
     if (bl < 0) {
@@ -2310,32 +3837,27 @@ void calculate_system_temperatures_cycle_data(struct cycle_data *cycle_data,
     }
     // We only do system temperature calculation if the baseline
     // is an autocorrelation.
-    bidx = cycle_data->all_baselines[bl] - 1;
-    if (bidx < 0) {
-      return;
+    if ((cycle_data->ant1[i] != cycle_data->ant2[i]) ||
+	((cycle_data->bin[i] != 1) && (cycle_data->bin[i] != 2))) {
+      continue;
     }
-    if (cycle_data->ant1[i] == cycle_data->ant2[i]) {
-      aidx = cycle_data->ant1[i] - 1;
-      iidx = cycle_data->if_no[i] - 1;
-      /* if (cycle_data->bin[i] == 1) { */
-      /*   // The noise diode is off. */
-      /*   *tp_array = tp_off_array; */
-      /*   *n_tp_array = n_tp_off_array; */
-      /* } else if (cycle_data->bin[i] == 2) { */
-      /*   // The noise diode is on. */
-      /*   *tp_array = tp_on_array; */
-      /*   *n_tp_array = n_tp_on_array; */
-      /* } */
-      ifno = cycle_data->if_no[i];
-      nchannels = scan_header_data->if_num_channels[iidx];
+    aidx = cycle_data->ant1[i] - 1;
+    iidx = cycle_data->if_no[i] - 1;
+    if ((aidx < 0) || (aidx >= cycle_data->num_cal_ants) ||
+	(iidx < 0) || (iidx >= scan_header_data->num_ifs)) {
+      continue;
+    }
+    ifno = cycle_data->if_no[i];
+    if (chan_low[iidx] < 0) {
       // Loop over the tvchannels.
       // But if our options don't know about the tvchannels, set them up now.
+      nchannels = scan_header_data->if_num_channels[iidx];
       if ((ifno < band_options->num_ifs) &&
 	  (band_options->min_tvchannel[ifno] > 0) &&
 	  (band_options->max_tvchannel[ifno] > 0)) {
 	// We already have valid tvchannels.
-	chan_low = band_options->min_tvchannel[ifno];
-	chan_high = band_options->max_tvchannel[ifno];
+	chan_low[iidx] = band_options->min_tvchannel[ifno];
+	chan_high[iidx] = band_options->max_tvchannel[ifno];
       } else {
 	// Get default values for this type of IF.
 	nhalfchan = (nchannels % 2) == 1 ?
@@ -2344,61 +3866,92 @@ void calculate_system_temperatures_cycle_data(struct cycle_data *cycle_data,
 	  scan_header_data->if_bandwidth[iidx] / (nhalfchan * 2);
 	default_tvchannels(nchannels, chanwidth * 1000,
 			   scan_header_data->if_centre_freq[iidx] * 1000,
-			   &chan_low, &chan_high);
+			   &(chan_low[iidx]), &(chan_high[iidx]));
 	add_tvchannels_to_options(band_options, ifno,
 				  scan_header_data->if_centre_freq[iidx],
 				  scan_header_data->if_bandwidth[iidx],
-				  nchannels, chan_low, chan_high);
+				  nchannels, chan_low[iidx], chan_high[iidx]);
       }
+      // The tvchannel range can go past the end of the band.
+      if (chan_high[iidx] >= nchannels) {
+	chan_high[iidx] = nchannels - 1;
+      }
+    }
+    for (k = CAL_XX; k <= CAL_YY; k++) {
+      slot = ((aidx * scan_header_data->num_ifs + iidx) * 2 + k) * 2 +
+	(cycle_data->bin[i] - 1);
+      tp_offset[slot] += chan_high[iidx] - chan_low[iidx] + 1;
+    }
+  }
+  for (i = 0, n_tp_total = 0; i < n_slots; i++) {
+    j = tp_offset[i];
+    tp_offset[i] = n_tp_total;
+    n_tp_total += j;
+  }
+  for (i = 0; i < scan_header_data->num_ifs; i++) {
+    use_median[i] = ((i + 1) < band_options->num_ifs) &&
+      (band_options->averaging_method[i + 1] & AVERAGETYPE_MEDIAN);
+  }
+  MALLOC(tp_values, n_tp_total + 1);
 
-      // Find the polarisations we need in the data.
-      for (j = 0; j < scan_header_data->if_num_stokes[iidx]; j++) {
-	polnum = polarisation_number(scan_header_data->if_stokes_names[iidx][j]);
-	if (polnum == POL_XX) {
-	  reqpol[CAL_XX] = j;
-	} else if (polnum == POL_YY) {
-	  reqpol[CAL_YY] = j;
+  // Now gather the total powers. The means only need the sums, but the
+  // medians need all the values.
+  for (i = 0; i < cycle_data->num_points; i++) {
+    bl = ants_to_base(cycle_data->ant1[i], cycle_data->ant2[i]);
+    if (bl < 0) {
+      continue;
+    }
+    if ((cycle_data->ant1[i] != cycle_data->ant2[i]) ||
+	((cycle_data->bin[i] != 1) && (cycle_data->bin[i] != 2))) {
+      continue;
+    }
+    aidx = cycle_data->ant1[i] - 1;
+    iidx = cycle_data->if_no[i] - 1;
+    if ((aidx < 0) || (aidx >= cycle_data->num_cal_ants) ||
+	(iidx < 0) || (iidx >= scan_header_data->num_ifs)) {
+      continue;
+    }
+    for (k = CAL_XX; k <= CAL_YY; k++) {
+      if (reqpol[2 * iidx + k] < 0) {
+	continue;
+      }
+      slot = ((aidx * scan_header_data->num_ifs + iidx) * 2 + k) * 2 +
+	(cycle_data->bin[i] - 1);
+      // Work out how to get back to the raw correlation coefficient.
+      vidx = (iidx * cycle_data->num_cal_ants + aidx) * 2 + k;
+      if ((iidx >= cycle_data->num_cal_ifs) ||
+	  !system_temperature_factor(old_state, old_ratio, vidx, vidx, 1.0,
+				     &remove_factor)) {
+	remove_factor = 1.0;
+      } else {
+	remove_factor = 1.0 / remove_factor;
+	if ((remove_factor != remove_factor) || (remove_factor < 0)) {
+	  remove_factor = 1.0;
 	}
       }
-  
-      for (j = chan_low; j <= chan_high; j++) {
-	for (k = CAL_XX; k <= CAL_YY; k++) {
-	  // Work out where our data is.
-	  vidx = reqpol[k] + j * scan_header_data->if_num_stokes[iidx];
-	  rcheck = crealf(cycle_data->vis[i][vidx]);
-	  if (rcheck != rcheck) {
-	    // Flagged channel.
-	    continue;
-	  }
-	  if (cycle_data->bin[i] == 1) {
-	    // The noise diode is off.
-	    n_tp_off_array[aidx][iidx][k] += 1;
-	    ARRAY_APPEND(tp_off_array[aidx][iidx][k], n_tp_off_array[aidx][iidx][k], rcheck);
-	  } else if (cycle_data->bin[i] == 2) {
-	    // The noise diode is on.
-	    n_tp_on_array[aidx][iidx][k] += 1;
-	    ARRAY_APPEND(tp_on_array[aidx][iidx][k], n_tp_on_array[aidx][iidx][k], rcheck);
-	  }
+      // The applied system temperature is in the scale table, not the data.
+      remove_factor *= system_temperature_scale(cycle_data, iidx,
+						cycle_data->all_baselines[bl] - 1,
+						reqpol[2 * iidx + k]);
+      for (j = chan_low[iidx]; j <= chan_high[iidx]; j++) {
+	// Work out where our data is.
+	vidx = reqpol[2 * iidx + k] + j * scan_header_data->if_num_stokes[iidx];
+	rcheck = crealf(cycle_data->vis[i][vidx]);
+	if (rcheck != rcheck) {
+	  // Flagged channel.
+	  continue;
+	}
+	rcheck *= remove_factor;
+	if (use_median[iidx]) {
+	  tp_values[tp_offset[slot] + n_tp[slot]] = rcheck;
+	} else {
+	  tp_sum[slot] += rcheck;
 	}
+	n_tp[slot] += 1;
       }
     }
   }
 
-  /* printf("[calculate_system_temperatures_cycle_data] after checking for all IFs in all points\n"); */
-  /* print_options_set(*num_options, *options); */
-  
-  // We've compiled all the information from the auto-correlations at this point.
-  // We can compute the system temperatures now, but before we do, we need to check
-  // if previously computed Tsys has been applied to the data. Since we'll be
-  // overwriting the computed Tsys numbers, we have to first reverse the application
-  // otherwise we'll have no way to reverse them later.
-  // We make only a simple check for this.
-  /* if ((cycle_data->computed_tsys_applied != NULL) && */
-  /*     (cycle_data->computed_tsys_applied[0][0][0] == SYSCAL_TSYS_APPLIED)) { */
-  /*   computed_tsys_applied = true; */
-  /*   system_temperature_modifier(STM_REMOVE, cycle_data, scan_header_data); */
-  /* } */
-  
   cycle_mjd = date2mjd(scan_header_data->obsdate, cycle_data->ut_seconds);
 
   // Now we're free to actually do the system temperature computations.
@@ -2436,28 +3989,24 @@ void calculate_system_temperatures_cycle_data(struct cycle_data *cycle_data,
       cycle_data->used_caljy_y[ifsidx][j] = caljy_y;
       
       for (k = CAL_XX; k <= CAL_YY; k++) {
+	// The off slot is immediately followed by the on slot.
+	slot = ((j * scan_header_data->num_ifs + ifsidx) * 2 + k) * 2;
 	if (band_options->averaging_method[ifno] & AVERAGETYPE_MEDIAN) {
-	  qsort(tp_on_array[j][ifsidx][k], n_tp_on_array[j][ifsidx][k], sizeof(float),
-		cmpfunc_real);
-	  qsort(tp_off_array[j][ifsidx][k], n_tp_off_array[j][ifsidx][k], sizeof(float),
-		cmpfunc_real);
-	  med_tp_on = fmedianf(tp_on_array[j][ifsidx][k], n_tp_on_array[j][ifsidx][k]);
-	  med_tp_off = fmedianf(tp_off_array[j][ifsidx][k], n_tp_off_array[j][ifsidx][k]);
+	  med_tp_on = fselectmedianf(tp_values + tp_offset[slot + 1], n_tp[slot + 1]);
+	  med_tp_off = fselectmedianf(tp_values + tp_offset[slot], n_tp[slot]);
 	  fs = 0.5 * (med_tp_on + med_tp_off);
 	  fd = med_tp_on - med_tp_off;
 	} else if (band_options->averaging_method[ifno] & AVERAGETYPE_MEAN) {
-	  tp_on = fmeanf(tp_on_array[j][ifsidx][k], n_tp_on_array[j][ifsidx][k]);
-	  tp_off = fmeanf(tp_off_array[j][ifsidx][k], n_tp_off_array[j][ifsidx][k]);
+	  tp_on = (n_tp[slot + 1] > 0) ? (tp_sum[slot + 1] / (float)n_tp[slot + 1]) : 0;
+	  tp_off = (n_tp[slot] > 0) ? (tp_sum[slot] / (float)n_tp[slot]) : 0;
 	  fs = 0.5 * (tp_on + tp_off);
 	  fd = tp_on - tp_off;
 	}
 	dx = 99.995 * 99.995;
 	if (fd > (0.01 * fs)) {
-	  if ((k == CAL_XX) && (caljy_x > 0)) {//(cycle_data->caljy_x[ifsidx][j] > 0)) {
-	    //dx = (fs / fd) * cycle_data->caljy_x[ifsidx][j];
+	  if ((k == CAL_XX) && (caljy_x > 0)) {
 	    dx = (fs / fd) * caljy_x;
-	  } else if ((k == CAL_YY) && (caljy_y > 0)) {//(cycle_data->caljy_y[ifsidx][j] > 0)) {
-	    //dx = (fs / fd) * cycle_data->caljy_y[ifsidx][j];
+	  } else if ((k == CAL_YY) && (caljy_y > 0)) {
 	    dx = (fs / fd) * caljy_y;
 	  }
 	}
@@ -2475,54 +4024,47 @@ void calculate_system_temperatures_cycle_data(struct cycle_data *cycle_data,
 
   }
 
-  /* // If upon entry the computed Tsys was applied to the data, we now reapply the newly */
-  /* // computed Tsys. */
-  /* if (computed_tsys_applied == true) { */
-  /*   system_temperature_modifier(STM_APPLY_COMPUTED, cycle_data, scan_header_data); */
-  /* } */
-
   // Work out from the options what to do about correcting the visibilities.
   if (band_options->systemp_reverse_online || acal_override) {
     if (band_options->systemp_apply_computed || acal_override) {
       // Apply the computed Tsys.
-      system_temperature_modifier(STM_APPLY_COMPUTED, cycle_data, scan_header_data);
-    /* } else { */
-    /*   // We are being asked to remove all calibration. */
-    /*   system_temperature_modifier(STM_REMOVE, cycle_data, scan_header_data); */
+      applied = STM_APPLY_COMPUTED;
+    } else {
+      // We are being asked to remove all calibration.
+      applied = STM_NOT_APPLIED;
     }
   } else {
     // The user wants to apply the online Tsys.
-    system_temperature_modifier(STM_APPLY_CORRELATOR, cycle_data, scan_header_data);
+    applied = STM_APPLY_CORRELATOR;
   }
+  MALLOC(new_state, nstates + 1);
+  MALLOC(new_ratio, nstates + 1);
+  system_temperature_factors(cycle_data, applied, new_state, new_ratio);
+  system_temperature_rescale(cycle_data, scan_header_data, old_state, old_ratio,
+			     new_state, new_ratio, pol1, pol2, max_stokes);
   
   // Free all the memory we've used.
-  for (i = 0; i < cycle_data->num_cal_ants; i++) {
-    for (j = 0; j < cycle_data->num_cal_ifs; j++) {
-      for (k = CAL_XX; k <= CAL_YY; k++) {
-	FREE(tp_on_array[i][j][k]);
-	FREE(tp_off_array[i][j][k]);
-      }
-      FREE(n_tp_on_array[i][j]);
-      FREE(n_tp_off_array[i][j]);
-      FREE(tp_on_array[i][j]);
-      FREE(tp_off_array[i][j]);
-    }
-    FREE(n_tp_on_array[i]);
-    FREE(n_tp_off_array[i]);
-    FREE(tp_on_array[i]);
-    FREE(tp_off_array[i]);
-  }
-  FREE(tp_on_array);
-  FREE(tp_off_array);
-  FREE(n_tp_on_array);
-  FREE(n_tp_off_array);
+  FREE(old_state);
+  FREE(old_ratio);
+  FREE(new_state);
+  FREE(new_ratio);
+  FREE(chan_low);
+  FREE(chan_high);
+  FREE(use_median);
+  FREE(reqpol);
+  FREE(pol1);
+  FREE(pol2);
+  FREE(n_tp);
+  FREE(tp_offset);
+  FREE(tp_sum);
+  FREE(tp_values);
 }
 
 void calculate_system_temperatures(struct ampphase *ampphase,
                                    struct ampphase_options *options) {
   int i, j, k, window_idx = -1, pol_idx = -1, a1, a2, n_expected, n_actual = 0;
   float tp_on = 0, tp_off = 0, *median_array_tpon = NULL;
-  float *median_array_tpoff = NULL, fs, fd, dx;
+  float *median_array_tpoff = NULL, fs, fd, dx, med_tp_on, med_tp_off;
   // Recalculate the system temperature from the data in the new
   // tvchannel range, and with different options.
   
@@ -2575,30 +4117,31 @@ void calculate_system_temperatures(struct ampphase *ampphase,
     for (j = 0; j < ampphase->nbaselines; j++) {
       base_to_ants(ampphase->baseline[j], &a1, &a2);
       if ((a1 == a2) && (a1 == ampphase->syscal_data->ant_num[i])) {
-        // Make our sums.
-        for (k = 0, n_actual = 0; k < ampphase->f_nchannels[j][0]; k++) {
-          if ((ampphase->f_channel[j][0][k] >=
+        // Make our sums, which need both bins.
+        n_actual = 0;
+        for (k = (ampphase->nbins[j] > 1) ?
+               ampphase_next_valid_channel(ampphase, j, 0, 0) : ampphase->nchannels;
+             k < ampphase->nchannels;
+             k = ampphase_next_valid_channel(ampphase, j, 0, k + 1)) {
+          if ((ampphase->channel[k] >=
                options->min_tvchannel[ampphase->window]) &&
-              (ampphase->f_channel[j][0][k] <=
-               options->max_tvchannel[ampphase->window]) &&
-              (ampphase->nbins[j] > 1)) {
+              (ampphase->channel[k] <=
+               options->max_tvchannel[ampphase->window])) {
             if (options->averaging_method[ampphase->window] & AVERAGETYPE_MEDIAN) {
-              median_array_tpon[n_actual] = crealf(ampphase->f_raw[j][1][k]);
-              median_array_tpoff[n_actual] = crealf(ampphase->f_raw[j][0][k]);
+              median_array_tpon[n_actual] = crealf(ampphase->raw[j][1][k]);
+              median_array_tpoff[n_actual] = crealf(ampphase->raw[j][0][k]);
             } else {
-              tp_on += crealf(ampphase->f_raw[j][1][k]);
-              tp_off += crealf(ampphase->f_raw[j][0][k]);
+              tp_on += crealf(ampphase->raw[j][1][k]);
+              tp_off += crealf(ampphase->raw[j][0][k]);
             }
             n_actual++;
           }
         }
         if (options->averaging_method[ampphase->window] & AVERAGETYPE_MEDIAN) {
-          qsort(median_array_tpon, n_actual, sizeof(float), cmpfunc_real);
-          qsort(median_array_tpoff, n_actual, sizeof(float), cmpfunc_real);
-          fs = 0.5 * (fmedianf(median_array_tpon, n_actual) +
-                      fmedianf(median_array_tpoff, n_actual));
-          fd = fmedianf(median_array_tpon, n_actual) -
-            fmedianf(median_array_tpoff, n_actual);
+          med_tp_on = fselectmedianf(median_array_tpon, n_actual);
+          med_tp_off = fselectmedianf(median_array_tpoff, n_actual);
+          fs = 0.5 * (med_tp_on + med_tp_off);
+          fd = med_tp_on - med_tp_off;
         } else {
           fs = 0.5 * (tp_on + tp_off);
           fd = tp_on - tp_off;
@@ -2830,225 +4373,43 @@ void spectrum_data_compile_system_temperatures(struct spectrum_data *spectrum_da
  *                - STM_REMOVE: remove any applied Tsys
  *  \param cycle_data the cycle data to be modified
  *  \param scan_header_data the header of the scan this cycle_data comes from
+ *
+ * Whatever is currently applied is removed before the requested system
+ * temperature is applied. The change is made to the cycle's tsys_scale
+ * table, which is multiplied into the visibilities as vis_ampphase reads them.
  */
 void system_temperature_modifier(int action,
 				 struct cycle_data *cycle_data,
 				 struct scan_header_data *scan_header_data) {
-  int i, j, k, bl, ant1_idx, ant2_idx, iidx, ifno, *ant1_polidx = NULL, *ant2_polidx = NULL;
-  int vidx, ***applied_target = NULL, applied_value = -1, polnum;
-  float rcheck, mfac = 1.0, mval; //***tsys_target = NULL;
-  float **sdo_target1 = NULL, **sdo_target2 = NULL;
-  float **caljy_target1 = NULL, **caljy_target2 = NULL;
-  bool already_applied = false, needs_removal = false, modified = false;
-  
-  if ((action == STM_APPLY_CORRELATOR) || (action == STM_APPLY_COMPUTED)) {
-    // Check first if something has already been applied.
-    for (i = 0; i < cycle_data->num_cal_ifs; i++) {
-      for (j = 0; j < cycle_data->num_cal_ants; j++) {
-	for (k = 0; k < 2; k++) {
-	  if (((cycle_data->tsys_applied[i][j][k] == SYSCAL_TSYS_APPLIED) &&
-	       (action == STM_APPLY_CORRELATOR)) ||
-	      ((cycle_data->computed_tsys_applied[i][j][k] == SYSCAL_TSYS_APPLIED) &&
-	       (action == STM_APPLY_COMPUTED))) {
-	    // The action doesn't need to be done.
-	    already_applied = true;
-	  } else if (((cycle_data->tsys_applied[i][j][k] == SYSCAL_TSYS_APPLIED) &&
-		      (action == STM_APPLY_COMPUTED)) ||
-		     ((cycle_data->computed_tsys_applied[i][j][k] == SYSCAL_TSYS_APPLIED) &&
-		      (action == STM_APPLY_CORRELATOR))) {
-	    // The opposite system temperature needs to be removed.
-	    needs_removal = true;
-	  }
-	}
-      }
-    }
-
-    // Check for actions.
-    if ((already_applied == true) && (needs_removal == true)) {
-      // What??
-      fprintf(stderr, "[system_temperature_modifier] unusable system temperature arrays detected\n");
-      return;
-    }
-    if (already_applied == true) {
-      // Don't need to do anything.
-      return;
-    }
-    if (needs_removal == true) {
-      // Call ourselves to remove what's currently there.
-      system_temperature_modifier(STM_REMOVE, cycle_data, scan_header_data);
-    }
-  }
-
-  // Go through all the visibilities and make the appropriate computation.
-  for (i = 0; i < cycle_data->num_points; i++) {
-    bl = ants_to_base(cycle_data->ant1[i], cycle_data->ant2[i]);
-    if (bl < 0) {
-      continue;
-    }
-    // Work out where the system temperatures will be in our array.
-    ant1_idx = cycle_data->ant1[i] - 1;
-    ant2_idx = cycle_data->ant2[i] - 1;
-    ifno = cycle_data->if_no[i];
-    iidx = ifno - 1;
-    // Each polarisation value will need a different combination of antenna
-    // polarisations; we work these out now.
-    MALLOC(ant1_polidx, scan_header_data->if_num_stokes[iidx]);
-    MALLOC(ant2_polidx, scan_header_data->if_num_stokes[iidx]);
-    for (j = 0; j < scan_header_data->if_num_stokes[iidx]; j++) {
-      polnum = polarisation_number(scan_header_data->if_stokes_names[iidx][j]);
-      if (polnum == POL_XX) {
-	ant1_polidx[j] = CAL_XX;
-	ant2_polidx[j] = CAL_XX;
-      } else if (polnum == POL_YY) {
-	ant1_polidx[j] = CAL_YY;
-	ant2_polidx[j] = CAL_YY;
-      } else if (polnum == POL_XY) {
-	ant1_polidx[j] = CAL_XX;
-	ant2_polidx[j] = CAL_YY;
-      } else if (polnum == POL_YX) {
-	ant1_polidx[j] = CAL_YY;
-	ant2_polidx[j] = CAL_XX;
-      } else {
-	// We don't modify weird single polarisation stuff.
-	ant1_polidx[j] = -1;
-	ant2_polidx[j] = -1;
-      }
-    }
-
-    // Now make the modifications.
-    for (j = 0; j < scan_header_data->if_num_stokes[iidx]; j++) {
-      if ((ant1_polidx[j] == -1) || (ant2_polidx[j] == -1)) {
-	// Don't modify.
-	continue;
-      }
-      if (ant1_idx == ant2_idx) {
-	mval = 1.0;
-      } else {
-	mval = 0.5;
-      }
-
-      if (ant1_polidx[j] == CAL_XX) {
-	caljy_target1 = cycle_data->used_caljy_x;
-      } else if (ant1_polidx[j] == CAL_YY) {
-	caljy_target1 = cycle_data->used_caljy_y;
-      }
-      if (ant2_polidx[j] == CAL_XX) {
-	caljy_target2 = cycle_data->used_caljy_x;
-      } else if (ant2_polidx[j] == CAL_YY) {
-	caljy_target2 = cycle_data->used_caljy_y;
-      }
-      
-      if ((action == STM_APPLY_CORRELATOR) ||
-	  ((action == STM_REMOVE) &&
-	   (cycle_data->tsys_applied[iidx][ant1_idx][ant1_polidx[j]] ==
-	    SYSCAL_TSYS_APPLIED) &&
-	   (cycle_data->tsys_applied[iidx][ant2_idx][ant2_polidx[j]] ==
-	    SYSCAL_TSYS_APPLIED))) {
-	if (ant1_polidx[j] == CAL_XX) {
-	  sdo_target1 = cycle_data->sdo_x;
-	} else if (ant1_polidx[j] == CAL_YY) {
-	  sdo_target1 = cycle_data->sdo_y;
-	}
-	if (ant2_polidx[j] == CAL_XX) {
-	  sdo_target2 = cycle_data->sdo_x;
-	} else if (ant2_polidx[j] == CAL_YY) {
-	  sdo_target2 = cycle_data->sdo_y;
-	}
-	if (action == STM_REMOVE) {
-	  applied_target = cycle_data->tsys_applied;
-	}
-      } else if ((action == STM_APPLY_COMPUTED) ||
-		 ((action == STM_REMOVE) &&
-		  (cycle_data->computed_tsys_applied[iidx][ant1_idx][ant1_polidx[j]] ==
-		   SYSCAL_TSYS_APPLIED) &&
-		  (cycle_data->computed_tsys_applied[iidx][ant2_idx][ant2_polidx[j]] ==
-		   SYSCAL_TSYS_APPLIED))) {
-	if (ant1_polidx[j] == CAL_XX) {
-	  sdo_target1 = cycle_data->computed_sdo_x;
-	} else if (ant1_polidx[j] == CAL_YY) {
-	  sdo_target1 = cycle_data->computed_sdo_y;
-	}
-	if (ant2_polidx[j] == CAL_XX) {
-	  sdo_target2 = cycle_data->computed_sdo_x;
-	} else if (ant2_polidx[j] == CAL_YY) {
-	  sdo_target2 = cycle_data->computed_sdo_y;
-	}
-	if (action == STM_REMOVE) {
-	  applied_target = cycle_data->computed_tsys_applied;
-	}
-      }
-
-      mfac = mval * sqrtf((caljy_target1[iidx][ant1_idx] / sdo_target1[iidx][ant1_idx]) *
-			  (caljy_target2[iidx][ant2_idx] / sdo_target2[iidx][ant2_idx]));
-      if (action == STM_REMOVE) {
-	mfac = 1.0 / mfac;
-      }
-      
-      /* if (action == STM_APPLY_CORRELATOR) { */
-      /* 	/\* mfac = mval * sqrtf(cycle_data->tsys[iidx][ant1_idx][ant1_polidx[j]] * *\/ */
-      /* 	/\* 		    cycle_data->tsys[iidx][ant2_idx][ant2_polidx[j]]); *\/ */
-      /* 	mfac = mval * sqrtf((caljy_target1[iidx][ant1_idx] / sdo_target1[iidx][ant1_idx]) * */
-      /* 			    (caljy_target2[iidx][ant2_idx] / sdo_target2[iidx][ant1_idx])); */
-      /* } else if (action == STM_APPLY_COMPUTED) { */
-      /* 	mfac = sqrtf(cycle_data->computed_tsys[iidx][ant1_idx][ant1_polidx[j]] * */
-      /* 		     cycle_data->computed_tsys[iidx][ant2_idx][ant2_polidx[j]]); */
-      /* } else if (action == STM_REMOVE) { */
-      /* 	// Work out which one has been applied. */
-      /* 	if ((cycle_data->tsys_applied[iidx][ant1_idx][ant1_polidx[j]] == SYSCAL_TSYS_APPLIED) && */
-      /* 	    (cycle_data->tsys_applied[iidx][ant2_idx][ant2_polidx[j]] == SYSCAL_TSYS_APPLIED)) { */
-      /* 	  tsys_target = cycle_data->tsys; */
-      /* 	  applied_target = cycle_data->tsys_applied; */
-      /* 	} else if ((cycle_data->computed_tsys_applied[iidx][ant1_idx][ant1_polidx[j]] == */
-      /* 		    SYSCAL_TSYS_APPLIED) && */
-      /* 		   (cycle_data->computed_tsys_applied[iidx][ant2_idx][ant2_polidx[j]] == */
-      /* 		    SYSCAL_TSYS_APPLIED)) { */
-      /* 	  tsys_target = cycle_data->computed_tsys; */
-      /* 	  applied_target = cycle_data->computed_tsys_applied; */
-      /* 	} */
-      /* 	mfac = 1.0 / sqrtf(tsys_target[iidx][ant1_idx][ant1_polidx[j]] * */
-      /* 			   tsys_target[iidx][ant2_idx][ant2_polidx[j]]); */
-      /* } */
-      if ((mfac != mfac) || (mfac < 0)) {
-	continue;
-      }
-      for (k = 0; k < scan_header_data->if_num_channels[iidx]; k++) {
-	// Work out where our data is.
-	vidx = j + k * scan_header_data->if_num_stokes[iidx];
-	rcheck = crealf(cycle_data->vis[i][vidx]);
-	if (rcheck != rcheck) {
-	  // This is NaN, so don't do anything to it.
-	  continue;
-	}
-	cycle_data->vis[i][vidx] *= mfac;
-	modified = true;
-      }
-    }
-
-    FREE(ant1_polidx);
-    FREE(ant2_polidx);
-  }
+  int nstates, max_stokes, *pol1 = NULL, *pol2 = NULL;
+  int *old_state = NULL, *new_state = NULL;
+  float *old_ratio = NULL, *new_ratio = NULL;
 
-  if (modified == true) {
-    if (action == STM_APPLY_CORRELATOR) {
-      applied_target = cycle_data->tsys_applied;
-      applied_value = SYSCAL_TSYS_APPLIED;
-    } else if (action == STM_APPLY_COMPUTED) {
-      applied_target = cycle_data->computed_tsys_applied;
-      applied_value = SYSCAL_TSYS_APPLIED;
-    } else if (action == STM_REMOVE) {
-      applied_value = SYSCAL_TSYS_NOT_APPLIED;
-    }
-    if (applied_target != NULL) {
-      for (i = 0; i < cycle_data->num_cal_ifs; i++) {
-	for (j = 0; j < cycle_data->num_cal_ants; j++) {
-	  for (k = 0; k < 2; k++) {
-	    applied_target[i][j][k] = applied_value;
-	  }
-	}
-      }
-    }
+  if ((action != STM_APPLY_CORRELATOR) && (action != STM_APPLY_COMPUTED) &&
+      (action != STM_REMOVE)) {
+    fprintf(stderr, "[system_temperature_modifier] unknown action %d\n", action);
+    return;
   }
 
+  nstates = cycle_data->num_cal_ifs * cycle_data->num_cal_ants * 2;
+  MALLOC(old_state, nstates + 1);
+  MALLOC(old_ratio, nstates + 1);
+  MALLOC(new_state, nstates + 1);
+  MALLOC(new_ratio, nstates + 1);
+  system_temperature_factors(cycle_data, -1, old_state, old_ratio);
+  system_temperature_factors(cycle_data,
+			     (action == STM_REMOVE) ? STM_NOT_APPLIED : action,
+			     new_state, new_ratio);
+  system_temperature_polarisations(scan_header_data, &max_stokes, &pol1, &pol2);
+  system_temperature_rescale(cycle_data, scan_header_data, old_state, old_ratio,
+			     new_state, new_ratio, pol1, pol2, max_stokes);
+
+  FREE(old_state);
+  FREE(old_ratio);
+  FREE(new_state);
+  FREE(new_ratio);
+  FREE(pol1);
+  FREE(pol2);
 }
 
 /*!
@@ -3182,55 +4543,483 @@ void print_information_scan_header(struct scan_header_data *header_data,
   }
 }
 
+/*! \def CHANAVERAGE_JOBS_PER_THREAD
+ *  \brief The number of baselines that each thread averaging a spectrum set
+ *         should get, so that small sets don't start more threads than they
+ *         can use
+ */
+#define CHANAVERAGE_JOBS_PER_THREAD 4
+
+/*! \struct chanaverage_workspace
+ *  \brief Scratch arrays used while averaging the channels of a spectrum
+ *
+ * The arrays only ever grow, so a workspace can be used for many spectra. A
+ * workspace can't be used by more than one thread at a time.
+ */
+struct chanaverage_workspace {
+  /*! \var max_channels
+   *  \brief The number of input channels that `mask` can hold
+   */
+  int max_channels;
+  /*! \var max_blocks
+   *  \brief The number of averaged channels that the sum arrays can hold
+   */
+  int max_blocks;
+  /*! \var max_width
+   *  \brief The number of channels in a block that the block arrays can hold
+   */
+  int max_width;
+  /*! \var mask
+   *  \brief 1 for each good input channel and 0 for each bad one
+   */
+  float *mask;
+  /*! \var all_raw
+   *  \brief The sum of the complex values of all the channels in each block
+   */
+  float complex *all_raw;
+  /*! \var valid_raw
+   *  \brief The sum of the complex values of the good channels in each block
+   */
+  float complex *valid_raw;
+  /*! \var all_amplitude
+   *  \brief The sum of the amplitudes of all the channels in each block
+   */
+  float *all_amplitude;
+  /*! \var valid_amplitude
+   *  \brief The sum of the amplitudes of the good channels in each block
+   */
+  float *valid_amplitude;
+  /*! \var all_phase
+   *  \brief The sum of the phases of all the channels in each block
+   */
+  float *all_phase;
+  /*! \var valid_phase
+   *  \brief The sum of the phases of the good channels in each block
+   */
+  float *valid_phase;
+  /*! \var nvalid
+   *  \brief The number of good channels in each block
+   */
+  float *nvalid;
+  /*! \var block_amplitude
+   *  \brief The amplitudes of the channels in one block, for the median
+   */
+  float *block_amplitude;
+  /*! \var block_phase
+   *  \brief The phases of the channels in one block, for the median
+   */
+  float *block_phase;
+  /*! \var block_raw
+   *  \brief The complex values of the channels in one block, for the median
+   */
+  float complex *block_raw;
+  /*! \var block_select
+   *  \brief Scratch space for the complex median selection
+   */
+  float *block_select;
+};
+
 /*!
- *  \brief Perform averaging over some ampphase data
+ *  \brief Make sure a channel averaging workspace is large enough
+ *  \param workspace the workspace, which starts out zeroed
+ *  \param nchannels the number of input channels
+ *  \param nblocks the number of averaged channels
+ *  \param width the number of channels averaged together
+ */
+static void chanaverage_workspace_size(struct chanaverage_workspace *workspace,
+				       int nchannels, int nblocks, int width) {
+  if (nchannels > workspace->max_channels) {
+    REALLOC(workspace->mask, nchannels);
+    workspace->max_channels = nchannels;
+  }
+  if (nblocks > workspace->max_blocks) {
+    REALLOC(workspace->all_raw, nblocks);
+    REALLOC(workspace->valid_raw, nblocks);
+    REALLOC(workspace->all_amplitude, nblocks);
+    REALLOC(workspace->valid_amplitude, nblocks);
+    REALLOC(workspace->all_phase, nblocks);
+    REALLOC(workspace->valid_phase, nblocks);
+    REALLOC(workspace->nvalid, nblocks);
+    workspace->max_blocks = nblocks;
+  }
+  if (width > workspace->max_width) {
+    REALLOC(workspace->block_amplitude, width);
+    REALLOC(workspace->block_phase, width);
+    REALLOC(workspace->block_raw, width);
+    REALLOC(workspace->block_select, width);
+    workspace->max_width = width;
+  }
+}
+
+/*!
+ *  \brief Free the arrays in a channel averaging workspace
+ *  \param workspace the workspace
+ */
+static void chanaverage_workspace_free(struct chanaverage_workspace *workspace) {
+  FREE(workspace->mask);
+  FREE(workspace->all_raw);
+  FREE(workspace->valid_raw);
+  FREE(workspace->all_amplitude);
+  FREE(workspace->valid_amplitude);
+  FREE(workspace->all_phase);
+  FREE(workspace->valid_phase);
+  FREE(workspace->nvalid);
+  FREE(workspace->block_amplitude);
+  FREE(workspace->block_phase);
+  FREE(workspace->block_raw);
+  FREE(workspace->block_select);
+}
+
+/*!
+ *  \brief Add up the channels in some blocks of a spectrum
+ *  \param n the number of channels in the spectrum
+ *  \param width the number of channels in each block
+ *  \param first_block the first block to sum
+ *  \param end_block one past the last block to sum
+ *  \param raw the complex values of the spectrum
+ *  \param amplitude the amplitudes of the spectrum
+ *  \param phase the phases of the spectrum
+ *  \param workspace the workspace, with its mask filled, which gets the sums
+ *
+ * The channels of each block are added in order, and a bad channel adds a 0
+ * to the good sums, so the sums are exactly those that adding up only the
+ * good channels would give.
+ */
+static void chanaverage_sums_scalar(int n, int width, int first_block, int end_block,
+				    float complex *raw, float *amplitude, float *phase,
+				    struct chanaverage_workspace *workspace) {
+  int c, l, k;
+  bool good;
+
+  for (c = first_block; c < end_block; c++) {
+    workspace->all_raw[c] = workspace->valid_raw[c] = 0;
+    workspace->all_amplitude[c] = workspace->valid_amplitude[c] = 0;
+    workspace->all_phase[c] = workspace->valid_phase[c] = 0;
+    workspace->nvalid[c] = 0;
+  }
+  for (l = 0; l < width; l++) {
+    for (c = first_block; c < end_block; c++) {
+      k = c * width + l;
+      if (k >= n) {
+	break;
+      }
+      good = (workspace->mask[k] != 0);
+      workspace->all_raw[c] += raw[k];
+      workspace->valid_raw[c] += (good ? raw[k] : 0);
+      workspace->all_amplitude[c] += amplitude[k];
+      workspace->valid_amplitude[c] += (good ? amplitude[k] : 0);
+      workspace->all_phase[c] += phase[k];
+      workspace->valid_phase[c] += (good ? phase[k] : 0);
+      workspace->nvalid[c] += workspace->mask[k];
+    }
+  }
+}
+
+#ifdef COMPUTE_AVX2
+/*!
+ *  \brief Add up the channels in the full blocks of a spectrum, using AVX2
+ *  \param n the number of channels in the spectrum
+ *  \param width the number of channels in each block
+ *  \param raw the complex values of the spectrum
+ *  \param amplitude the amplitudes of the spectrum
+ *  \param phase the phases of the spectrum
+ *  \param workspace the workspace, with its mask filled, which gets the sums
+ *  \return the number of blocks that were summed, starting from the first
+ *
+ * Each lane works on its own block, eight blocks at a time, so the channels of
+ * a block are added in the same order as chanaverage_sums_scalar adds them and
+ * the sums are identical.
+ */
+__attribute__((target("avx2")))
+static int chanaverage_sums_avx2(int n, int width, float complex *raw,
+				 float *amplitude, float *phase,
+				 struct chanaverage_workspace *workspace) {
+  int c, l, nfull = n / width;
+  const __m256 zero = _mm256_setzero_ps();
+  __m256i offsets, index, rindex;
+  __m256 all_re, all_im, valid_re, valid_im, all_amp, valid_amp;
+  __m256 all_pha, valid_pha, nvalid, mask, good, re, im, amp, pha, lo, hi;
+
+  offsets = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7),
+			       _mm256_set1_epi32(width));
+  for (c = 0; c + 8 <= nfull; c += 8) {
+    all_re = all_im = valid_re = valid_im = zero;
+    all_amp = valid_amp = all_pha = valid_pha = nvalid = zero;
+    for (l = 0; l < width; l++) {
+      index = _mm256_add_epi32(offsets, _mm256_set1_epi32(c * width + l));
+      rindex = _mm256_add_epi32(index, index);
+      mask = _mm256_i32gather_ps(workspace->mask, index, 4);
+      nvalid = _mm256_add_ps(nvalid, mask);
+      good = _mm256_cmp_ps(mask, zero, _CMP_NEQ_OQ);
+      re = _mm256_i32gather_ps((float *)raw, rindex, 4);
+      im = _mm256_i32gather_ps((float *)raw + 1, rindex, 4);
+      amp = _mm256_i32gather_ps(amplitude, index, 4);
+      pha = _mm256_i32gather_ps(phase, index, 4);
+      all_re = _mm256_add_ps(all_re, re);
+      all_im = _mm256_add_ps(all_im, im);
+      all_amp = _mm256_add_ps(all_amp, amp);
+      all_pha = _mm256_add_ps(all_pha, pha);
+      valid_re = _mm256_add_ps(valid_re, _mm256_and_ps(good, re));
+      valid_im = _mm256_add_ps(valid_im, _mm256_and_ps(good, im));
+      valid_amp = _mm256_add_ps(valid_amp, _mm256_and_ps(good, amp));
+      valid_pha = _mm256_add_ps(valid_pha, _mm256_and_ps(good, pha));
+    }
+    // Put the real and imaginary sums back together.
+    lo = _mm256_unpacklo_ps(all_re, all_im);
+    hi = _mm256_unpackhi_ps(all_re, all_im);
+    _mm256_storeu_ps((float *)(workspace->all_raw + c), _mm256_permute2f128_ps(lo, hi, 0x20));
+    _mm256_storeu_ps((float *)(workspace->all_raw + c + 4), _mm256_permute2f128_ps(lo, hi, 0x31));
+    lo = _mm256_unpacklo_ps(valid_re, valid_im);
+    hi = _mm256_unpackhi_ps(valid_re, valid_im);
+    _mm256_storeu_ps((float *)(workspace->valid_raw + c), _mm256_permute2f128_ps(lo, hi, 0x20));
+    _mm256_storeu_ps((float *)(workspace->valid_raw + c + 4), _mm256_permute2f128_ps(lo, hi, 0x31));
+    _mm256_storeu_ps(workspace->all_amplitude + c, all_amp);
+    _mm256_storeu_ps(workspace->valid_amplitude + c, valid_amp);
+    _mm256_storeu_ps(workspace->all_phase + c, all_pha);
+    _mm256_storeu_ps(workspace->valid_phase + c, valid_pha);
+    _mm256_storeu_ps(workspace->nvalid + c, nvalid);
+  }
+
+  return c;
+}
+#endif
+
+/*!
+ *  \brief Work out the averaged value of one block of channels in a spectrum
  *  \param ampphase the data before averaging
- *  \param avg_ampphase upon exit this will contain the averaged data
+ *  \param avg_ampphase the averaged data being filled
+ *  \param baseline the baseline index
+ *  \param bin the bin index
+ *  \param block the index of the block, and of the averaged channel
  *  \param averaging the number of channels to average together
  *  \param averaging_type bitwise-OR combination of AVERAGETYPE_* magic numbers
- *                        specifying how the average should be computed
  *  \param phase_in_degrees whether to output phase in degrees (true) or not
+ *  \param workspace the workspace, with its mask and sums filled
+ *  \return true if any of the channels in the block are good
+ *
+ * When any of the channels are good, only the good channels are averaged,
+ * otherwise all the channels are.
  */
-void chanaverage_ampphase(struct ampphase *ampphase, struct ampphase *avg_ampphase,
-			  int averaging, int averaging_type, bool phase_in_degrees) {
-  int n_delavg_expected, i, j, k, l, n_points;
-  int n_unflagged_points, chan_index, unflagged_index;
-  float *median_array_amplitude = NULL, *median_array_phase = NULL;
-  float *median_array_channel = NULL, *median_array_frequency = NULL;
-  float *median_unflagged_frequency = NULL, *median_unflagged_channel = NULL;
-  float *median_unflagged_amplitude = NULL, *median_unflagged_phase = NULL;
+static bool chanaverage_block(struct ampphase *ampphase, struct ampphase *avg_ampphase,
+			      int baseline, int bin, int block, int averaging,
+			      int averaging_type, bool phase_in_degrees,
+			      struct chanaverage_workspace *workspace) {
+  int k, l, first = block * averaging, n_points, n_used = 0;
+  bool any_valid;
+  float complex avg_raw = 0;
+  float avg_amplitude = 0, avg_phase = 0;
+
+  n_points = ampphase->nchannels - first;
+  if (n_points > averaging) {
+    n_points = averaging;
+  }
+  any_valid = (workspace->nvalid[block] > 0);
+  if (averaging_type & AVERAGETYPE_MEAN) {
+    if (any_valid) {
+      n_used = (int)workspace->nvalid[block];
+      avg_raw = workspace->valid_raw[block] / (float)n_used;
+      avg_amplitude = workspace->valid_amplitude[block] / (float)n_used;
+      avg_phase = workspace->valid_phase[block] / (float)n_used;
+    } else {
+      avg_raw = workspace->all_raw[block] / (float)n_points;
+      avg_amplitude = workspace->all_amplitude[block] / (float)n_points;
+      avg_phase = workspace->all_phase[block] / (float)n_points;
+    }
+  } else if (averaging_type & AVERAGETYPE_MEDIAN) {
+    // Select from copies of only the channels we need.
+    for (l = 0; l < n_points; l++) {
+      k = first + l;
+      if (!any_valid || (workspace->mask[k] != 0)) {
+	workspace->block_raw[n_used] = ampphase->raw[baseline][bin][k];
+	workspace->block_amplitude[n_used] = ampphase->amplitude[baseline][bin][k];
+	workspace->block_phase[n_used] = ampphase->phase[baseline][bin][k];
+	n_used++;
+      }
+    }
+    avg_raw = fcselectmedianfc(workspace->block_raw, workspace->block_select, n_used);
+    if (averaging_type & AVERAGETYPE_SCALAR) {
+      avg_amplitude = fselectmedianf(workspace->block_amplitude, n_used);
+      avg_phase = fselectmedianf(workspace->block_phase, n_used);
+    }
+  } else {
+    // CALLOC makes everything 0 by default.
+    return any_valid;
+  }
+
+  avg_ampphase->raw[baseline][bin][block] = avg_raw;
+  if (averaging_type & AVERAGETYPE_SCALAR) {
+    avg_ampphase->amplitude[baseline][bin][block] = avg_amplitude;
+    avg_ampphase->phase[baseline][bin][block] = avg_phase;
+  } else if (averaging_type & AVERAGETYPE_VECTOR) {
+    avg_ampphase->amplitude[baseline][bin][block] = cabsf(avg_raw);
+    avg_ampphase->phase[baseline][bin][block] = cargf(avg_raw);
+    if (phase_in_degrees) {
+      avg_ampphase->phase[baseline][bin][block] *= 180.0 / M_PI;
+    }
+  }
+
+  return any_valid;
+}
+
+/*!
+ *  \brief Average the channels of all the bins on one baseline
+ *  \param ampphase the data before averaging
+ *  \param avg_ampphase the averaged data, already set up by
+ *                      chanaverage_prepare
+ *  \param baseline the baseline index
+ *  \param averaging the number of channels to average together
+ *  \param averaging_type bitwise-OR combination of AVERAGETYPE_* magic numbers
+ *  \param phase_in_degrees whether to output phase in degrees (true) or not
+ *  \param workspace the workspace to use
+ *
+ * Only this baseline's parts of \a avg_ampphase are changed, so different
+ * baselines can be averaged at the same time by different threads.
+ */
+static void chanaverage_baseline(struct ampphase *ampphase, struct ampphase *avg_ampphase,
+				 int baseline, int averaging, int averaging_type,
+				 bool phase_in_degrees,
+				 struct chanaverage_workspace *workspace) {
+  int i = baseline, j, k, c, nsummed = 0, nblocks = avg_ampphase->nchannels;
   float checkval;
-  float complex *median_array_raw = NULL, *median_unflagged_raw = NULL;
-  
-  // Make the arrays required.
-  if (averaging < 1) {
-    averaging = 1;
+
+  // Set initial defaults for the baseline maxima and minima.
+  avg_ampphase->min_amplitude[i] = INFINITY;
+  avg_ampphase->max_amplitude[i] = -INFINITY;
+  avg_ampphase->min_phase[i] = INFINITY;
+  avg_ampphase->max_phase[i] = -INFINITY;
+  avg_ampphase->min_real[i] = INFINITY;
+  avg_ampphase->max_real[i] = -INFINITY;
+  avg_ampphase->min_imag[i] = INFINITY;
+  avg_ampphase->max_imag[i] = -INFINITY;
+
+  if (averaging == 1) {
+    // Special case where we can just copy everything over.
+    for (j = 0; j < ampphase->nbins[i]; j++) {
+      memcpy(avg_ampphase->weight[i][j], ampphase->weight[i][j],
+	     ampphase->nchannels * sizeof(float));
+      memcpy(avg_ampphase->amplitude[i][j], ampphase->amplitude[i][j],
+	     ampphase->nchannels * sizeof(float));
+      memcpy(avg_ampphase->phase[i][j], ampphase->phase[i][j],
+	     ampphase->nchannels * sizeof(float));
+      memcpy(avg_ampphase->raw[i][j], ampphase->raw[i][j],
+	     ampphase->nchannels * sizeof(float complex));
+      STRUCTCOPY(ampphase, avg_ampphase, f_nchannels[i][j]);
+      memcpy(avg_ampphase->valid[i][j], ampphase->valid[i][j],
+	     AMPPHASE_MASK_WORDS(ampphase->nchannels) * sizeof(unsigned int));
+    }
+    if (ampphase->nbins[i] > 0) {
+      STRUCTCOPY(ampphase, avg_ampphase, min_amplitude[i]);
+      STRUCTCOPY(ampphase, avg_ampphase, max_amplitude[i]);
+      STRUCTCOPY(ampphase, avg_ampphase, min_phase[i]);
+      STRUCTCOPY(ampphase, avg_ampphase, max_phase[i]);
+      STRUCTCOPY(ampphase, avg_ampphase, min_real[i]);
+      STRUCTCOPY(ampphase, avg_ampphase, max_real[i]);
+      STRUCTCOPY(ampphase, avg_ampphase, min_imag[i]);
+      STRUCTCOPY(ampphase, avg_ampphase, max_imag[i]);
+    }
+    return;
+  }
+
+  chanaverage_workspace_size(workspace, ampphase->nchannels, nblocks, averaging);
+  for (j = 0; j < ampphase->nbins[i]; j++) {
+    for (k = 0; k < ampphase->nchannels; k++) {
+      workspace->mask[k] = ampphase_channel_valid(ampphase, i, j, k) ? 1 : 0;
+    }
+    if (averaging_type & AVERAGETYPE_MEAN) {
+#ifdef COMPUTE_AVX2
+      if (__builtin_cpu_supports("avx2")) {
+	nsummed = chanaverage_sums_avx2(ampphase->nchannels, averaging,
+					ampphase->raw[i][j], ampphase->amplitude[i][j],
+					ampphase->phase[i][j], workspace);
+      }
+#endif
+      chanaverage_sums_scalar(ampphase->nchannels, averaging, nsummed, nblocks,
+			      ampphase->raw[i][j], ampphase->amplitude[i][j],
+			      ampphase->phase[i][j], workspace);
+    } else {
+      // Only the number of good channels in each block is needed.
+      for (c = 0; c < nblocks; c++) {
+	workspace->nvalid[c] = 0;
+      }
+      for (k = 0; k < ampphase->nchannels; k++) {
+	workspace->nvalid[k / averaging] += workspace->mask[k];
+      }
+    }
+
+    for (c = 0; c < nblocks; c++) {
+      if (!chanaverage_block(ampphase, avg_ampphase, i, j, c, averaging,
+			     averaging_type, phase_in_degrees, workspace)) {
+	continue;
+      }
+      // That's a successful unflagged channel.
+      ampphase_set_valid(avg_ampphase, i, j, c);
+      avg_ampphase->f_nchannels[i][j] += 1;
+      // Update the maxima and minima.
+      checkval = crealf(avg_ampphase->raw[i][j][c]);
+      if (checkval < avg_ampphase->min_real[i]) {
+	avg_ampphase->min_real[i] = checkval;
+      }
+      if (checkval > avg_ampphase->max_real[i]) {
+	avg_ampphase->max_real[i] = checkval;
+      }
+      checkval = cimagf(avg_ampphase->raw[i][j][c]);
+      if (checkval < avg_ampphase->min_imag[i]) {
+	avg_ampphase->min_imag[i] = checkval;
+      }
+      if (checkval > avg_ampphase->max_imag[i]) {
+	avg_ampphase->max_imag[i] = checkval;
+      }
+      checkval = avg_ampphase->amplitude[i][j][c];
+      if (checkval < avg_ampphase->min_amplitude[i]) {
+	avg_ampphase->min_amplitude[i] = checkval;
+      }
+      if (checkval > avg_ampphase->max_amplitude[i]) {
+	avg_ampphase->max_amplitude[i] = checkval;
+      }
+      checkval = avg_ampphase->phase[i][j][c];
+      if (checkval < avg_ampphase->min_phase[i]) {
+	avg_ampphase->min_phase[i] = checkval;
+      }
+      if (checkval > avg_ampphase->max_phase[i]) {
+	avg_ampphase->max_phase[i] = checkval;
+      }
+    }
   }
+}
+
+/*!
+ *  \brief Set up the structure that will hold averaged ampphase data
+ *  \param ampphase the data before averaging
+ *  \param avg_ampphase the structure to set up, which gets all the metadata,
+ *                      the averaged channel numbers and frequencies, and
+ *                      zeroed spectra
+ *  \param averaging the number of channels to average together
+ *  \param averaging_type bitwise-OR combination of AVERAGETYPE_* magic numbers
+ *  \param workspace the workspace to use
+ */
+static void chanaverage_prepare(struct ampphase *ampphase, struct ampphase *avg_ampphase,
+				int averaging, int averaging_type,
+				struct chanaverage_workspace *workspace) {
+  int n_delavg_expected, i, j, k, c, n_points;
+
   n_delavg_expected = (int)ceilf((float)ampphase->nchannels / (float)averaging);
   if (n_delavg_expected < 1) {
     n_delavg_expected = 1;
   }
-  CALLOC(median_array_amplitude, averaging);
-  CALLOC(median_array_phase, averaging);
-  CALLOC(median_array_raw, averaging);
-  CALLOC(median_array_channel, averaging);
-  CALLOC(median_array_frequency, averaging);
-  CALLOC(median_unflagged_amplitude, averaging);
-  CALLOC(median_unflagged_phase, averaging);
-  CALLOC(median_unflagged_raw, averaging);
-  CALLOC(median_unflagged_channel, averaging);
-  CALLOC(median_unflagged_frequency, averaging);
-  
+
   // Set the quantities in the output.
   avg_ampphase->nchannels = n_delavg_expected;
   STRUCTCOPY(ampphase, avg_ampphase, nbaselines);
   CALLOC(avg_ampphase->baseline, ampphase->nbaselines);
   CALLOC(avg_ampphase->nbins, ampphase->nbaselines);
-  CALLOC(avg_ampphase->flagged_bad, ampphase->nbaselines);
   for (i = 0; i < ampphase->nbaselines; i++) {
     STRUCTCOPY(ampphase, avg_ampphase, baseline[i]);
     STRUCTCOPY(ampphase, avg_ampphase, nbins[i]);
-    CALLOC(avg_ampphase->flagged_bad[i], ampphase->nbins[i]);
+  }
+  // The good channel mask starts out empty, and the averaged channels get
+  // marked as they are found to contain good data.
+  allocate_ampphase_spectra(avg_ampphase);
+  for (i = 0; i < ampphase->nbaselines; i++) {
     for (j = 0; j < ampphase->nbins[i]; j++) {
       STRUCTCOPY(ampphase, avg_ampphase, flagged_bad[i][j]);
     }
@@ -3254,19 +5043,8 @@ void chanaverage_ampphase(struct ampphase *ampphase, struct ampphase *avg_amppha
   avg_ampphase->max_amplitude_global = -INFINITY;
   avg_ampphase->min_phase_global = INFINITY;
   avg_ampphase->max_phase_global = -INFINITY;
-  
+
   // Allocate some memory.
-  CALLOC(avg_ampphase->weight, ampphase->nbaselines);
-  CALLOC(avg_ampphase->amplitude, ampphase->nbaselines);
-  CALLOC(avg_ampphase->phase, ampphase->nbaselines);
-  CALLOC(avg_ampphase->raw, ampphase->nbaselines);
-  CALLOC(avg_ampphase->f_nchannels, ampphase->nbaselines);
-  CALLOC(avg_ampphase->f_channel, ampphase->nbaselines);
-  CALLOC(avg_ampphase->f_frequency, ampphase->nbaselines);
-  CALLOC(avg_ampphase->f_weight, ampphase->nbaselines);
-  CALLOC(avg_ampphase->f_amplitude, ampphase->nbaselines);
-  CALLOC(avg_ampphase->f_phase, ampphase->nbaselines);
-  CALLOC(avg_ampphase->f_raw, ampphase->nbaselines);
   CALLOC(avg_ampphase->min_amplitude, ampphase->nbaselines);
   CALLOC(avg_ampphase->max_amplitude, ampphase->nbaselines);
   CALLOC(avg_ampphase->min_phase, ampphase->nbaselines);
@@ -3277,292 +5055,282 @@ void chanaverage_ampphase(struct ampphase *ampphase, struct ampphase *avg_amppha
   CALLOC(avg_ampphase->max_imag, ampphase->nbaselines);
   CALLOC(avg_ampphase->channel, n_delavg_expected);
   CALLOC(avg_ampphase->frequency, n_delavg_expected);
-  
-  // The averaging loop.
+
+  // The channel numbers and frequencies don't depend on the baseline, so
+  // they are only averaged once.
+  chanaverage_workspace_size(workspace, 0, 0, averaging);
+  for (k = 0, c = 0; k < ampphase->nchannels; k += averaging, c++) {
+    n_points = ampphase->nchannels - k;
+    if (n_points > averaging) {
+      n_points = averaging;
+    }
+    if (averaging == 1) {
+      STRUCTCOPY(ampphase, avg_ampphase, channel[k]);
+      STRUCTCOPY(ampphase, avg_ampphase, frequency[k]);
+    } else if (averaging_type & AVERAGETYPE_MEAN) {
+      avg_ampphase->channel[c] = (int)fmeanf(ampphase->channel + k, n_points);
+      avg_ampphase->frequency[c] = fmeanf(ampphase->frequency + k, n_points);
+    } else if (averaging_type & AVERAGETYPE_MEDIAN) {
+      memcpy(workspace->block_amplitude, ampphase->channel + k, n_points * sizeof(float));
+      avg_ampphase->channel[c] = (int)fselectmedianf(workspace->block_amplitude, n_points);
+      memcpy(workspace->block_amplitude, ampphase->frequency + k, n_points * sizeof(float));
+      avg_ampphase->frequency[c] = fselectmedianf(workspace->block_amplitude, n_points);
+    }
+  }
+}
+
+/*!
+ *  \brief Work out the global maxima and minima of some averaged data from
+ *         the maxima and minima of each baseline
+ *  \param avg_ampphase the averaged data
+ */
+static void chanaverage_global_limits(struct ampphase *avg_ampphase) {
+  int i;
+
+  for (i = 0; i < avg_ampphase->nbaselines; i++) {
+    if (avg_ampphase->min_amplitude[i] < avg_ampphase->min_amplitude_global) {
+      avg_ampphase->min_amplitude_global = avg_ampphase->min_amplitude[i];
+    }
+    if (avg_ampphase->max_amplitude[i] > avg_ampphase->max_amplitude_global) {
+      avg_ampphase->max_amplitude_global = avg_ampphase->max_amplitude[i];
+    }
+    if (avg_ampphase->min_phase[i] < avg_ampphase->min_phase_global) {
+      avg_ampphase->min_phase_global = avg_ampphase->min_phase[i];
+    }
+    if (avg_ampphase->max_phase[i] > avg_ampphase->max_phase_global) {
+      avg_ampphase->max_phase_global = avg_ampphase->max_phase[i];
+    }
+  }
+}
+
+/*!
+ *  \brief Perform averaging over some ampphase data
+ *  \param ampphase the data before averaging
+ *  \param avg_ampphase upon exit this will contain the averaged data
+ *  \param averaging the number of channels to average together
+ *  \param averaging_type bitwise-OR combination of AVERAGETYPE_* magic numbers
+ *                        specifying how the average should be computed
+ *  \param phase_in_degrees whether to output phase in degrees (true) or not
+ *
+ * The channels are averaged in blocks of \a averaging; the mean sums many
+ * blocks at once, and the median is selected in place within each block.
+ */
+void chanaverage_ampphase(struct ampphase *ampphase, struct ampphase *avg_ampphase,
+			  int averaging, int averaging_type, bool phase_in_degrees) {
+  int i;
+  struct chanaverage_workspace workspace;
+
+  if (averaging < 1) {
+    averaging = 1;
+  }
+  memset(&workspace, 0, sizeof(struct chanaverage_workspace));
+  chanaverage_prepare(ampphase, avg_ampphase, averaging, averaging_type, &workspace);
   for (i = 0; i < ampphase->nbaselines; i++) {
+    chanaverage_baseline(ampphase, avg_ampphase, i, averaging, averaging_type,
+			 phase_in_degrees, &workspace);
+  }
+  chanaverage_global_limits(avg_ampphase);
+  chanaverage_workspace_free(&workspace);
+}
 
-    // Set initial defaults for the baseline maxima and minima.
-    avg_ampphase->min_amplitude[i] = INFINITY;
-    avg_ampphase->max_amplitude[i] = -INFINITY;
-    avg_ampphase->min_phase[i] = INFINITY;
-    avg_ampphase->max_phase[i] = -INFINITY;
-    avg_ampphase->min_real[i] = INFINITY;
-    avg_ampphase->max_real[i] = -INFINITY;
-    avg_ampphase->min_imag[i] = INFINITY;
-    avg_ampphase->max_imag[i] = -INFINITY;
-    
-    // Allocate required memory.
-    CALLOC(avg_ampphase->weight[i], ampphase->nbins[i]);
-    CALLOC(avg_ampphase->amplitude[i], ampphase->nbins[i]);
-    CALLOC(avg_ampphase->phase[i], ampphase->nbins[i]);
-    CALLOC(avg_ampphase->raw[i], ampphase->nbins[i]);
-    CALLOC(avg_ampphase->f_nchannels[i], ampphase->nbins[i]);
-    CALLOC(avg_ampphase->f_channel[i], ampphase->nbins[i]);
-    CALLOC(avg_ampphase->f_frequency[i], ampphase->nbins[i]);
-    CALLOC(avg_ampphase->f_weight[i], ampphase->nbins[i]);
-    CALLOC(avg_ampphase->f_amplitude[i], ampphase->nbins[i]);
-    CALLOC(avg_ampphase->f_phase[i], ampphase->nbins[i]);
-    CALLOC(avg_ampphase->f_raw[i], ampphase->nbins[i]);
-    
-    for (j = 0; j < ampphase->nbins[i]; j++) {
+/*! \struct chanaverage_batch
+ *  \brief The averaging jobs shared between the threads averaging a set of
+ *         spectra
+ *
+ * Each job averages one baseline of one spectrum.
+ */
+struct chanaverage_batch {
+  /*! \var n_spectra
+   *  \brief The number of spectra in the set
+   */
+  int n_spectra;
+  /*! \var spectra
+   *  \brief The spectra before averaging
+   *
+   * This array of pointers has length `n_spectra`, and is indexed starting
+   * at 0.
+   */
+  struct ampphase **spectra;
+  /*! \var avg_spectra
+   *  \brief The averaged spectra
+   *
+   * This array of pointers has length `n_spectra`, and is indexed starting
+   * at 0.
+   */
+  struct ampphase **avg_spectra;
+  /*! \var averaging
+   *  \brief The number of channels to average together in each spectrum
+   *
+   * This array has length `n_spectra`, and is indexed starting at 0.
+   */
+  int *averaging;
+  /*! \var averaging_type
+   *  \brief How to average each spectrum
+   *
+   * This array has length `n_spectra`, and is indexed starting at 0.
+   */
+  int *averaging_type;
+  /*! \var n_jobs
+   *  \brief The total number of baselines in all the spectra
+   */
+  int n_jobs;
+  /*! \var first_job
+   *  \brief The job number of the first baseline in each spectrum
+   *
+   * This array has length `n_spectra`, and is indexed starting at 0.
+   */
+  int *first_job;
+  /*! \var next_job
+   *  \brief The next job to be taken by a thread
+   */
+  int next_job;
+  /*! \var lock
+   *  \brief Protects `next_job`
+   */
+  pthread_mutex_t lock;
+};
 
-      // Allocate required memory for the normal arrays.
-      CALLOC(avg_ampphase->weight[i][j], avg_ampphase->nchannels);
-      CALLOC(avg_ampphase->amplitude[i][j], avg_ampphase->nchannels);
-      CALLOC(avg_ampphase->phase[i][j], avg_ampphase->nchannels);
-      CALLOC(avg_ampphase->raw[i][j], avg_ampphase->nchannels);
-      // We allocate the unflagged arrays large to begin with, we can always
-      // lower their size later.
-      CALLOC(avg_ampphase->f_channel[i][j], avg_ampphase->nchannels);
-      CALLOC(avg_ampphase->f_frequency[i][j], avg_ampphase->nchannels);
-      CALLOC(avg_ampphase->f_weight[i][j], avg_ampphase->nchannels);
-      CALLOC(avg_ampphase->f_amplitude[i][j], avg_ampphase->nchannels);
-      CALLOC(avg_ampphase->f_phase[i][j], avg_ampphase->nchannels);
-      CALLOC(avg_ampphase->f_raw[i][j], avg_ampphase->nchannels);
-      
-      // We traverse all the channels in the original structure, with a stride
-      // of the averaging parameter.
-      for (k = 0, chan_index = 0, unflagged_index = 0; k < ampphase->nchannels;
-	   k += averaging, chan_index++) {
-	n_points = 0;
-	n_unflagged_points = 0;
-	if (averaging == 1) {
-	  // Special case where we can just copy everything over.
-	  STRUCTCOPY(ampphase, avg_ampphase, weight[i][j][k]);
-	  STRUCTCOPY(ampphase, avg_ampphase, amplitude[i][j][k]);
-	  STRUCTCOPY(ampphase, avg_ampphase, phase[i][j][k]);
-	  STRUCTCOPY(ampphase, avg_ampphase, raw[i][j][k]);
-	  if (k == 0) {
-	    STRUCTCOPY(ampphase, avg_ampphase, f_nchannels[i][j]);
-	    if (j == 0) {
-	      STRUCTCOPY(ampphase, avg_ampphase, min_amplitude[i]);
-	      STRUCTCOPY(ampphase, avg_ampphase, max_amplitude[i]);
-	      STRUCTCOPY(ampphase, avg_ampphase, min_phase[i]);
-	      STRUCTCOPY(ampphase, avg_ampphase, max_phase[i]);
-	      STRUCTCOPY(ampphase, avg_ampphase, min_real[i]);
-	      STRUCTCOPY(ampphase, avg_ampphase, max_real[i]);
-	      STRUCTCOPY(ampphase, avg_ampphase, min_imag[i]);
-	      STRUCTCOPY(ampphase, avg_ampphase, max_imag[i]);
-	    }
-	  }
-	  if (k < ampphase->f_nchannels[i][j]) {
-	    STRUCTCOPY(ampphase, avg_ampphase, f_channel[i][j][k]);
-	    STRUCTCOPY(ampphase, avg_ampphase, f_frequency[i][j][k]);
-	    STRUCTCOPY(ampphase, avg_ampphase, f_weight[i][j][k]);
-	    STRUCTCOPY(ampphase, avg_ampphase, f_amplitude[i][j][k]);
-	    STRUCTCOPY(ampphase, avg_ampphase, f_phase[i][j][k]);
-	    STRUCTCOPY(ampphase, avg_ampphase, f_raw[i][j][k]);
-	  }
-	} else {
-	  for (l = 0; l < averaging; l++) {
-	    if ((k + l) < ampphase->nchannels) {
-	      // Easy to use all the channels regardless of the flagging.
-	      median_array_amplitude[n_points] = ampphase->amplitude[i][j][k + l];
-	      median_array_phase[n_points] = ampphase->phase[i][j][k + l];
-	      median_array_raw[n_points] = ampphase->raw[i][j][k + l];
-	      median_array_channel[n_points] = ampphase->channel[k + l];
-	      median_array_frequency[n_points] = ampphase->frequency[k + l];
-	      n_points++;
-	    } else {
-	      break;
-	    }
-	  }
-	  // Find the unflagged channels required.
-	  while ((unflagged_index < ampphase->f_nchannels[i][j]) &&
-		 (ampphase->f_channel[i][j][unflagged_index] >= k) &&
-		 (ampphase->f_channel[i][j][unflagged_index] < (k + averaging))) {
-	    median_unflagged_amplitude[n_unflagged_points] =
-	      ampphase->f_amplitude[i][j][unflagged_index];
-	    median_unflagged_phase[n_unflagged_points] =
-	      ampphase->f_phase[i][j][unflagged_index];
-	    median_unflagged_raw[n_unflagged_points] =
-	      ampphase->f_raw[i][j][unflagged_index];
-	    median_unflagged_channel[n_unflagged_points] =
-	      ampphase->f_channel[i][j][unflagged_index];
-	    median_unflagged_frequency[n_unflagged_points] =
-	      ampphase->f_frequency[i][j][unflagged_index];
-	    n_unflagged_points++;
-	    unflagged_index++;
-	  }
-	  // Set the averaged values.
-	  if (n_points > 0) {
-	    if (averaging_type & AVERAGETYPE_MEAN) {
-	      avg_ampphase->raw[i][j][chan_index] = fcmeanfc(median_array_raw, n_points);
-	      avg_ampphase->channel[chan_index] = (int)fmeanf(median_array_channel, n_points);
-	      avg_ampphase->frequency[chan_index] = fmeanf(median_array_frequency, n_points);
-	      if (averaging_type & AVERAGETYPE_SCALAR) {
-		avg_ampphase->amplitude[i][j][chan_index] =
-		  fmeanf(median_array_amplitude, n_points);
-		avg_ampphase->phase[i][j][chan_index] =
-		  fmeanf(median_array_phase, n_points);
-	      } else if (averaging_type & AVERAGETYPE_VECTOR) {
-		avg_ampphase->amplitude[i][j][chan_index] =
-		  cabsf(avg_ampphase->raw[i][j][chan_index]);
-		avg_ampphase->phase[i][j][chan_index] =
-		  cargf(avg_ampphase->raw[i][j][chan_index]);
-		if (phase_in_degrees) {
-		  avg_ampphase->phase[i][j][chan_index] *= 180.0 / M_PI;
-		}
-	      }
-	    } else if (averaging_type & AVERAGETYPE_MEDIAN) {
-	      // Work out the channel and frequency first.
-	      qsort(median_array_channel, n_points, sizeof(float), cmpfunc_real);
-	      qsort(median_array_frequency, n_points, sizeof(float), cmpfunc_real);
-	      avg_ampphase->channel[chan_index] =
-		(int)fmedianf(median_array_channel, n_points);
-	      avg_ampphase->frequency[chan_index] =
-		fmedianf(median_array_frequency, n_points);
-
-	      qsort(median_array_raw, n_points, sizeof(float complex), cmpfunc_complex);
-	      avg_ampphase->raw[i][j][chan_index] =
-		fcmedianfc(median_array_raw, n_points);
-	      if (averaging_type & AVERAGETYPE_SCALAR) {
-		qsort(median_array_amplitude, n_points, sizeof(float), cmpfunc_real);
-		qsort(median_array_phase, n_points, sizeof(float), cmpfunc_real);
-		avg_ampphase->amplitude[i][j][chan_index] =
-		  fmedianf(median_array_amplitude, n_points);
-		avg_ampphase->phase[i][j][chan_index] =
-		  fmedianf(median_array_phase, n_points);
-	      } else if (averaging_type & AVERAGETYPE_VECTOR) {
-		avg_ampphase->amplitude[i][j][chan_index] =
-		  cabsf(avg_ampphase->raw[i][j][chan_index]);
-		avg_ampphase->phase[i][j][chan_index] =
-		  cargf(avg_ampphase->raw[i][j][chan_index]);
-		if (phase_in_degrees) {
-		  avg_ampphase->phase[i][j][chan_index] *= 180.0 / M_PI;
-		}
-	      }
-	    }
-	  }
-	  if (n_unflagged_points > 0) {
-	    if (averaging_type & AVERAGETYPE_MEAN) {
-	      avg_ampphase->f_raw[i][j][avg_ampphase->f_nchannels[i][j]] =
-		fcmeanfc(median_unflagged_raw, n_unflagged_points);
-	      avg_ampphase->f_channel[i][j][avg_ampphase->f_nchannels[i][j]] =
-		(int)fmeanf(median_unflagged_channel, n_unflagged_points);
-	      avg_ampphase->f_frequency[i][j][avg_ampphase->f_nchannels[i][j]] =
-		fmeanf(median_unflagged_frequency, n_unflagged_points);
-	      if (averaging_type & AVERAGETYPE_SCALAR) {
-		avg_ampphase->f_amplitude[i][j][avg_ampphase->f_nchannels[i][j]] =
-		  fmeanf(median_unflagged_amplitude, n_unflagged_points);
-		avg_ampphase->f_phase[i][j][avg_ampphase->f_nchannels[i][j]] =
-		  fmeanf(median_unflagged_phase, n_unflagged_points);
-	      } else if (averaging_type & AVERAGETYPE_VECTOR) {
-		avg_ampphase->f_amplitude[i][j][avg_ampphase->f_nchannels[i][j]] =
-		  cabsf(avg_ampphase->f_raw[i][j][avg_ampphase->f_nchannels[i][j]]);
-		avg_ampphase->f_phase[i][j][avg_ampphase->f_nchannels[i][j]] =
-		  cargf(avg_ampphase->f_raw[i][j][avg_ampphase->f_nchannels[i][j]]);
-		if (phase_in_degrees) {
-		  avg_ampphase->f_phase[i][j][avg_ampphase->f_nchannels[i][j]] *= 180.0 / M_PI;
-		}
-	      }
-	    } else if (averaging_type & AVERAGETYPE_MEDIAN) {
-	      qsort(median_unflagged_channel, n_unflagged_points, sizeof(float), cmpfunc_real);
-	      qsort(median_unflagged_frequency, n_unflagged_points, sizeof(float),
-		    cmpfunc_real);
-	      avg_ampphase->f_channel[i][j][avg_ampphase->f_nchannels[i][j]] =
-		(int)fmedianf(median_unflagged_channel, n_unflagged_points);
-	      avg_ampphase->f_frequency[i][j][avg_ampphase->f_nchannels[i][j]] =
-		fmedianf(median_unflagged_frequency, n_unflagged_points);
-
-	      qsort(median_unflagged_raw, n_unflagged_points, sizeof(float complex),
-		    cmpfunc_complex);
-	      avg_ampphase->f_raw[i][j][avg_ampphase->f_nchannels[i][j]] =
-		fcmedianfc(median_unflagged_raw, n_unflagged_points);
-	      if (averaging_type & AVERAGETYPE_SCALAR) {
-		qsort(median_unflagged_amplitude, n_unflagged_points, sizeof(float),
-		      cmpfunc_real);
-		qsort(median_unflagged_phase, n_unflagged_points, sizeof(float),
-		      cmpfunc_real);
-		avg_ampphase->f_amplitude[i][j][avg_ampphase->f_nchannels[i][j]] =
-		  fmedianf(median_unflagged_amplitude, n_unflagged_points);
-		avg_ampphase->f_phase[i][j][avg_ampphase->f_nchannels[i][j]] =
-		  fmedianf(median_unflagged_phase, n_unflagged_points);
-	      } else if (averaging_type & AVERAGETYPE_VECTOR) {
-		avg_ampphase->f_amplitude[i][j][avg_ampphase->f_nchannels[i][j]] =
-		  cabsf(avg_ampphase->f_raw[i][j][avg_ampphase->f_nchannels[i][j]]);
-		avg_ampphase->f_phase[i][j][avg_ampphase->f_nchannels[i][j]] =
-		  cargf(avg_ampphase->f_raw[i][j][avg_ampphase->f_nchannels[i][j]]);
-		if (phase_in_degrees) {
-		  avg_ampphase->f_phase[i][j][avg_ampphase->f_nchannels[i][j]] *= 180.0 / M_PI;
-		}
-	      }
-	    }
-	    // That's a successful unflagged channel.
-	    // Update the maxima and minima.
-	    checkval = crealf(avg_ampphase->f_raw[i][j][avg_ampphase->f_nchannels[i][j]]);
-	    if (checkval < avg_ampphase->min_real[i]) {
-	      avg_ampphase->min_real[i] = checkval;
-	    }
-	    if (checkval > avg_ampphase->max_real[i]) {
-	      avg_ampphase->max_real[i] = checkval;
-	    }
-	    checkval = cimagf(avg_ampphase->f_raw[i][j][avg_ampphase->f_nchannels[i][j]]);
-	    if (checkval < avg_ampphase->min_imag[i]) {
-	      avg_ampphase->min_imag[i] = checkval;
-	    }
-	    if (checkval > avg_ampphase->max_imag[i]) {
-	      avg_ampphase->max_imag[i] = checkval;
-	    }
-	    if (avg_ampphase->f_amplitude[i][j][avg_ampphase->f_nchannels[i][j]] <
-		avg_ampphase->min_amplitude_global) {
-	      avg_ampphase->min_amplitude_global =
-		avg_ampphase->f_amplitude[i][j][avg_ampphase->f_nchannels[i][j]];
-	    }
-	    if (avg_ampphase->f_amplitude[i][j][avg_ampphase->f_nchannels[i][j]] >
-		avg_ampphase->max_amplitude_global) {
-	      avg_ampphase->max_amplitude_global =
-		avg_ampphase->f_amplitude[i][j][avg_ampphase->f_nchannels[i][j]];
-	    }
-	    if (avg_ampphase->f_amplitude[i][j][avg_ampphase->f_nchannels[i][j]] <
-		avg_ampphase->min_amplitude[i]) {
-	      avg_ampphase->min_amplitude[i] =
-		avg_ampphase->f_amplitude[i][j][avg_ampphase->f_nchannels[i][j]];
-	    }
-	    if (avg_ampphase->f_amplitude[i][j][avg_ampphase->f_nchannels[i][j]] >
-		avg_ampphase->max_amplitude[i]) {
-	      avg_ampphase->max_amplitude[i] =
-		avg_ampphase->f_amplitude[i][j][avg_ampphase->f_nchannels[i][j]];
-	    }
-	    if (avg_ampphase->f_phase[i][j][avg_ampphase->f_nchannels[i][j]] <
-		avg_ampphase->min_phase_global) {
-	      avg_ampphase->min_phase_global =
-		avg_ampphase->f_phase[i][j][avg_ampphase->f_nchannels[i][j]];
-	    }
-	    if (avg_ampphase->f_phase[i][j][avg_ampphase->f_nchannels[i][j]] >
-		avg_ampphase->max_phase_global) {
-	      avg_ampphase->max_phase_global =
-		avg_ampphase->f_phase[i][j][avg_ampphase->f_nchannels[i][j]];
-	    }
-	    if (avg_ampphase->f_phase[i][j][avg_ampphase->f_nchannels[i][j]] <
-		avg_ampphase->min_phase[i]) {
-	      avg_ampphase->min_phase[i] =
-		avg_ampphase->f_phase[i][j][avg_ampphase->f_nchannels[i][j]];
-	    }
-	    if (avg_ampphase->f_phase[i][j][avg_ampphase->f_nchannels[i][j]] >
-		avg_ampphase->max_phase[i]) {
-	      avg_ampphase->max_phase[i] =
-		avg_ampphase->f_phase[i][j][avg_ampphase->f_nchannels[i][j]];
-	    }
-	    // Go to the next channel.
-	    avg_ampphase->f_nchannels[i][j] += 1;
-	  }
-	} // CALLOC makes everything 0 by default, for when n_points <= 0.
+/*!
+ *  \brief The routine run by each thread averaging a set of spectra
+ *  \param arg a pointer to the chanaverage_batch structure
+ *  \return NULL
+ */
+static void *chanaverage_thread(void *arg) {
+  int job, s;
+  struct chanaverage_batch *batch = (struct chanaverage_batch *)arg;
+  struct chanaverage_workspace workspace;
+
+  memset(&workspace, 0, sizeof(struct chanaverage_workspace));
+  for (s = 0; ; ) {
+    pthread_mutex_lock(&(batch->lock));
+    job = batch->next_job;
+    batch->next_job += 1;
+    pthread_mutex_unlock(&(batch->lock));
+    if (job >= batch->n_jobs) {
+      break;
+    }
+    // The jobs are taken in order, so the spectrum only moves forward.
+    while ((s < (batch->n_spectra - 1)) && (job >= batch->first_job[s + 1])) {
+      s++;
+    }
+    chanaverage_baseline(batch->spectra[s], batch->avg_spectra[s],
+			 (job - batch->first_job[s]), batch->averaging[s],
+			 batch->averaging_type[s],
+			 batch->spectra[s]->options->phase_in_degrees, &workspace);
+  }
+  chanaverage_workspace_free(&workspace);
+
+  return NULL;
+}
+
+/*!
+ *  \brief Average the channels of every spectrum in a set, using as many
+ *         threads as are useful
+ *  \param spectrum_data the set of spectra before averaging
+ *  \param avg_spectrum_data the structure to fill with the averaged spectra;
+ *                           it shares the header of \a spectrum_data, and
+ *                           should be freed with free_spectrum_data
+ *
+ * Each spectrum is averaged as set by its own options, with the
+ * `delay_averaging` and `averaging_method` of its window. The number of
+ * polarisations in each window comes from the header, since the windows
+ * needn't all have the same number, and any spectrum that is NULL is left
+ * NULL in the averaged set. The calling thread averages baselines as well, so
+ * if no other threads can be started the set is still completed serially.
+ */
+void chanaverage_spectrum_data(struct spectrum_data *spectrum_data,
+			       struct spectrum_data *avg_spectrum_data) {
+  int i, j, s, n_pols, n_threads = 0;
+  long n_cpus;
+  struct chanaverage_batch batch;
+  struct chanaverage_workspace workspace;
+  struct ampphase *spectrum = NULL;
+  pthread_t *threads = NULL;
+
+  avg_spectrum_data->header_data = spectrum_data->header_data;
+  avg_spectrum_data->num_ifs = spectrum_data->num_ifs;
+  MALLOC(avg_spectrum_data->spectrum, spectrum_data->num_ifs);
+
+  // Count the spectra, and make the averaged set wide enough for the window
+  // with the most polarisations.
+  memset(&batch, 0, sizeof(struct chanaverage_batch));
+  memset(&workspace, 0, sizeof(struct chanaverage_workspace));
+  avg_spectrum_data->num_pols = spectrum_data->num_pols;
+  for (i = 0; i < spectrum_data->num_ifs; i++) {
+    n_pols = (spectrum_data->header_data != NULL) ?
+      spectrum_data->header_data->if_num_stokes[i] : spectrum_data->num_pols;
+    if (n_pols > avg_spectrum_data->num_pols) {
+      avg_spectrum_data->num_pols = n_pols;
+    }
+    batch.n_spectra += n_pols;
+  }
+
+  // Set up all the averaged spectra first.
+  MALLOC(batch.spectra, (batch.n_spectra + 1));
+  MALLOC(batch.avg_spectra, (batch.n_spectra + 1));
+  MALLOC(batch.averaging, (batch.n_spectra + 1));
+  MALLOC(batch.averaging_type, (batch.n_spectra + 1));
+  MALLOC(batch.first_job, (batch.n_spectra + 1));
+  for (i = 0, s = 0; i < spectrum_data->num_ifs; i++) {
+    CALLOC(avg_spectrum_data->spectrum[i], (avg_spectrum_data->num_pols + 1));
+    n_pols = (spectrum_data->header_data != NULL) ?
+      spectrum_data->header_data->if_num_stokes[i] : spectrum_data->num_pols;
+    for (j = 0; j < n_pols; j++) {
+      spectrum = spectrum_data->spectrum[i][j];
+      if (spectrum == NULL) {
+	continue;
+      }
+      avg_spectrum_data->spectrum[i][j] = prepare_ampphase();
+      batch.spectra[s] = spectrum;
+      batch.avg_spectra[s] = avg_spectrum_data->spectrum[i][j];
+      batch.averaging[s] = spectrum->options->delay_averaging[spectrum->window];
+      if (batch.averaging[s] < 1) {
+	batch.averaging[s] = 1;
+      }
+      batch.averaging_type[s] = spectrum->options->averaging_method[spectrum->window];
+      batch.first_job[s] = batch.n_jobs;
+      batch.n_jobs += spectrum->nbaselines;
+      chanaverage_prepare(spectrum, batch.avg_spectra[s], batch.averaging[s],
+			  batch.averaging_type[s], &workspace);
+      s++;
+    }
+  }
+  batch.n_spectra = s;
+  chanaverage_workspace_free(&workspace);
+
+  // Now average the baselines.
+  pthread_mutex_init(&(batch.lock), NULL);
+  n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if (n_cpus > ((batch.n_jobs + CHANAVERAGE_JOBS_PER_THREAD - 1) /
+		CHANAVERAGE_JOBS_PER_THREAD)) {
+    n_cpus = (batch.n_jobs + CHANAVERAGE_JOBS_PER_THREAD - 1) /
+      CHANAVERAGE_JOBS_PER_THREAD;
+  }
+  if (n_cpus > 1) {
+    MALLOC(threads, n_cpus - 1);
+    for (i = 0; i < (n_cpus - 1); i++) {
+      if (pthread_create(&(threads[n_threads]), NULL, chanaverage_thread, &batch) != 0) {
+	fprintf(stderr, "[chanaverage_spectrum_data] unable to start thread %d\n", i);
+	break;
       }
+      n_threads++;
     }
   }
+  chanaverage_thread(&batch);
+  for (i = 0; i < n_threads; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  FREE(threads);
+  pthread_mutex_destroy(&(batch.lock));
 
-  // Free the temporary arrays we made for median averaging.
-  FREE(median_array_amplitude);
-  FREE(median_array_phase);
-  FREE(median_array_raw);
-  FREE(median_array_channel);
-  FREE(median_array_frequency);
-  FREE(median_unflagged_amplitude);
-  FREE(median_unflagged_phase);
-  FREE(median_unflagged_raw);
-  FREE(median_unflagged_channel);
-  FREE(median_unflagged_frequency);
+  for (s = 0; s < batch.n_spectra; s++) {
+    chanaverage_global_limits(batch.avg_spectra[s]);
+  }
+  FREE(batch.spectra);
+  FREE(batch.avg_spectra);
+  FREE(batch.averaging);
+  FREE(batch.averaging_type);
+  FREE(batch.first_job);
 }
 
 /*!
@@ -3603,18 +5371,98 @@ float baseline_phase(struct vis_quantities *vis_quantities,
   return (0.0);
 }
 
+/*! \struct closure_triangles
+ *  \brief The closure phase triangles for one scan header, along with the
+ *         baselines that make up each one
+ */
+struct closure_triangles {
+  /*! \var ntriangles
+   *  \brief The number of triangles
+   */
+  int ntriangles;
+  /*! \var ants
+   *  \brief The three antenna numbers of each triangle, in a block of
+   *         length 3 * `ntriangles`
+   */
+  int *ants;
+  /*! \var edge_baseline
+   *  \brief The baseline number of each edge of each triangle, in the same
+   *         order as `ants`, with edge `e` joining antenna `e` to the next one
+   */
+  int *edge_baseline;
+  /*! \var edge_reversed
+   *  \brief Whether each edge goes from the higher numbered antenna to the
+   *         lower, so its phase needs to be negated
+   */
+  bool *edge_reversed;
+  /*! \var edge_index
+   *  \brief The index of each edge's baseline in the vis_quantities being
+   *         computed, or -1 if it isn't there
+   */
+  int *edge_index;
+};
+
 /*!
- *  \brief Compute the closure phase from the precomputed averaged data
+ *  \brief Work out the closure phase triangles for a scan header
  *  \param scan_header_data the header data relating to the scan
- *  \param vis_quantities the precomputed data from that scan
- *  \param reference_antenna the antenna which is included in all the closure
- *                           phase computations, to ensure independence; this should
- *                           be an index, not a real number
+ *  \param reference_antenna the index of the antenna included in all the
+ *                           triangles
+ *  \param triangles the structure to fill, whose arrays are (re)allocated here
  */
-void compute_closure_phase(struct scan_header_data *scan_header_data,
-			   struct vis_quantities *vis_quantities,
-			   int reference_antenna) {
-  int i, j, k, n_triangles_set = 0, a1, a2;
+static void closure_triangles_setup(struct scan_header_data *scan_header_data,
+				    int reference_antenna,
+				    struct closure_triangles *triangles) {
+  int i, j, k, e, n = 0, a1, a2, num_ants = scan_header_data->num_ants;
+
+  triangles->ntriangles = (num_ants < 3) ? 0 :
+    (((num_ants - 1) * (num_ants - 2)) / 2);
+  REALLOC(triangles->ants, 3 * (triangles->ntriangles + 1));
+  REALLOC(triangles->edge_baseline, 3 * (triangles->ntriangles + 1));
+  REALLOC(triangles->edge_reversed, 3 * (triangles->ntriangles + 1));
+  REALLOC(triangles->edge_index, 3 * (triangles->ntriangles + 1));
+  for (i = 0; i < num_ants - 2; i++) {
+    for (j = (i + 1); j < num_ants - 1; j++) {
+      for (k = (j + 1); k < num_ants; k++) {
+	if ((n < triangles->ntriangles) &&
+	    ((i == reference_antenna) ||
+	     (j == reference_antenna) ||
+	     (k == reference_antenna))) {
+	  triangles->ants[3 * n] = scan_header_data->ant_label[i];
+	  triangles->ants[3 * n + 1] = scan_header_data->ant_label[j];
+	  triangles->ants[3 * n + 2] = scan_header_data->ant_label[k];
+	  n++;
+	}
+      }
+    }
+  }
+  // If the reference antenna isn't in the header, fewer triangles are made.
+  triangles->ntriangles = n;
+  for (i = 0; i < 3 * n; i++) {
+    a1 = triangles->ants[i];
+    a2 = triangles->ants[((i % 3) == 2) ? (i - 2) : (i + 1)];
+    e = ants_to_base(a1, a2);
+    triangles->edge_baseline[i] = e;
+    triangles->edge_reversed[i] = (a1 > a2);
+  }
+}
+
+/*!
+ *  \brief Compute the closure phases of one vis_quantities structure
+ *  \param triangles the triangles for the scan the data comes from
+ *  \param baseline_lookup an array of length MAX_BASELINENUM filled with -1,
+ *                         which is used as scratch space and left as it was
+ *  \param find_edges whether the baselines of each edge need to be found,
+ *                    which can be skipped if the previous structure computed
+ *                    with these triangles had the same baselines
+ *  \param vis_quantities the precomputed data
+ *  \param reference_antenna the index of the reference antenna
+ */
+static void closure_phase_fill(struct closure_triangles *triangles, int *baseline_lookup,
+			       bool find_edges, struct vis_quantities *vis_quantities,
+			       int reference_antenna) {
+  int i, j, a1, a2, nt = triangles->ntriangles, nb, b0, b1, b2;
+  int old_nb = vis_quantities->nbins_cross;
+  float p0, p1, p2;
 
   for (i = 0; i < vis_quantities->nbaselines; i++) {
     // Store the number of bins for later if this is a cross-correlation.
@@ -3623,56 +5471,70 @@ void compute_closure_phase(struct scan_header_data *scan_header_data,
       vis_quantities->nbins_cross = vis_quantities->nbins[i];
     }
   }
+  nb = vis_quantities->nbins_cross;
 
-  // Clean up any previously computed closure phases (for memory management).
-  for (i = 0; i < vis_quantities->ntriangles; i++) {
-    FREE(vis_quantities->triangles[i]);
-    FREE(vis_quantities->closure_phase[i]);
+  if (find_edges) {
+    for (i = 0; i < vis_quantities->nbaselines; i++) {
+      if ((vis_quantities->baseline[i] >= 0) &&
+	  (vis_quantities->baseline[i] < MAX_BASELINENUM) &&
+	  (baseline_lookup[vis_quantities->baseline[i]] < 0)) {
+	baseline_lookup[vis_quantities->baseline[i]] = i;
+      }
+    }
+    for (i = 0; i < 3 * nt; i++) {
+      triangles->edge_index[i] = (triangles->edge_baseline[i] < MAX_BASELINENUM) ?
+	baseline_lookup[triangles->edge_baseline[i]] : -1;
+    }
+    for (i = 0; i < vis_quantities->nbaselines; i++) {
+      if ((vis_quantities->baseline[i] >= 0) &&
+	  (vis_quantities->baseline[i] < MAX_BASELINENUM)) {
+	baseline_lookup[vis_quantities->baseline[i]] = -1;
+      }
+    }
   }
-  FREE(vis_quantities->triangles);
-  FREE(vis_quantities->closure_phase);
-  
-  // Compute the closure phase triangles.
-  vis_quantities->ntriangles = ((scan_header_data->num_ants - 1) *
-				(scan_header_data->num_ants - 2)) / 2;
-  MALLOC(vis_quantities->triangles, vis_quantities->ntriangles);
-  MALLOC(vis_quantities->closure_phase, vis_quantities->ntriangles);
-  for (i = 0; i < vis_quantities->ntriangles; i++) {
-    CALLOC(vis_quantities->triangles[i], 3);
-    CALLOC(vis_quantities->closure_phase[i], vis_quantities->nbins_cross);
-  }
-  n_triangles_set = 0;
-  for (i = 0; i < scan_header_data->num_ants - 2; i++) {
-    for (j = (i + 1); j < scan_header_data->num_ants - 1; j++) {
-      for (k = (j + 1); k < scan_header_data->num_ants; k++) {
-	if ((n_triangles_set < vis_quantities->ntriangles) &&
-	    ((i == reference_antenna) ||
-	     (j == reference_antenna) ||
-	     (k == reference_antenna))) {
-	  vis_quantities->triangles[n_triangles_set][0] =
-	    scan_header_data->ant_label[i];
-	  vis_quantities->triangles[n_triangles_set][1] =
-	    scan_header_data->ant_label[j];
-	  vis_quantities->triangles[n_triangles_set][2] =
-	    scan_header_data->ant_label[k];
-	  n_triangles_set++;
-	}
+
+  // The memory can be reused if the shape hasn't changed.
+  if ((vis_quantities->ntriangles != nt) || (old_nb != nb)) {
+    if (vis_quantities->ntriangles > 0) {
+      FREE(vis_quantities->triangles[0]);
+      FREE(vis_quantities->closure_phase[0]);
+    }
+    FREE(vis_quantities->triangles);
+    FREE(vis_quantities->closure_phase);
+    vis_quantities->ntriangles = nt;
+    if (nt > 0) {
+      MALLOC(vis_quantities->triangles, nt);
+      MALLOC(vis_quantities->closure_phase, nt);
+      MALLOC(vis_quantities->triangles[0], 3 * nt);
+      CALLOC(vis_quantities->closure_phase[0], nt * nb + 1);
+      for (i = 1; i < nt; i++) {
+	vis_quantities->triangles[i] = vis_quantities->triangles[0] + 3 * i;
+	vis_quantities->closure_phase[i] = vis_quantities->closure_phase[0] + nb * i;
       }
     }
   }
+  if (nt > 0) {
+    memcpy(vis_quantities->triangles[0], triangles->ants, 3 * nt * sizeof(int));
+  }
 
-  // Compute the closure phases now.
+  // Compute the closure phases now. A missing baseline contributes no phase.
   vis_quantities->min_closure_phase = INFINITY;
   vis_quantities->max_closure_phase = -INFINITY;
-  for (i = 0; i < n_triangles_set; i++) {
-    for (j = 0; j < vis_quantities->nbins_cross; j++) {
+  for (i = 0; i < nt; i++) {
+    b0 = triangles->edge_index[3 * i];
+    b1 = triangles->edge_index[3 * i + 1];
+    b2 = triangles->edge_index[3 * i + 2];
+    for (j = 0; j < nb; j++) {
+      p0 = (b0 < 0) ? 0.0 : vis_quantities->phase[b0][(j < vis_quantities->nbins[b0]) ?
+						      j : (vis_quantities->nbins[b0] - 1)];
+      p1 = (b1 < 0) ? 0.0 : vis_quantities->phase[b1][(j < vis_quantities->nbins[b1]) ?
+						      j : (vis_quantities->nbins[b1] - 1)];
+      p2 = (b2 < 0) ? 0.0 : vis_quantities->phase[b2][(j < vis_quantities->nbins[b2]) ?
+						      j : (vis_quantities->nbins[b2] - 1)];
       vis_quantities->closure_phase[i][j] =
-	baseline_phase(vis_quantities, vis_quantities->triangles[i][0],
-		       vis_quantities->triangles[i][1], j) +
-	baseline_phase(vis_quantities, vis_quantities->triangles[i][1],
-		       vis_quantities->triangles[i][2], j) +
-	baseline_phase(vis_quantities, vis_quantities->triangles[i][2],
-		       vis_quantities->triangles[i][0], j);
+	(triangles->edge_reversed[3 * i] ? -p0 : p0) +
+	(triangles->edge_reversed[3 * i + 1] ? -p1 : p1) +
+	(triangles->edge_reversed[3 * i + 2] ? -p2 : p2);
       if (vis_quantities->closure_phase[i][j] < vis_quantities->min_closure_phase) {
 	vis_quantities->min_closure_phase = vis_quantities->closure_phase[i][j];
       }
@@ -3681,6 +5543,91 @@ void compute_closure_phase(struct scan_header_data *scan_header_data,
       }
     }
   }
+  vis_quantities->closure_reference_antenna = reference_antenna;
+}
+
+/*!
+ *  \brief Compute the closure phase from the precomputed averaged data
+ *  \param scan_header_data the header data relating to the scan
+ *  \param vis_quantities the precomputed data from that scan
+ *  \param reference_antenna the antenna which is included in all the closure
+ *                           phase computations, to ensure independence; this should
+ *                           be an index, not a real number
+ */
+void compute_closure_phase(struct scan_header_data *scan_header_data,
+			   struct vis_quantities *vis_quantities,
+			   int reference_antenna) {
+  int i, *baseline_lookup = NULL;
+  struct closure_triangles triangles = { 0, NULL, NULL, NULL, NULL };
+
+  MALLOC(baseline_lookup, MAX_BASELINENUM);
+  for (i = 0; i < MAX_BASELINENUM; i++) {
+    baseline_lookup[i] = -1;
+  }
+  closure_triangles_setup(scan_header_data, reference_antenna, &triangles);
+  closure_phase_fill(&triangles, baseline_lookup, true, vis_quantities,
+		     reference_antenna);
+  FREE(triangles.ants);
+  FREE(triangles.edge_baseline);
+  FREE(triangles.edge_reversed);
+  FREE(triangles.edge_index);
+  FREE(baseline_lookup);
+}
+
+/*!
+ *  \brief Compute the closure phases for all the cycles in a vis_data structure
+ *  \param vis_data the precomputed data
+ *  \param reference_antenna the index of the antenna which is included in all
+ *                           the closure phase computations
+ *
+ * The triangles are only worked out when the scan header changes, and the
+ * baselines making up each triangle only when the baselines change, instead
+ * of searching for them for every triangle. Structures which already have
+ * closure phases for this reference antenna are left alone, so this only
+ * does any work for new data or a new reference antenna.
+ */
+void compute_closure_phases(struct vis_data *vis_data, int reference_antenna) {
+  int i, j, k, *baseline_lookup = NULL, nbaselines = -1, *baselines = NULL;
+  bool find_edges;
+  struct closure_triangles triangles = { 0, NULL, NULL, NULL, NULL };
+  struct scan_header_data *header = NULL;
+  struct vis_quantities *vq = NULL;
+
+  MALLOC(baseline_lookup, MAX_BASELINENUM);
+  for (i = 0; i < MAX_BASELINENUM; i++) {
+    baseline_lookup[i] = -1;
+  }
+  for (i = 0; i < vis_data->nviscycles; i++) {
+    for (j = 0; j < vis_data->num_ifs[i]; j++) {
+      for (k = 0; k < vis_data->num_pols[i][j]; k++) {
+	vq = vis_data->vis_quantities[i][j][k];
+	if ((vq == NULL) || (vq->closure_reference_antenna == reference_antenna)) {
+	  continue;
+	}
+	find_edges = false;
+	if (vis_data->header_data[i] != header) {
+	  header = vis_data->header_data[i];
+	  closure_triangles_setup(header, reference_antenna, &triangles);
+	  find_edges = true;
+	}
+	if ((vq->nbaselines != nbaselines) ||
+	    (memcmp(vq->baseline, baselines, nbaselines * sizeof(int)) != 0)) {
+	  nbaselines = vq->nbaselines;
+	  REALLOC(baselines, nbaselines + 1);
+	  memcpy(baselines, vq->baseline, nbaselines * sizeof(int));
+	  find_edges = true;
+	}
+	closure_phase_fill(&triangles, baseline_lookup, find_edges, vq,
+			   reference_antenna);
+      }
+    }
+  }
+  FREE(triangles.ants);
+  FREE(triangles.edge_baseline);
+  FREE(triangles.edge_reversed);
+  FREE(triangles.edge_index);
+  FREE(baselines);
+  FREE(baseline_lookup);
 }
 
 /*!
@@ -3705,8 +5652,9 @@ void compute_closure_phase(struct scan_header_data *scan_header_data,
 void compute_delays(struct ampphase *ampphase, bool phase_in_degrees, int min_chan, int max_chan,
 		    float ****delays, int *n_baselines, int **n_bins, int ***n_delays,
 		    float ***mean_delay, float ***median_delay) {
-  int i, j, k, nchans;
+  int i, j, k, prev, nchans;
   float dp, p1, p2, p3, delta_phase, delta_frequency, total_delay;
+  float *median_work = NULL;
   
   // Allocate the first index for all these arrays.
   *n_baselines = ampphase->nbaselines;
@@ -3726,28 +5674,34 @@ void compute_delays(struct ampphase *ampphase, bool phase_in_degrees, int min_ch
     for (j = 0; j < (*n_bins)[i]; j++) {
       // How many channels?
       nchans = 0;
-      for (k = 0; k < ampphase->f_nchannels[i][j]; k++) {
-	if ((ampphase->f_channel[i][j][k] >= min_chan) &&
-	    (ampphase->f_channel[i][j][k] < max_chan)) {
+      for (k = ampphase_next_valid_channel(ampphase, i, j, 0);
+	   k < ampphase->nchannels;
+	   k = ampphase_next_valid_channel(ampphase, i, j, (k + 1))) {
+	if ((ampphase->channel[k] >= min_chan) &&
+	    (ampphase->channel[k] < max_chan)) {
 	  nchans++;
 	}
       }
       (*n_delays)[i][j] = nchans;
       CALLOC((*delays)[i][j], (*n_delays)[i][j]);
-      for (k = 1, nchans = 0, total_delay = 0; k < ampphase->f_nchannels[i][j]; k++) {
+      // Each delay comes from a pair of neighbouring good channels.
+      prev = ampphase_next_valid_channel(ampphase, i, j, 0);
+      for (k = ampphase_next_valid_channel(ampphase, i, j, (prev + 1)),
+	     nchans = 0, total_delay = 0; k < ampphase->nchannels;
+	   prev = k, k = ampphase_next_valid_channel(ampphase, i, j, (k + 1))) {
 	if ((nchans < (*n_delays)[i][j]) &&
-	    (ampphase->f_channel[i][j][k - 1] >= min_chan) &&
-	    (ampphase->f_channel[i][j][k] <= max_chan)) {
+	    (ampphase->channel[prev] >= min_chan) &&
+	    (ampphase->channel[k] <= max_chan)) {
 	  dp = (phase_in_degrees) ? 360.0 : (2 * M_PI);
-	  p1 = ampphase->f_phase[i][j][k] - ampphase->f_phase[i][j][k - 1];
-	  p2 = (ampphase->f_phase[i][j][k] + dp) - ampphase->f_phase[i][j][k - 1];
-	  p3 = (ampphase->f_phase[i][j][k] - dp) - ampphase->f_phase[i][j][k - 1];
+	  p1 = ampphase->phase[i][j][k] - ampphase->phase[i][j][prev];
+	  p2 = (ampphase->phase[i][j][k] + dp) - ampphase->phase[i][j][prev];
+	  p3 = (ampphase->phase[i][j][k] - dp) - ampphase->phase[i][j][prev];
 
 	  delta_phase = (float)smallest_abs(3, p1, p2, p3);
 	  if (phase_in_degrees) {
 	    delta_phase *= (M_PI / 180);
 	  }
-	  delta_frequency = ampphase->f_frequency[i][j][k] - ampphase->f_frequency[i][j][k - 1];
+	  delta_frequency = ampphase->frequency[k] - ampphase->frequency[prev];
 	  (*delays)[i][j][nchans] = 1E3 * delta_phase / (2 * M_PI * delta_frequency);
 	  total_delay += (*delays)[i][j][nchans];
 	  nchans++;
@@ -3755,8 +5709,10 @@ void compute_delays(struct ampphase *ampphase, bool phase_in_degrees, int min_ch
       }
       if (nchans > 0) {
 	(*mean_delay)[i][j] = total_delay / (float)nchans;
-	qsort((*delays)[i][j], nchans, sizeof(float), cmpfunc_real);
-	(*median_delay)[i][j] = fmedianf((*delays)[i][j], nchans);
+	// Find the median from a copy so the delays stay in channel order.
+	REALLOC(median_work, nchans);
+	memcpy(median_work, (*delays)[i][j], nchans * sizeof(float));
+	(*median_delay)[i][j] = fselectmedianf(median_work, nchans);
       } else {
 	(*mean_delay)[i][j] = 0;
 	(*median_delay)[i][j] = 0;
@@ -3764,6 +5720,7 @@ void compute_delays(struct ampphase *ampphase, bool phase_in_degrees, int min_ch
       
     }
   }
+  FREE(median_work);
 }
 
 /*!
@@ -3786,35 +5743,108 @@ void free_fluxdensity_specification(struct fluxdensity_specification *a) {
 }
 
 /*!
- *  \brief Take some ampphase cycle data and calculate the noise diode amplitudes
- *         given a supplied flux density
- *  \param fluxdensity_models the flux density models for the source
- *  \param num_cycles the number of cycles in the \a cycle_ampphase array
- *  \param window the IF to look at
+ *  \brief Average the real and imaginary parts of the data in the tvchannels
+ *         of each bin on a baseline
+ *  \param ampphase the ampphase structure with the data to average
+ *  \param baseline_idx the index of the baseline to average
+ *  \param options the specification of the tvchannels
+ *  \param rsum if not NULL, filled with the average of the real parts in each bin;
+ *              this array must have length `ampphase->nbins[baseline_idx]`
+ *  \param isum if not NULL, filled with the average of the imaginary parts in
+ *              each bin, with the same length as \a rsum
+ *  \param asum if not NULL, filled with the average of the amplitudes in each bin,
+ *              with the same length as \a rsum
+ */
+static void sum_vis_bins(struct ampphase *ampphase, int baseline_idx,
+			 struct ampphase_options *options,
+			 float *rsum, float *isum, float *asum) {
+  int oidx, i, j, n, nbins;
+
+  nbins = ampphase->nbins[baseline_idx];
+  for (i = 0; i < nbins; i++) {
+    if (rsum != NULL) {
+      rsum[i] = 0;
+    }
+    if (isum != NULL) {
+      isum[i] = 0;
+    }
+    if (asum != NULL) {
+      asum[i] = 0;
+    }
+  }
+  
+  // For now we assume the window index works for the options.
+  oidx = ampphase->window;
+  if (oidx > options->num_ifs) {
+    // Bad.
+    return;
+  }
+
+  for (i = 0; i < nbins; i++) {
+    for (j = ampphase_next_valid_channel(ampphase, baseline_idx, i, 0), n = 0;
+	 j < ampphase->nchannels;
+	 j = ampphase_next_valid_channel(ampphase, baseline_idx, i, (j + 1))) {
+      if ((ampphase->channel[j] >= options->min_tvchannel[oidx]) &&
+	  (ampphase->channel[j] <= options->max_tvchannel[oidx])) {
+	n++;
+	if (rsum != NULL) {
+	  rsum[i] += crealf(ampphase->raw[baseline_idx][i][j]);
+	}
+	if (isum != NULL) {
+	  isum[i] += cimagf(ampphase->raw[baseline_idx][i][j]);
+	}
+	if (asum != NULL) {
+	  asum[i] += ampphase->amplitude[baseline_idx][i][j];
+	}
+      }
+    }
+    if ((rsum != NULL) && (n > 0)) {
+      rsum[i] /= (float)n;
+    }
+    if ((isum != NULL) && (n > 0)) {
+      isum[i] /= (float)n;
+    }
+    if ((asum != NULL) && (n > 0)) {
+      asum[i] /= (float)n;
+    }
+  }
+}
+
+/*!
+ *  \brief Make the tvchannel averages needed to solve for the noise diode
+ *         amplitudes from one cycle
+ *  \param cycle_spectrum the spectra of the cycle
+ *  \param window the window to make the averages in
  *  \param options the options structure to direct which channels to use
- *  \param cycle_spectra the array of cycle data, with length \a num_cycles
- *  \param noise_diode_modifier a pointer to a variable which upon exit will be
- *         a modifier structure filled with the derived noise diode amplitudes
+ *  \param sums the structure to fill, which should be empty; it should be freed
+ *              with free_noise_diode_sums afterwards
  */
-void compute_noise_diode_amplitudes(struct fluxdensity_specification *fluxdensity_models,
-				    int num_cycles, int window, struct ampphase_options *options,
-				    struct spectrum_data **cycle_spectra,
-				    struct ampphase_modifiers **noise_diode_modifier) {
-  int i, j, k, a, b, c, ant_label, polidx[POL_YY + 1], winidx = -1;
-  int bnt_label, cnt_label, x1, y1, x2, y2, x3, y3, a1, a2, nbins1, nbins2, nbins3;
-  int *gains_nbins = NULL, nbinsa, nfreqmatch = 0, maxfreqmatch = 0, freqmatchidx;
-  int **gainsum_numtriplets = NULL, nbins_gainsum = 0, opol = -1, nbinst = 0, nbinsta = 0;
-  int nbinsb, nbinsc, syswinidx = -1, syspolidx;
-  bool aons, bons, cons;
-  float *rsum1, *rsum2, *rsum3, *isum1, *isum2, *isum3, **gains = NULL, *asuma;
-  float nd_amp, src_fd, **gainsum = NULL, *asumb, *asumc;
-  float *trsum1 = NULL, *tisum1 = NULL, *trsum2 = NULL, *tisum2 = NULL;
-  float *trsum3 = NULL, *tisum3 = NULL, *tasuma = NULL;
-  double cmjd;
+void compute_noise_diode_sums(struct spectrum_data *cycle_spectrum, int window,
+			      struct ampphase_options *options,
+			      struct noise_diode_sums *sums) {
+  int i, j, k, p, n, winidx = -1, polidx[2];
+  struct ampphase *ampphase = NULL;
+
+  sums->window = window;
+  sums->window_found = false;
+  sums->pols_found = false;
+  sums->mjd = 0;
+  sums->num_ants = 0;
+  sums->ant_label = NULL;
+  sums->on_source = NULL;
+  sums->nchannels = 0;
+  sums->frequency = NULL;
+  sums->nbaselines = 0;
+  sums->baseline = NULL;
+  sums->nbins = NULL;
+  sums->offset = NULL;
+  sums->nvalues = 0;
+  sums->rsum = NULL;
+  sums->isum = NULL;
 
   // Figure out the IF index.
-  for (i = 0; i < cycle_spectra[0]->num_ifs; i++) {
-    if (cycle_spectra[0]->spectrum[i][0]->window == window) {
+  for (i = 0; i < cycle_spectrum->num_ifs; i++) {
+    if (cycle_spectrum->spectrum[i][0]->window == window) {
       winidx = i;
       break;
     }
@@ -3824,16 +5854,165 @@ void compute_noise_diode_amplitudes(struct fluxdensity_specification *fluxdensit
     return;
   }
   // For the syscal as well.
-  for (i = 0; i < cycle_spectra[0]->spectrum[winidx][0]->syscal_data->num_ifs; i++) {
-    if (cycle_spectra[0]->spectrum[winidx][0]->syscal_data->if_num[i] == window) {
-      syswinidx = i;
+  for (i = 0; i < cycle_spectrum->spectrum[winidx][0]->syscal_data->num_ifs; i++) {
+    if (cycle_spectrum->spectrum[winidx][0]->syscal_data->if_num[i] == window) {
+      sums->window_found = true;
       break;
     }
   }
-  if (syswinidx == -1) {
+  if (!sums->window_found) {
     // We don't know about this window's calibration.
     return;
   }
+  sums->mjd = date2mjd(cycle_spectrum->spectrum[winidx][0]->obsdate,
+		       cycle_spectrum->spectrum[winidx][0]->ut_seconds);
+
+  // Find the polarisations.
+  for (p = 0; p < 2; p++) {
+    polidx[p] = -1;
+    for (j = 0; j < cycle_spectrum->num_pols; j++) {
+      if (cycle_spectrum->spectrum[winidx][j]->pol == (POL_XX + p)) {
+	polidx[p] = j;
+	break;
+      }
+    }
+    if (polidx[p] < 0) {
+      // Weren't able to find this pol, we're in trouble!
+      return;
+    }
+  }
+  sums->pols_found = true;
+
+  // Which antennas are on source.
+  sums->num_ants = cycle_spectrum->header_data->num_ants;
+  MALLOC(sums->ant_label, sums->num_ants);
+  MALLOC(sums->on_source, 2 * sums->num_ants);
+  for (i = 0; i < sums->num_ants; i++) {
+    sums->ant_label[i] = cycle_spectrum->header_data->ant_label[i];
+    for (p = 0; p < 2; p++) {
+      ampphase = cycle_spectrum->spectrum[winidx][polidx[p]];
+      sums->on_source[p * sums->num_ants + i] =
+	!(ampphase->syscal_data->flagging[sums->ant_label[i] - 1] & 1);
+    }
+  }
+
+  // The frequencies are needed to choose the flux density model.
+  ampphase = cycle_spectrum->spectrum[winidx][polidx[0]];
+  sums->nchannels = ampphase->nchannels;
+  MALLOC(sums->frequency, sums->nchannels + 1);
+  memcpy(sums->frequency, ampphase->frequency, sums->nchannels * sizeof(float));
+
+  // Work out where each baseline's averages will go, then make them.
+  for (p = 0; p < 2; p++) {
+    MAXASSIGN(sums->nbaselines, cycle_spectrum->spectrum[winidx][polidx[p]]->nbaselines);
+  }
+  CALLOC(sums->baseline, 2 * sums->nbaselines + 1);
+  CALLOC(sums->nbins, 2 * sums->nbaselines + 1);
+  CALLOC(sums->offset, 2 * sums->nbaselines + 1);
+  for (p = 0, n = 0; p < 2; p++) {
+    ampphase = cycle_spectrum->spectrum[winidx][polidx[p]];
+    for (k = 0; k < ampphase->nbaselines; k++) {
+      sums->baseline[p * sums->nbaselines + k] = ampphase->baseline[k];
+      sums->nbins[p * sums->nbaselines + k] = ampphase->nbins[k];
+      sums->offset[p * sums->nbaselines + k] = n;
+      n += ampphase->nbins[k];
+    }
+  }
+  sums->nvalues = n;
+  MALLOC(sums->rsum, sums->nvalues + 1);
+  MALLOC(sums->isum, sums->nvalues + 1);
+  for (p = 0; p < 2; p++) {
+    ampphase = cycle_spectrum->spectrum[winidx][polidx[p]];
+    for (k = 0; k < ampphase->nbaselines; k++) {
+      n = sums->offset[p * sums->nbaselines + k];
+      sum_vis_bins(ampphase, k, options, sums->rsum + n, sums->isum + n, NULL);
+    }
+  }
+}
+
+/*!
+ *  \brief Free the memory within a noise_diode_sums structure, but not the
+ *         pointer memory itself
+ *  \param sums the structure to free
+ */
+void free_noise_diode_sums(struct noise_diode_sums *sums) {
+  FREE(sums->ant_label);
+  FREE(sums->on_source);
+  FREE(sums->frequency);
+  FREE(sums->baseline);
+  FREE(sums->nbins);
+  FREE(sums->offset);
+  FREE(sums->rsum);
+  FREE(sums->isum);
+  sums->num_ants = 0;
+  sums->nchannels = 0;
+  sums->nbaselines = 0;
+  sums->nvalues = 0;
+}
+
+/*!
+ *  \brief Find the averages of a baseline in a noise_diode_sums structure
+ *  \param sums the structure
+ *  \param pidx the polarisation index, 0 for XX or 1 for YY
+ *  \param ant1 the first antenna of the baseline
+ *  \param ant2 the second antenna of the baseline, which must not be less than
+ *              \a ant1
+ *  \param nbins set to the number of bins on the baseline, or 0 if the baseline
+ *               isn't present
+ *  \return a pointer to the average of the real parts in the first bin, which
+ *          is followed by the other bins, and with the averages of the imaginary
+ *          parts at the same offset from `sums->isum`; or NULL if the baseline
+ *          isn't present
+ */
+static float *noise_diode_sums_baseline(struct noise_diode_sums *sums, int pidx,
+				       int ant1, int ant2, int *nbins) {
+  int k, a1, a2;
+
+  *nbins = 0;
+  for (k = pidx * sums->nbaselines; k < (pidx + 1) * sums->nbaselines; k++) {
+    if (sums->baseline[k] == 0) {
+      continue;
+    }
+    base_to_ants(sums->baseline[k], &a1, &a2);
+    if ((a1 == ant1) && (a2 == ant2)) {
+      *nbins = sums->nbins[k];
+      return (sums->rsum + sums->offset[k]);
+    }
+  }
+  return NULL;
+}
+
+/*!
+ *  \brief Solve for the noise diode amplitudes given a supplied flux density
+ *  \param fluxdensity_models the flux density models for the source
+ *  \param num_cycles the number of cycles in the \a cycle_sums array
+ *  \param cycle_sums the tvchannel averages of each cycle in the window, all
+ *                    made by compute_noise_diode_sums, with length \a num_cycles
+ *  \param noise_diode_modifier a pointer to a variable which upon exit will be
+ *         a modifier structure filled with the derived noise diode amplitudes
+ *
+ * For each antenna, every triplet of on-source antennas that includes it gives
+ * an estimate of its gain, from which the noise diode amplitude follows. Only
+ * the averages in \a cycle_sums are used, so solving again with a different
+ * flux density model doesn't need the data.
+ */
+void solve_noise_diode_amplitudes(struct fluxdensity_specification *fluxdensity_models,
+				  int num_cycles, struct noise_diode_sums **cycle_sums,
+				  struct ampphase_modifiers **noise_diode_modifier) {
+  int i, j, k, p, a, b, c, ant_label, bnt_label, cnt_label, num_ants;
+  int x1, y1, x2, y2, x3, y3, nbins1, nbins2, nbins3, nbinsa, nbinst, nbinsta;
+  int nfreqmatch = 0, maxfreqmatch = 0, freqmatchidx, nbins_gainsum = 0, opol = -1;
+  int **gainsum_numtriplets = NULL;
+  bool aons, bons, cons;
+  float *rsum1, *rsum2, *rsum3, *asuma, gain, nd_amp, src_fd, **gainsum = NULL;
+  float *trsum1 = NULL, *tisum1 = NULL, *trsum2 = NULL, *tisum2 = NULL;
+  float *trsum3 = NULL, *tisum3 = NULL, *tasuma = NULL;
+  struct noise_diode_sums *sums = NULL;
+
+  if ((num_cycles < 1) || !cycle_sums[0]->window_found) {
+    // We don't know about this window.
+    return;
+  }
   
   // Check if we're supposed to create a modifier structure.
   if (*noise_diode_modifier == NULL) {
@@ -3848,46 +6027,32 @@ void compute_noise_diode_amplitudes(struct fluxdensity_specification *fluxdensit
 	     (*noise_diode_modifier)->noise_diode_num_pols);
     }
     // Take the dates from the cycles.
-    (*noise_diode_modifier)->noise_diode_start_mjd =
-      date2mjd(cycle_spectra[0]->spectrum[winidx][0]->obsdate,
-	       cycle_spectra[0]->spectrum[winidx][0]->ut_seconds);
-    (*noise_diode_modifier)->noise_diode_end_mjd =
-      (*noise_diode_modifier)->noise_diode_start_mjd;
+    (*noise_diode_modifier)->noise_diode_start_mjd = cycle_sums[0]->mjd;
+    (*noise_diode_modifier)->noise_diode_end_mjd = cycle_sums[0]->mjd;
     for (i = 1; i < num_cycles; i++) {
-      cmjd = date2mjd(cycle_spectra[i]->spectrum[winidx][0]->obsdate,
-		      cycle_spectra[i]->spectrum[winidx][0]->ut_seconds);
-      MINASSIGN((*noise_diode_modifier)->noise_diode_start_mjd, cmjd);
-      MAXASSIGN((*noise_diode_modifier)->noise_diode_end_mjd, cmjd);
+      MINASSIGN((*noise_diode_modifier)->noise_diode_start_mjd, cycle_sums[i]->mjd);
+      MAXASSIGN((*noise_diode_modifier)->noise_diode_end_mjd, cycle_sums[i]->mjd);
     }
   }
 
-  // Find the polarisations.
-  for (i = POL_XX; i <= POL_YY; i++) {
-    polidx[i] = -1;
-    for (j = 0; j < cycle_spectra[0]->num_pols; j++) {
-      if (cycle_spectra[0]->spectrum[winidx][j]->pol == i) {
-	polidx[i] = j;
-	break;
-      }
+  for (i = 0; i < num_cycles; i++) {
+    if (!cycle_sums[i]->pols_found) {
+      // Weren't able to find a pol, we're in trouble!
+      (*noise_diode_modifier)->set_noise_diode_amplitude = false;
+      return;
     }
   }
-
-  if ((polidx[POL_XX] < 0) || (polidx[POL_YY] < 0)) {
-    // Weren't able to find this pol, we're in trouble!
-    (*noise_diode_modifier)->set_noise_diode_amplitude = false;
-    return;
-  }
   
   // Work out which flux density model we use.
   maxfreqmatch = 0;
   freqmatchidx = -1;
   for (i = 0; i < fluxdensity_models->num_models; i++) {
     nfreqmatch = 0;
-    for (j = 0; j < cycle_spectra[0]->spectrum[winidx][polidx[POL_XX]]->nchannels; j++) {
-      if ((cycle_spectra[0]->spectrum[winidx][polidx[POL_XX]]->frequency[j] >=
+    for (j = 0; j < cycle_sums[0]->nchannels; j++) {
+      if ((cycle_sums[0]->frequency[j] >=
 	   fluxdensity_models->model_frequency[i] -
 	   fluxdensity_models->model_frequency_tolerance[i]) &&
-	  (cycle_spectra[0]->spectrum[winidx][polidx[POL_XX]]->frequency[j] <=
+	  (cycle_sums[0]->frequency[j] <=
 	   fluxdensity_models->model_frequency[i] +
 	   fluxdensity_models->model_frequency_tolerance[i])) {
 	nfreqmatch++;
@@ -3907,255 +6072,205 @@ void compute_noise_diode_amplitudes(struct fluxdensity_specification *fluxdensit
   }
 
   fprintf(stderr, "  DEBUG: assuming source flux density of %.3f Jy in window %d\n",
-	  fluxdensity_models->model_terms[freqmatchidx][0], window);
+	  fluxdensity_models->model_terms[freqmatchidx][0], cycle_sums[0]->window);
+  // In the CABB method, the flux density of the source is just the
+  // first term of the model.
+  src_fd = fluxdensity_models->model_terms[freqmatchidx][0];
+
+  // An antenna has to be on source for all the cycles to count.
+  num_ants = cycle_sums[0]->num_ants;
+  for (i = 1; i < num_cycles; i++) {
+    MINASSIGN(num_ants, cycle_sums[i]->num_ants);
+  }
   
   // Loop over the polarisations.
-  for (i = POL_XX; i <= POL_YY; i++) {
-    switch (i) {
-    case POL_XX:
-      opol = POL_X;
-      break;
-    case POL_YY:
-      opol = POL_Y;
-      break;
-    }
-    for (j = 0, syspolidx = -1; j < cycle_spectra[0]->spectrum[winidx][polidx[i]]->syscal_data->num_pols; j++) {
-      if (cycle_spectra[0]->spectrum[winidx][polidx[i]]->syscal_data->pol[j] == i) {
-	syspolidx = j;
-	break;
-      }
-    }
-    if (syspolidx == -1) {
-      fprintf(stderr, "DEBUG ACAL: can't find pol %d in the syscal!\n", i);
-      syspolidx = CAL_XX;
-    }
-    nbinst = 0;
-    nbinsta = 0;
+  for (p = 0; p < 2; p++) {
+    opol = (p == 0) ? POL_X : POL_Y;
 
     // We have to find the noise diode amplitude per antenna, so it is
     // most sensible to loop over the antennas here, and do the same
     // procedure for each.
-    CALLOC(gains, cycle_spectra[0]->header_data->num_ants);
-    CALLOC(gainsum, cycle_spectra[0]->header_data->num_ants);
-    CALLOC(gainsum_numtriplets, cycle_spectra[0]->header_data->num_ants);
-    CALLOC(gains_nbins, cycle_spectra[0]->header_data->num_ants);
-    for (a = 0; a < cycle_spectra[0]->header_data->num_ants; a++) {
-      ant_label = cycle_spectra[0]->header_data->ant_label[a];
-      // This antenna has to be on source for all the cycles to count.
-      aons = true;
-      for (j = 0; j < num_cycles; j++) {
-	aons &=
-	  (!(cycle_spectra[j]->spectrum[winidx][polidx[i]]->syscal_data->flagging[ant_label - 1] & 1));
+    CALLOC(gainsum, cycle_sums[0]->num_ants);
+    CALLOC(gainsum_numtriplets, cycle_sums[0]->num_ants);
+    for (a = 0; a < num_ants; a++) {
+      ant_label = cycle_sums[0]->ant_label[a];
+      for (j = 0, aons = true; j < num_cycles; j++) {
+	aons &= cycle_sums[j]->on_source[p * cycle_sums[j]->num_ants + a];
       }
       if (!aons) {
 	// Mark this antenna as off-source in the modifier.
 	(*noise_diode_modifier)->noise_diode_amplitude[ant_label][opol] = -1.0;
-	//  (*noise_diode_modifier)->noise_diode_amplitude[ant_label][POL_Y] = -1.0;
 	continue;
       }
       // Now determine all the gain triplets that can be made with this
       // antenna.
-      for (b = 0; b < cycle_spectra[0]->header_data->num_ants; b++) {
-	bnt_label = cycle_spectra[0]->header_data->ant_label[b];
-	if (bnt_label != ant_label) {
-	  bons = true;
-	  for (j = 0; j < num_cycles; j++) {
-	    bons &=
-	      (!(cycle_spectra[j]->spectrum[winidx][polidx[i]]->syscal_data->flagging[bnt_label - 1] & 1));
+      for (b = 0; b < num_ants; b++) {
+	bnt_label = cycle_sums[0]->ant_label[b];
+	if (bnt_label == ant_label) {
+	  continue;
+	}
+	for (j = 0, bons = true; j < num_cycles; j++) {
+	  bons &= cycle_sums[j]->on_source[p * cycle_sums[j]->num_ants + b];
+	}
+	if (!bons) {
+	  continue;
+	}
+	for (c = b + 1; c < num_ants; c++) {
+	  cnt_label = cycle_sums[0]->ant_label[c];
+	  if ((cnt_label == bnt_label) || (cnt_label == ant_label)) {
+	    continue;
+	  }
+	  for (j = 0, cons = true; j < num_cycles; j++) {
+	    cons &= cycle_sums[j]->on_source[p * cycle_sums[j]->num_ants + c];
+	  }
+	  if (!cons) {
+	    continue;
 	  }
-	  if (bons) {
-	    for (c = b + 1; c < cycle_spectra[0]->header_data->num_ants; c++) {
-	      cnt_label = cycle_spectra[0]->header_data->ant_label[c];
-	      if ((cnt_label != bnt_label) && (cnt_label != ant_label)) {
-		cons = true;
-		for (j = 0; j < num_cycles; j++) {
-		  cons &=
-		    (!(cycle_spectra[j]->spectrum[winidx][polidx[i]]->syscal_data->flagging[cnt_label - 1] & 1));
-		}
-		if (cons) {
-		  // All three antennas are unique and on-source.
-		  if (ant_label < bnt_label) {
-		    x1 = ant_label;
-		    y1 = bnt_label;
-		  } else {
-		    x1 = bnt_label;
-		    y1 = ant_label;
-		  }
-		  if (ant_label < cnt_label) {
-		    x2 = ant_label;
-		    y2 = cnt_label;
-		  } else {
-		    x2 = cnt_label;
-		    y2 = ant_label;
-		  }
-		  if (bnt_label < cnt_label) {
-		    x3 = bnt_label;
-		    y3 = cnt_label;
-		  } else {
-		    x3 = cnt_label;
-		    y3 = bnt_label;
-		  }
-		  // Now we collect data over the baselines and cycles and put them in memory
-		  // to do calculations later.
-		  for (j = 0; j < num_cycles; j++) {
-		    for (k = 0; k < cycle_spectra[j]->spectrum[winidx][polidx[i]]->nbaselines; k++) {
-		      base_to_ants(cycle_spectra[j]->spectrum[winidx][polidx[i]]->baseline[k],
-				   &a1, &a2);
-		      if ((a1 == x1) && (a2 == y1)) {
-			rsum1 = isum1 = NULL;
-			nbins1 = 0;
-			sum_vis(cycle_spectra[j]->spectrum[winidx][polidx[i]], k, options,
-				&nbins1, &rsum1, &isum1, NULL);
-		      } else if ((a1 == x2) && (a2 == y2)) {
-			rsum2 = isum2 = NULL;
-			nbins2 = 0;
-			sum_vis(cycle_spectra[j]->spectrum[winidx][polidx[i]], k, options,
-				&nbins2, &rsum2, &isum2, NULL);
-		      } else if ((a1 == x3) && (a2 == y3)) {
-			rsum3 = isum3 = NULL;
-			nbins3 = 0;
-			sum_vis(cycle_spectra[j]->spectrum[winidx][polidx[i]], k, options,
-				&nbins3, &rsum3, &isum3, NULL);
-		      } else if ((a1 == ant_label) && (a2 == ant_label)) {
-			// This is the autocorrelation, and we want to use this to
-			// get the noise diode amplitude.
-			asuma = NULL;
-			nbinsa = 0;
-			sum_vis(cycle_spectra[j]->spectrum[winidx][polidx[i]], k, options,
-				&nbinsa, &asuma, NULL, NULL);
-		      } else if ((a1 == bnt_label) && (a2 == bnt_label)) {
-			asumb = NULL;
-			nbinsb = 0;
-			sum_vis(cycle_spectra[j]->spectrum[winidx][polidx[i]], k, options,
-				&nbinsb, &asumb, NULL, NULL);
-		      } else if ((a1 == cnt_label) && (a2 == cnt_label)) {
-			asumc = NULL;
-			nbinsc = 0;
-			sum_vis(cycle_spectra[j]->spectrum[winidx][polidx[i]], k, options,
-				&nbinsc, &asumc, NULL, NULL);
-		      }
-		    }
-		    if ((nbins1 == nbins2) && (nbins1 == nbins3)) {
-		      if (nbinst == 0) {
-			nbinst = nbins1;
-			CALLOC(trsum1, nbinst);
-			CALLOC(tisum1, nbinst);
-			CALLOC(trsum2, nbinst);
-			CALLOC(tisum2, nbinst);
-			CALLOC(trsum3, nbinst);
-			CALLOC(tisum3, nbinst);
-		      }
-		      if (nbinsta == 0) {
-			nbinsta = nbinsa;
-			CALLOC(tasuma, nbinsta);
-		      }
-		      if (nbins1 == nbinst) {
-			for (k = 0; k < nbinst; k++) {
-			  trsum1[k] += rsum1[k];
-			  tisum1[k] += isum1[k];
-			  trsum2[k] += rsum2[k];
-			  tisum2[k] += isum2[k];
-			  trsum3[k] += rsum3[k];
-			  tisum3[k] += isum3[k];
-			}
-		      }
-		      if (nbinsa == nbinsta) {
-			for (k = 0; k < nbinsta; k++) {
-			  tasuma[k] += asuma[k];
-			}
-		      }
-		    }
-		    FREE(rsum1);
-		    FREE(isum1);
-		    FREE(rsum2);
-		    FREE(isum2);
-		    FREE(rsum3);
-		    FREE(isum3);
-		    FREE(asuma);
-		    FREE(asumb);
-		    FREE(asumc);
-		  }
-		  //if ((nbins1 == nbins2) && (nbins1 == nbins3)) {
-		  if ((nbinst > 0) && (nbinsta > 1)) {
-		    nbins_gainsum = nbinst;
-		    CALLOC(gains[ant_label - 1], nbinst);
-		    if (gainsum[ant_label - 1] == NULL) {
-		      CALLOC(gainsum[ant_label - 1], nbinst);
-		      CALLOC(gainsum_numtriplets[ant_label - 1], nbinst);
-		    }
-		    for (k = 0; k < nbinst; k++) {
-		      gains[ant_label - 1][k] =
-			sqrtf((trsum1[k] * trsum1[k] + tisum1[k] * tisum1[k]) *
-			      (trsum2[k] * trsum2[k] + tisum2[k] * tisum2[k]) /
-			      (trsum3[k] * trsum3[k] + tisum3[k] * tisum3[k]));
-		      /* fprintf(stderr, "ACAL: for ant %d bin %d, triplet %d-%d * %d-%d / %d-%d = root(%.3f * %.3f / %.3f) = %.3f\n", */
-		      /* 	      ant_label, k, x1, y1, x2, y2, x3, y3, */
-		      /* 	      (trsum1[k] * trsum1[k] + tisum1[k] * tisum1[k]), */
-		      /* 	      (trsum2[k] * trsum2[k] + tisum2[k] * tisum2[k]), */
-		      /* 	      (trsum3[k] * trsum3[k] + tisum3[k] * tisum3[k]), */
-		      /* 	      gains[ant_label - 1][k]); */
-		    }
-		    if (nbinsta == 2) {
-		      // We need the autos to have the niose diode on-off bins.
-		      nd_amp = tasuma[1] - tasuma[0];
-		    } else {
-		      nd_amp = 0;
-		    }
-		    // In the CABB method, the flux density of the source is just the
-		    // first term of the model.
-		    src_fd = fluxdensity_models->model_terms[freqmatchidx][0];
-		    // Now calculate the noise diode strength in Jy.
-		    for (k = 0; k < nbinst; k++) {
-		      gainsum[ant_label - 1][k] += (src_fd * nd_amp) / gains[ant_label - 1][k];
-		      gainsum_numtriplets[ant_label - 1][k] += 1;
-		      /* fprintf(stderr, "ACAL: gain sum ant %d bin %d, now %.3f N = %d\n", */
-		      /* 	      ant_label, k, gainsum[ant_label - 1][k], */
-		      /* 	      gainsum_numtriplets[ant_label - 1][k]); */
-		    }
-		    FREE(gains[ant_label - 1]);
-		  }
-		  FREE(trsum1);
-		  FREE(tisum1);
-		  FREE(trsum2);
-		  FREE(tisum2);
-		  FREE(trsum3);
-		  FREE(tisum3);
-		  nbinst = 0;
-		  FREE(tasuma);
-		  nbinsta = 0;
-		}
+	  // All three antennas are unique and on-source.
+	  x1 = (ant_label < bnt_label) ? ant_label : bnt_label;
+	  y1 = (ant_label < bnt_label) ? bnt_label : ant_label;
+	  x2 = (ant_label < cnt_label) ? ant_label : cnt_label;
+	  y2 = (ant_label < cnt_label) ? cnt_label : ant_label;
+	  x3 = (bnt_label < cnt_label) ? bnt_label : cnt_label;
+	  y3 = (bnt_label < cnt_label) ? cnt_label : bnt_label;
+	  // Add up the averages over the cycles.
+	  nbinst = 0;
+	  nbinsta = 0;
+	  for (j = 0; j < num_cycles; j++) {
+	    sums = cycle_sums[j];
+	    rsum1 = noise_diode_sums_baseline(sums, p, x1, y1, &nbins1);
+	    rsum2 = noise_diode_sums_baseline(sums, p, x2, y2, &nbins2);
+	    rsum3 = noise_diode_sums_baseline(sums, p, x3, y3, &nbins3);
+	    // The autocorrelation is used to get the noise diode amplitude.
+	    asuma = noise_diode_sums_baseline(sums, p, ant_label, ant_label, &nbinsa);
+	    if ((nbins1 == 0) || (nbins1 != nbins2) || (nbins1 != nbins3)) {
+	      continue;
+	    }
+	    if (nbinst == 0) {
+	      nbinst = nbins1;
+	      CALLOC(trsum1, nbinst);
+	      CALLOC(tisum1, nbinst);
+	      CALLOC(trsum2, nbinst);
+	      CALLOC(tisum2, nbinst);
+	      CALLOC(trsum3, nbinst);
+	      CALLOC(tisum3, nbinst);
+	    }
+	    if ((nbinsta == 0) && (nbinsa > 0)) {
+	      nbinsta = nbinsa;
+	      CALLOC(tasuma, nbinsta);
+	    }
+	    if (nbins1 == nbinst) {
+	      for (k = 0; k < nbinst; k++) {
+		trsum1[k] += rsum1[k];
+		tisum1[k] += sums->isum[(rsum1 - sums->rsum) + k];
+		trsum2[k] += rsum2[k];
+		tisum2[k] += sums->isum[(rsum2 - sums->rsum) + k];
+		trsum3[k] += rsum3[k];
+		tisum3[k] += sums->isum[(rsum3 - sums->rsum) + k];
+	      }
+	    }
+	    if ((nbinsa > 0) && (nbinsa == nbinsta)) {
+	      for (k = 0; k < nbinsta; k++) {
+		tasuma[k] += asuma[k];
 	      }
 	    }
 	  }
+	  if ((nbinst > 0) && (nbinsta > 1)) {
+	    nbins_gainsum = nbinst;
+	    if (gainsum[a] == NULL) {
+	      CALLOC(gainsum[a], nbinst);
+	      CALLOC(gainsum_numtriplets[a], nbinst);
+	    }
+	    if (nbinsta == 2) {
+	      // We need the autos to have the noise diode on-off bins.
+	      nd_amp = tasuma[1] - tasuma[0];
+	    } else {
+	      nd_amp = 0;
+	    }
+	    // Now calculate the noise diode strength in Jy.
+	    for (k = 0; k < nbinst; k++) {
+	      gain = sqrtf((trsum1[k] * trsum1[k] + tisum1[k] * tisum1[k]) *
+			   (trsum2[k] * trsum2[k] + tisum2[k] * tisum2[k]) /
+			   (trsum3[k] * trsum3[k] + tisum3[k] * tisum3[k]));
+	      gainsum[a][k] += (src_fd * nd_amp) / gain;
+	      gainsum_numtriplets[a][k] += 1;
+	    }
+	  }
+	  FREE(trsum1);
+	  FREE(tisum1);
+	  FREE(trsum2);
+	  FREE(tisum2);
+	  FREE(trsum3);
+	  FREE(tisum3);
+	  FREE(tasuma);
 	}
       }
     }
     // At this point, we have an array with all the antennas and all the cycles
     // filled in with the noise diode strengths. Calculate the average noise
     // diode strength.
-    for (a = 0; a < cycle_spectra[0]->header_data->num_ants; a++) {
+    for (a = 0; a < num_ants; a++) {
+      if (gainsum[a] == NULL) {
+	// This antenna wasn't in any triplets.
+	continue;
+      }
+      ant_label = cycle_sums[0]->ant_label[a];
       for (k = 0; k < nbins_gainsum; k++) {
 	// The 2x is because the noise diode amplitude is halved due to the
 	// 50% duty cycle, and we correct that here.
-	(*noise_diode_modifier)->noise_diode_amplitude[a + 1][opol] += 2 *
+	(*noise_diode_modifier)->noise_diode_amplitude[ant_label][opol] += 2 *
 	  gainsum[a][k] / (float)(gainsum_numtriplets[a][k] * nbins_gainsum);
       }
     }
     
-    FREE(gains);
-    FREE(gains_nbins);
-
-    for (a = 0; a < cycle_spectra[0]->header_data->num_ants; a++) {
+    for (a = 0; a < cycle_sums[0]->num_ants; a++) {
       FREE(gainsum[a]);
       FREE(gainsum_numtriplets[a]);
     }
     FREE(gainsum);
     FREE(gainsum_numtriplets);
-
   }
-
 }
 
+/*!
+ *  \brief Take some ampphase cycle data and calculate the noise diode amplitudes
+ *         given a supplied flux density
+ *  \param fluxdensity_models the flux density models for the source
+ *  \param num_cycles the number of cycles in the \a cycle_ampphase array
+ *  \param window the IF to look at
+ *  \param options the options structure to direct which channels to use
+ *  \param cycle_spectra the array of cycle data, with length \a num_cycles
+ *  \param noise_diode_modifier a pointer to a variable which upon exit will be
+ *         a modifier structure filled with the derived noise diode amplitudes
+ *
+ * This makes the tvchannel averages with compute_noise_diode_sums and then
+ * solves with solve_noise_diode_amplitudes. If the same cycles will be solved
+ * again with other flux density models, it is faster to keep the averages and
+ * call solve_noise_diode_amplitudes directly.
+ */
+void compute_noise_diode_amplitudes(struct fluxdensity_specification *fluxdensity_models,
+				    int num_cycles, int window, struct ampphase_options *options,
+				    struct spectrum_data **cycle_spectra,
+				    struct ampphase_modifiers **noise_diode_modifier) {
+  int i;
+  struct noise_diode_sums **cycle_sums = NULL;
+
+  if (num_cycles < 1) {
+    return;
+  }
+  MALLOC(cycle_sums, num_cycles);
+  for (i = 0; i < num_cycles; i++) {
+    MALLOC(cycle_sums[i], 1);
+    compute_noise_diode_sums(cycle_spectra[i], window, options, cycle_sums[i]);
+  }
+  solve_noise_diode_amplitudes(fluxdensity_models, num_cycles, cycle_sums,
+			       noise_diode_modifier);
+  for (i = 0; i < num_cycles; i++) {
+    free_noise_diode_sums(cycle_sums[i]);
+    FREE(cycle_sums[i]);
+  }
+  FREE(cycle_sums);
+}
 
 /*!
  *  \brief Create sums of imaginary and real variables over tvchannels
@@ -4175,7 +6290,6 @@ void compute_noise_diode_amplitudes(struct fluxdensity_specification *fluxdensit
  */
 void sum_vis(struct ampphase *ampphase, int baseline_idx, struct ampphase_options *options,
 	     int *nbins, float **rsum, float **isum, float **asum) {
-  int oidx, i, j, n;
   
   // Allocate the memory.
   *nbins = ampphase->nbins[baseline_idx];
@@ -4188,52 +6302,9 @@ void sum_vis(struct ampphase *ampphase, int baseline_idx, struct ampphase_option
   if (asum != NULL) {
     REALLOC(*asum, *nbins);
   }
-  for (i = 0; i < *nbins; i++) {
-    if (rsum != NULL) {
-      (*rsum)[i] = 0;
-    }
-    if (isum != NULL) {
-      (*isum)[i] = 0;
-    }
-    if (asum != NULL) {
-      (*asum)[i] = 0;
-    }
-  }
-  
-  // For now we assume the window index works for the options.
-  oidx = ampphase->window;
-  if (oidx > options->num_ifs) {
-    // Bad.
-    return;
-  }
-
-  for (i = 0; i < *nbins; i++) {
-    for (j = 0, n = 0; j < ampphase->f_nchannels[baseline_idx][i]; j++) {
-      if ((ampphase->f_channel[baseline_idx][i][j] >= options->min_tvchannel[oidx]) &&
-	  (ampphase->f_channel[baseline_idx][i][j] <= options->max_tvchannel[oidx])) {
-	n++;
-	if (rsum != NULL) {
-	  (*rsum)[i] += crealf(ampphase->f_raw[baseline_idx][i][j]);
-	}
-	if (isum != NULL) {
-	  (*isum)[i] += cimagf(ampphase->f_raw[baseline_idx][i][j]);
-	}
-	if (asum != NULL) {
-	  (*asum)[i] += ampphase->f_amplitude[baseline_idx][i][j];
-	}
-      }
-    }
-    if ((rsum != NULL) && (n > 0)) {
-      (*rsum)[i] /= (float)n;
-    }
-    if ((isum != NULL) && (n > 0)) {
-      (*isum)[i] /= (float)n;
-    }
-    if ((asum != NULL) && (n > 0)) {
-      (*asum)[i] /= (float)n;
-    }
-  }
-
+  sum_vis_bins(ampphase, baseline_idx, options,
+	       ((rsum != NULL) ? *rsum : NULL), ((isum != NULL) ? *isum : NULL),
+	       ((asum != NULL) ? *asum : NULL));
 }
 
 /*!
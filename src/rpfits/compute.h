@@ -116,11 +116,33 @@
  *         raw complex visibilities
  */
 #define STM_REMOVE            3
+/*! \def STM_NOT_APPLIED
+ *  \brief Describes raw complex visibilities that don't have any system
+ *         temperature applied to them, alongside STM_APPLY_CORRELATOR and
+ *         STM_APPLY_COMPUTED which describe the ones that do
+ */
+#define STM_NOT_APPLIED       0
 /*! \def TMPSTRINGLEN
  *  \brief The maximum length string that can be added in a single call to the
  *         info_print routine
  */
 #define TMPSTRINGLEN 100
+/*! \def PHASOR_RENORMALISE_CHANNELS
+ *  \brief When delay corrections are applied to a spectrum, the correction
+ *          is stepped from channel to channel by rotating a phasor, and it is
+ *          recomputed exactly every this many channels
+ */
+#define PHASOR_RENORMALISE_CHANNELS 64
+/*! \def AMPPHASE_MASK_BITS
+ *  \brief The number of channels recorded in each word of the good channel
+ *         masks in the ampphase structure
+ */
+#define AMPPHASE_MASK_BITS 32
+/*! \def AMPPHASE_MASK_WORDS
+ *  \brief The number of words in a good channel mask for a spectrum with
+ *         \a n channels
+ */
+#define AMPPHASE_MASK_WORDS(n) (((n) + AMPPHASE_MASK_BITS - 1) / AMPPHASE_MASK_BITS)
 
 /*! \struct ampphase_modifiers
  *  \brief Structure to hold details about modifications to be made to the
@@ -642,8 +664,8 @@ struct syscal_data {
  * particular product. Each structure represents a single IF and polarisation
  * from a single cycle, but contains all the baselines, channels and bins.
  * Both the raw complex data is stored here, along with the amplitudes and
- * phases computed from them. Two copies of the data are included, one which
- * has all the data, and another which excludes the data that was flagged bad.
+ * phases computed from them. The channels that were not flagged bad are
+ * marked in a mask for each baseline and bin.
  *
  * Metadata about the data ranges are available here to make it easier to plot
  * this data, The options used to compute this data is linked here, and the
@@ -792,8 +814,8 @@ struct ampphase {
    */
   float complex ***raw;
 
-  // These next arrays contain the same data as above, but
-  // do not include the flagged channels.
+  // The channels that are not flagged are recorded in a bitmask for each
+  // baseline and bin, rather than by keeping a second copy of the data.
   /*! \var f_nchannels
    *  \brief The number of good channels per baseline and bin
    *
@@ -803,66 +825,88 @@ struct ampphase {
    *
    * A channel from the raw complex data is bad if the real value of the channel
    * does not equal itself, ie. it has value NaN. Only those channels which are not
-   * bad in this sense are included in the f_* arrays in this structure.
+   * bad in this sense are marked in the `valid` masks in this structure.
    */
   int **f_nchannels;
-  /*! \var f_channel
-   *  \brief The channel number of the raw data corresponding to this good channel
-   *
-   * This 3-D array has length `nbaselines` for the first index, `nbins[i]` for
-   * the second index (where `i` is the position along the first index) and
-   * `f_nchannels[i][j]` for the third index (where `j` is the position along the
-   * second index). Each index starts at 0.
-   */
-  float ***f_channel;
-  /*! \var f_frequency
-   *  \brief The frequency corresponding to this good channel, in GHz
-   *
-   * This 3-D array has length `nbaselines` for the first index, `nbins[i]` for
-   * the second index (where `i` is the position along the first index) and
-   * `f_nchannels[i][j]` for the third index (where `j` is the position along the
-   * second index). Each index starts at 0.
-   */
-  float ***f_frequency;
-  /*! \var f_weight
-   *  \brief The weight for this good channel, which is currently unused
-   *
-   * This 3-D array has length `nbaselines` for the first index, `nbins[i]` for
-   * the second index (where `i` is the position along the first index) and
-   * `f_nchannels[i][j]` for the third index (where `j` is the position along the
-   * second index). Each index starts at 0.
-   */
-  float ***f_weight;
-  /*! \var f_amplitude
-   *  \brief The computed amplitude of this good channel
-   *
-   * This 3-D array has length `nbaselines` for the first index, `nbins[i]` for
-   * the second index (where `i` is the position along the first index) and
-   * `f_nchannels[i][j]` for the third index (where `j` is the position along the
-   * second index). Each index starts at 0.
-   */
-  float ***f_amplitude;
-  /*! \var f_phase
-   *  \brief The computed phase corresponding to this good channel, the units of which
-   *         are controlled by the variable `phase_in_degrees` in the ampphase_options
-   *         structure
-   *
-   * This 3-D array has length `nbaselines` for the first index, `nbins[i]` for
-   * the second index (where `i` is the position along the first index) and
-   * `f_nchannels[i][j]` for the third index (where `j` is the position along the
-   * second index). Each index starts at 0.
-   */
-  float ***f_phase;
-  /*! \var f_raw
-   *  \brief The raw complex data corresponding to this good channel
-   *
-   * This 3-D array has length `nbaselines` for the first index, `nbins[i]` for
-   * the second index (where `i` is the position along the first index) and
-   * `f_nchannels[i][j]` for the third index (where `j` is the position along the
-   * second index). Each index starts at 0.
-   */
-  float complex ***f_raw;
-  
+  /*! \var valid
+   *  \brief The mask of good channels per baseline and bin
+   *
+   * This 3-D array has length `nbaselines` for the first index, `nbins[i]`
+   * for the second index (where `i` is the position along the first index),
+   * and AMPPHASE_MASK_WORDS(`nchannels`) for the third index. Each index
+   * starts at 0. Channel `k` is good if bit `k % AMPPHASE_MASK_BITS` of word
+   * `k / AMPPHASE_MASK_BITS` is set.
+   *
+   * The good channels should be visited with ampphase_channel_valid or
+   * ampphase_next_valid_channel, and ampphase_compact_float and
+   * ampphase_compact_complex will make arrays of only the good channels when
+   * they are needed.
+   */
+  unsigned int ***valid;
+
+  // The storage behind the baseline and bin arrays above. Each kind of
+  // array is kept in a single block, with the spectra ordered by baseline
+  // and then by bin, and the arrays above are just views into these blocks.
+  /*! \var nspectra
+   *  \brief The total number of baseline and bin spectra, which is the sum
+   *         of all the values in `nbins`
+   */
+  int nspectra;
+  /*! \var spectrum_offset
+   *  \brief The index of the first spectrum of each baseline
+   *
+   * This array has length `nbaselines` and is indexed starting at 0. The
+   * spectrum of baseline `i` and bin `j` is spectrum number
+   * `spectrum_offset[i] + j` in each of the blocks.
+   */
+  int *spectrum_offset;
+  /*! \var flagged_bad_block
+   *  \brief The storage for `flagged_bad`, with length `nspectra`
+   */
+  int *flagged_bad_block;
+  /*! \var f_nchannels_block
+   *  \brief The storage for `f_nchannels`, with length `nspectra`
+   */
+  int *f_nchannels_block;
+  /*! \var weight_block
+   *  \brief The storage for `weight`, with `nchannels` values for each
+   *         spectrum
+   */
+  float *weight_block;
+  /*! \var amplitude_block
+   *  \brief The storage for `amplitude`, with `nchannels` values for each
+   *         spectrum
+   */
+  float *amplitude_block;
+  /*! \var phase_block
+   *  \brief The storage for `phase`, with `nchannels` values for each
+   *         spectrum
+   */
+  float *phase_block;
+  /*! \var raw_block
+   *  \brief The storage for `raw`, with `nchannels` values for each
+   *         spectrum
+   */
+  float complex *raw_block;
+  /*! \var valid_block
+   *  \brief The storage for `valid`, with AMPPHASE_MASK_WORDS(`nchannels`)
+   *         words for each spectrum
+   */
+  unsigned int *valid_block;
+  /*! \var spectrum_views
+   *  \brief The per-bin pointers of all the float baseline and bin arrays,
+   *         in one allocation
+   */
+  float **spectrum_views;
+  /*! \var complex_spectrum_views
+   *  \brief The per-bin pointers of the `raw` array
+   */
+  float complex **complex_spectrum_views;
+  /*! \var valid_views
+   *  \brief The per-bin pointers of the `valid` array
+   */
+  unsigned int **valid_views;
+
   // Some metadata.
   /*! \var min_amplitude_global
    *  \brief The minimum computed amplitude (including good data only) observed across
@@ -1152,7 +1196,8 @@ struct vis_quantities {
    *
    * This array has length `ntriangles` along the first axis, and 3 (it's a triangle)
    * along the second axis and is indexed starting at 0. The second axis is each
-   * antenna number in the triangle.
+   * antenna number in the triangle. All the triangles are stored in a single
+   * block, which starts at `triangles[0]`.
    */
   int **triangles;
   
@@ -1160,9 +1205,15 @@ struct vis_quantities {
    *  \brief The closure phase for each triangle and bin, in phase units
    *
    * This 2-D array has length `ntriangles` for the first index, and `nbins_cross`
-   * for the seocnd index. Both indices start at 0.
+   * for the seocnd index. Both indices start at 0. All the values are stored in
+   * a single block, which starts at `closure_phase[0]`.
    */
   float **closure_phase;
+  /*! \var closure_reference_antenna
+   *  \brief The index of the reference antenna that the closure phases were
+   *         computed with, or -1 if they haven't been computed
+   */
+  int closure_reference_antenna;
   /*! \var min_closure_phase
    *  \brief The minimum closure phase across all the baselines
    */
@@ -1292,6 +1343,97 @@ struct vis_data {
   struct ampphase_options **options;
 };
 
+/*! \struct ampphase_average_workspace
+ *  \brief Scratch arrays used by ampphase_average, which can be kept between
+ *         calls so the averaging doesn't need to allocate any memory
+ *
+ * The arrays only ever grow, so after the largest band has been seen they
+ * don't need to be reallocated. A workspace can't be used by more than one
+ * thread at a time, so each thread should have its own.
+ */
+struct ampphase_average_workspace {
+  /*! \var max_points
+   *  \brief The number of channels that the per-channel arrays can hold
+   */
+  int max_points;
+  /*! \var max_delavg
+   *  \brief The number of delay-averaging bins that the per-bin arrays can hold
+   */
+  int max_delavg;
+  /*! \var max_delavg_width
+   *  \brief The number of channels that each delay-averaging bin can hold
+   */
+  int max_delavg_width;
+  /*! \var median_array_amplitude
+   *  \brief The amplitudes in the tvchannel range, with length `max_points`
+   */
+  float *median_array_amplitude;
+  /*! \var median_array_phase
+   *  \brief The phases in the tvchannel range, with length `max_points`
+   */
+  float *median_array_phase;
+  /*! \var median_complex
+   *  \brief The complex values in the tvchannel range, with length `max_points`
+   */
+  float complex *median_complex;
+  /*! \var median_select_amplitude
+   *  \brief Scratch space for the complex median selection, with length
+   *         `max_points`
+   */
+  float *median_select_amplitude;
+  /*! \var array_frequency
+   *  \brief The frequencies in the tvchannel range, with length `max_points`
+   */
+  float *array_frequency;
+  /*! \var delavg_frequency
+   *  \brief The average frequency of each delay-averaging bin, with length
+   *         `max_delavg`
+   */
+  float *delavg_frequency;
+  /*! \var delavg_phase
+   *  \brief The phase of each delay-averaging bin, with length `max_delavg`
+   */
+  float *delavg_phase;
+  /*! \var delavg_raw
+   *  \brief The average complex value of each delay-averaging bin, with length
+   *         `max_delavg`
+   */
+  float complex *delavg_raw;
+  /*! \var delavg_n
+   *  \brief The number of channels in each delay-averaging bin, with length
+   *         `max_delavg`
+   */
+  int *delavg_n;
+  /*! \var median_array_delay
+   *  \brief The delay between each pair of delay-averaging bins, with length
+   *         `max_delavg`
+   */
+  float *median_array_delay;
+  /*! \var n_delavg_median
+   *  \brief The number of values stored for each bin in the following
+   *         median arrays, with length `max_delavg`
+   */
+  int *n_delavg_median;
+  /*! \var median_delavg_phase
+   *  \brief The phases in each delay-averaging bin
+   *
+   * This 2-D array has length `max_delavg` for the first index, and
+   * `max_delavg_width` for the second index. The values are stored in a
+   * single block, which starts at `median_delavg_phase[0]`.
+   */
+  float **median_delavg_phase;
+  /*! \var median_delavg_raw
+   *  \brief The complex values in each delay-averaging bin, stored in the same
+   *         way as `median_delavg_phase`
+   */
+  float complex **median_delavg_raw;
+  /*! \var median_delavg_frequency
+   *  \brief The frequencies in each delay-averaging bin, stored in the same
+   *         way as `median_delavg_phase`
+   */
+  float **median_delavg_frequency;
+};
+
 /*! \struct fluxdensity_specification
  *  \brief A way to specify flux densities required for amplitude calibration
  */
@@ -1336,8 +1478,106 @@ struct fluxdensity_specification {
   float **model_terms;
 };
 
+/*! \struct noise_diode_sums
+ *  \brief The tvchannel averages of the data of one cycle in one window, which
+ *         is all that is needed to solve for the noise diode amplitudes
+ *
+ * These averages don't depend on the flux density of the source, so they
+ * only need to be made once for each cycle, window and set of options, however
+ * many flux density models the noise diode amplitudes are then solved for.
+ * The polarisation index used throughout is 0 for XX and 1 for YY.
+ */
+struct noise_diode_sums {
+  /*! \var mjd
+   *  \brief The MJD of the cycle
+   */
+  double mjd;
+  /*! \var window
+   *  \brief The window number that the averages were made in
+   */
+  int window;
+  /*! \var window_found
+   *  \brief Whether the window and its calibration data were found in the cycle
+   */
+  bool window_found;
+  /*! \var pols_found
+   *  \brief Whether both the XX and YY polarisations were found in the window
+   */
+  bool pols_found;
+  /*! \var num_ants
+   *  \brief The number of antennas in the cycle
+   */
+  int num_ants;
+  /*! \var ant_label
+   *  \brief The label of each antenna
+   *
+   * This array has length `num_ants`, and is indexed starting at 0.
+   */
+  int *ant_label;
+  /*! \var on_source
+   *  \brief Whether each antenna was on source in each polarisation
+   *
+   * This flat array has length 2 * `num_ants`, and is indexed as
+   * (polarisation index * `num_ants`) + antenna index, where the antenna
+   * index is the same as for `ant_label`.
+   */
+  bool *on_source;
+  /*! \var nchannels
+   *  \brief The number of channels in the XX spectrum of the window
+   */
+  int nchannels;
+  /*! \var frequency
+   *  \brief The frequency of each channel in the XX spectrum, in GHz
+   *
+   * This array has length `nchannels`, and is indexed starting at 0.
+   */
+  float *frequency;
+  /*! \var nbaselines
+   *  \brief The largest number of baselines in either polarisation
+   */
+  int nbaselines;
+  /*! \var baseline
+   *  \brief The baseline number of each baseline in each polarisation
+   *
+   * This flat array has length 2 * `nbaselines`, and is indexed as
+   * (polarisation index * `nbaselines`) + baseline index. Baselines that
+   * aren't present have the number 0.
+   */
+  int *baseline;
+  /*! \var nbins
+   *  \brief The number of bins on each baseline in each polarisation, in the
+   *         same order as `baseline`
+   */
+  int *nbins;
+  /*! \var offset
+   *  \brief Where the averages of the first bin of each baseline in each
+   *         polarisation are in the `rsum` and `isum` arrays, in the same
+   *         order as `baseline`
+   */
+  int *offset;
+  /*! \var nvalues
+   *  \brief The total number of bins, and the length of `rsum` and `isum`
+   */
+  int nvalues;
+  /*! \var rsum
+   *  \brief The average of the real parts of the data in the tvchannels of
+   *         each bin, as made by sum_vis
+   *
+   * This array has length `nvalues`, and the bins of each baseline are
+   * contiguous, starting at its `offset`.
+   */
+  float *rsum;
+  /*! \var isum
+   *  \brief The average of the imaginary parts of the data in the tvchannels
+   *         of each bin, stored in the same way as `rsum`
+   */
+  float *isum;
+};
+
 float fmedianf(float *a, int n);
 float complex fcmedianfc(float complex *a, int n);
+float fselectmedianf(float *a, int n);
+float complex fcselectmedianfc(float complex *a, float *amplitude, int n);
 float fsumf(float *a, int n);
 float complex fcsumfc(float complex *a, int n);
 float fmeanf(float *a, int n);
@@ -1345,6 +1585,15 @@ float complex fcmeanfc(float complex *a, int n);
 double smallest(int n, ...);
 double smallest_abs(int n, ...);
 struct ampphase* prepare_ampphase(void);
+void allocate_ampphase_spectra(struct ampphase *ampphase);
+bool ampphase_channel_valid(struct ampphase *ampphase, int baseline, int bin,
+			    int channel);
+int ampphase_next_valid_channel(struct ampphase *ampphase, int baseline, int bin,
+				int channel);
+int ampphase_compact_float(struct ampphase *ampphase, int baseline, int bin,
+			   float *values, float *compacted);
+int ampphase_compact_complex(struct ampphase *ampphase, int baseline, int bin,
+			     float complex *values, float complex *compacted);
 struct vis_quantities* prepare_vis_quantities(void);
 void free_ampphase(struct ampphase **ampphase);
 void free_vis_quantities(struct vis_quantities **vis_quantities);
@@ -1366,10 +1615,14 @@ struct ampphase_options* find_ampphase_options(int num_options,
 					       struct ampphase_options **options,
 					       struct scan_header_data *scan_header_data,
 					       int *options_idx);
+bool ampphase_options_same_band(struct ampphase_options *a,
+				struct ampphase_options *b);
 void copy_metinfo(struct metinfo *dest,
                   struct metinfo *src);
 void copy_syscal_data(struct syscal_data *dest,
 		      struct syscal_data *src);
+void copy_vis_quantities(struct vis_quantities *dest,
+			 struct vis_quantities *src);
 void free_syscal_data(struct syscal_data *syscal_data);
 void default_tvchannels(int num_chan, float chan_width,
                         float centre_freq, int *min_tvchannel,
@@ -1382,19 +1635,29 @@ int vis_ampphase(struct scan_header_data *scan_header_data,
                  struct cycle_data *cycle_data,
                  struct ampphase **ampphase, int pol, int ifno, int *num_options,
                  struct ampphase_options ***options);
+int vis_ampphase_cycle(struct scan_header_data *scan_header_data,
+		       struct cycle_data *cycle_data,
+		       struct ampphase ***ampphase, int num_pols, int *pols,
+		       int *num_options, struct ampphase_options ***options);
 int cmpfunc_real(const void *a, const void *b);
 int cmpfunc_double(const void *a, const void *b);
 int cmpfunc_complex(const void *a, const void *b);
 int cmpfunc_integer(const void *a, const void *b);
+struct ampphase_average_workspace* prepare_ampphase_average_workspace(void);
+void free_ampphase_average_workspace(struct ampphase_average_workspace **workspace);
 int ampphase_average(struct scan_header_data *scan_header_data,
 		     struct ampphase *ampphase,
                      struct vis_quantities **vis_quantities,
 		     int *num_options,
-                     struct ampphase_options ***options);
+                     struct ampphase_options ***options,
+		     struct ampphase_average_workspace *workspace);
 bool ampphase_modifiers_match(struct ampphase_modifiers *a,
 			      struct ampphase_modifiers *b);
 bool ampphase_options_match(struct ampphase_options *a,
                             struct ampphase_options *b);
+bool ampphase_options_modifier_windows(struct ampphase_options *a,
+				       struct ampphase_options *b,
+				       int *n_windows, double **windows);
 void calculate_system_temperatures_cycle_data(struct cycle_data *cycle_data,
 					      struct scan_header_data *scan_header_data,
 					      int *num_options,
@@ -1413,15 +1676,25 @@ void print_information_scan_header(struct scan_header_data *header_data,
 				   char *output, int output_length);
 void chanaverage_ampphase(struct ampphase *ampphase, struct ampphase *avg_ampphase,
 			  int averaging, int averaging_type, bool phase_in_degrees);
+void chanaverage_spectrum_data(struct spectrum_data *spectrum_data,
+			       struct spectrum_data *avg_spectrum_data);
 float baseline_phase(struct vis_quantities *vis_quantities,
 		     int ant1, int ant2, int bin);
 void compute_closure_phase(struct scan_header_data *scan_header_data,
 			   struct vis_quantities *vis_quantities,
 			   int reference_antenna);
+void compute_closure_phases(struct vis_data *vis_data, int reference_antenna);
 void compute_delays(struct ampphase *ampphase, bool phase_in_degrees, int min_chan, int max_chan,
 		    float ****delays, int *n_baselines, int **n_bins, int ***n_delays,
 		    float ***mean_delay, float ***median_delay);
 void free_fluxdensity_specification(struct fluxdensity_specification *a);
+void compute_noise_diode_sums(struct spectrum_data *cycle_spectrum, int window,
+			      struct ampphase_options *options,
+			      struct noise_diode_sums *sums);
+void free_noise_diode_sums(struct noise_diode_sums *sums);
+void solve_noise_diode_amplitudes(struct fluxdensity_specification *fluxdensity_models,
+				  int num_cycles, struct noise_diode_sums **cycle_sums,
+				  struct ampphase_modifiers **noise_diode_modifier);
 void compute_noise_diode_amplitudes(struct fluxdensity_specification *fluxdensity_models,
 				    int num_cycles, int window, struct ampphase_options *options,
 				    struct spectrum_data **cycle_spectra,
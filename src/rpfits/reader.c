@@ -13,7 +13,6 @@
 #include <string.h>
 #include <math.h>
 #include <complex.h>
-#include "RPFITS.h"
 #include "atrpfits.h"
 #include "reader.h"
 #include "memory.h"
@@ -21,23 +20,23 @@
 
 /** 
  *  \brief Routine to assess how large this visibility set is.
+ *  \param rpfits_file the context of the file being read
  *  \return the total size of the visibility [int]
  *
- * RPFITS makes a bunch of data visible via global variables,
- * which is why we don't take any arguments. The total size is the
- * sum over all the IFs present in the data, for the product of
- * number of Stokes parameters and the number of channels in each IF.
+ * The total size is the sum over all the IFs present in the most
+ * recently-read header, for the product of number of Stokes parameters
+ * and the number of channels in each IF.
  * 
  * For example, if we had 3 IFs, and the first 2 IFs had 2048 channels
  * each, and the third IF had 4096 channels, and all the IFs had
  * 4 Stokes parameters, then this routine would return:
  * 2048 * 4 + 2048 * 4 + 4096 * 4 = 32768.
  */
-int size_of_vis(void) {
+int size_of_vis(struct rpfits_file *rpfits_file) {
   int i, vis_size = 0;
 
-  for (i = 0; i < if_.n_if; i++){
-    vis_size += (if_.if_nstok[i] * if_.if_nfreq[i]);
+  for (i = 0; i < rpfits_file->n_if; i++){
+    vis_size += (NSTOKES(rpfits_file, i) * NCHANNELS(rpfits_file, i));
   }
 
   return(vis_size);
@@ -46,6 +45,7 @@ int size_of_vis(void) {
 /** 
  *  \brief Routine to work out how big the visibility set is for
  *         a specified IF.
+ *  \param rpfits_file the context of the file being read
  *  \param if_no the IF number of interest (**the first IF is 1, not 0**) [int]
  *  \return the total size of the IF's visibility [int]
  *
@@ -55,34 +55,35 @@ int size_of_vis(void) {
  * For example, if the specified IF had 2048 channels and 4 Stokes
  * parameters, this routine would return 2048 * 4 = 8192.
  */
-int size_of_if_vis(int if_no) {
+int size_of_if_vis(struct rpfits_file *rpfits_file, int if_no) {
   int vis_size = 0, idx = -1;
 
   // The vis size is just the number of Stokes parameters
   // multiplied by the number of channels.
-  // The if_no is what comes from the rpfitsin_ call, which is
+  // The if_no is what comes from the data group header, which is
   // 1-indexed, so we subtract 1.
   idx = if_no - 1;
-  vis_size = if_.if_nstok[idx] * if_.if_nfreq[idx];
+  vis_size = NSTOKES(rpfits_file, idx) * NCHANNELS(rpfits_file, idx);
 
   return(vis_size);
 }
 
 /** 
  *  \brief Routine to work out the maximum size required for a vis array.
+ *  \param rpfits_file the context of the file being read
  *  \return the maximum visibility set size [int]
  *
  * After reading in the header, but before asking for the data, the vis
  * variable needs to be allocated to be large enough to accept all data
  * from all IFs (since you don't know which IF will be returned by the next
- * call to rpfitsin_). This routine returns the visibility set size of
+ * data read). This routine returns the visibility set size of
  * the largest IF specified in the most recently-read header.
  */
-int max_size_of_vis(void) {
+int max_size_of_vis(struct rpfits_file *rpfits_file) {
   int i = 0, vis_size = 0, max_vis_size = 0;
 
-  for (i = 1; i <= if_.n_if; i++) {
-    vis_size = size_of_if_vis(i);
+  for (i = 1; i <= rpfits_file->n_if; i++) {
+    vis_size = size_of_if_vis(rpfits_file, i);
     max_vis_size = (vis_size > max_vis_size) ? vis_size : max_vis_size;
   }
 
@@ -92,25 +93,23 @@ int max_size_of_vis(void) {
 /** 
  *  \brief Routine to open an RPFITS file.
  *  \param filename the name of the file to open [string]
- *  \return the JSTAT return code from the call to rpfitsin_ [int]
+ *  \param rpfits_file pointer to a variable which will be set to the newly
+ *                     allocated context for the open file, or NULL if the
+ *                     file cannot be opened
+ *  \return the JSTAT return code [int]
  *
  * If the file is opened successfully, this routine will return the
  * magic number JSTAT_SUCCESSFUL, otherwise it will return
- * JSTAT_UNSUCCESSFUL.
+ * JSTAT_UNSUCCESSFUL. Each opened file has its own context, so any
+ * number of files may be read at the same time.
  */
-int open_rpfits_file(char *filename) {
+int open_rpfits_file(char *filename, struct rpfits_file **rpfits_file) {
   int this_jstat = JSTAT_UNSUCCESSFUL;
-  size_t flen = 0;
-  
-  // We load in the name of the file to read.
-  flen = strlen(filename);
-  if (flen > 0) {
-    strncpy(names_.file, filename, flen);
-    this_jstat = JSTAT_OPENFILE;
-    rpfitsin_(&this_jstat, NULL, NULL, NULL, NULL, NULL,
-	      NULL, NULL, NULL, NULL, NULL, NULL);
-  }
-  if (this_jstat == JSTAT_UNSUCCESSFUL) {
+
+  *rpfits_file = rpfitsio_open(filename);
+  if (*rpfits_file != NULL) {
+    this_jstat = JSTAT_SUCCESSFUL;
+  } else {
     fprintf(stderr, "Cannot open RPFITS file %s\n", filename);
   }
 
@@ -118,18 +117,19 @@ int open_rpfits_file(char *filename) {
 }
 
 /**
- *  \brief This routine attempts to close the currently open RPFITS file.
- *  \return the JSTAT return code from the call to rpfitsin_ [int]
+ *  \brief This routine attempts to close an open RPFITS file.
+ *  \param rpfits_file the context of the file to close, which is freed
+ *                     by this routine
+ *  \return the JSTAT return code [int]
  *
  * If the file is closed successfully, this routine will return the
  * magic number JSTAT_SUCCESSFUL, otherwise it will return
  * JSTAT_UNSUCCESSFUL.
  */
-int close_rpfits_file(void) {
-  int this_jstat = JSTAT_CLOSEFILE;
+int close_rpfits_file(struct rpfits_file *rpfits_file) {
+  int this_jstat = JSTAT_UNSUCCESSFUL;
 
-  rpfitsin_(&this_jstat, NULL, NULL, NULL, NULL, NULL,
-	    NULL, NULL, NULL, NULL, NULL, NULL);
+  this_jstat = rpfitsio_close(rpfits_file);
   if (this_jstat == JSTAT_UNSUCCESSFUL) {
     fprintf(stderr, "Problem when closing RPFITS file\n");
   }
@@ -144,8 +144,8 @@ int close_rpfits_file(void) {
  *  \param length how many characters to copy into the destination [int]
  *  \param dest pointer to the destination string [char *]
  *
- * The RPFITS library stores all its strings in a single char array, and
- * all strings within it are of fixed length. This means there are no null
+ * The RPFITS reader stores all its strings in fixed-length char arrays,
+ * padded with blanks. This means there are no null
  * characters within the substrings. This routine makes it easy to copy
  * a substring to a destination, and ensuring the correct string termination.
  */
@@ -156,28 +156,36 @@ void string_copy(char *start, int length, char *dest) {
 
 /**
  *  \brief Routine to find an RPFITS header card label and return its value.
+ *  \param rpfits_file the context of the file being read
  *  \param header_name the header tag [string]
  *  \param value a pointer to the destination string [char *]
  *  \param value_maxlength the limit to the number of characters that can be
  *                         stored in the destination string
  */
-void get_card_value(char *header_name, char *value, int value_maxlength) {
-  int i, j;
+void get_card_value(struct rpfits_file *rpfits_file, char *header_name,
+		    char *value, int value_maxlength) {
+  int i, j, vlen;
   char *firstptr = NULL;
   
-  for (i = 0; i < param_.ncard; i++) {
-    firstptr = names_.card + i * 80;
+  for (i = 0; i < rpfits_file->ncard; i++) {
+    firstptr = rpfits_file->card[i];
     if (strncmp(firstptr, header_name, strlen(header_name)) == 0) {
       // Found the thing.
       // Find the first valid character.
       firstptr += strlen(header_name);
       while ((*firstptr == ' ') || (*firstptr == '=')) firstptr++;
       // Check we haven't gone past the correct card.
-      if (firstptr >= (names_.card + (i + 1) * 80)) {
+      if (firstptr >= (rpfits_file->card[i] + RPFITS_CARD_LENGTH)) {
 	// The value must be nothing.
 	value[0] = 0;
       } else {
-	strncpy(value, firstptr, value_maxlength);
+	// Don't read past the end of this card.
+	vlen = rpfits_file->card[i] + RPFITS_CARD_LENGTH - firstptr;
+	if (vlen > value_maxlength) {
+	  vlen = value_maxlength;
+	}
+	memset(value, 0, value_maxlength);
+	strncpy(value, firstptr, vlen);
       }
       value[value_maxlength - 1] = 0;
 
@@ -197,6 +205,7 @@ void get_card_value(char *header_name, char *value, int value_maxlength) {
 /**
  *  \brief Routine to move to and read the next cycle header from the open file and
  *         return some parameters.
+ *  \param rpfits_file the context of the file being read
  *  \param scan_header_data pointer to the destination scan_header_data structure,
  *                          which will be filled by this routine
  *  \return indication of whether there is something left after the header, a bitwise
@@ -210,58 +219,42 @@ void get_card_value(char *header_name, char *value, int value_maxlength) {
  * information about the size and shape of the data in the cycle that will be present
  * after the next header.
  */
-int read_scan_header(struct scan_header_data *scan_header_data) {
-  int keep_reading = READER_HEADER_AVAILABLE, this_jstat = 0;/* , that_jstat = 0; */
-  int rpfits_result = 0;
-  /* int flag = 0, bin = 0, if_no = 0, sourceno = 0, baseline = 0; */
+int read_scan_header(struct rpfits_file *rpfits_file,
+		     struct scan_header_data *scan_header_data) {
+  int keep_reading = READER_HEADER_AVAILABLE, this_jstat = 0;
   int i = 0, j = 0, *nfound_chain = NULL, nfound_if = 0, zn = 0;
-  /* float ut = 0, u = 0, v = 0, w = 0; */
-  //char *ptr = NULL;
   
-  this_jstat = JSTAT_READNEXTHEADER;
-  // Get the cards so we can search for the scan type.
-  param_.ncard = -1;
-  rpfits_result = rpfitsin_(&this_jstat, NULL, NULL, NULL, NULL, NULL,
-  			    NULL, NULL, NULL, NULL, NULL, NULL);
-  /* rpfits_result = rpfitsin_(&this_jstat, NULL, NULL, &baseline, &ut, */
-  /* 			    &u, &v, &w, &flag, &bin, &if_no, &sourceno); */
-  /* printf("[read_scan_header] ut = %.6f after header read\n", ut); */
+  // Read the header, which keeps the cards so we can search for the scan type.
+  this_jstat = rpfitsio_read_header(rpfits_file);
   if (this_jstat == JSTAT_SUCCESSFUL) {
     // We can read the data in this header.
 
     // Get the date of the observation.
-    string_copy(names_.datobs, OBSDATE_LENGTH, scan_header_data->obsdate);
-
-    // Read the data.
-    /* that_jstat = JSTAT_READDATA; */
-    /* rpfits_result = rpfitsin_(&that_jstat, NULL, NULL, &baseline, &ut, */
-    /* 			      &u, &v, &w, &flag, &bin, &if_no, &sourceno); */
-    /* printf("[scan_read] got read result %d %d for ut = %.6f baseline = %d\n", */
-    /* 	   rpfits_result, this_jstat, ut, baseline); */
-    
+    string_copy(rpfits_file->datobs, OBSDATE_LENGTH, scan_header_data->obsdate);
+
     // Put all the data into the structure.
     // We set the time later when we actually read data.
     scan_header_data->ut_seconds = -1;
     
-    get_card_value("SCANTYPE", scan_header_data->obstype, OBSTYPE_LENGTH);
-    scan_header_data->cycle_time = param_.intime;
+    get_card_value(rpfits_file, "SCANTYPE", scan_header_data->obstype, OBSTYPE_LENGTH);
+    scan_header_data->cycle_time = rpfits_file->intime;
     
-    scan_header_data->num_sources = su_.n_su;
+    scan_header_data->num_sources = rpfits_file->n_su;
     CALLOC(scan_header_data->source_name, scan_header_data->num_sources);
     CALLOC(scan_header_data->rightascension_hours, scan_header_data->num_sources);
     CALLOC(scan_header_data->declination_degrees, scan_header_data->num_sources);
     for (i = 0; i < scan_header_data->num_sources; i++) {
       if (i == 0) {
-	string_copy(CALCODE(i), CALCODE_LENGTH, scan_header_data->calcode);
+	string_copy(CALCODE(rpfits_file, i), CALCODE_LENGTH, scan_header_data->calcode);
       }
       CALLOC(scan_header_data->source_name[i], SOURCE_LENGTH);
-      string_copy(SOURCENAME(i), SOURCE_LENGTH, scan_header_data->source_name[i]);
-      scan_header_data->rightascension_hours[i] = RIGHTASCENSION(i) * 180 /
+      string_copy(SOURCENAME(rpfits_file, i), SOURCE_LENGTH, scan_header_data->source_name[i]);
+      scan_header_data->rightascension_hours[i] = RIGHTASCENSION(rpfits_file, i) * 180 /
 	(15 * M_PI);
-      scan_header_data->declination_degrees[i] = DECLINATION(i) * 180 / M_PI;
+      scan_header_data->declination_degrees[i] = DECLINATION(rpfits_file, i) * 180 / M_PI;
     }
 
-    scan_header_data->num_ifs = if_.n_if;
+    scan_header_data->num_ifs = rpfits_file->n_if;
     MALLOC(scan_header_data->if_centre_freq, scan_header_data->num_ifs);
     MALLOC(scan_header_data->if_bandwidth, scan_header_data->num_ifs);
     MALLOC(scan_header_data->if_num_channels, scan_header_data->num_ifs);
@@ -273,13 +266,13 @@ int read_scan_header(struct scan_header_data *scan_header_data) {
     MALLOC(scan_header_data->if_stokes_names, scan_header_data->num_ifs);
     
     for (i = 0; i < scan_header_data->num_ifs; i++) {
-      scan_header_data->if_centre_freq[i] = FREQUENCYMHZ(i);
-      scan_header_data->if_bandwidth[i] = BANDWIDTHMHZ(i);
-      scan_header_data->if_num_channels[i] = NCHANNELS(i);
-      scan_header_data->if_num_stokes[i] = NSTOKES(i);
-      scan_header_data->if_sideband[i] = SIDEBAND(i);
-      scan_header_data->if_chain[i] = CHAIN(i);
-      scan_header_data->if_label[i] = LABEL(i);
+      scan_header_data->if_centre_freq[i] = FREQUENCYMHZ(rpfits_file, i);
+      scan_header_data->if_bandwidth[i] = BANDWIDTHMHZ(rpfits_file, i);
+      scan_header_data->if_num_channels[i] = NCHANNELS(rpfits_file, i);
+      scan_header_data->if_num_stokes[i] = NSTOKES(rpfits_file, i);
+      scan_header_data->if_sideband[i] = SIDEBAND(rpfits_file, i);
+      scan_header_data->if_chain[i] = CHAIN(rpfits_file, i);
+      scan_header_data->if_label[i] = LABEL(rpfits_file, i);
       MALLOC(scan_header_data->if_name[i], 3);
       // The first name is the simple indicator like f1 or f3.
       MALLOC(scan_header_data->if_name[i][0], 8);
@@ -314,28 +307,28 @@ int read_scan_header(struct scan_header_data *scan_header_data) {
       }
       nfound_chain[scan_header_data->if_chain[i] - 1] += 1;
       
-      MALLOC(scan_header_data->if_stokes_names[i], NSTOKES(i));
-      for (j = 0; j < NSTOKES(i); j++) {
+      MALLOC(scan_header_data->if_stokes_names[i], NSTOKES(rpfits_file, i));
+      for (j = 0; j < NSTOKES(rpfits_file, i); j++) {
         MALLOC(scan_header_data->if_stokes_names[i][j], 3);
         (void)strncpy(scan_header_data->if_stokes_names[i][j],
-                      CSTOKES(i, j), 2);
+                      CSTOKES(rpfits_file, i, j), 2);
         scan_header_data->if_stokes_names[i][j][2] = '\0';
       }
     }
-    scan_header_data->num_ants = anten_.nant;
+    scan_header_data->num_ants = rpfits_file->nant;
     MALLOC(scan_header_data->ant_label, scan_header_data->num_ants);
     MALLOC(scan_header_data->ant_name, scan_header_data->num_ants);
     MALLOC(scan_header_data->ant_cartesian, scan_header_data->num_ants);
     for (i = 0; i < scan_header_data->num_ants; i++) {
-      scan_header_data->ant_label[i] = ANTNUM(i);
+      scan_header_data->ant_label[i] = ANTNUM(rpfits_file, i);
       MALLOC(scan_header_data->ant_name[i], 9);
       scan_header_data->ant_name[i][8] = '\0';
       (void)strncpy(scan_header_data->ant_name[i],
-		    ANTSTATION(i), 8);
+		    ANTSTATION(rpfits_file, i), 8);
       MALLOC(scan_header_data->ant_cartesian[i], 3);
-      scan_header_data->ant_cartesian[i][0] = ANTX(i);
-      scan_header_data->ant_cartesian[i][1] = ANTY(i);
-      scan_header_data->ant_cartesian[i][2] = ANTZ(i);
+      scan_header_data->ant_cartesian[i][0] = ANTX(rpfits_file, i);
+      scan_header_data->ant_cartesian[i][1] = ANTY(rpfits_file, i);
+      scan_header_data->ant_cartesian[i][2] = ANTZ(rpfits_file, i);
     }
 
     // We read the data if there is data to read.
@@ -349,10 +342,10 @@ int read_scan_header(struct scan_header_data *scan_header_data) {
     keep_reading = READER_EXHAUSTED;
   } else if (this_jstat == JSTAT_FGTABLE) {
     // We've found the flagging table.
-    printf("READER: found %d flag groups\n", fg_.n_fg);
+    printf("READER: found flag table\n");
     
-  } else if (rpfits_result == 0) {
-    fprintf(stderr, "While reading header, rpfitsin encountered an error\n");
+  } else if (this_jstat == JSTAT_UNSUCCESSFUL) {
+    fprintf(stderr, "While reading header, the reader encountered an error\n");
   }
 
   FREE(nfound_chain);
@@ -384,6 +377,11 @@ struct cycle_data* prepare_new_cycle_data(void) {
   cycle_data->if_no = NULL;
   cycle_data->source_no = NULL;
   /* cycle_data->source = NULL; */
+  cycle_data->max_points = 0;
+  cycle_data->vis_slab = NULL;
+  cycle_data->wgt_slab = NULL;
+  cycle_data->slab_length = 0;
+  cycle_data->slab_used = 0;
   cycle_data->num_cal_ifs = 0;
   cycle_data->num_cal_ants = 0;
   cycle_data->cal_ifs = NULL;
@@ -392,6 +390,9 @@ struct cycle_data* prepare_new_cycle_data(void) {
   cycle_data->tsys_applied = NULL;
   cycle_data->computed_tsys = NULL;
   cycle_data->computed_tsys_applied = NULL;
+  cycle_data->tsys_scale = NULL;
+  cycle_data->tsys_scale_num_ifs = 0;
+  cycle_data->tsys_scale_num_stokes = 0;
   cycle_data->xyphase = NULL;
   cycle_data->xyamp = NULL;
   cycle_data->parangle = NULL;
@@ -530,15 +531,14 @@ void free_cycle_data(struct cycle_data *cycle_data) {
   FREE(cycle_data->bin);
   FREE(cycle_data->if_no);
   FREE(cycle_data->source_no);
-  for (i = 0; i < cycle_data->num_points; i++) {
-    /* FREE(cycle_data->source[i]); */
-    FREE(cycle_data->vis[i]);
-    FREE(cycle_data->wgt[i]);
-  }
   /* FREE(cycle_data->source); */
   FREE(cycle_data->vis_size);
+  // The vis and wgt arrays point into the slabs.
   FREE(cycle_data->vis);
   FREE(cycle_data->wgt);
+  FREE(cycle_data->vis_slab);
+  FREE(cycle_data->wgt_slab);
+  FREE(cycle_data->tsys_scale);
 
   FREE(cycle_data->cal_ifs);
   FREE(cycle_data->cal_ants);
@@ -619,9 +619,70 @@ void free_scan_data(struct scan_data *scan_data) {
   FREE(scan_data);
 }
 
+/**
+ *  \brief Make sure that the per-point arrays in a cycle_data structure are
+ *         large enough
+ *  \param cycle_data the cycle_data structure
+ *  \param num_points the number of points the arrays need to be able to hold
+ *
+ * The arrays at least double in size each time they need to grow, so that
+ * filling a cycle point by point only needs a few reallocations.
+ */
+static void cycle_data_reserve_points(struct cycle_data *cycle_data, int num_points) {
+  int new_max;
+
+  if (num_points <= cycle_data->max_points) {
+    return;
+  }
+  new_max = (num_points > (2 * cycle_data->max_points)) ? num_points :
+    (2 * cycle_data->max_points);
+  REALLOC(cycle_data->u, new_max);
+  REALLOC(cycle_data->v, new_max);
+  REALLOC(cycle_data->w, new_max);
+  REALLOC(cycle_data->ant1, new_max);
+  REALLOC(cycle_data->ant2, new_max);
+  REALLOC(cycle_data->flag, new_max);
+  REALLOC(cycle_data->vis_size, new_max);
+  REALLOC(cycle_data->vis, new_max);
+  REALLOC(cycle_data->wgt, new_max);
+  REALLOC(cycle_data->bin, new_max);
+  REALLOC(cycle_data->if_no, new_max);
+  REALLOC(cycle_data->source_no, new_max);
+  cycle_data->max_points = new_max;
+}
+
+/**
+ *  \brief Make sure that the visibility and weight slabs in a cycle_data
+ *         structure are large enough
+ *  \param cycle_data the cycle_data structure
+ *  \param length the number of values the slabs need to be able to hold
+ *
+ * If the slabs have to move, the vis and wgt pointers for each point already
+ * stored are updated to point into the new slabs.
+ */
+static void cycle_data_reserve_slab(struct cycle_data *cycle_data, size_t length) {
+  int i;
+  size_t new_length, offset;
+
+  if (length <= cycle_data->slab_length) {
+    return;
+  }
+  new_length = (length > (2 * cycle_data->slab_length)) ? length :
+    (2 * cycle_data->slab_length);
+  REALLOC(cycle_data->vis_slab, new_length);
+  REALLOC(cycle_data->wgt_slab, new_length);
+  cycle_data->slab_length = new_length;
+  for (i = 0, offset = 0; i < cycle_data->num_points; i++) {
+    cycle_data->vis[i] = cycle_data->vis_slab + offset;
+    cycle_data->wgt[i] = cycle_data->wgt_slab + offset;
+    offset += cycle_data->vis_size[i];
+  }
+}
+
 /**
  *  \brief This routine reads in a full cycle's worth of data, allocating
  *         memory as required
+ *  \param rpfits_file the context of the file being read
  *  \param scan_header_data a pointer to the scan_header_data structure
  *                          for this scan, but is currently unused
  *  \param cycle_data a pointer to the cycle_data structure to be filled
@@ -634,30 +695,51 @@ void free_scan_data(struct scan_data *scan_data) {
  *          - READER_EXHAUSTED: there is no further information in the currently
  *            opened file.
  */
-int read_cycle_data(struct scan_header_data *scan_header_data,
+int read_cycle_data(struct rpfits_file *rpfits_file,
+		    struct scan_header_data *scan_header_data,
                     struct cycle_data *cycle_data) {
-  int this_jstat = JSTAT_READDATA, read_data = 1, rpfits_result = 0;
+  int this_jstat = JSTAT_READDATA, read_data = 1;
   int flag, bin, if_no, sourceno, vis_size = 0, rv = READER_HEADER_AVAILABLE;
-  int baseline, ant1, ant2, i, bidx = 1, sif;
-  float *vis = NULL, *wgt = NULL, ut, last_ut = -1, u, v, w;
+  int baseline, ant1, ant2, i, bidx = 1, sif, max_vis_size, n, num_baselines;
+  float *wgt = NULL, ut, last_ut = -1, u, v, w;
   float complex *cvis = NULL;
+  size_t scan_vis_size = 0;
 
   // This is only here to prevent a compiler warning.
   if (scan_header_data == NULL) {
     return(-1);
   }
+
+  if (cycle_data->max_points == 0) {
+    // Size the storage from the scan header, so a typical cycle can be read
+    // without any further allocation.
+    num_baselines = (scan_header_data->num_ants * (scan_header_data->num_ants + 1)) / 2;
+    for (i = 0; i < scan_header_data->num_ifs; i++) {
+      scan_vis_size += (scan_header_data->if_num_channels[i] *
+			scan_header_data->if_num_stokes[i]);
+    }
+    cycle_data_reserve_points(cycle_data, num_baselines * scan_header_data->num_ifs);
+    cycle_data_reserve_slab(cycle_data, num_baselines * scan_vis_size);
+  }
+  max_vis_size = max_size_of_vis(rpfits_file);
   
   /* printf("reading data\n"); */
   while (read_data) {
-    // Allocate some memory.
-    vis_size = max_size_of_vis();
-    MALLOC(vis, 2 * vis_size);
-    CALLOC(wgt, vis_size);
+    // Make sure there's room for whichever IF comes next, and read the
+    // data straight into the slabs. A float complex has the same layout as
+    // an array of two floats (real then imaginary), so the reader's
+    // interleaved output is already the complex data we want.
+    cycle_data_reserve_slab(cycle_data, cycle_data->slab_used + max_vis_size);
+    cvis = cycle_data->vis_slab + cycle_data->slab_used;
+    wgt = cycle_data->wgt_slab + cycle_data->slab_used;
+    if (rpfits_file->data_format != 3) {
+      // No weights will be read.
+      memset(wgt, 0, max_vis_size * sizeof(float));
+    }
 
     // Read in the data.
-    this_jstat = JSTAT_READDATA;
-    rpfits_result = rpfitsin_(&this_jstat, vis, wgt, &baseline, &ut,
-			      &u, &v, &w, &flag, &bin, &if_no, &sourceno);
+    this_jstat = rpfitsio_read_data(rpfits_file, (float *)cvis, wgt, &baseline, &ut,
+				    &u, &v, &w, &flag, &bin, &if_no, &sourceno);
     /* printf("got read result %d %d for ut = %.6f baseline = %d\n", rpfits_result, */
     /* 	   this_jstat, ut, baseline); */
     if (last_ut == -1) {
@@ -669,12 +751,9 @@ int read_cycle_data(struct scan_header_data *scan_header_data,
     // Check for success.
     if (this_jstat != JSTAT_SUCCESSFUL) {
       /* printf("this isn't right... %d\n", this_jstat); */
-      FREE(vis);
-      FREE(wgt);
       // Stop reading.
       read_data = 0;
       if (this_jstat == JSTAT_ILLEGALDATA) {
-        /* printf("got illegal data, %d\n", fg_.n_fg); */
 	rv = READER_DATA_AVAILABLE;
       } else if (this_jstat == JSTAT_ENDOFFILE) {
         rv = READER_EXHAUSTED;
@@ -682,12 +761,10 @@ int read_cycle_data(struct scan_header_data *scan_header_data,
         // We've hit the end of this data.
         rv = READER_HEADER_AVAILABLE;
       } else if (this_jstat == JSTAT_HEADERNOTDATA) {
-        /* printf("READER: while reading data, hit a header with %d entries\n", */
-        /*        fg_.n_fg); */
         rv = READER_HEADER_AVAILABLE;
+      } else {
+	fprintf(stderr, "While reading data, the reader encountered an error\n");
       }
-    } else if (rpfits_result == 0) {
-      fprintf(stderr, "While reading data, rpfitsin encountered an error\n");
     } else {
       // Check if we need to set the header variables.
       if (scan_header_data->ut_seconds < 0) {
@@ -703,28 +780,28 @@ int read_cycle_data(struct scan_header_data *scan_header_data,
         cycle_data->num_cal_ifs = cycle_data->num_cal_ifs + 1;
         sif = cycle_data->num_cal_ifs - 1;
         REALLOC(cycle_data->cal_ifs, cycle_data->num_cal_ifs);
-        cycle_data->cal_ifs[sif] = SYSCAL_IF(0, 0);
+        cycle_data->cal_ifs[sif] = SYSCAL_IF(rpfits_file, 0, 0);
         if (cycle_data->num_cal_ifs == 1) {
           // We do a bunch of stuff only once.
           // The number of antennas is given by the header.
           // It will always be 1 less than the specified number since when it's
           // 0 it's actually presenting the additional syscal record.
-          cycle_data->num_cal_ants = SYSCAL_NUM_ANTS - 1;
-          MALLOC(cycle_data->cal_ants, (SYSCAL_NUM_ANTS - 1));
+          cycle_data->num_cal_ants = SYSCAL_NUM_ANTS(rpfits_file) - 1;
+          MALLOC(cycle_data->cal_ants, (SYSCAL_NUM_ANTS(rpfits_file) - 1));
           // Let's deal with the additional syscal record now, which is
           // just meteorological data.
-          if (SYSCAL_ADDITIONAL_CHECK == 0) {
+          if (SYSCAL_ADDITIONAL_CHECK(rpfits_file) == 0) {
             // The syscal data is formatted as we expect.
-            cycle_data->temperature = SYSCAL_ADDITIONAL_TEMP;
-            cycle_data->air_pressure = SYSCAL_ADDITIONAL_AIRPRESS;
-            cycle_data->humidity = SYSCAL_ADDITIONAL_HUMI;
-            cycle_data->wind_speed = SYSCAL_ADDITIONAL_WINDSPEED;
-            cycle_data->wind_direction = SYSCAL_ADDITIONAL_WINDDIR;
-            cycle_data->rain_gauge = SYSCAL_ADDITIONAL_RAIN;
-            cycle_data->weather_valid = SYSCAL_ADDITIONAL_WEATHERFLAG;
-            cycle_data->seemon_phase = SYSCAL_ADDITIONAL_SEEMON_PHASE;
-            cycle_data->seemon_rms = SYSCAL_ADDITIONAL_SEEMON_RMS;
-            cycle_data->seemon_valid = SYSCAL_ADDITIONAL_SEEMON_FLAG;
+            cycle_data->temperature = SYSCAL_ADDITIONAL_TEMP(rpfits_file);
+            cycle_data->air_pressure = SYSCAL_ADDITIONAL_AIRPRESS(rpfits_file);
+            cycle_data->humidity = SYSCAL_ADDITIONAL_HUMI(rpfits_file);
+            cycle_data->wind_speed = SYSCAL_ADDITIONAL_WINDSPEED(rpfits_file);
+            cycle_data->wind_direction = SYSCAL_ADDITIONAL_WINDDIR(rpfits_file);
+            cycle_data->rain_gauge = SYSCAL_ADDITIONAL_RAIN(rpfits_file);
+            cycle_data->weather_valid = SYSCAL_ADDITIONAL_WEATHERFLAG(rpfits_file);
+            cycle_data->seemon_phase = SYSCAL_ADDITIONAL_SEEMON_PHASE(rpfits_file);
+            cycle_data->seemon_rms = SYSCAL_ADDITIONAL_SEEMON_RMS(rpfits_file);
+            cycle_data->seemon_valid = SYSCAL_ADDITIONAL_SEEMON_FLAG(rpfits_file);
           }
         }
         // Do some array allocation.
@@ -774,30 +851,30 @@ int read_cycle_data(struct scan_header_data *scan_header_data,
         MALLOC(cycle_data->used_caljy_y[sif], cycle_data->num_cal_ants);
         MALLOC(cycle_data->flagging[sif], cycle_data->num_cal_ants);
         for (i = 0; i < cycle_data->num_cal_ants; i++) {
-          cycle_data->cal_ants[i] = SYSCAL_ANT(i, 0);
+          cycle_data->cal_ants[i] = SYSCAL_ANT(rpfits_file, i, 0);
           MALLOC(cycle_data->tsys[sif][i], 2);
           MALLOC(cycle_data->tsys_applied[sif][i], 2);
           CALLOC(cycle_data->computed_tsys[sif][i], 2);
           CALLOC(cycle_data->computed_tsys_applied[sif][i], 2);
-          cycle_data->tsys[sif][i][CAL_XX] = SYSCAL_TSYS_X(i, 0);
-          cycle_data->tsys[sif][i][CAL_YY] = SYSCAL_TSYS_Y(i, 0);
-          cycle_data->tsys_applied[sif][i][CAL_XX] = SYSCAL_TSYS_X_APPLIED(i, 0);
-          cycle_data->tsys_applied[sif][i][CAL_YY] = SYSCAL_TSYS_Y_APPLIED(i, 0);
+          cycle_data->tsys[sif][i][CAL_XX] = SYSCAL_TSYS_X(rpfits_file, i, 0);
+          cycle_data->tsys[sif][i][CAL_YY] = SYSCAL_TSYS_Y(rpfits_file, i, 0);
+          cycle_data->tsys_applied[sif][i][CAL_XX] = SYSCAL_TSYS_X_APPLIED(rpfits_file, i, 0);
+          cycle_data->tsys_applied[sif][i][CAL_YY] = SYSCAL_TSYS_Y_APPLIED(rpfits_file, i, 0);
           
-          cycle_data->xyphase[sif][i] = SYSCAL_XYPHASE(i, 0);
-          cycle_data->xyamp[sif][i] = SYSCAL_XYAMP(i, 0);
-          cycle_data->parangle[sif][i] = SYSCAL_PARANGLE(i, 0);
-          cycle_data->tracking_error_max[sif][i] = SYSCAL_TRACKERR_MAX(i, 0);
-          cycle_data->tracking_error_rms[sif][i] = SYSCAL_TRACKERR_RMS(i, 0);
-          cycle_data->gtp_x[sif][i] = SYSCAL_GTP_X(i, 0);
-          cycle_data->gtp_y[sif][i] = SYSCAL_GTP_Y(i, 0);
-          cycle_data->sdo_x[sif][i] = SYSCAL_SDO_X(i, 0);
-          cycle_data->sdo_y[sif][i] = SYSCAL_SDO_Y(i, 0);
-          cycle_data->caljy_x[sif][i] = SYSCAL_CALJY_X(i, 0);
-          cycle_data->caljy_y[sif][i] = SYSCAL_CALJY_Y(i, 0);
+          cycle_data->xyphase[sif][i] = SYSCAL_XYPHASE(rpfits_file, i, 0);
+          cycle_data->xyamp[sif][i] = SYSCAL_XYAMP(rpfits_file, i, 0);
+          cycle_data->parangle[sif][i] = SYSCAL_PARANGLE(rpfits_file, i, 0);
+          cycle_data->tracking_error_max[sif][i] = SYSCAL_TRACKERR_MAX(rpfits_file, i, 0);
+          cycle_data->tracking_error_rms[sif][i] = SYSCAL_TRACKERR_RMS(rpfits_file, i, 0);
+          cycle_data->gtp_x[sif][i] = SYSCAL_GTP_X(rpfits_file, i, 0);
+          cycle_data->gtp_y[sif][i] = SYSCAL_GTP_Y(rpfits_file, i, 0);
+          cycle_data->sdo_x[sif][i] = SYSCAL_SDO_X(rpfits_file, i, 0);
+          cycle_data->sdo_y[sif][i] = SYSCAL_SDO_Y(rpfits_file, i, 0);
+          cycle_data->caljy_x[sif][i] = SYSCAL_CALJY_X(rpfits_file, i, 0);
+          cycle_data->caljy_y[sif][i] = SYSCAL_CALJY_Y(rpfits_file, i, 0);
           cycle_data->used_caljy_x[sif][i] = cycle_data->caljy_x[sif][i];
           cycle_data->used_caljy_y[sif][i] = cycle_data->caljy_y[sif][i];
-          cycle_data->flagging[sif][i] = SYSCAL_FLAG_BAD(i, 0);
+          cycle_data->flagging[sif][i] = SYSCAL_FLAG_BAD(rpfits_file, i, 0);
         }
         if (ut > (last_ut + 0.5)) {
           // We've gone to a new cycle.
@@ -805,41 +882,38 @@ int read_cycle_data(struct scan_header_data *scan_header_data,
           rv = READER_HEADER_AVAILABLE | READER_DATA_AVAILABLE;
           read_data = 0;
         }
-        FREE(wgt);
       } else {
         // Store this data.
+        cycle_data_reserve_points(cycle_data, cycle_data->num_points + 1);
+        n = cycle_data->num_points;
         cycle_data->num_points += 1;
         base_to_ants(baseline, &ant1, &ant2);
         if (cycle_data->all_baselines[baseline] == 0) {
           cycle_data->all_baselines[baseline] = bidx;
           bidx += 1;
         }
-        ARRAY_APPEND(cycle_data->u, cycle_data->num_points, u);
-        ARRAY_APPEND(cycle_data->v, cycle_data->num_points, v);
-        ARRAY_APPEND(cycle_data->w, cycle_data->num_points, w);
-        ARRAY_APPEND(cycle_data->ant1, cycle_data->num_points, ant1);
-        ARRAY_APPEND(cycle_data->ant2, cycle_data->num_points, ant2);
-        ARRAY_APPEND(cycle_data->flag, cycle_data->num_points, flag);
-        ARRAY_APPEND(cycle_data->bin, cycle_data->num_points, bin);
-        ARRAY_APPEND(cycle_data->if_no, cycle_data->num_points, if_no);
-        ARRAY_APPEND(cycle_data->vis_size, cycle_data->num_points, vis_size);
+        vis_size = size_of_if_vis(rpfits_file, if_no);
+        cycle_data->u[n] = u;
+        cycle_data->v[n] = v;
+        cycle_data->w[n] = w;
+        cycle_data->ant1[n] = ant1;
+        cycle_data->ant2[n] = ant2;
+        cycle_data->flag[n] = flag;
+        cycle_data->bin[n] = bin;
+        cycle_data->if_no[n] = if_no;
+        cycle_data->vis_size[n] = vis_size;
         /* // We have to do something special for the source name. */
         /* REALLOC(cycle_data->source, cycle_data->num_points); */
         /* MALLOC(cycle_data->source[cycle_data->num_points - 1], SOURCE_LENGTH); */
-        /* string_copy(SOURCENAME(sourceno), SOURCE_LENGTH, */
+        /* string_copy(SOURCENAME(rpfits_file, sourceno), SOURCE_LENGTH, */
         /*             cycle_data->source[cycle_data->num_points - 1]); */
-	ARRAY_APPEND(cycle_data->source_no, cycle_data->num_points, (sourceno - 1));
-        // Convert the vis array read into complex numbers.
-        MALLOC(cvis, vis_size);
-        for (i = 0; i < vis_size; i++) {
-          cvis[i] = vis[i * 2] + vis[(i * 2) + 1] * I;
-        }
+	cycle_data->source_no[n] = sourceno - 1;
         // Keep a pointer to the vis and weight data.
-        ARRAY_APPEND(cycle_data->vis, cycle_data->num_points, cvis);
+        cycle_data->vis[n] = cvis;
         // Weight is not used for CABB RPFITS, but we keep this here.
-        ARRAY_APPEND(cycle_data->wgt, cycle_data->num_points, wgt);
+        cycle_data->wgt[n] = wgt;
+        cycle_data->slab_used += vis_size;
       }
-      FREE(vis);
     }
   }
 
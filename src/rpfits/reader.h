@@ -12,13 +12,14 @@
 
 #pragma once
 #include "atrpfits.h"
+#include "rpfitsio.h"
 
 /* RPFITS commands numerical definitions to make the code more readable */
 /*! \def JSTAT_OPENFILE
  *  \brief Magic number used to open an RPFITS file.
  *
  * This parameter is given as this_jstat in calls to rpfitsin_ to get the
- * RPFITS library to open the file specified in names_.file.
+ * RPFITS library to open the specified file.
  */
 #define JSTAT_OPENFILE -3
 /*! \def JSTAT_OPENFILE_READHEADER
@@ -26,7 +27,7 @@
  *         first header in that file.
  *
  * This parameter is given as this_jstat in calls to rpfitsin_ to get the
- * RPFITS library to open the file specified in names_.file and read the
+ * RPFITS library to open the specified file and read the
  * first header.
  */
 #define JSTAT_OPENFILE_READHEADER -2
@@ -98,197 +99,217 @@
 
 /* Macros to get information. */
 /*! \def SOURCENAME
- *  \brief Get the name of source \a s from the RPFITS variables.
+ *  \brief Get the name of source \a s from the RPFITS file.
+ *  \param r pointer to the rpfits_file structure of the file being read
  *  \param s the number of the source (starts at 0)
  *  \return a pointer to the start of the source name string
  *
  * A convenience macro to determine the pointer location to obtain the
- * name of the source with number \a s from the RPFITS variables, after
+ * name of the source with number \a s from the RPFITS file, after
  * reading in the header.
  */
-#define SOURCENAME(s) names_.su_name + (s) * SOURCE_LENGTH
+#define SOURCENAME(r, s) (r)->su_name[s]
 /*! \def RIGHTASCENSION
- *  \brief Get the right ascension of source \a s from the RPFITS variables.
+ *  \brief Get the right ascension of source \a s from the RPFITS file.
+ *  \param r pointer to the rpfits_file structure of the file being read
  *  \param s the number of the source (starts at 0)
  *  \return right ascension of the source in radians [double]
  *
  * A convenience macro to retrieve the Right Ascension of source with
- * number \a s from the RPFITS variables, after reading in the header.
+ * number \a s from the RPFITS file, after reading in the header.
  */
-#define RIGHTASCENSION(s) doubles_.su_ra[s]
+#define RIGHTASCENSION(r, s) (r)->su_ra[s]
 /*! \def DECLINATION
- *  \brief Get the right ascension of source \a s from the RPFITS variables.
+ *  \brief Get the right ascension of source \a s from the RPFITS file.
+ *  \param r pointer to the rpfits_file structure of the file being read
  *  \param s the number of the source (starts at 0)
  *  \return right ascension of the source in radians [double]
  *
  * A convenience macro to retrieve the Declination of source with
- * number \a s from the RPFITS variables, after reading in the header.
+ * number \a s from the RPFITS file, after reading in the header.
  */
-#define DECLINATION(s) doubles_.su_dec[s]
+#define DECLINATION(r, s) (r)->su_dec[s]
 /*! \def CALCODE
- *  \brief Get the calibrator code of source \a s from the RPFITS variables.
+ *  \brief Get the calibrator code of source \a s from the RPFITS file.
+ *  \param r pointer to the rpfits_file structure of the file being read
  *  \param s the number of the source (starts at 0)
  *  \return a pointer to the start of the calibrator code string
  *
  * A convenience macro to determine the pointer location to obtain the
- * calibrator code of the source with number \a s from the RPFITS variables,
+ * calibrator code of the source with number \a s from the RPFITS file,
  * after reading in the header.
  */
-#define CALCODE(s) names_.su_cal + (s) * CALCODE_LENGTH
+#define CALCODE(r, s) (r)->su_cal[s]
 /*! \def FREQUENCYMHZ
- *  \brief Get the central frequency of IF \a f from the RPFITS variables.
+ *  \brief Get the central frequency of IF \a f from the RPFITS file.
+ *  \param r pointer to the rpfits_file structure of the file being read
  *  \param f the number of the IF (starts at 0)
  *  \return central frequency of the IF in MHz [double]
  *
  * A convenience macro to retrieve the frequency at the centre of the IF with
- * number \a f from the RPFITS variables, after reading in the header.
+ * number \a f from the RPFITS file, after reading in the header.
  */
-#define FREQUENCYMHZ(f) doubles_.if_freq[f] / 1e6
+#define FREQUENCYMHZ(r, f) (r)->if_freq[f] / 1e6
 /*! \def BANDWIDTHMHZ
- *  \brief Get the total bandwidth of IF \a f from the RPFITS variables.
+ *  \brief Get the total bandwidth of IF \a f from the RPFITS file.
+ *  \param r pointer to the rpfits_file structure of the file being read
  *  \param f the number of the IF (starts at 0)
  *  \return total bandwidth of the IF in MHz [double]
  *
  * A convenience macro to retrieve the total bandwidth of the IF with
- * number \a f from the RPFITS variables, after reading in the header.
+ * number \a f from the RPFITS file, after reading in the header.
  */
-#define BANDWIDTHMHZ(f) doubles_.if_bw[f] / 1e6
+#define BANDWIDTHMHZ(r, f) (r)->if_bw[f] / 1e6
 /*! \def NCHANNELS
- *  \brief Get the number of channels in IF \a f from the RPFITS variables.
+ *  \brief Get the number of channels in IF \a f from the RPFITS file.
+ *  \param r pointer to the rpfits_file structure of the file being read
  *  \param f the number of the IF (starts at 0)
  *  \return number of channels in the IF [int]
  *
  * A convenience macro to retrieve the number of channels in the IF with
- * number \a f from the RPFITS variables, after reading in the header.
+ * number \a f from the RPFITS file, after reading in the header.
  */
-#define NCHANNELS(f) if_.if_nfreq[f]
+#define NCHANNELS(r, f) (r)->if_nfreq[f]
 /*! \def NSTOKES
- *  \brief Get the number of Stokes parameters in IF \a f from the RPFITS variables.
+ *  \brief Get the number of Stokes parameters in IF \a f from the RPFITS file.
+ *  \param r pointer to the rpfits_file structure of the file being read
  *  \param f the number of the IF (starts at 0)
  *  \return number of Stokes parameters in the IF [int]
  *
  * A convenience macro to retrieve the number of Stokes parameters in the IF with
- * number \a f from the RPFITS variables, after reading in the header.
+ * number \a f from the RPFITS file, after reading in the header.
  */
-#define NSTOKES(f) if_.if_nstok[f]
+#define NSTOKES(r, f) (r)->if_nstok[f]
 /*! \def SIDEBAND
- *  \brief Get a flag representing the sideband of IF \a f from the RPFITS variables.
+ *  \brief Get a flag representing the sideband of IF \a f from the RPFITS file.
+ *  \param r pointer to the rpfits_file structure of the file being read
  *  \param f the number of the IF (starts at 0)
  *  \return either +1 for USB IF, or -1 for LSB IF [int]
  *
  * A convenience macro to retrieve the sideband inversion factor for the IF with
- * number \a f from the RPFITS variables, after reading in the header.
+ * number \a f from the RPFITS file, after reading in the header.
  */
-#define SIDEBAND(f) if_.if_invert[f]
+#define SIDEBAND(r, f) (r)->if_invert[f]
 /*! \def CHAIN
  *  \brief Get the number of the RF signal chain used to produce the IF \a f
- *         from the RPFITS variables
+ *         from the RPFITS file
+ *  \param r pointer to the rpfits_file structure of the file being read
  *  \param f the number of the IF (starts at 0)
  *  \return the RF signal chain number, which starts at 1 [int]
  *
  * A convenience macro to retrieve the RF signal chain number used to produce the
- * IF with number \a f from the RPFITS variables, after reading in the header.
+ * IF with number \a f from the RPFITS file, after reading in the header.
  */
-#define CHAIN(f) if_.if_chain[f]
+#define CHAIN(r, f) (r)->if_chain[f]
 /*! \def LABEL
- *  \brief Get the assigned number of the IF \a f from the RPFITS variables
+ *  \brief Get the assigned number of the IF \a f from the RPFITS file
+ *  \param r pointer to the rpfits_file structure of the file being read
  *  \param f the number of the IF (starts at 0)
  *  \return the assigned IF number, which starts at 1 [int]
  *
  * A convenience macro to retrieve the assigned IF number for the
- * IF with number \a f from the RPFITS variables, after reading in the header.
+ * IF with number \a f from the RPFITS file, after reading in the header.
  */
-#define LABEL(f) if_.if_num[f]
+#define LABEL(r, f) (r)->if_num[f]
 /*! \def CSTOKES
  *  \brief Get the name for the \a s Stokes parameter in IF \a f from the
  *         RPFITS variables
+ *  \param r pointer to the rpfits_file structure of the file being read
  *  \param f the number of the IF (starts at 0)
  *  \param s the number of the Stokes parameter (starts at 0)
  *  \return a pointer to the start of the Stokes parameter string
  *
  * A convenience macro to determine the pointer location to obtain the
  * Stokes parameter name for the parameter with number \a s in the IF with
- * number \a f from the RPFITS variables, after reading in the header.
+ * number \a f from the RPFITS file, after reading in the header.
  */
-#define CSTOKES(f,s) names_.if_cstok + (s * 2 + f * 4 * 2)
+#define CSTOKES(r, f, s) (r)->if_cstok[f][s]
 /*! \def ANTNUM
- *  \brief Get the assigned number of the antenna \a a from the RPFITS variables
+ *  \brief Get the assigned number of the antenna \a a from the RPFITS file
+ *  \param r pointer to the rpfits_file structure of the file being read
  *  \param a the number of the antenna (starts at 0)
  *  \return the assigned number of the antenna, which starts at 1 [int]
  *
  * A convenience macro to retrieve the assigned antenna number for the antenna
- * with number \a a from the RPFITS variables, after reading in the header.
+ * with number \a a from the RPFITS file, after reading in the header.
  */
-#define ANTNUM(a) anten_.ant_num[a]
+#define ANTNUM(r, a) (r)->ant_num[a]
 /*! \def ANTSTATION
  *  \brief Get the name of the station that antenna \a a is connected to from
- *         the RPFITS variables
+ *         the RPFITS file
+ *  \param r pointer to the rpfits_file structure of the file being read
  *  \param a the number of the antenna (starts at 0)
  *  \return a pointer to the start of the station name string
  *
  * A convenience macro to determine the pointer location to obtain the station
- * name that the antenna with number \a a is connected to from the RPFITS variables,
+ * name that the antenna with number \a a is connected to from the RPFITS file,
  * after reading in the header.
  */
-#define ANTSTATION(a) names_.sta + (a * 8)
+#define ANTSTATION(r, a) (r)->sta[a]
 /*! \def ANTX
- *  \brief Get the X-coordinate of the antenna \a a from the RPFITS variables
+ *  \brief Get the X-coordinate of the antenna \a a from the RPFITS file
+ *  \param r pointer to the rpfits_file structure of the file being read
  *  \param a the number of the antenna (starts at 0)
  *  \return the X-coordinate of the position of antenna \a a on the WGS84
  *          Cartesian plane, in m [double]
  *
  * A convenience macro to retrieve the position of the antenna with number \a a
- * from the RPFITS variables, after reading in the header. To get the full position
+ * from the RPFITS file, after reading in the header. To get the full position
  * this macro needs to be used along with two others.
  */
-#define ANTX(a) doubles_.x[a]
+#define ANTX(r, a) (r)->x[a]
 /*! \def ANTY
- *  \brief Get the Y-coordinate of the antenna \a a from the RPFITS variables
+ *  \brief Get the Y-coordinate of the antenna \a a from the RPFITS file
+ *  \param r pointer to the rpfits_file structure of the file being read
  *  \param a the number of the antenna (starts at 0)
  *  \return the Y-coordinate of the position of antenna \a a on the WGS84
  *          Cartesian plane, in m [double]
  *
  * A convenience macro to retrieve the position of the antenna with number \a a
- * from the RPFITS variables, after reading in the header. To get the full position
+ * from the RPFITS file, after reading in the header. To get the full position
  * this macro needs to be used along with two others.
  */
-#define ANTY(a) doubles_.y[a]
+#define ANTY(r, a) (r)->y[a]
 /*! \def ANTZ
- *  \brief Get the Z-coordinate of the antenna \a a from the RPFITS variables
+ *  \brief Get the Z-coordinate of the antenna \a a from the RPFITS file
+ *  \param r pointer to the rpfits_file structure of the file being read
  *  \param a the number of the antenna (starts at 0)
  *  \return the Z-coordinate of the position of antenna \a a on the WGS84
  *          Cartesian plane, in m [double]
  *
  * A convenience macro to retrieve the position of the antenna with number \a a
- * from the RPFITS variables, after reading in the header. To get the full position
+ * from the RPFITS file, after reading in the header. To get the full position
  * this macro needs to be used along with two others.
  */
-#define ANTZ(a) doubles_.z[a]
+#define ANTZ(r, a) (r)->z[a]
 
 /* These macros allow for easier interrogation of the SYSCAL table. */
 /*! \def SYSCAL_NUM_ANTS
  *  \brief Get the number of antennas represented in the SYSCAL table from the
  *         RPFITS variables
+ *  \param r pointer to the rpfits_file structure of the file being read
  *  \return the number of antennas in the SYSCAL table [int]
  *
  * A convenience macro to retrieve the number of antennas that the SYSCAL table
  * contains information about. This will only return a non-zero number if the SYSCAL
  * table has just been read. This macro is here only to make the code more readable.
  */
-#define SYSCAL_NUM_ANTS   sc_.sc_ant
+#define SYSCAL_NUM_ANTS(r)   (r)->sc_ant
 /*! \def SYSCAL_NUM_IFS
  *  \brief Get the number of IFs represented in the SYSCAL table from the
  *         RPFITS variables
+ *  \param r pointer to the rpfits_file structure of the file being read
  *  \return the number of IFs in the SYSCAL table [int]
  *
  * A convenience macro to retrieve the number of IFs that the SYSCAL table
  * contains information about. This will only return a non-zero number if the SYSCAL
  * table has just been read. This macro is here only to make the code more readable.
  */
-#define SYSCAL_NUM_IFS    sc_.sc_if
+#define SYSCAL_NUM_IFS(r)    (r)->sc_if
 /*! \def SYSCAL_NUM_PARAMS
  *  \brief Get the number of parameters represented in the SYSCAL table from the
  *         RPFITS variables
+ *  \param r pointer to the rpfits_file structure of the file being read
  *  \return the number of parameters in the SYSCAL table [int]
  *
  * A convenience macro to retrieve the number of parameters that the SYSCAL table
@@ -296,46 +317,50 @@
  * table has just been read. This macro is here only to make the code more readable.
  * A SYSCAL parameter is something like Tsys, or parallactic angle etc.
  */
-#define SYSCAL_NUM_PARAMS sc_.sc_q
+#define SYSCAL_NUM_PARAMS(r) (r)->sc_q
 /*! \def SYSCAL_GRP
  *  \brief Get the array index for the SYSCAL parameters pertaining to antenna
  *         \a a and IF \a i
+ *  \param r pointer to the rpfits_file structure of the file being read
  *  \param a the number of the antenna (starts at 0)
  *  \param i the number of the IF (starts at 0)
  *  \return the array index at the start of the SYSCAL record for antenna \a a
  *          and IF \a i
  *
- * Convenience macro to index the SYSCAL array from the RPFITS variables. Since
+ * Convenience macro to index the SYSCAL array from the RPFITS file. Since
  * the SYSCAL array is a single flat array, the index depends on how many IFs are
  * present, how many parameters are presented, and which antenna and IF is desired.
  * This macro is here only to make the code more readable.
  */
-#define SYSCAL_GRP(a, i) (a * (SYSCAL_NUM_IFS * SYSCAL_NUM_PARAMS) + i * SYSCAL_NUM_PARAMS)
+#define SYSCAL_GRP(r, a, i) ((a) * (SYSCAL_NUM_IFS(r) * SYSCAL_NUM_PARAMS(r)) + (i) * SYSCAL_NUM_PARAMS(r))
 /*! \def SYSCAL_PARAM
  *  \brief Get the parameter value for the SYCAL parameter with index \a o pertaining 
  *         to antenna \a a and IF \a i
+ *  \param r pointer to the rpfits_file structure of the file being read
  *  \param a the number of the antenna (starts at 0)
  *  \param i the number of the IF (starts at 0)
  *  \param o the number of the parameter (starts at 0)
  *  \return the value of SYSCAL parameter with index \a o for antenna \a a and IF \a i [float]
  *  
- * Convenience macro to return SYSCAL parameter values from the RPFITS variables.
+ * Convenience macro to return SYSCAL parameter values from the RPFITS file.
  * This macro is here only to make the code a lot more readable.
  */
-#define SYSCAL_PARAM(a, i, o) (sc_.sc_cal[SYSCAL_GRP(a, i) + o])
+#define SYSCAL_PARAM(r, a, i, o) ((r)->sc_cal[SYSCAL_GRP(r, a, i) + o])
 /*! \def SYSCAL_ANT
  *  \brief Get the assigned antenna number for the SYSCAL parameter pertaining to
  *         antenna \a a and IF \a i
+ *  \param r pointer to the rpfits_file structure of the file being read
  *  \param a the number of the antenna (starts at 0)
  *  \param i the number of the IF (starts at 0)
  *  \return the assigned antenna number (starts at 1) [int]
  *
  * Convenience macro to return the assigned antenna number for a particular SYSCAL entry.
  */
-#define SYSCAL_ANT(a, i) (int)SYSCAL_PARAM(a, i, 0)
+#define SYSCAL_ANT(r, a, i) (int)SYSCAL_PARAM(r, a, i, 0)
 /*! \def SYSCAL_IF
  *  \brief Get the assigned IF number for the SYSCAL parameter pertaining to
  *         antenna \a a and IF \a i
+ *  \param r pointer to the rpfits_file structure of the file being read
  *  \param a the number of the antenna (starts at 0)
  *  \param i the number of the IF (starts at 0)
  *  \return the assigned IF number (starts at 1) [int]
@@ -343,10 +368,11 @@
  * Convenience macro to return the assigned IF number for a particular SYSCAL entry.
  * This macro will only return a valid value if the SYSCAL table has just been read.
  */
-#define SYSCAL_IF(a, i) (int)SYSCAL_PARAM(a, i, 1)
+#define SYSCAL_IF(r, a, i) (int)SYSCAL_PARAM(r, a, i, 1)
 /*! \def SYSCAL_XYPHASE
  *  \brief Get the phase between the X and Y polarisations from the SYSCAL parameter 
  *         pertaining to antenna \a a and IF \a i
+ *  \param r pointer to the rpfits_file structure of the file being read
  *  \param a the number of the antenna (starts at 0)
  *  \param i the number of the IF (starts at 0)
  *  \return the phase between the X and Y polarisations, as measured by the correlator,
@@ -356,10 +382,11 @@
  * antenna \a a and IF \a i.
  * This macro will only return a valid value if the SYSCAL table has just been read.
  */
-#define SYSCAL_XYPHASE(a, i) SYSCAL_PARAM(a, i, 2)
+#define SYSCAL_XYPHASE(r, a, i) SYSCAL_PARAM(r, a, i, 2)
 /*! \def SYSCAL_TSYS_X
  *  \brief Get the system temperature of the X polarisation from the SYSCAL parameter 
  *         pertaining to antenna \a a and IF \a i
+ *  \param r pointer to the rpfits_file structure of the file being read
  *  \param a the number of the antenna (starts at 0)
  *  \param i the number of the IF (starts at 0)
  *  \return the system temperature of the X polarisation, as measured by the correlator,
@@ -369,10 +396,11 @@
  * for a specified antenna \a a and IF \a i.
  * This macro will only return a valid value if the SYSCAL table has just been read.
  */
-#define SYSCAL_TSYS_X(a, i) fabsf(SYSCAL_PARAM(a, i, 3))
+#define SYSCAL_TSYS_X(r, a, i) fabsf(SYSCAL_PARAM(r, a, i, 3))
 /*! \def SYSCAL_TSYS_Y
  *  \brief Get the system temperature of the Y polarisation from the SYSCAL parameter 
  *         pertaining to antenna \a a and IF \a i
+ *  \param r pointer to the rpfits_file structure of the file being read
  *  \param a the number of the antenna (starts at 0)
  *  \param i the number of the IF (starts at 0)
  *  \return the system temperature of the Y polarisation, as measured by the correlator,
@@ -382,10 +410,11 @@
  * for a specified antenna \a a and IF \a i.
  * This macro will only return a valid value if the SYSCAL table has just been read.
  */
-#define SYSCAL_TSYS_Y(a, i) fabsf(SYSCAL_PARAM(a, i, 4))
+#define SYSCAL_TSYS_Y(r, a, i) fabsf(SYSCAL_PARAM(r, a, i, 4))
 /*! \def SYSCAL_TSYS_X_APPLIED
  *  \brief Get a flag of whether the X-pol Tsys has been applied to the data pertaining
  *         to antenna \a a and IF \a i
+ *  \param r pointer to the rpfits_file structure of the file being read
  *  \param a the number of the antenna (starts at 0)
  *  \param i the number of the IF (starts at 0)
  *  \return an indication of whether the Tsys has been applied to the X-pol data
@@ -395,10 +424,11 @@
  * data according to the measured system temperature for the specified antenna \a a and
  * IF \a i. This macro will only return a valid value if the SYSCAL table has just been read.
  */
-#define SYSCAL_TSYS_X_APPLIED(a, i) (SYSCAL_PARAM(a, i, 3) < 0) ? SYSCAL_TSYS_NOT_APPLIED : SYSCAL_TSYS_APPLIED
+#define SYSCAL_TSYS_X_APPLIED(r, a, i) (SYSCAL_PARAM(r, a, i, 3) < 0) ? SYSCAL_TSYS_NOT_APPLIED : SYSCAL_TSYS_APPLIED
 /*! \def SYSCAL_TSYS_Y_APPLIED
  *  \brief Get a flag of whether the Y-pol Tsys has been applied to the data pertaining
  *         to antenna \a a and IF \a i
+ *  \param r pointer to the rpfits_file structure of the file being read
  *  \param a the number of the antenna (starts at 0)
  *  \param i the number of the IF (starts at 0)
  *  \return an indication of whether the Tsys has been applied to the Y-pol data
@@ -408,10 +438,11 @@
  * data according to the measured system temperature for the specified antenna \a a and
  * IF \a i. This macro will only return a valid value if the SYSCAL table has just been read.
  */
-#define SYSCAL_TSYS_Y_APPLIED(a, i) (SYSCAL_PARAM(a, i, 4) < 0) ? SYSCAL_TSYS_NOT_APPLIED : SYSCAL_TSYS_APPLIED
+#define SYSCAL_TSYS_Y_APPLIED(r, a, i) (SYSCAL_PARAM(r, a, i, 4) < 0) ? SYSCAL_TSYS_NOT_APPLIED : SYSCAL_TSYS_APPLIED
 /*! \def SYSCAL_GTP_X
  *  \brief Get the gated total power (GTP) calculated by the correlator pertaining
  *         to antenna \a a and IF \a i for the X polarisation
+ *  \param r pointer to the rpfits_file structure of the file being read
  *  \param a the number of the antenna (starts at 0)
  *  \param i the number of the IF (starts at 0)
  *  \return the correlator-measured X-pol GTP
@@ -419,10 +450,11 @@
  * Convenience macro to return the X-pol gated total power for the specified antenna \a a and
  * IF \a i. This macro will only return a valid value if the SYSCAL table has just been read.
  */
-#define SYSCAL_GTP_X(a, i) SYSCAL_PARAM(a, i, 5)
+#define SYSCAL_GTP_X(r, a, i) SYSCAL_PARAM(r, a, i, 5)
 /*! \def SYSCAL_SDO_X
  *  \brief Get the synchronously-demodulated output (SDO) calculated by the correlator 
  *         pertaining to antenna \a a and IF \a i for the X polarisation
+ *  \param r pointer to the rpfits_file structure of the file being read
  *  \param a the number of the antenna (starts at 0)
  *  \param i the number of the IF (starts at 0)
  *  \return the correlator-measured X-pol SDO
@@ -431,10 +463,11 @@
  * antenna \a a and IF \a i. This macro will only return a valid value if the SYSCAL table 
  * has just been read.
  */
-#define SYSCAL_SDO_X(a, i) SYSCAL_PARAM(a, i, 6)
+#define SYSCAL_SDO_X(r, a, i) SYSCAL_PARAM(r, a, i, 6)
 /*! \def SYSCAL_CALJY_X
  *  \brief Get the assumed strength of the noise diode pertaining to antenna \a a and 
  *         IF \a i for the X polarisation
+ *  \param r pointer to the rpfits_file structure of the file being read
  *  \param a the number of the antenna (starts at 0)
  *  \param i the number of the IF (starts at 0)
  *  \return the correlator-assumed X-pol noise diode amplitude [Jy]
@@ -444,10 +477,11 @@
  * antenna \a a and IF \a i. This macro will only return a valid value if the SYSCAL table 
  * has just been read.
  */
-#define SYSCAL_CALJY_X(a, i) SYSCAL_PARAM(a, i, 7)
+#define SYSCAL_CALJY_X(r, a, i) SYSCAL_PARAM(r, a, i, 7)
 /*! \def SYSCAL_GTP_Y
  *  \brief Get the gated total power (GTP) calculated by the correlator pertaining
  *         to antenna \a a and IF \a i for the Y polarisation
+ *  \param r pointer to the rpfits_file structure of the file being read
  *  \param a the number of the antenna (starts at 0)
  *  \param i the number of the IF (starts at 0)
  *  \return the correlator-measured Y-pol GTP
@@ -455,10 +489,11 @@
  * Convenience macro to return the Y-pol gated total power for the specified antenna \a a and
  * IF \a i. This macro will only return a valid value if the SYSCAL table has just been read.
  */
-#define SYSCAL_GTP_Y(a, i) SYSCAL_PARAM(a, i, 8)
+#define SYSCAL_GTP_Y(r, a, i) SYSCAL_PARAM(r, a, i, 8)
 /*! \def SYSCAL_SDO_Y
  *  \brief Get the synchronously-demodulated output (SDO) calculated by the correlator 
  *         pertaining to antenna \a a and IF \a i for the Y polarisation
+ *  \param r pointer to the rpfits_file structure of the file being read
  *  \param a the number of the antenna (starts at 0)
  *  \param i the number of the IF (starts at 0)
  *  \return the correlator-measured Y-pol SDO
@@ -467,10 +502,11 @@
  * antenna \a a and IF \a i. This macro will only return a valid value if the SYSCAL table 
  * has just been read.
  */
-#define SYSCAL_SDO_Y(a, i) SYSCAL_PARAM(a, i, 9)
+#define SYSCAL_SDO_Y(r, a, i) SYSCAL_PARAM(r, a, i, 9)
 /*! \def SYSCAL_CALJY_Y
  *  \brief Get the assumed strength of the noise diode pertaining to antenna \a a and 
  *         IF \a i for the Y polarisation
+ *  \param r pointer to the rpfits_file structure of the file being read
  *  \param a the number of the antenna (starts at 0)
  *  \param i the number of the IF (starts at 0)
  *  \return the correlator-assumed Y-pol noise diode amplitude [Jy]
@@ -480,10 +516,11 @@
  * antenna \a a and IF \a i. This macro will only return a valid value if the SYSCAL table 
  * has just been read.
  */
-#define SYSCAL_CALJY_Y(a, i) SYSCAL_PARAM(a, i, 10)
+#define SYSCAL_CALJY_Y(r, a, i) SYSCAL_PARAM(r, a, i, 10)
 /*! \def SYSCAL_PARANGLE
  *  \brief Get the parallactic angle of the cycle with regards the antenna \a a and IF
  *         \a i
+ *  \param r pointer to the rpfits_file structure of the file being read
  *  \param a the number of the antenna (starts at 0)
  *  \param i the number of the IF (starts at 0)
  *  \return the parallactic angle [deg]
@@ -492,10 +529,11 @@
  * current cycle, for the specified antenna \a a and IF \a i. This macro will only return
  * a valid value if the SYSCAL table has just been read.
  */
-#define SYSCAL_PARANGLE(a, i) SYSCAL_PARAM(a, i, 11)
+#define SYSCAL_PARANGLE(r, a, i) SYSCAL_PARAM(r, a, i, 11)
 /*! \def SYSCAL_FLAG_BAD
  *  \brief Get an indicator of whether this data has been flagged bad for the antenna
  *         \a a and IF \a i
+ *  \param r pointer to the rpfits_file structure of the file being read
  *  \param a the number of the antenna (starts at 0)
  *  \param i the number of the IF (starts at 0)
  *  \return a bitwise OR indication that the data in this cycle is bad for the reason:
@@ -507,10 +545,11 @@
  * current cycle, for the specified antenna \a a and IF \a i. This macro will only return
  * a valid value if the SYSCAL table has just been read.
  */
-#define SYSCAL_FLAG_BAD(a, i) (int)SYSCAL_PARAM(a, i, 12)
+#define SYSCAL_FLAG_BAD(r, a, i) (int)SYSCAL_PARAM(r, a, i, 12)
 /*! \def SYSCAL_XYAMP
  *  \brief Get the XY-amplitude measured by the correlator for this the cycle pertaining
  *         to the antenna \a a and IF \a i
+ *  \param r pointer to the rpfits_file structure of the file being read
  *  \param a the number of the antenna (starts at 0)
  *  \param i the number of the IF (starts at 0)
  *  \return the XY-amplitude [Jy]
@@ -519,10 +558,11 @@
  * current cycle, for the specified antenna \a a and IF \a i. This macro will only return
  * a valid value if the SYSCAL table has just been read.
  */
-#define SYSCAL_XYAMP(a, i) SYSCAL_PARAM(a, i, 13)
+#define SYSCAL_XYAMP(r, a, i) SYSCAL_PARAM(r, a, i, 13)
 /*! \def SYSCAL_TRACKERR_MAX
  *  \brief Get the maximum tracking error of antenna \a a (and IF \a i, but this should
  *         of course be invariant) observed during this cycle
+ *  \param r pointer to the rpfits_file structure of the file being read
  *  \param a the number of the antenna (starts at 0)
  *  \param i the number of the IF (starts at 0)
  *  \return the maximum tracking error [arcsec]
@@ -531,10 +571,11 @@
  * current cycle, for the specified antenna \a a and IF \a i. This macro will only return
  * a valid value if the SYSCAL table has just been read.
  */
-#define SYSCAL_TRACKERR_MAX(a, i) SYSCAL_PARAM(a, i, 14)
+#define SYSCAL_TRACKERR_MAX(r, a, i) SYSCAL_PARAM(r, a, i, 14)
 /*! \def SYSCAL_TRACKERR_RMS
  *  \brief Get the RMS tracking error of antenna \a a (and IF \a i, but this should
  *         of course be invariant) observed during this cycle
+ *  \param r pointer to the rpfits_file structure of the file being read
  *  \param a the number of the antenna (starts at 0)
  *  \param i the number of the IF (starts at 0)
  *  \return the RMS tracking error [arcsec]
@@ -543,12 +584,13 @@
  * current cycle, for the specified antenna \a a and IF \a i. This macro will only return
  * a valid value if the SYSCAL table has just been read.
  */
-#define SYSCAL_TRACKERR_RMS(a, i) SYSCAL_PARAM(a, i, 15)
+#define SYSCAL_TRACKERR_RMS(r, a, i) SYSCAL_PARAM(r, a, i, 15)
 
 /* These next macros will work if SYSCAL_ADDITIONAL_CHECK returns 0. */
 /*! \def SYSCAL_ADDITIONAL_CHECK
  *  \brief Return a check flag for whether the SYSCAL record just read corresponds
  *         to an RPFITS additional SYSCAL record, which carries different information
+ *  \param r pointer to the rpfits_file structure of the file being read
  *  \return 0 if the SYSCAL record just read matches the additional record, or not
  *          0 otherwise
  *
@@ -558,93 +600,103 @@
  * it must be the additional record. If that is the case, all the SYSCAL_ADDITIONAL_*
  * convenience macros can be used, otherwise the SYSCAL_* macros should be used.
  */
-#define SYSCAL_ADDITIONAL_CHECK (int)SYSCAL_PARAM((SYSCAL_NUM_ANTS - 1), (SYSCAL_NUM_IFS - 1), 0)
+#define SYSCAL_ADDITIONAL_CHECK(r) (int)SYSCAL_PARAM(r, (SYSCAL_NUM_ANTS(r) - 1), (SYSCAL_NUM_IFS(r) - 1), 0)
 /*! \def SYSCAL_ADDITIONAL_TEMP
  *  \brief Return the temperature as recorded by the site weather station for this
  *         cycle
+ *  \param r pointer to the rpfits_file structure of the file being read
  *  \return the site ambient temperature [C]
  *
  * Convenience macro to obtain the ambient temperature on site during this cycle.
  */
-#define SYSCAL_ADDITIONAL_TEMP SYSCAL_PARAM((SYSCAL_NUM_ANTS - 1), (SYSCAL_NUM_IFS - 1), 1)
+#define SYSCAL_ADDITIONAL_TEMP(r) SYSCAL_PARAM(r, (SYSCAL_NUM_ANTS(r) - 1), (SYSCAL_NUM_IFS(r) - 1), 1)
 /*! \def SYSCAL_ADDITIONAL_AIRPRESS
  *  \brief Return the air pressure as recorded by the site weather station for this
  *         cycle
+ *  \param r pointer to the rpfits_file structure of the file being read
  *  \return the site air pressure [mBar]
  *
  * Convenience macro to obtain the air pressure on site during this cycle.
  */
-#define SYSCAL_ADDITIONAL_AIRPRESS SYSCAL_PARAM((SYSCAL_NUM_ANTS - 1), (SYSCAL_NUM_IFS - 1), 2)
+#define SYSCAL_ADDITIONAL_AIRPRESS(r) SYSCAL_PARAM(r, (SYSCAL_NUM_ANTS(r) - 1), (SYSCAL_NUM_IFS(r) - 1), 2)
 /*! \def SYSCAL_ADDITIONAL_HUMI
  *  \brief Return the relative humidity as recorded by the site weather station for this
  *         cycle
+ *  \param r pointer to the rpfits_file structure of the file being read
  *  \return the site relative humidity [%]
  *
  * Convenience macro to obtain the relative humidity on site during this cycle.
  */
-#define SYSCAL_ADDITIONAL_HUMI SYSCAL_PARAM((SYSCAL_NUM_ANTS - 1), (SYSCAL_NUM_IFS - 1), 3)
+#define SYSCAL_ADDITIONAL_HUMI(r) SYSCAL_PARAM(r, (SYSCAL_NUM_ANTS(r) - 1), (SYSCAL_NUM_IFS(r) - 1), 3)
 /*! \def SYSCAL_ADDITIONAL_WINDSPEED
  *  \brief Return the wind speed as recorded by the site weather station for this
  *         cycle
+ *  \param r pointer to the rpfits_file structure of the file being read
  *  \return the site wind speed [km/h]
  *
  * Convenience macro to obtain the wind speed on site during this cycle.
  */
-#define SYSCAL_ADDITIONAL_WINDSPEED SYSCAL_PARAM((SYSCAL_NUM_ANTS - 1), (SYSCAL_NUM_IFS - 1), 4)
+#define SYSCAL_ADDITIONAL_WINDSPEED(r) SYSCAL_PARAM(r, (SYSCAL_NUM_ANTS(r) - 1), (SYSCAL_NUM_IFS(r) - 1), 4)
 /*! \def SYSCAL_ADDITIONAL_WINDDIR
  *  \brief Return the wind direction as recorded by the site weather station for this
  *         cycle
+ *  \param r pointer to the rpfits_file structure of the file being read
  *  \return the site wind direction [deg]
  *
  * Convenience macro to obtain the direction of the wind on site during this cycle.
  */
-#define SYSCAL_ADDITIONAL_WINDDIR SYSCAL_PARAM((SYSCAL_NUM_ANTS - 1), (SYSCAL_NUM_IFS - 1), 5)
+#define SYSCAL_ADDITIONAL_WINDDIR(r) SYSCAL_PARAM(r, (SYSCAL_NUM_ANTS(r) - 1), (SYSCAL_NUM_IFS(r) - 1), 5)
 /*! \def SYSCAL_ADDITIONAL_WEATHERFLAG
  *  \brief Return a flag to indicate if the additional SYSCAL weather parameters are
  *         valid for this cycle
+ *  \param r pointer to the rpfits_file structure of the file being read
  *  \return SYSCAL_VALID if the weather parameters are valid for this cycle, or
  *          SYSCAL_INVALID if they are not
  *
  * Convenience macro to signal whether the weather station parameters recorded for this cycle
  * are valid and useful.
  */
-#define SYSCAL_ADDITIONAL_WEATHERFLAG (int)SYSCAL_PARAM((SYSCAL_NUM_ANTS - 1), (SYSCAL_NUM_IFS - 1), 6)
+#define SYSCAL_ADDITIONAL_WEATHERFLAG(r) (int)SYSCAL_PARAM(r, (SYSCAL_NUM_ANTS(r) - 1), (SYSCAL_NUM_IFS(r) - 1), 6)
 /*! \def SYSCAL_ADDITIONAL_RAIN
  *  \brief Return the rain gauge value as recorded by the site weather station for this
  *         cycle
+ *  \param r pointer to the rpfits_file structure of the file being read
  *  \return the amount of rain in the rain gauge [mm]
  *
  * Convenience macro to obtain the amount of rain in the rain gauge during this cycle.
  */
-#define SYSCAL_ADDITIONAL_RAIN SYSCAL_PARAM((SYSCAL_NUM_ANTS - 1), (SYSCAL_NUM_IFS - 1), 7)
+#define SYSCAL_ADDITIONAL_RAIN(r) SYSCAL_PARAM(r, (SYSCAL_NUM_ANTS(r) - 1), (SYSCAL_NUM_IFS(r) - 1), 7)
 /*! \def SYSCAL_ADDITIONAL_SEEMON_PHASE
  *  \brief Return the average phase value as recorded by the site atmospheric seeing monitor 
  *         for this cycle
+ *  \param r pointer to the rpfits_file structure of the file being read
  *  \return the atmospheric seeing monitor average phase [rad]
  *
  * Convenience macro to obtain the average phase of the satellite observed by the atmospheric 
  * seeing monitor during this cycle.
  */
-#define SYSCAL_ADDITIONAL_SEEMON_PHASE SYSCAL_PARAM((SYSCAL_NUM_ANTS - 1), (SYSCAL_NUM_IFS - 1), 8)
+#define SYSCAL_ADDITIONAL_SEEMON_PHASE(r) SYSCAL_PARAM(r, (SYSCAL_NUM_ANTS(r) - 1), (SYSCAL_NUM_IFS(r) - 1), 8)
 /*! \def SYSCAL_ADDITIONAL_SEEMON_RMS
  *  \brief Return the RMS phase variation observed by the site atmospheric seeing monitor for this
  *         cycle
+ *  \param r pointer to the rpfits_file structure of the file being read
  *  \return the atmospheric seeing monitor RMS phase variation [rad]
  *
  * Convenience macro to obtain the RMS phase variation of the satellite observed by the 
  * atmospheric seeing monitor during this cycle.
  */
-#define SYSCAL_ADDITIONAL_SEEMON_RMS SYSCAL_PARAM((SYSCAL_NUM_ANTS - 1), (SYSCAL_NUM_IFS - 1), 9)
+#define SYSCAL_ADDITIONAL_SEEMON_RMS(r) SYSCAL_PARAM(r, (SYSCAL_NUM_ANTS(r) - 1), (SYSCAL_NUM_IFS(r) - 1), 9)
 /*! \def SYSCAL_ADDITIONAL_SEEMON_FLAG
  *  \brief Return a flag to indicate if the additional SYSCAL seeing monitor parameters are
  *         valid for this cycle
+ *  \param r pointer to the rpfits_file structure of the file being read
  *  \return SYSCAL_VALID if the seeing monitor parameters are valid for this cycle, or
  *          SYSCAL_INVALID if they are not
  *
  * Convenience macro to signal whether the atmospheric seeing monitor parameters recorded for 
  * this cycle are valid and useful.
  */
-#define SYSCAL_ADDITIONAL_SEEMON_FLAG (int)SYSCAL_PARAM((SYSCAL_NUM_ANTS - 1), (SYSCAL_NUM_IFS - 1), 10)
+#define SYSCAL_ADDITIONAL_SEEMON_FLAG(r) (int)SYSCAL_PARAM(r, (SYSCAL_NUM_ANTS(r) - 1), (SYSCAL_NUM_IFS(r) - 1), 10)
 
 // Return values from the read routines.
 /*! \def READER_EXHAUSTED
@@ -664,20 +716,23 @@
  */
 #define READER_HEADER_AVAILABLE 2
 
-int size_of_vis(void);
-int size_of_if_vis(int if_no);
-int max_size_of_vis(void);
-int open_rpfits_file(char *filename);
-int close_rpfits_file(void);
+int size_of_vis(struct rpfits_file *rpfits_file);
+int size_of_if_vis(struct rpfits_file *rpfits_file, int if_no);
+int max_size_of_vis(struct rpfits_file *rpfits_file);
+int open_rpfits_file(char *filename, struct rpfits_file **rpfits_file);
+int close_rpfits_file(struct rpfits_file *rpfits_file);
 void string_copy(char *start, int length, char *dest);
-void get_card_value(char *header_name, char *value, int value_maxlength);
-int read_scan_header(struct scan_header_data *scan_header_data);
+void get_card_value(struct rpfits_file *rpfits_file, char *header_name,
+		    char *value, int value_maxlength);
+int read_scan_header(struct rpfits_file *rpfits_file,
+		     struct scan_header_data *scan_header_data);
 struct cycle_data* prepare_new_cycle_data(void);
 struct scan_data* prepare_new_scan_data(void);
 struct cycle_data* scan_add_cycle(struct scan_data *scan_data);
 void free_scan_header_data(struct scan_header_data *scan_header_data);
 void free_cycle_data(struct cycle_data *cycle_data);
 void free_scan_data(struct scan_data *scan_data);
-int read_cycle_data(struct scan_header_data *scan_header_data,
+int read_cycle_data(struct rpfits_file *rpfits_file,
+		    struct scan_header_data *scan_header_data,
 		    struct cycle_data *cycle_data);
 //int generate_rpfits_index(struct rpfits_index *rpfits_index);
@@ -0,0 +1,1306 @@
+/** \file rpfitsio.c
+ *  \brief A native C decoder for RPFITS files
+ *
+ * ATCA Training Library
+ * (C) Jamie Stevens CSIRO 2020
+ *
+ * This module reads RPFITS headers and data groups in the same way as the
+ * RPFITSIN routine from the Fortran RPFITS library, but keeps all of its
+ * state in a rpfits_file structure instead of global common blocks. The
+ * return codes are the JSTAT_* magic numbers used by RPFITSIN.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "rpfitsio.h"
+#include "reader.h"
+#include "memory.h"
+
+/*! \def RECORD_OK
+ *  \brief Return value from read_record when a record was read successfully
+ */
+#define RECORD_OK 0
+/*! \def RECORD_EOF
+ *  \brief Return value from read_record when the end of the file was reached
+ */
+#define RECORD_EOF -1
+/*! \def RECORD_ERROR
+ *  \brief Return value from read_record when an I/O error occurred
+ */
+#define RECORD_ERROR 1
+
+/*! \def TABLE_NONE
+ *  \brief Header parsing state: not in a table
+ */
+#define TABLE_NONE 0
+/*! \def TABLE_AN
+ *  \brief Header parsing state: in the antenna table
+ */
+#define TABLE_AN   1
+/*! \def TABLE_IF
+ *  \brief Header parsing state: in the IF table
+ */
+#define TABLE_IF   2
+/*! \def TABLE_SU
+ *  \brief Header parsing state: in the source table
+ */
+#define TABLE_SU   3
+/*! \def TABLE_SX
+ *  \brief Header parsing state: in the extended source table
+ */
+#define TABLE_SX   4
+/*! \def TABLE_OTHER
+ *  \brief Header parsing state: in a table we don't need to decode
+ */
+#define TABLE_OTHER 5
+
+/*!
+ *  \brief Convert a 4-byte VAX F_floating number into a native float
+ *  \param b pointer to the 4 bytes as they appear in the file
+ *  \return the floating point value
+ *
+ * This is the C equivalent of the RV2L routine from the RPFITS library, and
+ * maps the VAX reserved operand to NaN and overflows to signed infinity.
+ */
+static float vax_real(const unsigned char *b) {
+  unsigned char n[4];
+  uint32_t u;
+  float f;
+
+  // Put the bytes in natural order.
+  n[0] = b[1];
+  n[1] = b[0];
+  n[2] = b[3];
+  n[3] = b[2];
+
+  if ((n[0] == 0x80) && (n[1] < 0x80)) {
+    // VAX reserved operand, set to NaN.
+    n[0] = 0xff;
+    n[1] = 0xff;
+    n[2] = 0;
+    n[3] = 0;
+  } else if ((n[1] >= 0x80) && ((n[0] == 0x7f) || (n[0] == 0xff))) {
+    // Overflow, set to signed infinity.
+    n[1] = 0x80;
+    n[2] = 0;
+    n[3] = 0;
+  } else if ((n[0] == 0) && (n[1] < 0x80)) {
+    // VAX zero.
+    n[1] = 0;
+    n[2] = 0;
+    n[3] = 0;
+  } else {
+    // Scale VAX to IEEE.
+    n[0] -= 1;
+  }
+
+  u = ((uint32_t)n[0] << 24) | ((uint32_t)n[1] << 16) |
+    ((uint32_t)n[2] << 8) | (uint32_t)n[3];
+  memcpy(&f, &u, sizeof(float));
+  return(f);
+}
+
+/*!
+ *  \brief Convert a 4-byte VAX integer into a native integer
+ *  \param b pointer to the 4 bytes as they appear in the file
+ *  \return the integer value
+ */
+static int vax_int(const unsigned char *b) {
+  uint32_t u;
+
+  u = (uint32_t)b[0] | ((uint32_t)b[1] << 8) |
+    ((uint32_t)b[2] << 16) | ((uint32_t)b[3] << 24);
+  return((int32_t)u);
+}
+
+/*!
+ *  \brief Get the floating point value of a word in a record buffer
+ *  \param buffer the record buffer
+ *  \param idx the word index, starting at 0
+ *  \return the floating point value
+ */
+static float word_real(const unsigned char *buffer, int idx) {
+  return(vax_real(buffer + 4 * idx));
+}
+
+/*!
+ *  \brief Get the integer value of a word in a record buffer
+ *  \param buffer the record buffer
+ *  \param idx the word index, starting at 0
+ *  \return the integer value
+ */
+static int word_int(const unsigned char *buffer, int idx) {
+  return(vax_int(buffer + 4 * idx));
+}
+
+/*!
+ *  \brief Map the whole of an open file into memory, replacing any existing
+ *         mapping
+ *  \param rpfits_file the file context
+ *  \return JSTAT_SUCCESSFUL, or JSTAT_UNSUCCESSFUL if the file could not be
+ *          mapped, in which case any existing mapping is left alone
+ */
+static int map_file(struct rpfits_file *rpfits_file) {
+  struct stat st;
+  void *map = NULL;
+
+  if ((fstat(fileno(rpfits_file->fh), &st) != 0) || (st.st_size <= 0)) {
+    return(JSTAT_UNSUCCESSFUL);
+  }
+  if ((rpfits_file->map != NULL) &&
+      ((size_t)st.st_size == rpfits_file->map_length)) {
+    // Nothing has changed.
+    return(JSTAT_SUCCESSFUL);
+  }
+  // We only ever read the mapping, so it doesn't need to be shared.
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(rpfits_file->fh), 0);
+  if (map == MAP_FAILED) {
+    return(JSTAT_UNSUCCESSFUL);
+  }
+  if (rpfits_file->map != NULL) {
+    munmap(rpfits_file->map, rpfits_file->map_length);
+  }
+  rpfits_file->map = map;
+  rpfits_file->map_length = st.st_size;
+  (void)madvise(rpfits_file->map, rpfits_file->map_length,
+		((rpfits_file->map_access == RPFITSIO_ACCESS_RANDOM) ?
+		 MADV_RANDOM : MADV_SEQUENTIAL));
+
+  return(JSTAT_SUCCESSFUL);
+}
+
+/*!
+ *  \brief Read the next record from the file, or the record that was
+ *         pushed back by unread_record
+ *  \param rpfits_file the file context
+ *  \param dest the buffer to fill, which must be RPFITS_RECORD_LENGTH long
+ *  \return RECORD_OK, RECORD_EOF or RECORD_ERROR
+ */
+static int read_record(struct rpfits_file *rpfits_file, unsigned char *dest) {
+  size_t nread = 0;
+
+  if (rpfits_file->reread) {
+    memcpy(dest, rpfits_file->saved, RPFITS_RECORD_LENGTH);
+    rpfits_file->buffer_offset = rpfits_file->saved_offset;
+    rpfits_file->reread = false;
+    return(RECORD_OK);
+  }
+
+  if (rpfits_file->map != NULL) {
+    if (((rpfits_file->map_position + RPFITS_RECORD_LENGTH) >
+	 (long)rpfits_file->map_length) &&
+	((map_file(rpfits_file) != JSTAT_SUCCESSFUL) ||
+	 ((rpfits_file->map_position + RPFITS_RECORD_LENGTH) >
+	  (long)rpfits_file->map_length))) {
+      // The file hasn't grown since we mapped it, so this is the end.
+      return(RECORD_EOF);
+    }
+    rpfits_file->buffer_offset = rpfits_file->map_position;
+    memcpy(dest, rpfits_file->map + rpfits_file->map_position, RPFITS_RECORD_LENGTH);
+    rpfits_file->map_position += RPFITS_RECORD_LENGTH;
+    return(RECORD_OK);
+  }
+
+  rpfits_file->buffer_offset = ftell(rpfits_file->fh);
+  nread = fread(dest, 1, RPFITS_RECORD_LENGTH, rpfits_file->fh);
+  if (nread != RPFITS_RECORD_LENGTH) {
+    // A partial record is treated as the end of the file, just like AT_READ.
+    return(ferror(rpfits_file->fh) ? RECORD_ERROR : RECORD_EOF);
+  }
+
+  return(RECORD_OK);
+}
+
+/*!
+ *  \brief Push the current record buffer back so it will be returned by the
+ *         next read_record
+ *  \param rpfits_file the file context
+ */
+static void unread_record(struct rpfits_file *rpfits_file) {
+  memcpy(rpfits_file->saved, rpfits_file->buffer, RPFITS_RECORD_LENGTH);
+  rpfits_file->saved_offset = rpfits_file->buffer_offset;
+  rpfits_file->reread = true;
+}
+
+/*!
+ *  \brief Check whether a record is the start of a header or flag table
+ *  \param buffer the record buffer
+ *  \return JSTAT_HEADERNOTDATA if this record starts a header, JSTAT_FGTABLE if
+ *          it starts a flag table, or JSTAT_SUCCESSFUL otherwise
+ */
+static int simple(const unsigned char *buffer) {
+  if (strncmp((const char *)buffer, "SIMPLE", 6) == 0) {
+    return(JSTAT_HEADERNOTDATA);
+  } else if (strncmp((const char *)buffer, "FG TABLE", 8) == 0) {
+    return(JSTAT_FGTABLE);
+  }
+  return(JSTAT_SUCCESSFUL);
+}
+
+/*!
+ *  \brief Read a new record into the file's buffer during data reading, and
+ *         check that it doesn't begin a header
+ *  \param rpfits_file the file context
+ *  \return JSTAT_SUCCESSFUL if the record contains data, or the JSTAT code to
+ *          return to the caller otherwise
+ */
+static int next_data_record(struct rpfits_file *rpfits_file) {
+  int rres, jstat;
+
+  rres = read_record(rpfits_file, rpfits_file->buffer);
+  if (rres == RECORD_EOF) {
+    return(JSTAT_ENDOFFILE);
+  } else if (rres != RECORD_OK) {
+    fprintf(stderr, "[rpfitsio] I/O error reading data\n");
+    return(JSTAT_UNSUCCESSFUL);
+  }
+
+  jstat = simple(rpfits_file->buffer);
+  if (jstat != JSTAT_SUCCESSFUL) {
+    unread_record(rpfits_file);
+  }
+  return(jstat);
+}
+
+/*!
+ *  \brief Copy a fixed-width field from a header card
+ *  \param card the header card
+ *  \param start the first character of the field, starting at 0
+ *  \param width the number of characters in the field
+ *  \param dest the destination, which must be at least \a width + 1 long,
+ *              and will be null-terminated
+ */
+static void card_field(const char *card, int start, int width, char *dest) {
+  memcpy(dest, card + start, width);
+  dest[width] = 0;
+}
+
+/*!
+ *  \brief Read an integer from a fixed-width field in a header card
+ *  \param card the header card
+ *  \param start the first character of the field, starting at 0
+ *  \param width the number of characters in the field
+ *  \return the integer value, or 0 if the field is blank
+ */
+static int card_int(const char *card, int start, int width) {
+  char field[RPFITS_CARD_LENGTH + 1];
+
+  card_field(card, start, width, field);
+  return((int)strtol(field, NULL, 10));
+}
+
+/*!
+ *  \brief Read a floating point number from a fixed-width field in a header card
+ *  \param card the header card
+ *  \param start the first character of the field, starting at 0
+ *  \param width the number of characters in the field
+ *  \return the floating point value, or 0 if the field is blank
+ */
+static double card_double(const char *card, int start, int width) {
+  char field[RPFITS_CARD_LENGTH + 1];
+  int i;
+
+  card_field(card, start, width, field);
+  // Fortran allows D as the exponent character.
+  for (i = 0; i < width; i++) {
+    if ((field[i] == 'D') || (field[i] == 'd')) {
+      field[i] = 'E';
+    }
+  }
+  return(strtod(field, NULL));
+}
+
+/*!
+ *  \brief Copy a fixed-width field from a header card into a blank-padded
+ *         character array
+ *  \param card the header card
+ *  \param start the first character of the field, starting at 0
+ *  \param width the number of characters in the field
+ *  \param dest the destination character array
+ *  \param dest_length the length of the destination array
+ */
+static void card_chars(const char *card, int start, int width,
+		       char *dest, int dest_length) {
+  int i;
+
+  for (i = 0; i < dest_length; i++) {
+    dest[i] = (i < width) ? card[start + i] : ' ';
+  }
+}
+
+/*!
+ *  \brief Check if the keyword of a header card matches a given keyword
+ *  \param card the header card
+ *  \param keyword the keyword to compare against, which is compared as if
+ *                 it were padded with blanks to 8 characters
+ *  \return true if the keyword matches
+ */
+static bool keyword_is(const char *card, const char *keyword) {
+  int i, l = strlen(keyword);
+
+  for (i = 0; i < 8; i++) {
+    if (card[i] != ((i < l) ? keyword[i] : ' ')) {
+      return(false);
+    }
+  }
+  return(true);
+}
+
+/*!
+ *  \brief Check if the keyword of a header card starts with some string
+ *  \param card the header card
+ *  \param prefix the string to look for
+ *  \return true if the keyword starts with \a prefix
+ */
+static bool keyword_starts(const char *card, const char *prefix) {
+  return(strncmp(card, prefix, strlen(prefix)) == 0);
+}
+
+/*!
+ *  \brief Get the value of a header card in the same way as RPFITSIN
+ *  \param card the header card
+ *  \param keyvalue the destination, which must be at least 21 characters long
+ *
+ * If the value is a string, the quotes are removed.
+ */
+static void card_keyvalue(const char *card, char *keyvalue) {
+  int i;
+
+  if (card[10] == '\'') {
+    // Must be a character value.
+    card_field(card, 11, 20, keyvalue);
+    for (i = 0; i < 20; i++) {
+      if (keyvalue[i] == '\'') {
+	// Strip off the trailing apostrophe.
+	memset(keyvalue + i, ' ', 20 - i);
+	break;
+      }
+    }
+  } else {
+    card_field(card, 10, 20, keyvalue);
+  }
+}
+
+/*!
+ *  \brief Translate an observation date into YYYY-MM-DD form
+ *  \param olddate the date as it appears in the header
+ *  \param newdate the blank-padded 12 character destination
+ *
+ * This is the equivalent of the DATFIT routine from the RPFITS library,
+ * which fixes old dates in DD/MM/YY format.
+ */
+static void date_fit(const char *olddate, char *newdate) {
+  int iday, imon, iyear;
+  char tmp[16];
+
+  if (olddate[2] != '/') {
+    // New date format.
+    card_chars(olddate, 0, 10, newdate, 12);
+    return;
+  }
+  memcpy(tmp, olddate, 10);
+  tmp[10] = 0;
+  if ((strncmp(tmp + 6, "19", 2) == 0) && (tmp[8] != ' ')) {
+    // Convert DD/MM/YYYY (rare) to DD/MM/YY.
+    tmp[6] = tmp[8];
+    tmp[7] = tmp[9];
+  }
+  if (strncmp(tmp + 6, "**", 2) == 0) {
+    // Rescue bad dates written at Mopra in 2000.
+    tmp[6] = '0';
+    tmp[7] = '0';
+  }
+  tmp[8] = 0;
+  if (sscanf(tmp, "%2d/%2d/%2d", &iday, &imon, &iyear) != 3) {
+    return;
+  }
+  if ((imon < 1) || (imon > 12) || (iday < 1) || (iday > 31)) {
+    return;
+  }
+  if (iyear < 70) {
+    iyear += 100;
+  }
+  iyear += 1900;
+  (void)snprintf(tmp, sizeof(tmp), "%04d-%02d-%02d", iyear, imon, iday);
+  card_chars(tmp, 0, 10, newdate, 12);
+}
+
+/*!
+ *  \brief Open an RPFITS file for reading
+ *  \param filename the name of the file to open
+ *  \return a newly allocated file context, or NULL if the file cannot be
+ *          opened
+ *
+ * The context should be freed with rpfitsio_close when no longer required.
+ */
+struct rpfits_file* rpfitsio_open(char *filename) {
+  struct rpfits_file *rpfits_file = NULL;
+  FILE *fh = NULL;
+
+  if ((filename == NULL) || (filename[0] == 0)) {
+    return(NULL);
+  }
+  fh = fopen(filename, "rb");
+  if (fh == NULL) {
+    return(NULL);
+  }
+
+  CALLOC(rpfits_file, 1);
+  (void)snprintf(rpfits_file->filename, sizeof(rpfits_file->filename),
+		 "%s", filename);
+  rpfits_file->fh = fh;
+  rpfits_file->map = NULL;
+  rpfits_file->reread = false;
+  rpfits_file->bufptr = -1;
+
+  // Start with all the strings blank, like Fortran would.
+  memset(rpfits_file->datobs, ' ', sizeof(rpfits_file->datobs));
+  memset(rpfits_file->object, ' ', sizeof(rpfits_file->object));
+  memset(rpfits_file->obstype, ' ', sizeof(rpfits_file->obstype));
+  memset(rpfits_file->sta, ' ', sizeof(rpfits_file->sta));
+  memset(rpfits_file->if_cstok, ' ', sizeof(rpfits_file->if_cstok));
+  memset(rpfits_file->su_name, ' ', sizeof(rpfits_file->su_name));
+  memset(rpfits_file->su_cal, ' ', sizeof(rpfits_file->su_cal));
+
+  return(rpfits_file);
+}
+
+/*!
+ *  \brief Close an RPFITS file and free its context
+ *  \param rpfits_file the file context, which will be freed by this routine
+ *  \return JSTAT_SUCCESSFUL, or JSTAT_UNSUCCESSFUL if the file could not be
+ *          closed cleanly
+ */
+int rpfitsio_close(struct rpfits_file *rpfits_file) {
+  int rv = JSTAT_SUCCESSFUL;
+
+  if (rpfits_file == NULL) {
+    return(rv);
+  }
+  if (rpfits_file->map != NULL) {
+    munmap(rpfits_file->map, rpfits_file->map_length);
+  }
+  if ((rpfits_file->fh != NULL) && (fclose(rpfits_file->fh) != 0)) {
+    rv = JSTAT_UNSUCCESSFUL;
+  }
+  FREE(rpfits_file);
+
+  return(rv);
+}
+
+/*!
+ *  \brief Read an open RPFITS file through a memory mapping instead of stdio
+ *  \param rpfits_file the file context
+ *  \param access one of the RPFITSIO_ACCESS_* hints, describing how the file
+ *                will be read from now on
+ *  \return JSTAT_SUCCESSFUL, or JSTAT_UNSUCCESSFUL if the file could not be
+ *          mapped, in which case it continues to be read through stdio
+ *
+ * Reading through a mapping avoids a system call for every record, and lets
+ * several processes reading the same file share the page cache. If the file is
+ * already mapped, only the access hint is changed. Reading continues from the
+ * current position, and the mapping is extended if the file grows. A file which
+ * might be truncated or replaced while it is being read should not be mapped,
+ * since touching the mapping beyond the new end of the file raises SIGBUS.
+ */
+int rpfitsio_map(struct rpfits_file *rpfits_file, int access) {
+  bool first_map;
+
+  if ((rpfits_file == NULL) || (rpfits_file->fh == NULL)) {
+    return(JSTAT_UNSUCCESSFUL);
+  }
+  first_map = (rpfits_file->map == NULL);
+  if (!first_map && (rpfits_file->map_access != access)) {
+    rpfits_file->map_access = access;
+    (void)madvise(rpfits_file->map, rpfits_file->map_length,
+		  ((access == RPFITSIO_ACCESS_RANDOM) ? MADV_RANDOM : MADV_SEQUENTIAL));
+    return(JSTAT_SUCCESSFUL);
+  }
+  rpfits_file->map_access = access;
+  if (map_file(rpfits_file) != JSTAT_SUCCESSFUL) {
+    return(JSTAT_UNSUCCESSFUL);
+  }
+  if (first_map) {
+    // Carry on from wherever stdio had got to.
+    rpfits_file->map_position = ftell(rpfits_file->fh);
+  }
+
+  return(JSTAT_SUCCESSFUL);
+}
+
+/*!
+ *  \brief Get the current position of the reader in an RPFITS file
+ *  \param rpfits_file the file context
+ *  \return the byte offset in the file of the next word that will be read
+ *
+ * The position returned can be passed to rpfitsio_seek to return to this point
+ * later, as long as the same header is current at that time.
+ */
+long rpfitsio_tell(struct rpfits_file *rpfits_file) {
+  if ((rpfits_file->bufptr >= 0) &&
+      (rpfits_file->bufptr < RPFITS_RECORD_WORDS)) {
+    // We're partway through the current record.
+    return(rpfits_file->buffer_offset + 4 * rpfits_file->bufptr);
+  }
+  if (rpfits_file->reread) {
+    // The next record will be the one that was pushed back.
+    return(rpfits_file->saved_offset);
+  }
+  if (rpfits_file->map != NULL) {
+    return(rpfits_file->map_position);
+  }
+  return(ftell(rpfits_file->fh));
+}
+
+/*!
+ *  \brief Move the reader to a position in an RPFITS file
+ *  \param rpfits_file the file context
+ *  \param offset a byte offset previously obtained from rpfitsio_tell
+ *  \return JSTAT_SUCCESSFUL, or JSTAT_UNSUCCESSFUL if the position cannot
+ *          be reached
+ *
+ * To read data after seeking, the header describing that data must already
+ * have been read; the simplest way to ensure this is to first seek to the
+ * header_offset recorded when the header was read, and call
+ * rpfitsio_read_header.
+ */
+int rpfitsio_seek(struct rpfits_file *rpfits_file, long offset) {
+  long record_offset;
+
+  if ((rpfits_file == NULL) || (rpfits_file->fh == NULL) || (offset < 0)) {
+    return(JSTAT_UNSUCCESSFUL);
+  }
+  record_offset = offset - (offset % RPFITS_RECORD_LENGTH);
+  rpfits_file->reread = false;
+  rpfits_file->bufptr = -1;
+  if (rpfits_file->map != NULL) {
+    rpfits_file->map_position = record_offset;
+  } else if (fseek(rpfits_file->fh, record_offset, SEEK_SET) != 0) {
+    return(JSTAT_UNSUCCESSFUL);
+  }
+  if (offset > record_offset) {
+    // The position is within a record, so we need to load it now.
+    if (read_record(rpfits_file, rpfits_file->buffer) != RECORD_OK) {
+      return(JSTAT_UNSUCCESSFUL);
+    }
+    rpfits_file->bufptr = (offset - record_offset) / 4;
+  }
+
+  return(JSTAT_SUCCESSFUL);
+}
+
+/*!
+ *  \brief Decode a row of a table in the header
+ *  \param rpfits_file the file context
+ *  \param table the TABLE_* magic number of the table being read
+ *  \param card the header card containing the row
+ *  \return JSTAT_SUCCESSFUL, or JSTAT_UNSUCCESSFUL if the table has too many
+ *          entries
+ */
+static int read_table_row(struct rpfits_file *rpfits_file, int table,
+			  const char *card) {
+  int k, l, o;
+  char temp[8];
+
+  if (keyword_is(card, "HEADER") || keyword_is(card, "COMMENT")) {
+    // Skip it.
+    return(JSTAT_SUCCESSFUL);
+  }
+
+  if (table == TABLE_AN) {
+    k = rpfits_file->nant;
+    if (k >= RPFITS_MAX_ANTS) {
+      fprintf(stderr, "[rpfitsio] AN table contains too many entries.\n");
+      return(JSTAT_UNSUCCESSFUL);
+    }
+    // Format (i2,1x,a8,i2,3f14.3,i5).
+    rpfits_file->ant_num[k] = card_int(card, 0, 2);
+    card_chars(card, 3, 8, rpfits_file->sta[k], 8);
+    rpfits_file->ant_mount[k] = card_int(card, 11, 2);
+    rpfits_file->x[k] = card_double(card, 13, 14);
+    rpfits_file->y[k] = card_double(card, 27, 14);
+    rpfits_file->z[k] = card_double(card, 41, 14);
+    rpfits_file->axis_offset[k] = card_int(card, 55, 5) / 1000.0;
+    rpfits_file->nant = k + 1;
+  } else if (table == TABLE_IF) {
+    k = rpfits_file->n_if;
+    if (k >= RPFITS_MAX_IFS) {
+      fprintf(stderr, "[rpfitsio] IF table contains too many entries.\n");
+      return(JSTAT_UNSUCCESSFUL);
+    }
+    // Format (i3,f16.3,i3,f17.3,i5,i3,1x,4a2,i2,f7.1,1x,a5).
+    rpfits_file->if_num[k] = card_int(card, 0, 3);
+    rpfits_file->if_freq[k] = card_double(card, 3, 16);
+    rpfits_file->if_invert[k] = card_int(card, 19, 3);
+    rpfits_file->if_bw[k] = card_double(card, 22, 17);
+    rpfits_file->if_nfreq[k] = card_int(card, 39, 5);
+    rpfits_file->if_nstok[k] = card_int(card, 44, 3);
+    for (l = 0; l < 4; l++) {
+      card_chars(card, 48 + 2 * l, 2, rpfits_file->if_cstok[k][l], 2);
+    }
+    rpfits_file->if_sampl[k] = card_int(card, 56, 2);
+    rpfits_file->if_ref[k] = card_double(card, 58, 7);
+    card_field(card, 66, 5, temp);
+    rpfits_file->if_simul[k] = 1;
+    rpfits_file->if_chain[k] = 1;
+    if (sscanf(temp, "%d %d", &(rpfits_file->if_simul[k]),
+	       &(rpfits_file->if_chain[k])) > 0) {
+      if (rpfits_file->if_simul[k] == 0) {
+	rpfits_file->if_simul[k] = 1;
+      }
+      if (rpfits_file->if_chain[k] == 0) {
+	rpfits_file->if_chain[k] = 1;
+      }
+    }
+    rpfits_file->n_if = k + 1;
+  } else if ((table == TABLE_SU) || (table == TABLE_SX)) {
+    k = rpfits_file->n_su;
+    if (k >= RPFITS_MAX_SOURCES) {
+      fprintf(stderr, "[rpfitsio] SU table contains too many entries.\n");
+      return(JSTAT_UNSUCCESSFUL);
+    }
+    // Format (i3,a16,2f13.9,1x,a4,2f12.9) for SU, and
+    // (i4,1x,a16,2f13.9,1x,a4,2f12.9) for SX.
+    if (table == TABLE_SU) {
+      rpfits_file->su_num[k] = card_int(card, 0, 3);
+      o = 3;
+    } else {
+      rpfits_file->su_num[k] = card_int(card, 0, 4);
+      o = 5;
+    }
+    card_chars(card, o, 16, rpfits_file->su_name[k], 16);
+    rpfits_file->su_ra[k] = card_double(card, o + 16, 13);
+    rpfits_file->su_dec[k] = card_double(card, o + 29, 13);
+    card_chars(card, o + 43, 4, rpfits_file->su_cal[k], 4);
+    rpfits_file->su_rad[k] = card_double(card, o + 47, 12);
+    rpfits_file->su_decd[k] = card_double(card, o + 59, 12);
+    if (rpfits_file->su_ra[k] < 0) {
+      rpfits_file->su_ra[k] += 2 * M_PI;
+    }
+    if (rpfits_file->su_rad[k] < 0) {
+      rpfits_file->su_rad[k] += 2 * M_PI;
+    }
+    rpfits_file->su_pra[k] = rpfits_file->su_ra[k];
+    rpfits_file->su_pdec[k] = rpfits_file->su_dec[k];
+    rpfits_file->n_su = k + 1;
+  }
+
+  return(JSTAT_SUCCESSFUL);
+}
+
+/*!
+ *  \brief Move to and read the next header in the file
+ *  \param rpfits_file the file context
+ *  \return a JSTAT_* magic number:
+ *          - JSTAT_SUCCESSFUL: the header was read
+ *          - JSTAT_ENDOFFILE: the end of the file was reached
+ *          - JSTAT_FGTABLE: a flag table was found instead of a header
+ *          - JSTAT_UNSUCCESSFUL: an error occurred
+ *
+ * This is the equivalent of calling RPFITSIN with jstat = JSTAT_READNEXTHEADER,
+ * with all the header cards stored in the context.
+ */
+int rpfitsio_read_header(struct rpfits_file *rpfits_file) {
+  int rres, jstat, i, k, table = TABLE_NONE;
+  bool endhdr = false, starthdr = false, new_antenna = false;
+  bool if_found = false, su_found = false;
+  char *card = NULL, keyvalue[24];
+
+  if ((rpfits_file == NULL) || (rpfits_file->fh == NULL)) {
+    fprintf(stderr, "[rpfitsio_read_header] File is not open.\n");
+    return(JSTAT_UNSUCCESSFUL);
+  }
+
+  rpfits_file->bufptr = -1;
+  rpfits_file->n_if = 0;
+  rpfits_file->ncard = 0;
+  rpfits_file->pra = 0;
+  rpfits_file->pdec = 0;
+
+  // Look for the start of the next header.
+  while (!starthdr) {
+    rres = read_record(rpfits_file, rpfits_file->buffer);
+    if (rres == RECORD_EOF) {
+      return(JSTAT_ENDOFFILE);
+    } else if (rres != RECORD_OK) {
+      fprintf(stderr, "[rpfitsio_read_header] I/O error reading header\n");
+      return(JSTAT_UNSUCCESSFUL);
+    }
+    jstat = simple(rpfits_file->buffer);
+    if (jstat == JSTAT_HEADERNOTDATA) {
+      starthdr = true;
+      rpfits_file->header_offset = rpfits_file->buffer_offset;
+    } else if (jstat != JSTAT_SUCCESSFUL) {
+      return(jstat);
+    }
+  }
+
+  // Scan through the header, getting the interesting bits.
+  while (!endhdr) {
+    if (!starthdr) {
+      rres = read_record(rpfits_file, rpfits_file->buffer);
+      if (rres == RECORD_EOF) {
+	return(JSTAT_ENDOFFILE);
+      } else if (rres != RECORD_OK) {
+	fprintf(stderr, "[rpfitsio_read_header] I/O error reading header\n");
+	return(JSTAT_UNSUCCESSFUL);
+      }
+    }
+    starthdr = false;
+
+    for (i = 0; i < RPFITS_CARDS_PER_RECORD; i++) {
+      card = (char *)rpfits_file->buffer + i * RPFITS_CARD_LENGTH;
+      if (keyword_is(card, "END") && (table == TABLE_NONE)) {
+	endhdr = true;
+	break;
+      }
+
+      // Keep a copy of every card.
+      if (rpfits_file->ncard < RPFITS_MAX_CARDS) {
+	memcpy(rpfits_file->card[rpfits_file->ncard], card, RPFITS_CARD_LENGTH);
+	rpfits_file->ncard += 1;
+      }
+
+      if (table != TABLE_NONE) {
+	if (keyword_is(card, "ENDTABLE")) {
+	  table = TABLE_NONE;
+	} else if (read_table_row(rpfits_file, table, card) != JSTAT_SUCCESSFUL) {
+	  return(JSTAT_UNSUCCESSFUL);
+	}
+	continue;
+      }
+
+      card_keyvalue(card, keyvalue);
+      if (keyword_is(card, "CDELT4")) {
+	rpfits_file->dfreq = strtod(keyvalue, NULL);
+      } else if (keyword_is(card, "CRPIX4")) {
+	rpfits_file->crpix4 = strtod(keyvalue, NULL);
+      } else if (keyword_is(card, "CRVAL4")) {
+	rpfits_file->freq = strtod(keyvalue, NULL);
+      } else if (keyword_is(card, "CRVAL5")) {
+	rpfits_file->ra = strtod(keyvalue, NULL);
+	if (rpfits_file->ra < 0) {
+	  rpfits_file->ra += 2 * M_PI;
+	}
+      } else if (keyword_is(card, "CRVAL6")) {
+	rpfits_file->dec = strtod(keyvalue, NULL);
+      } else if (keyword_is(card, "DATE-OBS")) {
+	date_fit(keyvalue, rpfits_file->datobs);
+      } else if (keyword_is(card, "INTIME")) {
+	rpfits_file->intime = (int)strtol(keyvalue, NULL, 10);
+      } else if (keyword_is(card, "NAXIS2")) {
+	rpfits_file->data_format = (int)strtol(keyvalue, NULL, 10);
+      } else if (keyword_is(card, "NAXIS3") || keyword_is(card, "NAXIS7")) {
+	// NAXIS7 is a fudge for intermediate format PTI data.
+	rpfits_file->nstok = (int)strtol(keyvalue, NULL, 10);
+      } else if (keyword_is(card, "NAXIS4")) {
+	rpfits_file->nfreq = (int)strtol(keyvalue, NULL, 10);
+      } else if (keyword_is(card, "OBJECT")) {
+	card_chars(keyvalue, 0, 16, rpfits_file->object, 16);
+      } else if (keyword_is(card, "OBSTYPE")) {
+	card_chars(keyvalue, 0, 16, rpfits_file->obstype, 16);
+      } else if (keyword_is(card, "PCOUNT")) {
+	rpfits_file->pcount = (int)strtol(keyvalue, NULL, 10);
+      } else if (keyword_is(card, "PNTCENTR")) {
+	rpfits_file->pra = card_double(card, 10, 12);
+	rpfits_file->pdec = card_double(card, 23, 12);
+      } else if (keyword_starts(card, "TABLE ")) {
+	// Sort out tables.
+	if (keyword_is(card, "TABLE AN")) {
+	  table = TABLE_AN;
+	  rpfits_file->nant = 0;
+	} else if (keyword_is(card, "TABLE IF")) {
+	  table = TABLE_IF;
+	  if_found = true;
+	  rpfits_file->n_if = 0;
+	} else if (keyword_is(card, "TABLE SU") || keyword_is(card, "TABLE SX")) {
+	  table = (card[7] == 'U') ? TABLE_SU : TABLE_SX;
+	  su_found = true;
+	  rpfits_file->n_su = 0;
+	} else {
+	  table = TABLE_OTHER;
+	}
+      } else if (keyword_starts(card, "ANTENNA")) {
+	// Antenna parameters, in the absence of an antenna table.
+	if (!new_antenna) {
+	  rpfits_file->nant = 0;
+	  new_antenna = true;
+	}
+	if (keyword_is(card, "ANTENNA")) {
+	  // Format (i1,1x,a3,3x,g17.10,3x,g17.10,3x,g17.10).
+	  k = card_int(card, 10, 1) - 1;
+	  if ((k >= 0) && (k < RPFITS_MAX_ANTS)) {
+	    card_chars(card, 12, 3, rpfits_file->sta[k], 8);
+	    rpfits_file->x[k] = card_double(card, 18, 17);
+	    rpfits_file->y[k] = card_double(card, 38, 17);
+	    rpfits_file->z[k] = card_double(card, 58, 17);
+	  }
+	} else {
+	  // Old format ('ANTENNA:'), (i1,4x,g13.6,3x,g13.6,3x,g13.6,5x,a3).
+	  k = card_int(card, 11, 1) - 1;
+	  if ((k >= 0) && (k < RPFITS_MAX_ANTS)) {
+	    rpfits_file->x[k] = card_double(card, 16, 13);
+	    rpfits_file->y[k] = card_double(card, 32, 13);
+	    rpfits_file->z[k] = card_double(card, 48, 13);
+	    card_chars(card, 66, 3, rpfits_file->sta[k], 8);
+	  }
+	}
+	rpfits_file->nant += 1;
+      }
+    }
+  }
+
+  // Set up for reading data.
+  if ((rpfits_file->data_format < 1) || (rpfits_file->data_format > 3)) {
+    fprintf(stderr, "[rpfitsio_read_header] NAXIS2 must be 1, 2, or 3.\n");
+    return(JSTAT_UNSUCCESSFUL);
+  }
+  if (rpfits_file->pcount > RPFITS_MAX_PCOUNT) {
+    fprintf(stderr, "[rpfitsio_read_header] PCOUNT must be at most %d.\n",
+	    RPFITS_MAX_PCOUNT);
+    return(JSTAT_UNSUCCESSFUL);
+  }
+
+  // Insert default values into the tables if they weren't found.
+  if (!if_found) {
+    rpfits_file->n_if = 1;
+    rpfits_file->if_num[0] = 1;
+    rpfits_file->if_freq[0] = rpfits_file->freq;
+    rpfits_file->if_invert[0] = 1;
+    rpfits_file->if_bw[0] = rpfits_file->nfreq * rpfits_file->dfreq;
+    rpfits_file->if_nfreq[0] = rpfits_file->nfreq;
+    rpfits_file->if_nstok[0] = rpfits_file->nstok;
+    rpfits_file->if_ref[0] = rpfits_file->crpix4;
+    memset(rpfits_file->if_cstok[0], ' ', sizeof(rpfits_file->if_cstok[0]));
+    rpfits_file->if_simul[0] = 1;
+    rpfits_file->if_chain[0] = 1;
+  } else {
+    rpfits_file->freq = rpfits_file->if_freq[0];
+    rpfits_file->nfreq = rpfits_file->if_nfreq[0];
+    if (rpfits_file->if_nfreq[0] > 1) {
+      rpfits_file->dfreq = rpfits_file->if_bw[0] / (rpfits_file->if_nfreq[0] - 1);
+    } else if (rpfits_file->if_nfreq[0] == 1) {
+      rpfits_file->dfreq = rpfits_file->if_bw[0];
+    }
+    rpfits_file->nstok = rpfits_file->if_nstok[0];
+  }
+  if (!su_found) {
+    rpfits_file->n_su = 1;
+    memcpy(rpfits_file->su_name[0], rpfits_file->object, 16);
+    rpfits_file->su_ra[0] = rpfits_file->ra;
+    rpfits_file->su_dec[0] = rpfits_file->dec;
+  } else {
+    memcpy(rpfits_file->object, rpfits_file->su_name[0], 16);
+    rpfits_file->ra = rpfits_file->su_ra[0];
+    rpfits_file->dec = rpfits_file->su_dec[0];
+    // For a single source, record a possible pointing centre offset.
+    if ((rpfits_file->n_su == 1) &&
+	((rpfits_file->pra != 0) || (rpfits_file->pdec != 0))) {
+      rpfits_file->su_pra[0] = rpfits_file->pra;
+      rpfits_file->su_pdec[0] = rpfits_file->pdec;
+    }
+  }
+
+  rpfits_file->bufptr = -1;
+  return(JSTAT_SUCCESSFUL);
+}
+
+/*!
+ *  \brief Check for illegal group parameters
+ *  \param rpfits_file the file context
+ *  \param u the u coordinate
+ *  \param v the v coordinate
+ *  \param w the w coordinate
+ *  \param rbase the baseline number, as a float
+ *  \param ut the UT in seconds
+ *  \param iant the number of syscal antennas
+ *  \param iif the IF number
+ *  \param iq the number of syscal parameters
+ *  \return true if any parameter is illegal
+ */
+static bool illegal_parameters(struct rpfits_file *rpfits_file,
+			       float u, float v, float w, float rbase,
+			       float ut, int iant, int iif, int iq) {
+  int baseline, iant1, iant2;
+
+  if ((rpfits_file->data_format < 1) || (rpfits_file->data_format > 3)) {
+    // Invalid data format.
+    return(true);
+  } else if ((fabsf(u) > 1e10) || (fabsf(v) > 1e10) || (fabsf(w) > 1e10)) {
+    // Invalid visibility coordinate.
+    return(true);
+  } else if ((rbase < -1.1) || (rbase > (257 * rpfits_file->nant + 0.1))) {
+    // Invalid baseline number.
+    return(true);
+  } else if ((ut < 0) || (ut > 172800.0)) {
+    // Invalid time.
+    return(true);
+  }
+
+  // Baseline can now safely be converted to an integer.
+  baseline = (int)lroundf(rbase);
+  if (fabsf(rbase - baseline) > 0.001) {
+    // This value is not close enough to an integer to be valid.
+    return(true);
+  }
+  if (baseline == -1) {
+    // Syscal record.
+    return((iant < 1) || (iant > RPFITS_MAX_ANTS) ||
+	   (iif < 1) || (iif > RPFITS_MAX_IFS) ||
+	   (iq < 1) || (iq > 100));
+  }
+  // Data record.
+  iant1 = baseline / 256;
+  iant2 = baseline % 256;
+  return((iant1 < 1) || (iant1 > rpfits_file->nant) ||
+	 (iant2 < 1) || (iant2 > rpfits_file->nant) ||
+	 (iif < 0) || (iif > RPFITS_MAX_IFS));
+}
+
+/*!
+ *  \brief Read the potentially illegal parameters from a group header
+ *  \param rpfits_file the file context
+ *  \param g the group header words
+ *  \param u output u coordinate
+ *  \param v output v coordinate
+ *  \param w output w coordinate
+ *  \param rbase output baseline number as a float
+ *  \param ut output UT in seconds
+ *  \param iant output number of syscal antennas
+ *  \param iif output IF number
+ *  \param iq output number of syscal parameters
+ */
+static void group_parameters(struct rpfits_file *rpfits_file,
+			     const unsigned char *g, float *u, float *v,
+			     float *w, float *rbase, float *ut, int *iant,
+			     int *iif, int *iq) {
+  *u = word_real(g, 0);
+  *v = word_real(g, 1);
+  *w = word_real(g, 2);
+  *rbase = word_real(g, 3);
+  *ut = word_real(g, 4);
+  *iant = 0;
+  *iq = 0;
+  if (*rbase < 0) {
+    // Syscal parameters.
+    *iant = word_int(g, 5);
+    *iif = word_int(g, 6);
+    *iq = word_int(g, 7);
+  } else {
+    // IF number.
+    *iif = word_int(g, 7);
+    if (rpfits_file->pcount >= 11) {
+      // Otherwise, data_format comes from NAXIS2.
+      rpfits_file->data_format = word_int(g, 10);
+    }
+  }
+}
+
+/*!
+ *  \brief Skip through data looking for recognisable data or a header
+ *  \param rpfits_file the file context
+ *  \return -2 if something was found, or the JSTAT code to return to the
+ *          caller otherwise
+ *
+ * This is the equivalent of the SKIPTHRU routine in the RPFITS library.
+ */
+static int skip_through(struct rpfits_file *rpfits_file) {
+  int i, j, jstat, iant, iif, iq;
+  float u, v, w, rbase, ut;
+  unsigned char g[4 * RPFITS_MAX_PCOUNT];
+
+  for (j = 0; j < RPFITS_SKIP_RECORDS; j++) {
+    // Read a new block; the remainder of the old one is unlikely to
+    // contain anything useful.
+    jstat = next_data_record(rpfits_file);
+    if (jstat != JSTAT_SUCCESSFUL) {
+      return(jstat);
+    }
+
+    // Scan through the block looking for something legal.
+    for (i = 0; i < (RPFITS_RECORD_WORDS - 8); i++) {
+      memset(g, 0, sizeof(g));
+      memcpy(g, rpfits_file->buffer + 4 * i,
+	     4 * (((RPFITS_RECORD_WORDS - i) < RPFITS_MAX_PCOUNT) ?
+		  (RPFITS_RECORD_WORDS - i) : RPFITS_MAX_PCOUNT));
+      group_parameters(rpfits_file, g, &u, &v, &w, &rbase, &ut, &iant, &iif, &iq);
+      if (!illegal_parameters(rpfits_file, u, v, w, rbase, ut, iant, iif, iq)) {
+	rpfits_file->bufptr = i;
+	return(-2);
+      }
+    }
+  }
+
+  rpfits_file->bufptr = 0;
+  return(-2);
+}
+
+/*!
+ *  \brief Read a data group header and check its validity
+ *  \param rpfits_file the file context
+ *  \param g the group header words
+ *  \param baseline output baseline number
+ *  \param ut output UT in seconds
+ *  \param u output u coordinate
+ *  \param v output v coordinate
+ *  \param w output w coordinate
+ *  \param flag output flag
+ *  \param bin output bin number
+ *  \param if_no output IF number
+ *  \param sourceno output source number
+ *  \return JSTAT_SUCCESSFUL, -2 if we had to skip data to find a valid group,
+ *          or another JSTAT code to return to the caller
+ */
+static int get_parameters(struct rpfits_file *rpfits_file, const unsigned char *g,
+			  int *baseline, float *ut, float *u, float *v, float *w,
+			  int *flag, int *bin, int *if_no, int *sourceno) {
+  int iant, iif, iq;
+  float rbase;
+
+  group_parameters(rpfits_file, g, u, v, w, &rbase, ut, &iant, &iif, &iq);
+
+  // Check for illegal parameters.
+  if (illegal_parameters(rpfits_file, *u, *v, *w, rbase, *ut, iant, iif, iq)) {
+    // This can be caused by a bad block, so look for more data.
+    fprintf(stderr, "[rpfitsio] Corrupted data encountered, skipping...\n");
+    return(skip_through(rpfits_file));
+  }
+
+  // Looks ok, pick up the remaining parameters.
+  *baseline = (int)lroundf(rbase);
+  if (*baseline == -1) {
+    // Syscal parameters.
+    rpfits_file->sc_ut = *ut;
+    rpfits_file->sc_ant = iant;
+    rpfits_file->sc_if = iif;
+    rpfits_file->sc_q = iq;
+    rpfits_file->sc_srcno = word_int(g, 8);
+  } else if (rpfits_file->pcount > 5) {
+    *flag = word_int(g, 5);
+    *bin = word_int(g, 6);
+    *if_no = word_int(g, 7);
+    *sourceno = word_int(g, 8);
+  }
+
+  return(JSTAT_SUCCESSFUL);
+}
+
+/*!
+ *  \brief Read the next data group from the file
+ *  \param rpfits_file the file context
+ *  \param vis the array to fill with the interleaved real and imaginary parts
+ *             of the visibilities; it must be large enough for the largest IF
+ *  \param weight the array to fill with the visibility weights, if present
+ *  \param baseline output baseline number, or -1 for a syscal group
+ *  \param ut output UT in seconds
+ *  \param u output u coordinate, in m
+ *  \param v output v coordinate, in m
+ *  \param w output w coordinate, in m
+ *  \param flag output data flag
+ *  \param bin output bin number
+ *  \param if_no output IF number, starting at 1
+ *  \param sourceno output source number, starting at 1
+ *  \return a JSTAT_* magic number:
+ *          - JSTAT_SUCCESSFUL: a data group was read
+ *          - JSTAT_HEADERNOTDATA: a header was found instead of data
+ *          - JSTAT_ENDOFFILE: the end of the file was reached
+ *          - JSTAT_FGTABLE: a flag table was found instead of data
+ *          - JSTAT_ILLEGALDATA: the end of the scan was found
+ *          - JSTAT_UNSUCCESSFUL: an error occurred
+ *
+ * This is the equivalent of calling RPFITSIN with jstat = JSTAT_READDATA. When
+ * a syscal group is read, the syscal parameters are left in the context.
+ */
+int rpfitsio_read_data(struct rpfits_file *rpfits_file, float *vis, float *weight,
+		       int *baseline, float *ut, float *u, float *v, float *w,
+		       int *flag, int *bin, int *if_no, int *sourceno) {
+  int jstat, bufleft, bufleft3, grplength, grpptr = 0, i, i1, i2, i3, nrem;
+  int df, pcount;
+  float revis = 0;
+  unsigned char g[4 * RPFITS_MAX_PCOUNT];
+  bool endscan;
+
+  if ((rpfits_file == NULL) || (rpfits_file->fh == NULL)) {
+    fprintf(stderr, "[rpfitsio_read_data] File is not open.\n");
+    return(JSTAT_UNSUCCESSFUL);
+  }
+  pcount = rpfits_file->pcount;
+  *if_no = 1;
+
+  if ((rpfits_file->bufptr < 0) ||
+      (rpfits_file->bufptr >= RPFITS_RECORD_WORDS)) {
+    jstat = next_data_record(rpfits_file);
+    if (jstat != JSTAT_SUCCESSFUL) {
+      return(jstat);
+    }
+    rpfits_file->bufptr = 0;
+  }
+
+  // Read the group parameters.
+  jstat = -2;
+  while (jstat == -2) {
+    bufleft = RPFITS_RECORD_WORDS - rpfits_file->bufptr;
+    memset(g, 0, sizeof(g));
+
+    // End of scan?
+    i1 = word_int(rpfits_file->buffer, rpfits_file->bufptr);
+    endscan = (i1 == RPFITS_ILLEGAL);
+    if (!endscan && (bufleft >= pcount)) {
+      // Old RPFITS files may be padded with zeros, so check for u,
+      // baseline number and UT all zero.
+      i2 = word_int(rpfits_file->buffer, rpfits_file->bufptr + 3);
+      i3 = word_int(rpfits_file->buffer, rpfits_file->bufptr + 4);
+      endscan = (i1 == 0) && (i2 == 0) && (i3 == 0);
+    }
+
+    if (endscan) {
+      jstat = next_data_record(rpfits_file);
+      if (jstat != JSTAT_SUCCESSFUL) {
+	return(jstat);
+      }
+      rpfits_file->bufptr = 0;
+      return(JSTAT_ILLEGALDATA);
+    }
+
+    if (bufleft >= pcount) {
+      // It will all fit in the current buffer, so things are easy.
+      memcpy(g, rpfits_file->buffer + 4 * rpfits_file->bufptr, 4 * pcount);
+      jstat = get_parameters(rpfits_file, g, baseline, ut, u, v, w,
+			     flag, bin, if_no, sourceno);
+      if (jstat == JSTAT_SUCCESSFUL) {
+	rpfits_file->bufptr += pcount;
+      }
+    } else {
+      // We can recover only part of the group header here, and the
+      // remainder comes from the next record.
+      memcpy(g, rpfits_file->buffer + 4 * rpfits_file->bufptr, 4 * bufleft);
+      jstat = next_data_record(rpfits_file);
+      if (jstat != JSTAT_SUCCESSFUL) {
+	return(jstat);
+      }
+      nrem = pcount - bufleft;
+      memcpy(g + 4 * bufleft, rpfits_file->buffer, 4 * nrem);
+      jstat = get_parameters(rpfits_file, g, baseline, ut, u, v, w,
+			     flag, bin, if_no, sourceno);
+      if (jstat == JSTAT_SUCCESSFUL) {
+	// Set the pointer to the first visibility in the new buffer.
+	rpfits_file->bufptr = nrem;
+      }
+    }
+    if ((jstat != -2) && (jstat != JSTAT_SUCCESSFUL)) {
+      return(jstat);
+    }
+  }
+
+  if (*baseline == -1) {
+    // Read the syscal data group, where the group length is in words.
+    grplength = rpfits_file->sc_q * rpfits_file->sc_if * rpfits_file->sc_ant;
+    if (grplength > (RPFITS_MAX_SYSCAL * RPFITS_MAX_IFS * RPFITS_MAX_ANTS)) {
+      fprintf(stderr, "[rpfitsio_read_data] syscal group too large\n");
+      return(JSTAT_UNSUCCESSFUL);
+    }
+    while (1) {
+      bufleft = RPFITS_RECORD_WORDS - rpfits_file->bufptr;
+      nrem = ((grplength - grpptr) < bufleft) ? (grplength - grpptr) : bufleft;
+      for (i = 0; i < nrem; i++) {
+	rpfits_file->sc_cal[grpptr + i] =
+	  word_real(rpfits_file->buffer, rpfits_file->bufptr + i);
+      }
+      rpfits_file->bufptr += nrem;
+      grpptr += nrem;
+      if (grpptr >= grplength) {
+	return(JSTAT_SUCCESSFUL);
+      }
+      jstat = next_data_record(rpfits_file);
+      if (jstat != JSTAT_SUCCESSFUL) {
+	return(jstat);
+      }
+      rpfits_file->bufptr = 0;
+    }
+  }
+
+  // Read the visibility data group. The data format is determined by the
+  // value of NAXIS2:
+  //   1: real(vis)
+  //   2: real(vis) imag(vis)
+  //   3: real(vis) imag(vis) weight
+  df = rpfits_file->data_format;
+  if ((df < 1) || (df > 3)) {
+    fprintf(stderr, "[rpfitsio_read_data] NAXIS2 in file must be 1, 2, or 3.\n");
+    return(JSTAT_UNSUCCESSFUL);
+  }
+  if (*if_no > 1) {
+    if (*if_no > rpfits_file->n_if) {
+      fprintf(stderr, "[rpfitsio_read_data] IF %d not in header\n", *if_no);
+      return(JSTAT_UNSUCCESSFUL);
+    }
+    grplength = rpfits_file->if_nfreq[*if_no - 1] * rpfits_file->if_nstok[*if_no - 1];
+  } else {
+    grplength = rpfits_file->nstok * rpfits_file->nfreq;
+  }
+
+  while (1) {
+    bufleft = RPFITS_RECORD_WORDS - rpfits_file->bufptr;
+    bufleft3 = bufleft / df;
+    nrem = ((grplength - grpptr) < bufleft3) ? (grplength - grpptr) : bufleft3;
+    // Read the complete visibilities in this buffer.
+    for (i = grpptr; i < (grpptr + nrem); i++) {
+      vis[2 * i] = word_real(rpfits_file->buffer, rpfits_file->bufptr);
+      if (df > 1) {
+	vis[2 * i + 1] = word_real(rpfits_file->buffer, rpfits_file->bufptr + 1);
+	if ((df == 3) && (weight != NULL)) {
+	  weight[i] = word_real(rpfits_file->buffer, rpfits_file->bufptr + 2);
+	}
+      } else {
+	vis[2 * i + 1] = 0;
+      }
+      rpfits_file->bufptr += df;
+    }
+    grpptr += nrem;
+    if (grpptr >= grplength) {
+      return(JSTAT_SUCCESSFUL);
+    }
+
+    // Read the fraction of a visibility left in the old buffer.
+    // This should not happen for data_format = 1.
+    bufleft -= df * bufleft3;
+    if (bufleft == 1) {
+      revis = word_real(rpfits_file->buffer, RPFITS_RECORD_WORDS - 1);
+    } else if ((bufleft == 2) && (df == 3)) {
+      vis[2 * grpptr] = word_real(rpfits_file->buffer, RPFITS_RECORD_WORDS - 2);
+      vis[2 * grpptr + 1] = word_real(rpfits_file->buffer, RPFITS_RECORD_WORDS - 1);
+    }
+
+    // Now read in a new buffer.
+    jstat = next_data_record(rpfits_file);
+    if (jstat != JSTAT_SUCCESSFUL) {
+      return(jstat);
+    }
+
+    // Fill any incomplete visibility.
+    rpfits_file->bufptr = 0;
+    if (bufleft == 1) {
+      vis[2 * grpptr] = revis;
+      vis[2 * grpptr + 1] = word_real(rpfits_file->buffer, 0);
+      if ((df == 3) && (weight != NULL)) {
+	weight[grpptr] = word_real(rpfits_file->buffer, 1);
+      }
+      grpptr += 1;
+      rpfits_file->bufptr = df - 1;
+    } else if ((bufleft == 2) && (df == 3)) {
+      if (weight != NULL) {
+	weight[grpptr] = word_real(rpfits_file->buffer, 0);
+      }
+      grpptr += 1;
+      rpfits_file->bufptr = 1;
+    }
+    if (grpptr >= grplength) {
+      return(JSTAT_SUCCESSFUL);
+    }
+  }
+}
@@ -0,0 +1,384 @@
+/** \file rpfitsio.h
+ *  \brief Definitions for the native RPFITS decoder, which holds all of its state
+ *         in a per-file context structure
+ *
+ * ATCA Training Library
+ * (C) Jamie Stevens CSIRO 2020
+ *
+ * This module is a C implementation of the parts of the Fortran RPFITS library
+ * (RPFITSIN and the AT_* I/O routines) that this library needs to read data.
+ * Unlike the Fortran library, which keeps everything in global common blocks,
+ * each open file here has its own context, so many files can be read at the
+ * same time, from different threads if required.
+ */
+
+#pragma once
+#include <stdio.h>
+#include <stdbool.h>
+
+/*! \def RPFITS_RECORD_LENGTH
+ *  \brief The number of bytes in each RPFITS record
+ */
+#define RPFITS_RECORD_LENGTH 2560
+/*! \def RPFITS_RECORD_WORDS
+ *  \brief The number of 4-byte words in each RPFITS record
+ */
+#define RPFITS_RECORD_WORDS 640
+/*! \def RPFITS_CARD_LENGTH
+ *  \brief The number of characters in each RPFITS header card
+ */
+#define RPFITS_CARD_LENGTH 80
+/*! \def RPFITS_CARDS_PER_RECORD
+ *  \brief The number of header cards in each RPFITS record
+ */
+#define RPFITS_CARDS_PER_RECORD 32
+/*! \def RPFITS_MAX_CARDS
+ *  \brief The maximum number of header cards we will keep for each header,
+ *         which is `max_card` in the Fortran library
+ */
+#define RPFITS_MAX_CARDS 2240
+/*! \def RPFITS_MAX_ANTS
+ *  \brief The maximum number of antennas that can be described in a header,
+ *         which is `ant_max` in the Fortran library
+ */
+#define RPFITS_MAX_ANTS 16
+/*! \def RPFITS_MAX_IFS
+ *  \brief The maximum number of IFs that can be described in a header,
+ *         which is `max_if` in the Fortran library
+ */
+#define RPFITS_MAX_IFS 48
+/*! \def RPFITS_MAX_SOURCES
+ *  \brief The maximum number of sources that can be described in a header,
+ *         which is `max_su` in the Fortran library
+ */
+#define RPFITS_MAX_SOURCES 2048
+/*! \def RPFITS_MAX_SYSCAL
+ *  \brief The maximum number of parameters in each syscal group, which
+ *         is `max_sc` in the Fortran library
+ */
+#define RPFITS_MAX_SYSCAL 16
+/*! \def RPFITS_MAX_PCOUNT
+ *  \brief The maximum number of random parameters that can precede each
+ *         data group
+ */
+#define RPFITS_MAX_PCOUNT 11
+/*! \def RPFITS_ILLEGAL
+ *  \brief The integer value which marks the end of a scan in the data
+ */
+#define RPFITS_ILLEGAL 32768
+/*! \def RPFITS_SKIP_RECORDS
+ *  \brief The maximum number of records to skip while looking for valid data
+ *         after encountering a corrupted block
+ */
+#define RPFITS_SKIP_RECORDS 1000
+/*! \def RPFITSIO_ACCESS_SEQUENTIAL
+ *  \brief Access hint for rpfitsio_map: the file will be read from start to
+ *         end, as when making an index
+ */
+#define RPFITSIO_ACCESS_SEQUENTIAL 1
+/*! \def RPFITSIO_ACCESS_RANDOM
+ *  \brief Access hint for rpfitsio_map: the reader will seek to particular
+ *         headers and cycles
+ */
+#define RPFITSIO_ACCESS_RANDOM 2
+
+/*! \struct rpfits_file
+ *  \brief All the state associated with reading a single RPFITS file
+ *
+ * The members of this structure mirror the variables in the Fortran RPFITS
+ * common blocks, and the character arrays are stored in the same fixed-length,
+ * blank-padded form (ie. not null-terminated).
+ */
+struct rpfits_file {
+  /*! \var filename
+   *  \brief The name of the file being read
+   */
+  char filename[256];
+  /*! \var fh
+   *  \brief The handle of the open file
+   */
+  FILE *fh;
+  /*! \var map
+   *  \brief The memory mapping of the file, or NULL if the file is being read
+   *         through `fh`
+   */
+  unsigned char *map;
+  /*! \var map_length
+   *  \brief The number of bytes in the memory mapping
+   */
+  size_t map_length;
+  /*! \var map_position
+   *  \brief The byte offset of the next record to read from the mapping
+   */
+  long map_position;
+  /*! \var map_access
+   *  \brief The RPFITSIO_ACCESS_* hint given to the kernel about the mapping
+   */
+  int map_access;
+
+  // The record buffer.
+  /*! \var buffer
+   *  \brief The most recently read record
+   */
+  unsigned char buffer[RPFITS_RECORD_LENGTH];
+  /*! \var saved
+   *  \brief A record that has been pushed back to be read again
+   */
+  unsigned char saved[RPFITS_RECORD_LENGTH];
+  /*! \var reread
+   *  \brief Flag to indicate that the next record read should return `saved`
+   */
+  bool reread;
+  /*! \var bufptr
+   *  \brief The next word to read in `buffer`, starting at 0; if this is
+   *         negative or past the end of the buffer a new record is needed
+   */
+  int bufptr;
+  /*! \var buffer_offset
+   *  \brief The byte offset in the file of the record in `buffer`
+   */
+  long buffer_offset;
+  /*! \var saved_offset
+   *  \brief The byte offset in the file of the record in `saved`
+   */
+  long saved_offset;
+  /*! \var header_offset
+   *  \brief The byte offset in the file of the first record of the most
+   *         recently read header
+   */
+  long header_offset;
+
+  // Parameters from the header cards.
+  /*! \var data_format
+   *  \brief The number of words in each visibility (NAXIS2)
+   */
+  int data_format;
+  /*! \var pcount
+   *  \brief The number of random parameters before each data group
+   */
+  int pcount;
+  /*! \var intime
+   *  \brief The integration time, in seconds
+   */
+  int intime;
+  /*! \var nstok
+   *  \brief The number of Stokes parameters in the first IF
+   */
+  int nstok;
+  /*! \var nfreq
+   *  \brief The number of channels in the first IF
+   */
+  int nfreq;
+  /*! \var freq
+   *  \brief The reference frequency from the header, in Hz
+   */
+  double freq;
+  /*! \var dfreq
+   *  \brief The channel width from the header, in Hz
+   */
+  double dfreq;
+  /*! \var crpix4
+   *  \brief The reference channel from the header
+   */
+  double crpix4;
+  /*! \var ra
+   *  \brief The right ascension from the header, in radians
+   */
+  double ra;
+  /*! \var dec
+   *  \brief The declination from the header, in radians
+   */
+  double dec;
+  /*! \var pra
+   *  \brief The pointing centre right ascension, in radians
+   */
+  double pra;
+  /*! \var pdec
+   *  \brief The pointing centre declination, in radians
+   */
+  double pdec;
+  /*! \var datobs
+   *  \brief The observation date
+   */
+  char datobs[12];
+  /*! \var object
+   *  \brief The name of the object from the header
+   */
+  char object[16];
+  /*! \var obstype
+   *  \brief The observation type from the header
+   */
+  char obstype[16];
+
+  // The header cards.
+  /*! \var ncard
+   *  \brief The number of cards stored from the most recent header
+   */
+  int ncard;
+  /*! \var card
+   *  \brief The cards from the most recent header
+   */
+  char card[RPFITS_MAX_CARDS][RPFITS_CARD_LENGTH];
+
+  // The antenna table.
+  /*! \var nant
+   *  \brief The number of antennas
+   */
+  int nant;
+  /*! \var ant_num
+   *  \brief The number of each antenna
+   */
+  int ant_num[RPFITS_MAX_ANTS];
+  /*! \var ant_mount
+   *  \brief The mount type of each antenna
+   */
+  int ant_mount[RPFITS_MAX_ANTS];
+  /*! \var x
+   *  \brief The X coordinate of each antenna, in m
+   */
+  double x[RPFITS_MAX_ANTS];
+  /*! \var y
+   *  \brief The Y coordinate of each antenna, in m
+   */
+  double y[RPFITS_MAX_ANTS];
+  /*! \var z
+   *  \brief The Z coordinate of each antenna, in m
+   */
+  double z[RPFITS_MAX_ANTS];
+  /*! \var axis_offset
+   *  \brief The axis offset of each antenna, in m
+   */
+  double axis_offset[RPFITS_MAX_ANTS];
+  /*! \var sta
+   *  \brief The station name of each antenna
+   */
+  char sta[RPFITS_MAX_ANTS][8];
+
+  // The IF table.
+  /*! \var n_if
+   *  \brief The number of IFs
+   */
+  int n_if;
+  /*! \var if_num
+   *  \brief The number of each IF
+   */
+  int if_num[RPFITS_MAX_IFS];
+  /*! \var if_invert
+   *  \brief The sideband of each IF
+   */
+  int if_invert[RPFITS_MAX_IFS];
+  /*! \var if_nfreq
+   *  \brief The number of channels in each IF
+   */
+  int if_nfreq[RPFITS_MAX_IFS];
+  /*! \var if_nstok
+   *  \brief The number of Stokes parameters in each IF
+   */
+  int if_nstok[RPFITS_MAX_IFS];
+  /*! \var if_sampl
+   *  \brief The sampler bits of each IF
+   */
+  int if_sampl[RPFITS_MAX_IFS];
+  /*! \var if_simul
+   *  \brief The simultaneous group of each IF
+   */
+  int if_simul[RPFITS_MAX_IFS];
+  /*! \var if_chain
+   *  \brief The conversion chain of each IF
+   */
+  int if_chain[RPFITS_MAX_IFS];
+  /*! \var if_freq
+   *  \brief The centre frequency of each IF, in Hz
+   */
+  double if_freq[RPFITS_MAX_IFS];
+  /*! \var if_bw
+   *  \brief The bandwidth of each IF, in Hz
+   */
+  double if_bw[RPFITS_MAX_IFS];
+  /*! \var if_ref
+   *  \brief The reference channel of each IF
+   */
+  double if_ref[RPFITS_MAX_IFS];
+  /*! \var if_cstok
+   *  \brief The name of each Stokes parameter in each IF
+   */
+  char if_cstok[RPFITS_MAX_IFS][4][2];
+
+  // The source table.
+  /*! \var n_su
+   *  \brief The number of sources
+   */
+  int n_su;
+  /*! \var su_num
+   *  \brief The number of each source
+   */
+  int su_num[RPFITS_MAX_SOURCES];
+  /*! \var su_ra
+   *  \brief The right ascension of each source, in radians
+   */
+  double su_ra[RPFITS_MAX_SOURCES];
+  /*! \var su_dec
+   *  \brief The declination of each source, in radians
+   */
+  double su_dec[RPFITS_MAX_SOURCES];
+  /*! \var su_rad
+   *  \brief The apparent right ascension of each source, in radians
+   */
+  double su_rad[RPFITS_MAX_SOURCES];
+  /*! \var su_decd
+   *  \brief The apparent declination of each source, in radians
+   */
+  double su_decd[RPFITS_MAX_SOURCES];
+  /*! \var su_pra
+   *  \brief The pointing right ascension of each source, in radians
+   */
+  double su_pra[RPFITS_MAX_SOURCES];
+  /*! \var su_pdec
+   *  \brief The pointing declination of each source, in radians
+   */
+  double su_pdec[RPFITS_MAX_SOURCES];
+  /*! \var su_name
+   *  \brief The name of each source
+   */
+  char su_name[RPFITS_MAX_SOURCES][16];
+  /*! \var su_cal
+   *  \brief The calibrator code of each source
+   */
+  char su_cal[RPFITS_MAX_SOURCES][4];
+
+  // The most recent syscal group.
+  /*! \var sc_ut
+   *  \brief The UT of the syscal group, in seconds
+   */
+  float sc_ut;
+  /*! \var sc_ant
+   *  \brief The number of antennas in the syscal group
+   */
+  int sc_ant;
+  /*! \var sc_if
+   *  \brief The number of IFs in the syscal group
+   */
+  int sc_if;
+  /*! \var sc_q
+   *  \brief The number of parameters per antenna and IF in the syscal group
+   */
+  int sc_q;
+  /*! \var sc_srcno
+   *  \brief The source number of the syscal group
+   */
+  int sc_srcno;
+  /*! \var sc_cal
+   *  \brief The syscal parameters, ordered by antenna, then IF, then parameter
+   */
+  float sc_cal[RPFITS_MAX_SYSCAL * RPFITS_MAX_IFS * RPFITS_MAX_ANTS];
+};
+
+struct rpfits_file* rpfitsio_open(char *filename);
+int rpfitsio_close(struct rpfits_file *rpfits_file);
+int rpfitsio_map(struct rpfits_file *rpfits_file, int access);
+long rpfitsio_tell(struct rpfits_file *rpfits_file);
+int rpfitsio_seek(struct rpfits_file *rpfits_file, long offset);
+int rpfitsio_read_header(struct rpfits_file *rpfits_file);
+int rpfitsio_read_data(struct rpfits_file *rpfits_file, float *vis, float *weight,
+		       int *baseline, float *ut, float *u, float *v, float *w,
+		       int *flag, int *bin, int *if_no, int *sourceno);